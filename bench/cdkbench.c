@@ -0,0 +1,587 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "cdkbenchgeany.h"
+#include "cdkbenchsci.h"
+#include <cdk/cdkhighlighter.h>
+#include <cdk/cdkplugin.h>
+#include <clang-c/Index.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Runs libcdk outside of Geany on a corpus of files and prints the
+ * timings it records as JSON. Every file is opened as a document,
+ * parsed, then repeatedly edited at its end, reparsed, highlighted and
+ * completed in. The diagnostics are applied after every (re)parse.
+ *
+ * Unless --cache-dir is given the on-disk TU cache starts out empty,
+ * so the parse timings are for cold parses.
+ */
+
+#define CDK_BENCH_TIMEOUT (120 * G_USEC_PER_SEC)
+
+static gchar   *opt_cflags = NULL;
+static gchar   *opt_compdb = NULL;
+static gchar   *opt_pch = NULL;
+static gchar   *opt_cache_dir = NULL;
+static gboolean opt_out_of_process = FALSE;
+static gboolean opt_warm_up = FALSE;
+static gboolean opt_symbol_index = FALSE;
+static gboolean opt_per_token_styling = FALSE;
+static gint     opt_synthetic = -1;
+static gint     opt_functions = 200;
+static gint     opt_iterations = 10;
+static gchar  **opt_files = NULL;
+
+static GOptionEntry cdk_bench_options[] = {
+  { "cflags", 0, 0, G_OPTION_ARG_STRING, &opt_cflags,
+    "Compiler flags for the files", "FLAGS" },
+  { "compdb", 0, 0, G_OPTION_ARG_FILENAME, &opt_compdb,
+    "Directory containing compile_commands.json", "DIR" },
+  { "pch", 0, 0, G_OPTION_ARG_STRING, &opt_pch,
+    "Prefix header to precompile, or \"auto\"", "HEADER" },
+  { "cache-dir", 0, 0, G_OPTION_ARG_FILENAME, &opt_cache_dir,
+    "Use (and keep) the TU cache in DIR", "DIR" },
+  { "out-of-process", 0, 0, G_OPTION_ARG_NONE, &opt_out_of_process,
+    "Parse in worker processes, see CDK_WORKER_PATH", NULL },
+  { "warm-up", 0, 0, G_OPTION_ARG_NONE, &opt_warm_up,
+    "Warm up the cache before opening the files", NULL },
+  { "symbol-index", 0, 0, G_OPTION_ARG_NONE, &opt_symbol_index,
+    "Index the files and look up every symbol in the index", NULL },
+  { "per-token-styling", 0, 0, G_OPTION_ARG_NONE, &opt_per_token_styling,
+    "Style each token with its own messages rather than each range with one", NULL },
+  { "synthetic", 0, 0, G_OPTION_ARG_INT, &opt_synthetic,
+    "Number of generated files to add to the corpus (default 4 without FILES)", "N" },
+  { "functions", 0, 0, G_OPTION_ARG_INT, &opt_functions,
+    "Number of functions in each generated file (default 200)", "N" },
+  { "iterations", 0, 0, G_OPTION_ARG_INT, &opt_iterations,
+    "Number of edits made to each file (default 10)", "N" },
+  { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_files,
+    NULL, "FILES..." },
+  { NULL, 0, 0, 0, NULL, NULL, NULL },
+};
+
+static const gchar *cdk_bench_latency_names[CDK_NUM_LATENCIES] = {
+  [CDK_LATENCY_PARSE]       = "parse",
+  [CDK_LATENCY_REPARSE]     = "reparse",
+  [CDK_LATENCY_HIGHLIGHT]   = "highlight",
+  [CDK_LATENCY_COMPLETE]    = "complete",
+  [CDK_LATENCY_DIAGNOSTICS] = "diagnostics",
+  [CDK_LATENCY_LOOKUP]      = "lookup",
+};
+
+static const gchar *cdk_bench_outcome_names[CDK_NUM_JOB_OUTCOMES] = {
+  [CDK_JOB_COMPLETED] = "completed",
+  [CDK_JOB_CANCELLED] = "cancelled",
+  [CDK_JOB_DISCARDED] = "discarded",
+};
+
+typedef gboolean (*CdkBenchCondition) (CdkPlugin *plugin, GeanyDocument *doc, gpointer data);
+
+static gboolean
+cdk_bench_tick (G_GNUC_UNUSED gpointer unused)
+{
+  return G_SOURCE_CONTINUE;
+}
+
+// Runs the main loop until cond is met, FALSE if it took too long
+static gboolean
+cdk_bench_wait (CdkPlugin *plugin,
+                GeanyDocument *doc,
+                CdkBenchCondition cond,
+                gpointer data)
+{
+  gint64 deadline = g_get_monotonic_time () + CDK_BENCH_TIMEOUT;
+  // wakes the loop up now and then to check the deadline
+  guint tick_hnd = g_timeout_add (100, cdk_bench_tick, NULL);
+  gboolean met;
+
+  while (! (met = cond (plugin, doc, data)) &&
+         g_get_monotonic_time () < deadline)
+    {
+      g_main_context_iteration (NULL, TRUE);
+    }
+
+  g_source_remove (tick_hnd);
+
+  if (! met)
+    g_printerr ("cdk-bench: timed out on '%s'\n",
+                (doc != NULL) ? doc->file_name : "project");
+
+  return met;
+}
+
+static gboolean
+cdk_bench_is_parsed (CdkPlugin *plugin,
+                     GeanyDocument *doc,
+                     G_GNUC_UNUSED gpointer data)
+{
+  return ! cdk_plugin_is_document_pending (plugin, doc);
+}
+
+static gboolean
+cdk_bench_is_warmed_up (CdkPlugin *plugin,
+                        G_GNUC_UNUSED GeanyDocument *doc,
+                        G_GNUC_UNUSED gpointer data)
+{
+  return ! cdk_plugin_is_warming_up (plugin);
+}
+
+static gboolean
+cdk_bench_is_indexed (CdkPlugin *plugin,
+                      G_GNUC_UNUSED GeanyDocument *doc,
+                      G_GNUC_UNUSED gpointer data)
+{
+  return ! cdk_plugin_is_indexing (plugin);
+}
+
+// Looks up every symbol in the index once, for the lookup timings
+static void
+cdk_bench_lookup_symbols (CdkPlugin *plugin)
+{
+  CdkIndex *index = cdk_plugin_get_index (plugin);
+  if (index == NULL)
+    return;
+
+  guint n_symbols = cdk_index_get_n_symbols (index);
+  for (guint i = 0; i < n_symbols; i++)
+    {
+      GArray *locations =
+        cdk_plugin_lookup_symbol (plugin, cdk_index_get_symbol (index, i), CDK_INDEX_ALL);
+      if (locations != NULL)
+        g_array_unref (locations);
+    }
+}
+
+static guint64
+cdk_bench_get_count (CdkPlugin *plugin, GeanyDocument *doc, CdkLatencyKind kind)
+{
+  CdkLatencyStats stats;
+  cdk_plugin_get_latency_stats (plugin, doc, kind, &stats);
+  return stats.count;
+}
+
+typedef struct
+{
+  CdkLatencyKind kind;
+  guint64        count; // count to wait for
+}
+CdkBenchCount;
+
+static gboolean
+cdk_bench_has_count (CdkPlugin *plugin,
+                     GeanyDocument *doc,
+                     CdkBenchCount *count)
+{
+  return (cdk_bench_get_count (plugin, doc, count->kind) >= count->count);
+}
+
+static sptr_t
+cdk_bench_sci_send (GeanyDocument *doc, guint msg, uptr_t wparam, sptr_t lparam)
+{
+  return scintilla_send_message (doc->editor->sci, msg, wparam, lparam);
+}
+
+// Scrolls to position start and has the highlighter style everything
+// from there
+static gboolean
+cdk_bench_highlight (CdkPlugin *plugin, GeanyDocument *doc, gint start)
+{
+  CdkBenchCount count = {
+    CDK_LATENCY_HIGHLIGHT,
+    cdk_bench_get_count (plugin, doc, CDK_LATENCY_HIGHLIGHT) + 1
+  };
+  gint length = cdk_bench_sci_send (doc, SCI_GETLENGTH, 0, 0);
+  gint line = cdk_bench_sci_send (doc, SCI_LINEFROMPOSITION, start, 0);
+
+  cdk_bench_sci_send (doc, SCI_SETFIRSTVISIBLELINE, line, 0);
+  cdk_bench_sci_send (doc, SCI_STARTSTYLING, start, 0);
+  cdk_bench_sci_notify (doc->editor->sci, SCN_STYLENEEDED, length, 0);
+
+  return cdk_bench_wait (plugin, doc, (CdkBenchCondition) cdk_bench_has_count, &count);
+}
+
+static guint64
+cdk_bench_get_parses (CdkPlugin *plugin)
+{
+  guint64 count = 0;
+  for (guint outcome = 0; outcome < CDK_NUM_JOB_OUTCOMES; outcome++)
+    {
+      count += cdk_plugin_get_job_outcome_count (plugin, CDK_LATENCY_PARSE, outcome);
+      count += cdk_plugin_get_job_outcome_count (plugin, CDK_LATENCY_REPARSE, outcome);
+    }
+  return count;
+}
+
+static gboolean
+cdk_bench_has_parsed (CdkPlugin *plugin,
+                      G_GNUC_UNUSED GeanyDocument *doc,
+                      guint64 *count)
+{
+  return (cdk_bench_get_parses (plugin) >= *count);
+}
+
+// The document keeps its TU while it's reparsed, so wait for the
+// result to be in rather than for the document to have a TU
+static gboolean
+cdk_bench_reparse (CdkPlugin *plugin, GeanyDocument *doc)
+{
+  guint64 count = cdk_bench_get_parses (plugin) + 1;
+
+  doc->changed = TRUE;
+  if (! cdk_plugin_update_document (plugin, doc))
+    return TRUE;
+
+  return cdk_bench_wait (plugin, doc, (CdkBenchCondition) cdk_bench_has_parsed, &count);
+}
+
+static guint64
+cdk_bench_get_completions (CdkPlugin *plugin)
+{
+  guint64 count = 0;
+  for (guint outcome = 0; outcome < CDK_NUM_JOB_OUTCOMES; outcome++)
+    count += cdk_plugin_get_job_outcome_count (plugin, CDK_LATENCY_COMPLETE, outcome);
+  return count;
+}
+
+static gboolean
+cdk_bench_has_completed (CdkPlugin *plugin,
+                         G_GNUC_UNUSED GeanyDocument *doc,
+                         guint64 *count)
+{
+  return (cdk_bench_get_completions (plugin) >= *count);
+}
+
+// Types the start of an identifier at the end of the file to trigger
+// completion, then takes it out again once it ran
+static gboolean
+cdk_bench_complete (CdkPlugin *plugin, GeanyDocument *doc, guint iteration)
+{
+  gint length = cdk_bench_sci_send (doc, SCI_GETLENGTH, 0, 0);
+  gchar *snippet =
+    g_strdup_printf ("\nint cdk_bench_complete_%u (void) { return cdk_b", iteration);
+  guint64 count = cdk_bench_get_completions (plugin) + 1;
+
+  cdk_bench_sci_send (doc, SCI_INSERTTEXT, length, (sptr_t) snippet);
+  gint end = length + strlen (snippet);
+  cdk_bench_sci_send (doc, SCI_GOTOPOS, end, 0);
+  cdk_bench_sci_notify (doc->editor->sci, SCN_CHARADDED, end, 'b');
+
+  gboolean met = cdk_bench_wait (plugin, doc, (CdkBenchCondition) cdk_bench_has_completed, &count);
+  cdk_bench_sci_send (doc, SCI_DELETERANGE, length, strlen (snippet));
+
+  g_free (snippet);
+
+  return met;
+}
+
+static void
+cdk_bench_run_document (CdkPlugin *plugin, GeanyDocument *doc)
+{
+  cdk_plugin_set_current_document (plugin, doc);
+
+  if (! cdk_bench_wait (plugin, doc, cdk_bench_is_parsed, NULL))
+    return;
+
+  // dropped by the plugin if it couldn't be parsed
+  if (cdk_plugin_get_style_runs (plugin, doc) == NULL)
+    {
+      g_printerr ("cdk-bench: failed to parse '%s'\n", doc->file_name);
+      return;
+    }
+
+  if (! cdk_bench_highlight (plugin, doc, 0))
+    return;
+
+  for (gint i = 0; i < opt_iterations; i++)
+    {
+      gint length = cdk_bench_sci_send (doc, SCI_GETLENGTH, 0, 0);
+      gchar *edit =
+        g_strdup_printf ("\nint cdk_bench_edit_%d (int x)\n{\n  return x + %d;\n}\n", i, i);
+      cdk_bench_sci_send (doc, SCI_INSERTTEXT, length, (sptr_t) edit);
+      g_free (edit);
+
+      if (! cdk_bench_reparse (plugin, doc) ||
+          ! cdk_bench_highlight (plugin, doc, length) ||
+          ! cdk_bench_complete (plugin, doc, i))
+        return;
+    }
+}
+
+static gchar *
+cdk_bench_write_synthetic (const gchar *dir, guint index, GError **error)
+{
+  GString *src = g_string_new ("#include <stdio.h>\n"
+                               "#include <stdlib.h>\n"
+                               "#include <string.h>\n\n");
+
+  g_string_append_printf (src,
+                          "struct cdk_bench_point_%u\n"
+                          "{\n"
+                          "  int x;\n"
+                          "  int y;\n"
+                          "  char name[32];\n"
+                          "};\n",
+                          index);
+
+  for (gint i = 0; i < opt_functions; i++)
+    {
+      g_string_append_printf (src,
+                              "\nint\n"
+                              "cdk_bench_fn_%u_%d (struct cdk_bench_point_%u *p, int n)\n"
+                              "{\n"
+                              "  int total = 0;\n"
+                              "  for (int i = 0; i < n; i++)\n"
+                              "    total += p->x * i + p->y;\n"
+                              "  snprintf (p->name, sizeof (p->name), \"%%d\", total);\n"
+                              "  return total + (int) strlen (p->name);\n"
+                              "}\n",
+                              index, i, index);
+    }
+
+  gchar *name = g_strdup_printf ("synthetic%03u.c", index);
+  gchar *filename = g_build_filename (dir, name, NULL);
+  g_free (name);
+
+  if (! g_file_set_contents (filename, src->str, src->len, error))
+    {
+      g_free (filename);
+      filename = NULL;
+    }
+
+  g_string_free (src, TRUE);
+
+  return filename;
+}
+
+static void
+cdk_bench_print_stats (const CdkLatencyStats *stats)
+{
+  g_print ("{ \"count\": %" G_GUINT64_FORMAT
+           ", \"p50_us\": %" G_GUINT64_FORMAT
+           ", \"p95_us\": %" G_GUINT64_FORMAT
+           ", \"p99_us\": %" G_GUINT64_FORMAT
+           ", \"max_us\": %" G_GUINT64_FORMAT " }",
+           stats->count, stats->p50, stats->p95, stats->p99, stats->max);
+}
+
+static void
+cdk_bench_print_string (const gchar *str)
+{
+  gchar *escaped = g_strescape (str, NULL);
+  g_print ("\"%s\"", escaped);
+  g_free (escaped);
+}
+
+static void
+cdk_bench_print_results (CdkPlugin *plugin, GPtrArray *docs)
+{
+  CdkLatencyStats stats;
+  CXString version = clang_getClangVersion ();
+
+  g_print ("{\n  \"clang_version\": ");
+  cdk_bench_print_string (clang_getCString (version));
+  g_print (",\n  \"iterations\": %d,\n  \"documents\": [", opt_iterations);
+  clang_disposeString (version);
+
+  for (guint i = 0; i < docs->len; i++)
+    {
+      GeanyDocument *doc = docs->pdata[i];
+      CdkResourceUsage usage;
+
+      cdk_plugin_get_resource_usage (plugin, doc, &usage);
+      g_print ("%s\n    {\n      \"file\": ", i > 0 ? "," : "");
+      cdk_bench_print_string (doc->real_path);
+      g_print (",\n      \"memory_bytes\": %" G_GUINT64_FORMAT, usage.total);
+      g_print (",\n      \"styling_messages\": %" G_GUINT64_FORMAT,
+               cdk_bench_sci_get_n_styling (doc->editor->sci));
+      for (guint kind = 0; kind < CDK_NUM_LATENCIES; kind++)
+        {
+          cdk_plugin_get_latency_stats (plugin, doc, kind, &stats);
+          g_print (",\n      \"%s\": ", cdk_bench_latency_names[kind]);
+          cdk_bench_print_stats (&stats);
+        }
+      g_print ("\n    }");
+    }
+
+  g_print ("\n  ],\n  \"project\": {");
+  for (guint kind = 0; kind < CDK_NUM_LATENCIES; kind++)
+    {
+      cdk_plugin_get_project_latency_stats (plugin, kind, &stats);
+      g_print ("%s\n    \"%s\": ", kind > 0 ? "," : "", cdk_bench_latency_names[kind]);
+      cdk_bench_print_stats (&stats);
+    }
+  g_print ("\n  },\n  \"outcomes\": {");
+  for (guint kind = 0; kind < CDK_NUM_LATENCIES; kind++)
+    {
+      g_print ("%s\n    \"%s\": {", kind > 0 ? "," : "", cdk_bench_latency_names[kind]);
+      for (guint outcome = 0; outcome < CDK_NUM_JOB_OUTCOMES; outcome++)
+        {
+          g_print ("%s \"%s\": %" G_GUINT64_FORMAT, outcome > 0 ? "," : "",
+                   cdk_bench_outcome_names[outcome],
+                   cdk_plugin_get_job_outcome_count (plugin, kind, outcome));
+        }
+      g_print (" }");
+    }
+  g_print ("\n  }\n}\n");
+}
+
+static void
+cdk_bench_remove_dir (const gchar *path)
+{
+  GDir *dir = g_dir_open (path, 0, NULL);
+  if (dir != NULL)
+    {
+      const gchar *name;
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          gchar *child = g_build_filename (path, name, NULL);
+          if (g_file_test (child, G_FILE_TEST_IS_DIR))
+            cdk_bench_remove_dir (child);
+          else
+            g_unlink (child);
+          g_free (child);
+        }
+      g_dir_close (dir);
+    }
+  g_rmdir (path);
+}
+
+int
+main (int argc, char **argv)
+{
+  GError *error = NULL;
+  GOptionContext *context = g_option_context_new ("- benchmark libcdk");
+  g_option_context_add_main_entries (context, cdk_bench_options, NULL);
+  if (! g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("cdk-bench: %s\n", error->message);
+      g_error_free (error);
+      g_option_context_free (context);
+      return EXIT_FAILURE;
+    }
+  g_option_context_free (context);
+
+  gchar *work_dir = g_dir_make_tmp ("cdk-bench-XXXXXX", &error);
+  if (work_dir == NULL)
+    {
+      g_printerr ("cdk-bench: %s\n", error->message);
+      g_error_free (error);
+      return EXIT_FAILURE;
+    }
+
+  // Must happen before anything asks GLib for the cache dir
+  if (opt_cache_dir == NULL)
+    g_setenv ("XDG_CACHE_HOME", work_dir, TRUE);
+  else
+    g_setenv ("XDG_CACHE_HOME", opt_cache_dir, TRUE);
+
+  // The stand-in Scintilla is never realized so no display is needed
+  gtk_init_check (&argc, &argv);
+
+  GPtrArray *files = g_ptr_array_new_with_free_func (g_free);
+  for (gchar **it = opt_files; it != NULL && *it != NULL; it++)
+    g_ptr_array_add (files, g_strdup (*it));
+
+  if (opt_synthetic < 0)
+    opt_synthetic = (files->len == 0) ? 4 : 0;
+  for (gint i = 0; i < opt_synthetic; i++)
+    {
+      gchar *filename = cdk_bench_write_synthetic (work_dir, i, &error);
+      if (filename == NULL)
+        {
+          g_printerr ("cdk-bench: %s\n", error->message);
+          g_clear_error (&error);
+          continue;
+        }
+      g_ptr_array_add (files, filename);
+    }
+
+  gchar *base_path = (opt_compdb != NULL) ? g_strdup (opt_compdb) : g_get_current_dir ();
+  cdk_bench_geany_init (base_path);
+  g_free (base_path);
+
+  GPtrArray *docs = g_ptr_array_new ();
+  for (guint i = 0; i < files->len; i++)
+    {
+      GeanyDocument *doc = cdk_bench_document_new (files->pdata[i], &error);
+      if (doc == NULL)
+        {
+          g_printerr ("cdk-bench: %s\n", error->message);
+          g_clear_error (&error);
+          continue;
+        }
+      g_ptr_array_add (docs, doc);
+    }
+
+  GKeyFile *config = g_key_file_new ();
+  if (opt_cflags != NULL)
+    g_key_file_set_string (config, "cdk", "cflags", opt_cflags);
+  else if (opt_synthetic > 0)
+    g_key_file_set_string (config, "cdk", "cflags", "-std=gnu99 -Wall");
+  if (opt_compdb != NULL)
+    g_key_file_set_string (config, "cdk", "compdb", opt_compdb);
+  if (opt_pch != NULL)
+    g_key_file_set_string (config, "cdk", "pch", opt_pch);
+  if (opt_out_of_process)
+    g_key_file_set_boolean (config, "cdk", "out-of-process", TRUE);
+  if (opt_warm_up)
+    g_key_file_set_boolean (config, "cdk", "warm-up", TRUE);
+  if (opt_symbol_index)
+    g_key_file_set_boolean (config, "cdk", "symbol-index", TRUE);
+
+  GPtrArray *paths = g_ptr_array_new ();
+  for (guint i = 0; i < docs->len; i++)
+    g_ptr_array_add (paths, ((GeanyDocument *) docs->pdata[i])->real_path);
+  g_key_file_set_string_list (config, "cdk", "files",
+                              (const gchar *const *) paths->pdata, paths->len);
+  g_ptr_array_free (paths, TRUE);
+
+  CdkPlugin *plugin = cdk_plugin_new ();
+  cdk_plugin_open_project (plugin, config);
+  g_key_file_free (config);
+
+  // the files are only warmed up while they aren't open
+  if (opt_warm_up)
+    cdk_bench_wait (plugin, NULL, cdk_bench_is_warmed_up, NULL);
+
+  if (opt_symbol_index &&
+      cdk_bench_wait (plugin, NULL, cdk_bench_is_indexed, NULL))
+    cdk_bench_lookup_symbols (plugin);
+
+  for (guint i = 0; i < docs->len; i++)
+    {
+      GeanyDocument *doc = docs->pdata[i];
+      if (! cdk_plugin_add_document (plugin, doc))
+        g_printerr ("cdk-bench: '%s' isn't supported\n", doc->file_name);
+      else if (opt_per_token_styling)
+        cdk_highlighter_set_per_token_styling (cdk_plugin_get_highlighter (plugin, doc), TRUE);
+    }
+
+  for (guint i = 0; i < docs->len; i++)
+    cdk_bench_run_document (plugin, docs->pdata[i]);
+
+  cdk_bench_print_results (plugin, docs);
+
+  cdk_plugin_close_project (plugin);
+  g_object_unref (plugin);
+
+  for (guint i = 0; i < docs->len; i++)
+    cdk_bench_document_free (docs->pdata[i]);
+  g_ptr_array_free (docs, TRUE);
+  g_ptr_array_free (files, TRUE);
+  cdk_bench_geany_cleanup ();
+
+  cdk_bench_remove_dir (work_dir);
+  g_free (work_dir);
+
+  return EXIT_SUCCESS;
+}
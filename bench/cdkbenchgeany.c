@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "cdkbenchgeany.h"
+#include "cdkbenchsci.h"
+#include <cdk/cdkutils.h>
+#include <string.h>
+
+/*
+ * Stand-ins for the parts of Geany libcdk uses: the global geany_data,
+ * documents backed by a CdkBenchSci and the message window and editor
+ * functions, which do nothing here.
+ */
+
+GeanyData *geany_data = NULL;
+
+static GeanyFiletype cdk_bench_filetypes[] = {
+  { .id = GEANY_FILETYPES_C },
+  { .id = GEANY_FILETYPES_CPP },
+  { .id = GEANY_FILETYPES_OBJECTIVEC },
+};
+
+void
+cdk_bench_geany_init (const gchar *base_path)
+{
+  g_return_if_fail (geany_data == NULL);
+
+  geany_data = g_new0 (GeanyData, 1);
+  geany_data->app = g_new0 (GeanyApp, 1);
+  geany_data->app->project = g_new0 (GeanyProject, 1);
+  geany_data->app->project->name = g_strdup ("cdk-bench");
+  geany_data->app->project->base_path = g_strdup (base_path);
+  geany_data->documents_array = g_ptr_array_new ();
+  geany_data->main_widgets = g_new0 (GeanyMainWidgets, 1);
+  // only used to attach the CdkPlugin to
+  geany_data->main_widgets->window = g_object_new (G_TYPE_OBJECT, NULL);
+}
+
+void
+cdk_bench_geany_cleanup (void)
+{
+  if (geany_data == NULL)
+    return;
+
+  g_ptr_array_free (geany_data->documents_array, TRUE);
+  g_object_unref (geany_data->main_widgets->window);
+  g_free (geany_data->main_widgets);
+  g_free (geany_data->app->project->name);
+  g_free (geany_data->app->project->base_path);
+  g_free (geany_data->app->project);
+  g_free (geany_data->app);
+  g_free (geany_data);
+  geany_data = NULL;
+}
+
+static GeanyFiletype *
+cdk_bench_filetype_for_file (const gchar *filename)
+{
+  const gchar *ext = strrchr (filename, '.');
+
+  if (ext == NULL || g_strcmp0 (ext, ".c") == 0 || g_strcmp0 (ext, ".h") == 0)
+    return &cdk_bench_filetypes[0];
+  else if (g_strcmp0 (ext, ".m") == 0)
+    return &cdk_bench_filetypes[2];
+  else
+    return &cdk_bench_filetypes[1];
+}
+
+/*
+ * Loads filename into a new document, as if it was opened in Geany.
+ */
+GeanyDocument *
+cdk_bench_document_new (const gchar *filename, GError **error)
+{
+  g_return_val_if_fail (filename != NULL, NULL);
+
+  gchar *contents = NULL;
+  if (! g_file_get_contents (filename, &contents, NULL, error))
+    return NULL;
+
+  GeanyDocument *doc = g_new0 (GeanyDocument, 1);
+  doc->is_valid = TRUE;
+  doc->file_name = g_strdup (filename);
+  doc->real_path = cdk_abspath (filename);
+  doc->file_type = cdk_bench_filetype_for_file (filename);
+  doc->editor = g_new0 (GeanyEditor, 1);
+  doc->editor->document = doc;
+  doc->editor->sci = cdk_bench_sci_new ();
+
+  scintilla_send_message (doc->editor->sci, SCI_SETTEXT, 0, (sptr_t) contents);
+  scintilla_send_message (doc->editor->sci, SCI_SETSAVEPOINT, 0, 0);
+  doc->changed = FALSE;
+
+  g_free (contents);
+
+  return doc;
+}
+
+void
+cdk_bench_document_free (GeanyDocument *doc)
+{
+  if (G_UNLIKELY (doc == NULL))
+    return;
+
+  g_object_unref (doc->editor->sci);
+  g_free (doc->editor);
+  g_free (doc->file_name);
+  g_free (doc->real_path);
+  g_free (doc);
+}
+
+void
+msgwin_clear_tab (G_GNUC_UNUSED gint tabnum)
+{
+}
+
+void
+msgwin_compiler_add (G_GNUC_UNUSED gint msg_color,
+                     G_GNUC_UNUSED const gchar *format,
+                     ...)
+{
+}
+
+void
+msgwin_set_messages_dir (G_GNUC_UNUSED const gchar *messages_dir)
+{
+}
+
+void
+editor_indicator_clear (G_GNUC_UNUSED GeanyEditor *editor,
+                        G_GNUC_UNUSED gint indic)
+{
+}
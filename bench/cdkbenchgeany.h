@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifndef CDK_BENCH_GEANY_H_
+#define CDK_BENCH_GEANY_H_ 1
+
+#include <geanyplugin.h>
+
+G_BEGIN_DECLS
+
+void cdk_bench_geany_init (const gchar *base_path);
+void cdk_bench_geany_cleanup (void);
+
+GeanyDocument *cdk_bench_document_new (const gchar *filename, GError **error);
+void cdk_bench_document_free (GeanyDocument *doc);
+
+G_END_DECLS
+
+#endif /* CDK_BENCH_GEANY_H_ */
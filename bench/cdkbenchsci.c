@@ -0,0 +1,583 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "cdkbenchsci.h"
+#include <string.h>
+#include <ctype.h>
+
+/*
+ * A stand-in for the Scintilla widget, just enough of it for libcdk to
+ * run against without a display. It keeps the text, the styles and a
+ * few bits of state and answers the messages libcdk sends, everything
+ * to do with drawing (indicators, markers, annotations, ...) is
+ * accepted and ignored. It replaces the real widget by providing
+ * scintilla_send_message() and the type function the SCINTILLA() casts
+ * use, so the benchmark must be linked with -export-dynamic.
+ */
+
+#define CDK_BENCH_SCI_LINES_ON_SCREEN 50
+#define CDK_BENCH_SCI_TAB_WIDTH       8
+
+typedef struct
+{
+  ScintillaObject parent;
+  GString  *text;          // the document
+  GString  *styles;        // style byte of each character
+  GArray   *line_starts;   // position of each line, rebuilt when dirty
+  gboolean  lines_dirty;   // whether line_starts is out of date
+  gint      end_styled;    // position up to which the text is styled
+  gint      styling_pos;   // where SCI_SETSTYLING continues from
+  gint      current_pos;   // caret position
+  gint      first_visible; // first line in view
+  gint      lexer;
+  gint      target_start;
+  gint      target_end;
+  gint      search_flags;
+  gint      autoc_separator;
+  gint      autoc_order;
+  gboolean  modified;      // changed since the last save point
+  guint     n_autoc_shown; // number of SCI_AUTOCSHOW received
+  guint64   n_styling;     // number of styling messages received
+}
+CdkBenchSci;
+
+typedef struct
+{
+  ScintillaClass parent_class;
+}
+CdkBenchSciClass;
+
+static void cdk_bench_sci_finalize (GObject *object);
+
+G_DEFINE_TYPE (CdkBenchSci, cdk_bench_sci, GTK_TYPE_CONTAINER)
+
+#define CDK_BENCH_SCI(obj) ((CdkBenchSci *) (obj))
+
+static void
+cdk_bench_sci_class_init (CdkBenchSciClass *klass)
+{
+  GObjectClass *g_object_class = G_OBJECT_CLASS (klass);
+
+  g_object_class->finalize = cdk_bench_sci_finalize;
+
+  // same signature as the real one
+  g_signal_new ("sci-notify", G_TYPE_FROM_CLASS (klass), G_SIGNAL_RUN_LAST,
+                G_STRUCT_OFFSET (ScintillaClass, notify), NULL, NULL, NULL,
+                G_TYPE_NONE, 2, G_TYPE_INT, G_TYPE_POINTER);
+}
+
+static void
+cdk_bench_sci_init (CdkBenchSci *self)
+{
+  self->text = g_string_new ("");
+  self->styles = g_string_new ("");
+  self->line_starts = g_array_new (FALSE, FALSE, sizeof (gint));
+  self->lines_dirty = TRUE;
+  self->autoc_separator = ' ';
+}
+
+static void
+cdk_bench_sci_finalize (GObject *object)
+{
+  CdkBenchSci *self = CDK_BENCH_SCI (object);
+
+  g_string_free (self->text, TRUE);
+  g_string_free (self->styles, TRUE);
+  g_array_free (self->line_starts, TRUE);
+
+  G_OBJECT_CLASS (cdk_bench_sci_parent_class)->finalize (object);
+}
+
+// The SCINTILLA() and IS_SCINTILLA() macros check against this type
+#ifdef SCINTILLA_TYPE_OBJECT
+GType
+scintilla_object_get_type (void)
+{
+  return cdk_bench_sci_get_type ();
+}
+#endif
+
+GType
+scintilla_get_type (void)
+{
+  return cdk_bench_sci_get_type ();
+}
+
+ScintillaObject *
+cdk_bench_sci_new (void)
+{
+  ScintillaObject *sci = g_object_new (cdk_bench_sci_get_type (), NULL);
+  return g_object_ref_sink (sci);
+}
+
+/*
+ * Emits sci-notify with a notification of code, like Scintilla does
+ * for SCN_STYLENEEDED, SCN_CHARADDED, etc.
+ */
+void
+cdk_bench_sci_notify (ScintillaObject *sci,
+                      guint code,
+                      gint position,
+                      gint ch)
+{
+  SCNotification nt;
+
+  memset (&nt, 0, sizeof (SCNotification));
+  nt.nmhdr.hwndFrom = sci;
+  nt.nmhdr.code = code;
+  nt.position = position;
+  nt.ch = ch;
+
+  g_signal_emit_by_name (sci, "sci-notify", 0, &nt);
+}
+
+guint
+cdk_bench_sci_get_n_autoc_shown (ScintillaObject *sci)
+{
+  return CDK_BENCH_SCI (sci)->n_autoc_shown;
+}
+
+/*
+ * The number of SCI_STARTSTYLING, SCI_SETSTYLING and SCI_SETSTYLINGEX
+ * messages received, each of which is a synchronous call into the real
+ * Scintilla.
+ */
+guint64
+cdk_bench_sci_get_n_styling (ScintillaObject *sci)
+{
+  return CDK_BENCH_SCI (sci)->n_styling;
+}
+
+static void
+cdk_bench_sci_notify_modified (CdkBenchSci *self,
+                               gint mod_type,
+                               gint position,
+                               const gchar *text,
+                               gint length,
+                               gint lines_added)
+{
+  SCNotification nt;
+
+  memset (&nt, 0, sizeof (SCNotification));
+  nt.nmhdr.hwndFrom = self;
+  nt.nmhdr.code = SCN_MODIFIED;
+  nt.modificationType = mod_type;
+  nt.position = position;
+  nt.text = text;
+  nt.length = length;
+  nt.linesAdded = lines_added;
+
+  g_signal_emit_by_name (self, "sci-notify", 0, &nt);
+}
+
+static gint
+cdk_bench_sci_count_lines (const gchar *text, gint length)
+{
+  gint n_lines = 0;
+  for (gint i = 0; i < length; i++)
+    {
+      if (text[i] == '\n')
+        n_lines++;
+    }
+  return n_lines;
+}
+
+static void
+cdk_bench_sci_insert_text (CdkBenchSci *self, gint pos, const gchar *text)
+{
+  gint length = strlen (text);
+
+  if (pos < 0)
+    pos = self->current_pos;
+  pos = CLAMP (pos, 0, (gint) self->text->len);
+
+  g_string_insert_len (self->text, pos, text, length);
+  gchar *zeros = g_malloc0 (length);
+  g_string_insert_len (self->styles, pos, zeros, length);
+  g_free (zeros);
+
+  if (self->current_pos >= pos)
+    self->current_pos += length;
+  self->end_styled = MIN (self->end_styled, pos);
+  self->lines_dirty = TRUE;
+  self->modified = TRUE;
+
+  cdk_bench_sci_notify_modified (self, SC_MOD_INSERTTEXT, pos, text, length,
+                                 cdk_bench_sci_count_lines (text, length));
+}
+
+static void
+cdk_bench_sci_delete_range (CdkBenchSci *self, gint pos, gint length)
+{
+  pos = CLAMP (pos, 0, (gint) self->text->len);
+  length = CLAMP (length, 0, (gint) self->text->len - pos);
+  if (length == 0)
+    return;
+
+  gchar *deleted = g_strndup (self->text->str + pos, length);
+  g_string_erase (self->text, pos, length);
+  g_string_erase (self->styles, pos, length);
+
+  if (self->current_pos >= pos + length)
+    self->current_pos -= length;
+  else if (self->current_pos > pos)
+    self->current_pos = pos;
+  self->end_styled = MIN (self->end_styled, pos);
+  self->lines_dirty = TRUE;
+  self->modified = TRUE;
+
+  cdk_bench_sci_notify_modified (self, SC_MOD_DELETETEXT, pos, deleted, length,
+                                 -cdk_bench_sci_count_lines (deleted, length));
+  g_free (deleted);
+}
+
+static GArray *
+cdk_bench_sci_get_line_starts (CdkBenchSci *self)
+{
+  if (self->lines_dirty)
+    {
+      gint start = 0;
+      g_array_set_size (self->line_starts, 0);
+      g_array_append_val (self->line_starts, start);
+      for (gsize i = 0; i < self->text->len; i++)
+        {
+          if (self->text->str[i] == '\n')
+            {
+              start = i + 1;
+              g_array_append_val (self->line_starts, start);
+            }
+        }
+      self->lines_dirty = FALSE;
+    }
+  return self->line_starts;
+}
+
+static gint
+cdk_bench_sci_line_from_position (CdkBenchSci *self, gint pos)
+{
+  GArray *starts = cdk_bench_sci_get_line_starts (self);
+  gint lo = 0, hi = starts->len - 1;
+
+  // last line starting at or before pos
+  while (lo < hi)
+    {
+      gint mid = (lo + hi + 1) / 2;
+      if (g_array_index (starts, gint, mid) <= pos)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+
+  return lo;
+}
+
+static gint
+cdk_bench_sci_position_from_line (CdkBenchSci *self, gint line)
+{
+  GArray *starts = cdk_bench_sci_get_line_starts (self);
+  if (line < 0 || line >= (gint) starts->len)
+    return -1;
+  return g_array_index (starts, gint, line);
+}
+
+static gint
+cdk_bench_sci_line_end_position (CdkBenchSci *self, gint line)
+{
+  GArray *starts = cdk_bench_sci_get_line_starts (self);
+  if (line < 0 || line >= (gint) starts->len)
+    return self->text->len;
+  if (line == (gint) starts->len - 1)
+    return self->text->len;
+
+  gint end = g_array_index (starts, gint, line + 1) - 1;
+  if (end > 0 && self->text->str[end - 1] == '\r')
+    end--;
+  return end;
+}
+
+static gint
+cdk_bench_sci_get_column (CdkBenchSci *self, gint pos)
+{
+  gint line = cdk_bench_sci_line_from_position (self, pos);
+  gint column = 0;
+
+  for (gint i = cdk_bench_sci_position_from_line (self, line); i < pos; i++)
+    {
+      if (self->text->str[i] == '\t')
+        column = (column / CDK_BENCH_SCI_TAB_WIDTH + 1) * CDK_BENCH_SCI_TAB_WIDTH;
+      else
+        column++;
+    }
+
+  return column;
+}
+
+static gboolean
+cdk_bench_sci_is_word_char (gchar ch)
+{
+  return (isalnum ((guchar) ch) || ch == '_' || (guchar) ch >= 0x80);
+}
+
+// 0 for spaces, 1 for word characters and 2 for punctuation
+static gint
+cdk_bench_sci_char_class (gchar ch)
+{
+  if (isspace ((guchar) ch))
+    return 0;
+  return cdk_bench_sci_is_word_char (ch) ? 1 : 2;
+}
+
+static gint
+cdk_bench_sci_word_start (CdkBenchSci *self, gint pos, gboolean only_word_chars)
+{
+  const gchar *text = self->text->str;
+
+  pos = CLAMP (pos, 0, (gint) self->text->len);
+  if (pos == 0)
+    return 0;
+
+  if (only_word_chars)
+    {
+      while (pos > 0 && cdk_bench_sci_is_word_char (text[pos - 1]))
+        pos--;
+    }
+  else
+    {
+      gint cls = cdk_bench_sci_char_class (text[pos - 1]);
+      while (pos > 0 && cdk_bench_sci_char_class (text[pos - 1]) == cls)
+        pos--;
+    }
+
+  return pos;
+}
+
+static gint
+cdk_bench_sci_word_end (CdkBenchSci *self, gint pos, gboolean only_word_chars)
+{
+  const gchar *text = self->text->str;
+  gint length = self->text->len;
+
+  pos = CLAMP (pos, 0, length);
+  if (pos == length)
+    return length;
+
+  if (only_word_chars)
+    {
+      while (pos < length && cdk_bench_sci_is_word_char (text[pos]))
+        pos++;
+    }
+  else
+    {
+      gint cls = cdk_bench_sci_char_class (text[pos]);
+      while (pos < length && cdk_bench_sci_char_class (text[pos]) == cls)
+        pos++;
+    }
+
+  return pos;
+}
+
+static gint
+cdk_bench_sci_get_text_range (CdkBenchSci *self, struct Sci_TextRange *tr)
+{
+  gint length = self->text->len;
+  gint start = CLAMP ((gint) tr->chrg.cpMin, 0, length);
+  gint end = (tr->chrg.cpMax < 0) ? length : CLAMP ((gint) tr->chrg.cpMax, start, length);
+
+  memcpy (tr->lpstrText, self->text->str + start, end - start);
+  tr->lpstrText[end - start] = '\0';
+
+  return end - start;
+}
+
+static gint
+cdk_bench_sci_search_in_target (CdkBenchSci *self, gint length, const gchar *needle)
+{
+  const gchar *text = self->text->str;
+  gint start = MIN (self->target_start, self->target_end);
+  gint end = MAX (self->target_start, self->target_end);
+
+  for (gint pos = start; pos + length <= end; pos++)
+    {
+      gboolean match;
+      if (self->search_flags & SCFIND_MATCHCASE)
+        match = (strncmp (text + pos, needle, length) == 0);
+      else
+        match = (g_ascii_strncasecmp (text + pos, needle, length) == 0);
+
+      if (match && (self->search_flags & SCFIND_WHOLEWORD))
+        {
+          match = (pos == 0 || ! cdk_bench_sci_is_word_char (text[pos - 1])) &&
+                  (pos + length == (gint) self->text->len ||
+                   ! cdk_bench_sci_is_word_char (text[pos + length]));
+        }
+
+      if (match)
+        {
+          self->target_start = pos;
+          self->target_end = pos + length;
+          return pos;
+        }
+    }
+
+  return -1;
+}
+
+sptr_t
+scintilla_send_message (ScintillaObject *sci,
+                        unsigned int msg,
+                        uptr_t wparam,
+                        sptr_t lparam)
+{
+  CdkBenchSci *self = CDK_BENCH_SCI (sci);
+  gint length = self->text->len;
+
+  switch (msg)
+    {
+    case SCI_GETLENGTH:
+    case SCI_GETTEXTLENGTH:
+      return length;
+    case SCI_GETCHARACTERPOINTER:
+      return (sptr_t) self->text->str;
+    case SCI_GETRANGEPOINTER:
+      return (sptr_t) (self->text->str + CLAMP ((gint) wparam, 0, length));
+    case SCI_GETGAPPOSITION:
+      return length;
+    case SCI_GETCHARAT:
+      return ((gint) wparam >= 0 && (gint) wparam < length) ?
+        self->text->str[wparam] : 0;
+    case SCI_GETTEXT:
+      if (lparam != 0 && wparam > 0)
+        {
+          gsize n = MIN ((gsize) length, wparam - 1);
+          memcpy ((gchar *) lparam, self->text->str, n);
+          ((gchar *) lparam)[n] = '\0';
+        }
+      return length;
+    case SCI_GETTEXTRANGE:
+      return cdk_bench_sci_get_text_range (self, (struct Sci_TextRange *) lparam);
+
+    case SCI_SETTEXT:
+      cdk_bench_sci_delete_range (self, 0, length);
+      cdk_bench_sci_insert_text (self, 0, (const gchar *) lparam);
+      self->current_pos = 0;
+      return 0;
+    case SCI_INSERTTEXT:
+      cdk_bench_sci_insert_text (self, (gint) wparam, (const gchar *) lparam);
+      return 0;
+    case SCI_DELETERANGE:
+      cdk_bench_sci_delete_range (self, (gint) wparam, (gint) lparam);
+      return 0;
+    case SCI_GETMODIFY:
+      return self->modified;
+    case SCI_SETSAVEPOINT:
+      self->modified = FALSE;
+      return 0;
+
+    case SCI_GETCURRENTPOS:
+      return self->current_pos;
+    case SCI_GOTOPOS:
+      self->current_pos = CLAMP ((gint) wparam, 0, length);
+      return 0;
+    case SCI_WORDSTARTPOSITION:
+      return cdk_bench_sci_word_start (self, (gint) wparam, (gboolean) lparam);
+    case SCI_WORDENDPOSITION:
+      return cdk_bench_sci_word_end (self, (gint) wparam, (gboolean) lparam);
+
+    case SCI_GETLINECOUNT:
+      return cdk_bench_sci_get_line_starts (self)->len;
+    case SCI_LINEFROMPOSITION:
+      return cdk_bench_sci_line_from_position (self, (gint) wparam);
+    case SCI_POSITIONFROMLINE:
+      return cdk_bench_sci_position_from_line (self, (gint) wparam);
+    case SCI_GETLINEENDPOSITION:
+      return cdk_bench_sci_line_end_position (self, (gint) wparam);
+    case SCI_GETCOLUMN:
+      return cdk_bench_sci_get_column (self, CLAMP ((gint) wparam, 0, length));
+    case SCI_GETFIRSTVISIBLELINE:
+      return self->first_visible;
+    case SCI_SETFIRSTVISIBLELINE:
+      self->first_visible = CLAMP ((gint) wparam, 0,
+                                   (gint) cdk_bench_sci_get_line_starts (self)->len - 1);
+      return 0;
+    case SCI_LINESONSCREEN:
+      return CDK_BENCH_SCI_LINES_ON_SCREEN;
+    case SCI_DOCLINEFROMVISIBLE:
+    case SCI_VISIBLEFROMDOCLINE:
+      return wparam;
+    case SCI_POSITIONFROMPOINT:
+      return 0;
+
+    case SCI_GETLEXER:
+      return self->lexer;
+    case SCI_SETLEXER:
+      self->lexer = (gint) wparam;
+      return 0;
+    case SCI_STARTSTYLING:
+      self->n_styling++;
+      self->styling_pos = self->end_styled = CLAMP ((gint) wparam, 0, length);
+      return 0;
+    case SCI_SETSTYLING:
+      {
+        self->n_styling++;
+        gint n = CLAMP ((gint) wparam, 0, length - self->styling_pos);
+        memset (self->styles->str + self->styling_pos, (gint) lparam, n);
+        self->styling_pos += n;
+        self->end_styled = self->styling_pos;
+        return 0;
+      }
+    case SCI_SETSTYLINGEX:
+      {
+        self->n_styling++;
+        gint n = CLAMP ((gint) wparam, 0, length - self->styling_pos);
+        memcpy (self->styles->str + self->styling_pos, (const gchar *) lparam, n);
+        self->styling_pos += n;
+        self->end_styled = self->styling_pos;
+        return 0;
+      }
+    case SCI_GETENDSTYLED:
+      return self->end_styled;
+    case SCI_GETSTYLEAT:
+      return ((gint) wparam >= 0 && (gint) wparam < length) ?
+        (guchar) self->styles->str[wparam] : 0;
+
+    case SCI_SETTARGETRANGE:
+      self->target_start = CLAMP ((gint) wparam, 0, length);
+      self->target_end = CLAMP ((gint) lparam, 0, length);
+      return 0;
+    case SCI_GETTARGETSTART:
+      return self->target_start;
+    case SCI_GETTARGETEND:
+      return self->target_end;
+    case SCI_SETSEARCHFLAGS:
+      self->search_flags = (gint) wparam;
+      return 0;
+    case SCI_SEARCHINTARGET:
+      return cdk_bench_sci_search_in_target (self, (gint) wparam, (const gchar *) lparam);
+
+    case SCI_AUTOCSHOW:
+      self->n_autoc_shown++;
+      return 0;
+    case SCI_AUTOCACTIVE:
+      return FALSE;
+    case SCI_AUTOCGETSEPARATOR:
+      return self->autoc_separator;
+    case SCI_AUTOCSETSEPARATOR:
+      self->autoc_separator = (gint) wparam;
+      return 0;
+    case SCI_AUTOCGETORDER:
+      return self->autoc_order;
+    case SCI_AUTOCSETORDER:
+      self->autoc_order = (gint) wparam;
+      return 0;
+
+    default:
+      // styles, indicators, markers, annotations, ... only affect drawing
+      return 0;
+    }
+}
@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifndef CDK_BENCH_SCI_H_
+#define CDK_BENCH_SCI_H_ 1
+
+#include <geanyplugin.h>
+
+G_BEGIN_DECLS
+
+ScintillaObject *cdk_bench_sci_new (void);
+void cdk_bench_sci_notify (ScintillaObject *sci, guint code, gint position, gint ch);
+guint cdk_bench_sci_get_n_autoc_shown (ScintillaObject *sci);
+guint64 cdk_bench_sci_get_n_styling (ScintillaObject *sci);
+
+G_END_DECLS
+
+#endif /* CDK_BENCH_SCI_H_ */
@@ -10,6 +10,7 @@
 #include <cdk/cdkdiagnostics.h>
 #include <cdk/cdkdocumenthelper.h>
 #include <cdk/cdkhighlighter.h>
+#include <cdk/cdkindex.h>
 #include <cdk/cdkplugin.h>
 #include <cdk/cdkstyle.h>
 #include <cdk/cdkstylescheme.h>
@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <cdk/cdkcache.h>
+#include <clang-c/Index.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Each cached TU is stored as two files in the cache directory, named
+ * after a key made from the main file's path, the compiler arguments
+ * and the libclang version:
+ *
+ *   <key>.ast  - the serialized AST from clang_saveTranslationUnit()
+ *   <key>.deps - key file listing every file the AST was built from
+ *                together with a hash of its contents
+ *
+ * An entry is only used if all of the files listed in the .deps file
+ * still hash the same, so any edit to the source or one of its headers
+ * invalidates it. The cache is only touched by the parser's threads,
+ * and never for the same main file by more than one of them.
+ *
+ * Loading an entry touches its .ast file, so the modification times
+ * tell when each entry was last used. cdk_cache_prune() goes by those
+ * to drop the entries unused for too long, then the least recently
+ * used ones until the rest fit in the size given.
+ */
+
+#define CDK_CACHE_GROUP    "cdk-cache"
+#define CDK_CACHE_CHECKSUM G_CHECKSUM_SHA1
+
+struct CdkCache_
+{
+  gchar *dir;           // directory the entries are stored in
+  gchar *clang_version; // libclang version string, part of every key
+};
+
+CdkCache *
+cdk_cache_new (const gchar *cache_dir)
+{
+  g_return_val_if_fail (cache_dir != NULL, NULL);
+
+  if (g_mkdir_with_parents (cache_dir, 0700) != 0)
+    {
+      g_warning ("failed to create cache directory '%s': %s",
+                 cache_dir, g_strerror (errno));
+      return NULL;
+    }
+
+  CdkCache *cache = g_slice_new0 (CdkCache);
+  cache->dir = g_strdup (cache_dir);
+
+  CXString version = clang_getClangVersion ();
+  cache->clang_version = g_strdup (clang_getCString (version));
+  clang_disposeString (version);
+
+  return cache;
+}
+
+void
+cdk_cache_free (CdkCache *cache)
+{
+  if (G_UNLIKELY (cache == NULL))
+    return;
+  g_free (cache->dir);
+  g_free (cache->clang_version);
+  g_slice_free (CdkCache, cache);
+}
+
+const gchar *
+cdk_cache_get_dir (CdkCache *cache)
+{
+  g_return_val_if_fail (cache != NULL, NULL);
+  return cache->dir;
+}
+
+gchar *
+cdk_cache_make_key (CdkCache *cache,
+                    const gchar *filename,
+                    const gchar *const *argv)
+{
+  g_return_val_if_fail (cache != NULL, NULL);
+  g_return_val_if_fail (filename != NULL, NULL);
+
+  GChecksum *sum = g_checksum_new (CDK_CACHE_CHECKSUM);
+  // include the terminators so the fields can't run into each other
+  g_checksum_update (sum, (const guchar *) filename, strlen (filename) + 1);
+  for (const gchar *const *it = argv; it != NULL && *it != NULL; it++)
+    g_checksum_update (sum, (const guchar *) *it, strlen (*it) + 1);
+  g_checksum_update (sum, (const guchar *) "", 1);
+  g_checksum_update (sum, (const guchar *) cache->clang_version,
+                     strlen (cache->clang_version) + 1);
+  gchar *key = g_strdup (g_checksum_get_string (sum));
+  g_checksum_free (sum);
+
+  return key;
+}
+
+static gchar *
+cdk_cache_get_entry_path (CdkCache *cache,
+                          const gchar *key,
+                          const gchar *suffix)
+{
+  gchar *name = g_strconcat (key, suffix, NULL);
+  gchar *path = g_build_filename (cache->dir, name, NULL);
+  g_free (name);
+  return path;
+}
+
+// Hash of the unsaved contents if filename is the main file being
+// edited, otherwise of the file on disk. NULL if it can't be read.
+static gchar *
+cdk_cache_hash_file (const gchar *filename,
+                     const gchar *main_filename,
+                     GBytes *contents)
+{
+  if (contents != NULL && g_strcmp0 (filename, main_filename) == 0)
+    {
+      gsize length = 0;
+      gconstpointer data = g_bytes_get_data (contents, &length);
+      return g_compute_checksum_for_data (CDK_CACHE_CHECKSUM, data, length);
+    }
+
+  GMappedFile *map = g_mapped_file_new (filename, FALSE, NULL);
+  if (map == NULL)
+    return NULL;
+
+  gsize length = g_mapped_file_get_length (map);
+  const gchar *data = g_mapped_file_get_contents (map);
+  gchar *hash =
+    g_compute_checksum_for_data (CDK_CACHE_CHECKSUM,
+                                 (const guchar *) (data ? data : ""),
+                                 data ? length : 0);
+  g_mapped_file_unref (map);
+
+  return hash;
+}
+
+static gboolean
+cdk_cache_check_deps (const gchar *deps_path,
+                      const gchar *filename,
+                      GBytes *contents)
+{
+  GKeyFile *kf = g_key_file_new ();
+  gboolean valid = FALSE;
+
+  if (g_key_file_load_from_file (kf, deps_path, G_KEY_FILE_NONE, NULL))
+    {
+      gsize n_files = 0, n_hashes = 0;
+      gchar **files =
+        g_key_file_get_string_list (kf, CDK_CACHE_GROUP, "files", &n_files, NULL);
+      gchar **hashes =
+        g_key_file_get_string_list (kf, CDK_CACHE_GROUP, "hashes", &n_hashes, NULL);
+
+      valid = (files != NULL && hashes != NULL && n_files == n_hashes);
+      for (gsize i = 0; valid && i < n_files; i++)
+        {
+          gchar *hash = cdk_cache_hash_file (files[i], filename, contents);
+          valid = (g_strcmp0 (hash, hashes[i]) == 0);
+          g_free (hash);
+        }
+
+      g_strfreev (files);
+      g_strfreev (hashes);
+    }
+
+  g_key_file_free (kf);
+  return valid;
+}
+
+struct CXTranslationUnitImpl *
+cdk_cache_load (CdkCache *cache,
+                gpointer index,
+                const gchar *key,
+                const gchar *filename,
+                GBytes *contents)
+{
+  g_return_val_if_fail (cache != NULL, NULL);
+  g_return_val_if_fail (key != NULL, NULL);
+
+  CXTranslationUnit tu = NULL;
+  gchar *deps_path = cdk_cache_get_entry_path (cache, key, ".deps");
+  gchar *ast_path = cdk_cache_get_entry_path (cache, key, ".ast");
+
+  if (cdk_cache_check_deps (deps_path, filename, contents))
+    {
+      enum CXErrorCode err = clang_createTranslationUnit2 (index, ast_path, &tu);
+      if (err != CXError_Success)
+        {
+          g_debug ("failed to load cached AST '%s', error '%u'",
+                   ast_path, (guint) err);
+          if (tu != NULL)
+            clang_disposeTranslationUnit (tu);
+          tu = NULL;
+        }
+      else
+        g_utime (ast_path, NULL); // keep it from being pruned
+    }
+
+  g_free (deps_path);
+  g_free (ast_path);
+
+  return tu;
+}
+
+/*
+ * Whether there's an entry for key that cdk_cache_load() would use for
+ * filename as it is on disk, without loading it.
+ */
+gboolean
+cdk_cache_is_fresh (CdkCache *cache,
+                    const gchar *key,
+                    const gchar *filename)
+{
+  g_return_val_if_fail (cache != NULL, FALSE);
+  g_return_val_if_fail (key != NULL, FALSE);
+
+  gchar *deps_path = cdk_cache_get_entry_path (cache, key, ".deps");
+  gchar *ast_path = cdk_cache_get_entry_path (cache, key, ".ast");
+
+  gboolean fresh = (g_file_test (ast_path, G_FILE_TEST_IS_REGULAR) &&
+                    cdk_cache_check_deps (deps_path, filename, NULL));
+
+  g_free (deps_path);
+  g_free (ast_path);
+
+  return fresh;
+}
+
+typedef struct
+{
+  GPtrArray  *files; // files in inclusion order
+  GHashTable *seen;  // set of files already added, owns the strings
+}
+CdkCacheInclusions;
+
+static void
+cdk_cache_visit_inclusion (CXFile included_file,
+                           G_GNUC_UNUSED CXSourceLocation *stack,
+                           G_GNUC_UNUSED unsigned stack_len,
+                           CdkCacheInclusions *incs)
+{
+  CXString name = clang_getFileName (included_file);
+  const gchar *path = clang_getCString (name);
+  if (path != NULL && ! g_hash_table_contains (incs->seen, path))
+    {
+      gchar *file = g_strdup (path);
+      g_hash_table_add (incs->seen, file);
+      g_ptr_array_add (incs->files, file);
+    }
+  clang_disposeString (name);
+}
+
+gboolean
+cdk_cache_save (CdkCache *cache,
+                struct CXTranslationUnitImpl *tu,
+                const gchar *key,
+                const gchar *filename,
+                GBytes *contents)
+{
+  g_return_val_if_fail (cache != NULL, FALSE);
+  g_return_val_if_fail (tu != NULL, FALSE);
+  g_return_val_if_fail (key != NULL, FALSE);
+
+  gboolean saved = FALSE;
+  gchar *deps_path = cdk_cache_get_entry_path (cache, key, ".deps");
+  gchar *ast_path = cdk_cache_get_entry_path (cache, key, ".ast");
+  gchar *tmp_path = cdk_cache_get_entry_path (cache, key, ".ast.tmp");
+
+  // The main file always comes first, its hash is of the unsaved contents
+  CdkCacheInclusions incs;
+  incs.files = g_ptr_array_new ();
+  incs.seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  gchar *main_file = g_strdup (filename);
+  g_hash_table_add (incs.seen, main_file);
+  g_ptr_array_add (incs.files, main_file);
+  clang_getInclusions (tu, (CXInclusionVisitor) cdk_cache_visit_inclusion, &incs);
+
+  GPtrArray *hashes = g_ptr_array_new_with_free_func (g_free);
+  for (guint i = 0; i < incs.files->len; i++)
+    {
+      gchar *hash = cdk_cache_hash_file (incs.files->pdata[i], filename, contents);
+      if (hash == NULL)
+        goto out;
+      g_ptr_array_add (hashes, hash);
+    }
+
+  // Invalidate the old entry and write the AST under a temporary name
+  // first so a half-written file or stale deps are never picked up
+  g_unlink (deps_path);
+  gint err = clang_saveTranslationUnit (tu, tmp_path, clang_defaultSaveOptions (tu));
+  if (err != CXSaveError_None)
+    {
+      g_debug ("failed to save AST for '%s', error '%d'", filename, err);
+      g_unlink (tmp_path);
+      goto out;
+    }
+  if (g_rename (tmp_path, ast_path) != 0)
+    {
+      g_unlink (tmp_path);
+      goto out;
+    }
+
+  GKeyFile *kf = g_key_file_new ();
+  g_key_file_set_string (kf, CDK_CACHE_GROUP, "filename", filename);
+  g_key_file_set_string_list (kf, CDK_CACHE_GROUP, "files",
+                              (const gchar *const *) incs.files->pdata,
+                              incs.files->len);
+  g_key_file_set_string_list (kf, CDK_CACHE_GROUP, "hashes",
+                              (const gchar *const *) hashes->pdata,
+                              hashes->len);
+  saved = g_key_file_save_to_file (kf, deps_path, NULL);
+  g_key_file_free (kf);
+
+out:
+  g_ptr_array_free (hashes, TRUE);
+  g_ptr_array_free (incs.files, TRUE);
+  g_hash_table_destroy (incs.seen);
+  g_free (deps_path);
+  g_free (ast_path);
+  g_free (tmp_path);
+  return saved;
+}
+
+typedef struct
+{
+  gchar  *key;   // the entry's key
+  gint64  mtime; // when the entry was last saved or loaded
+  guint64 size;  // size of the .ast and .deps files together
+}
+CdkCacheEntry;
+
+static void
+cdk_cache_entry_free (CdkCacheEntry *entry)
+{
+  g_free (entry->key);
+  g_slice_free (CdkCacheEntry, entry);
+}
+
+static gint
+cdk_cache_entry_compare_mtime (const CdkCacheEntry **a,
+                               const CdkCacheEntry **b)
+{
+  return ((*a)->mtime > (*b)->mtime) - ((*a)->mtime < (*b)->mtime);
+}
+
+static void
+cdk_cache_remove_entry (CdkCache *cache, const gchar *key)
+{
+  gchar *deps_path = cdk_cache_get_entry_path (cache, key, ".deps");
+  gchar *ast_path = cdk_cache_get_entry_path (cache, key, ".ast");
+  g_unlink (deps_path);
+  g_unlink (ast_path);
+  g_free (deps_path);
+  g_free (ast_path);
+}
+
+// Whether name is something else left in the cache directory: the
+// temporary files of saves and PCH builds that didn't finish, the PCH
+// files and prefix headers of sessions that didn't end cleanly, and
+// the index shards from before each index had a directory of its own
+static gboolean
+cdk_cache_is_leftover (const gchar *name)
+{
+  return (g_str_has_suffix (name, ".tmp") ||
+          g_str_has_suffix (name, ".shard") ||
+          g_str_has_suffix (name, ".pch") ||
+          g_str_has_suffix (name, "-prefix.h") ||
+          g_str_has_suffix (name, "-prefix.hh"));
+}
+
+/*
+ * Removes the entries not used for more than max_age seconds, then the
+ * least recently used ones until the rest take up no more than
+ * max_size bytes. Either limit is ignored if 0. Leftovers older than
+ * max_age are removed as well. Only to be called while no parser is
+ * using the cache.
+ */
+void
+cdk_cache_prune (CdkCache *cache, guint64 max_size, gint64 max_age)
+{
+  g_return_if_fail (cache != NULL);
+
+  GDir *dir = g_dir_open (cache->dir, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  GPtrArray *entries =
+    g_ptr_array_new_with_free_func ((GDestroyNotify) cdk_cache_entry_free);
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  guint64 total = 0;
+  const gchar *name;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      // another instance may still be using them
+      if (cdk_cache_is_leftover (name))
+        {
+          gchar *path = g_build_filename (cache->dir, name, NULL);
+          GStatBuf st;
+          if (max_age > 0 && g_stat (path, &st) == 0 &&
+              now - (gint64) st.st_mtime > max_age)
+            {
+              g_unlink (path);
+            }
+          g_free (path);
+          continue;
+        }
+
+      if (! g_str_has_suffix (name, ".ast"))
+        continue;
+
+      gchar *key = g_strndup (name, strlen (name) - strlen (".ast"));
+      gchar *deps_path = cdk_cache_get_entry_path (cache, key, ".deps");
+      gchar *ast_path = cdk_cache_get_entry_path (cache, key, ".ast");
+      GStatBuf st;
+
+      if (g_stat (ast_path, &st) != 0)
+        g_free (key);
+      else if (max_age > 0 && now - (gint64) st.st_mtime > max_age)
+        {
+          cdk_cache_remove_entry (cache, key);
+          g_free (key);
+        }
+      else
+        {
+          CdkCacheEntry *entry = g_slice_new0 (CdkCacheEntry);
+          entry->key = key;
+          entry->mtime = st.st_mtime;
+          entry->size = st.st_size;
+          if (g_stat (deps_path, &st) == 0)
+            entry->size += st.st_size;
+          total += entry->size;
+          g_ptr_array_add (entries, entry);
+        }
+
+      g_free (deps_path);
+      g_free (ast_path);
+    }
+
+  g_dir_close (dir);
+
+  g_ptr_array_sort (entries, (GCompareFunc) cdk_cache_entry_compare_mtime);
+  for (guint i = 0; max_size > 0 && total > max_size && i < entries->len; i++)
+    {
+      CdkCacheEntry *entry = entries->pdata[i];
+      cdk_cache_remove_entry (cache, entry->key);
+      total -= entry->size;
+    }
+
+  g_ptr_array_free (entries, TRUE);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifndef CDK_CACHE_H_
+#define CDK_CACHE_H_ 1
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+// Limits the cache is pruned to when the plugin starts
+#define CDK_CACHE_MAX_SIZE (G_GUINT64_CONSTANT (1) << 30)
+#define CDK_CACHE_MAX_AGE  (30 * 24 * 60 * 60)
+
+struct CXTranslationUnitImpl;
+
+typedef struct CdkCache_ CdkCache;
+
+CdkCache *cdk_cache_new (const gchar *cache_dir);
+void cdk_cache_free (CdkCache *cache);
+const gchar *cdk_cache_get_dir (CdkCache *cache);
+
+gchar *cdk_cache_make_key (CdkCache *cache,
+                           const gchar *filename,
+                           const gchar *const *argv);
+
+struct CXTranslationUnitImpl *cdk_cache_load (CdkCache *cache,
+                                              gpointer index,
+                                              const gchar *key,
+                                              const gchar *filename,
+                                              GBytes *contents);
+gboolean cdk_cache_is_fresh (CdkCache *cache,
+                             const gchar *key,
+                             const gchar *filename);
+gboolean cdk_cache_save (CdkCache *cache,
+                         struct CXTranslationUnitImpl *tu,
+                         const gchar *key,
+                         const gchar *filename,
+                         GBytes *contents);
+void cdk_cache_prune (CdkCache *cache, guint64 max_size, gint64 max_age);
+
+G_END_DECLS
+
+#endif /* CDK_CACHE_H_ */
@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <cdk/cdkcompdb.h>
+#include <clang-c/CXCompilationDatabase.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+
+/*
+ * Compiler arguments per source file, as read from a compilation
+ * database (compile_commands.json). Most files in a project are built
+ * with the same flags so every string is stored once in a string chunk
+ * and identical argument vectors are shared. Since the strings are
+ * interned, vectors can be hashed and compared by pointer.
+ *
+ * The vectors are ready to hand to libclang, the compiler, the source
+ * file and the output options are stripped from them.
+ */
+
+struct CdkCompDb_
+{
+  GStringChunk *strings; // every argument and file name, stored once
+  GHashTable   *argvs;   // set of interned NULL-terminated vectors, owns them
+  GHashTable   *files;   // maps an interned file name to its vector
+  GPtrArray    *names;   // NULL-terminated list of the files
+};
+
+static guint
+cdk_compdb_argv_hash (gconstpointer key)
+{
+  guint hash = 5381;
+  for (const gchar *const *it = key; *it != NULL; it++)
+    hash = (hash << 5) + hash + g_direct_hash (*it);
+  return hash;
+}
+
+static gboolean
+cdk_compdb_argv_equal (gconstpointer a, gconstpointer b)
+{
+  const gchar *const *it1 = a;
+  const gchar *const *it2 = b;
+  while (*it1 != NULL && *it1 == *it2)
+    {
+      it1++;
+      it2++;
+    }
+  return (*it1 == *it2);
+}
+
+CdkCompDb *
+cdk_compdb_new (void)
+{
+  CdkCompDb *db = g_slice_new0 (CdkCompDb);
+  db->strings = g_string_chunk_new (4096);
+  db->argvs = g_hash_table_new_full (cdk_compdb_argv_hash,
+                                     cdk_compdb_argv_equal,
+                                     g_free, NULL);
+  db->files = g_hash_table_new (g_str_hash, g_str_equal);
+  db->names = g_ptr_array_new ();
+  g_ptr_array_add (db->names, NULL);
+  return db;
+}
+
+void
+cdk_compdb_free (CdkCompDb *db)
+{
+  if (G_UNLIKELY (db == NULL))
+    return;
+  g_hash_table_destroy (db->files);
+  g_hash_table_destroy (db->argvs);
+  g_ptr_array_free (db->names, TRUE);
+  g_string_chunk_free (db->strings);
+  g_slice_free (CdkCompDb, db);
+}
+
+// Stores a vector of already interned strings unless it's known
+static const gchar *const *
+cdk_compdb_intern_interned (CdkCompDb *db, GPtrArray *args)
+{
+  g_ptr_array_add (args, NULL);
+
+  gpointer argv = NULL;
+  if (! g_hash_table_lookup_extended (db->argvs, args->pdata, &argv, NULL))
+    {
+      argv = g_new (gpointer, args->len);
+      memcpy (argv, args->pdata, args->len * sizeof (gpointer));
+      g_hash_table_add (db->argvs, argv);
+    }
+
+  g_ptr_array_set_size (args, args->len - 1);
+
+  return argv;
+}
+
+/*
+ * Returns the shared copy of argv, which stays valid as long as db.
+ */
+const gchar *const *
+cdk_compdb_intern (CdkCompDb *db, const gchar *const *argv)
+{
+  g_return_val_if_fail (db != NULL, NULL);
+
+  GPtrArray *args = g_ptr_array_new ();
+  for (const gchar *const *it = argv; it != NULL && *it != NULL; it++)
+    g_ptr_array_add (args, g_string_chunk_insert_const (db->strings, *it));
+
+  const gchar *const *result = cdk_compdb_intern_interned (db, args);
+  g_ptr_array_free (args, TRUE);
+
+  return result;
+}
+
+// Absolute path with symlinks resolved, like GeanyDocument.real_path,
+// falling back to a plain canonical path for files that don't exist
+static gchar *
+cdk_compdb_real_path (const gchar *filename, const gchar *directory)
+{
+  gchar *path = g_canonicalize_filename (filename, directory);
+  gchar buffer[PATH_MAX+1] = {0};
+  if (realpath (path, buffer) != NULL)
+    {
+      g_free (path);
+      path = g_strdup (buffer);
+    }
+  return path;
+}
+
+static gboolean
+cdk_compdb_is_source_arg (const gchar *arg,
+                          const gchar *filename,
+                          const gchar *abs_filename)
+{
+  return (strcmp (arg, filename) == 0 || strcmp (arg, abs_filename) == 0);
+}
+
+// Number of arguments to drop starting at arg, which only matter to
+// the build: the output, dependency file generation and -c. 0 to keep it.
+static guint
+cdk_compdb_get_build_only_args (const gchar *arg)
+{
+  static const gchar *const with_value[] = { "-o", "-MF", "-MT", "-MQ", "-MJ" };
+  static const gchar *const flags[] = { "-c", "-M", "-MM", "-MD", "-MMD", "-MG", "-MP" };
+
+  for (guint i = 0; i < G_N_ELEMENTS (with_value); i++)
+    {
+      if (strcmp (arg, with_value[i]) == 0)
+        return 2;
+      // the joined form, eg. -MFfoo.d, but not -objc
+      if (g_str_has_prefix (arg, with_value[i]) && ! g_str_has_prefix (arg, "-objc"))
+        return 1;
+    }
+
+  for (guint i = 0; i < G_N_ELEMENTS (flags); i++)
+    {
+      if (strcmp (arg, flags[i]) == 0)
+        return 1;
+    }
+
+  // eg. -Wp,-MD,foo.d as some build systems pass them
+  if (g_str_has_prefix (arg, "-Wp,-MD,") || g_str_has_prefix (arg, "-Wp,-MMD,"))
+    return 1;
+
+  return 0;
+}
+
+// Whether arg runs the compiler given after it, like ccache does
+static gboolean
+cdk_compdb_is_launcher (const gchar *arg)
+{
+  static const gchar *const launchers[] = { "ccache", "distcc", "sccache", "icecc", "buildcache" };
+
+  gchar *name = g_path_get_basename (arg);
+  gboolean is_launcher = FALSE;
+  for (guint i = 0; ! is_launcher && i < G_N_ELEMENTS (launchers); i++)
+    is_launcher = (strcmp (name, launchers[i]) == 0);
+  g_free (name);
+
+  return is_launcher;
+}
+
+static void
+cdk_compdb_add_command (CdkCompDb *db,
+                        CXCompileCommand cmd,
+                        GPtrArray *args)
+{
+  CXString cx_dir = clang_CompileCommand_getDirectory (cmd);
+  CXString cx_file = clang_CompileCommand_getFilename (cmd);
+  const gchar *directory = clang_getCString (cx_dir);
+  const gchar *filename = clang_getCString (cx_file);
+  gchar *abs_filename = cdk_compdb_real_path (filename, directory);
+  guint n_args = clang_CompileCommand_getNumArgs (cmd);
+
+  g_ptr_array_set_size (args, 0);
+
+  // The compiler comes first, after the launchers wrapping it if any
+  guint first = 0;
+  while (first + 1 < n_args)
+    {
+      CXString cx_arg = clang_CompileCommand_getArg (cmd, first);
+      gboolean is_launcher = cdk_compdb_is_launcher (clang_getCString (cx_arg));
+      clang_disposeString (cx_arg);
+      if (! is_launcher)
+        break;
+      first++;
+    }
+
+  for (guint i = first + 1; i < n_args; i++)
+    {
+      CXString cx_arg = clang_CompileCommand_getArg (cmd, i);
+      const gchar *arg = clang_getCString (cx_arg);
+
+      guint n_skip = cdk_compdb_get_build_only_args (arg);
+      if (n_skip > 0)
+        i += n_skip - 1; // skip its argument too, if any
+      else if (! cdk_compdb_is_source_arg (arg, filename, abs_filename))
+        g_ptr_array_add (args, g_string_chunk_insert_const (db->strings, arg));
+
+      clang_disposeString (cx_arg);
+    }
+
+  // relative paths in the flags are relative to the build directory
+  gchar *wd_arg = g_strconcat ("-working-directory=", directory, NULL);
+  g_ptr_array_add (args, g_string_chunk_insert_const (db->strings, wd_arg));
+  g_free (wd_arg);
+
+  const gchar *const *argv = cdk_compdb_intern_interned (db, args);
+  const gchar *file = g_string_chunk_insert_const (db->strings, abs_filename);
+  // the first command for a file wins, like clang tools do
+  if (! g_hash_table_contains (db->files, file))
+    {
+      g_hash_table_insert (db->files, (gpointer) file, (gpointer) argv);
+      g_ptr_array_index (db->names, db->names->len - 1) = (gpointer) file;
+      g_ptr_array_add (db->names, NULL);
+    }
+
+  g_free (abs_filename);
+  clang_disposeString (cx_file);
+  clang_disposeString (cx_dir);
+}
+
+/*
+ * Loads compile_commands.json from build_dir, adding to what's
+ * already in db.
+ */
+gboolean
+cdk_compdb_load (CdkCompDb *db, const gchar *build_dir, GError **error)
+{
+  g_return_val_if_fail (db != NULL, FALSE);
+  g_return_val_if_fail (build_dir != NULL, FALSE);
+
+  CXCompilationDatabase_Error err = CXCompilationDatabase_NoError;
+  CXCompilationDatabase cdb =
+    clang_CompilationDatabase_fromDirectory (build_dir, &err);
+
+  if (cdb == NULL || err != CXCompilationDatabase_NoError)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   "unable to load compilation database from '%s'",
+                   build_dir);
+      if (cdb != NULL)
+        clang_CompilationDatabase_dispose (cdb);
+      return FALSE;
+    }
+
+  CXCompileCommands cmds = clang_CompilationDatabase_getAllCompileCommands (cdb);
+  guint n_cmds = clang_CompileCommands_getSize (cmds);
+  GPtrArray *args = g_ptr_array_new ();
+
+  for (guint i = 0; i < n_cmds; i++)
+    cdk_compdb_add_command (db, clang_CompileCommands_getCommand (cmds, i), args);
+
+  g_ptr_array_free (args, TRUE);
+  clang_CompileCommands_dispose (cmds);
+  clang_CompilationDatabase_dispose (cdb);
+
+  return TRUE;
+}
+
+/*
+ * Returns the arguments to parse filename with or NULL if it's not in
+ * the database. filename must be an absolute path with symlinks
+ * resolved.
+ */
+const gchar *const *
+cdk_compdb_lookup (CdkCompDb *db, const gchar *filename)
+{
+  g_return_val_if_fail (db != NULL, NULL);
+  g_return_val_if_fail (filename != NULL, NULL);
+  return g_hash_table_lookup (db->files, filename);
+}
+
+const gchar *const *
+cdk_compdb_get_files (CdkCompDb *db, gsize *n_files)
+{
+  g_return_val_if_fail (db != NULL, NULL);
+  if (n_files != NULL)
+    *n_files = db->names->len - 1;
+  return (const gchar *const *) db->names->pdata;
+}
+
+gsize
+cdk_compdb_get_n_argvs (CdkCompDb *db)
+{
+  g_return_val_if_fail (db != NULL, 0);
+  return g_hash_table_size (db->argvs);
+}
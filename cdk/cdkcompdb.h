@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifndef CDK_COMPDB_H_
+#define CDK_COMPDB_H_ 1
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct CdkCompDb_ CdkCompDb;
+
+CdkCompDb *cdk_compdb_new (void);
+void cdk_compdb_free (CdkCompDb *db);
+
+gboolean cdk_compdb_load (CdkCompDb *db, const gchar *build_dir, GError **error);
+const gchar *const *cdk_compdb_intern (CdkCompDb *db, const gchar *const *argv);
+const gchar *const *cdk_compdb_lookup (CdkCompDb *db, const gchar *filename);
+const gchar *const *cdk_compdb_get_files (CdkCompDb *db, gsize *n_files);
+gsize cdk_compdb_get_n_argvs (CdkCompDb *db);
+
+G_END_DECLS
+
+#endif /* CDK_COMPDB_H_ */
@@ -18,6 +18,14 @@ struct CdkCompleterPrivate_
   gulong sci_handler;
   uptr_t prev_autoc_order;
   uptr_t prev_autoc_sep;
+  guint complete_hnd;       // idle handler running the queued completion
+  gint complete_pos;        // position the queued completion is for
+  guint complete_revision;  // buffer revision it was queued at
+  gboolean waiting;         // whether the queued completion waits for a TU
+  gint request_start;       // out of process: start of the word completed in
+  gint request_pos;         // position the worker completes at
+  gchar *request_word;      // the part of the word typed, NULL if no request was made
+  gint64 request_time;      // monotonic time the completion started
 };
 
 enum
@@ -27,6 +35,8 @@ enum
 };
 
 static void cdk_completer_finalize (GObject *object);
+static void cdk_completer_updated (CdkDocumentHelper *object,
+                                   GeanyDocument *document);
 static void cdk_completer_sci_notify (CdkCompleter *self,
                                       gint unused,
                                       SCNotification *notif,
@@ -60,6 +70,10 @@ cdk_completer_deinitialize_document (CdkCompleter  *self,
   if (self->priv->sci_handler > 0)
     g_signal_handler_disconnect (sci, self->priv->sci_handler);
 
+  if (self->priv->complete_hnd != 0)
+    g_source_remove (self->priv->complete_hnd);
+  self->priv->complete_hnd = 0;
+
   cdk_sci_send (sci, SCI_AUTOCSETORDER, self->priv->prev_autoc_order, 0);
   cdk_sci_send (sci, SCI_AUTOCSETSEPARATOR, self->priv->prev_autoc_sep, 0);
 }
@@ -74,6 +88,7 @@ cdk_completer_class_init (CdkCompleterClass *klass)
   dh_object_class = CDK_DOCUMENT_HELPER_CLASS (klass);
 
   dh_object_class->initialize = cdk_completer_initialize_document;
+  dh_object_class->updated = cdk_completer_updated;
 
   g_object_class->finalize = cdk_completer_finalize;
 
@@ -91,6 +106,7 @@ cdk_completer_finalize (GObject *object)
 
   GeanyDocument *doc = cdk_document_helper_get_document (CDK_DOCUMENT_HELPER (self));
   cdk_completer_deinitialize_document (self, doc);
+  g_free (self->priv->request_word);
 
   G_OBJECT_CLASS (cdk_completer_parent_class)->finalize (object);
 }
@@ -107,6 +123,31 @@ cdk_completer_new (struct CdkPlugin_ *plugin, GeanyDocument *doc)
   return g_object_new (CDK_TYPE_COMPLETER, "plugin", plugin, "document", doc, NULL);
 }
 
+static void
+cdk_completer_add_completion (GString *autoc_str,
+                              const gchar *name,
+                              const gchar *current_word)
+{
+  if (current_word[0] == '\0' || g_str_has_prefix (name, current_word))
+    {
+      g_string_append (autoc_str, name);
+      g_string_append_c (autoc_str, '\n');
+    }
+}
+
+// Takes autoc_str
+static void
+cdk_completer_show_list (ScintillaObject *sci,
+                         GString *autoc_str,
+                         gint word_len)
+{
+  gchar *compl_list = g_string_free (autoc_str, FALSE);
+  g_strstrip (compl_list);
+  if (strlen (compl_list) > 0)
+    cdk_sci_send (sci, SCI_AUTOCSHOW, word_len, compl_list);
+  g_free (compl_list);
+}
+
 static void
 cdk_completer_complete (CdkCompleter *self,
                         gint word_start,
@@ -117,34 +158,55 @@ cdk_completer_complete (CdkCompleter *self,
   GeanyDocument *doc = cdk_document_helper_get_document (helper);
   ScintillaObject *sci = doc->editor->sci;
   CdkPlugin *plugin = cdk_document_helper_get_plugin (helper);
-  CXTranslationUnit tu = cdk_plugin_get_translation_unit (plugin, doc);
-  if (tu == NULL)
-    return;
+  gint64 start_time = g_get_monotonic_time ();
 
-  struct CXUnsavedFile usf;
-  struct CXUnsavedFile *usf_ptr = NULL;
-  guint n_usf = 0;
+  // libclang uses 1-based line, Scintilla uses 0-based line
+  guint line = cdk_sci_send (sci, SCI_LINEFROMPOSITION, current_pos, 0) + 1;
+  guint col = cdk_sci_send (sci, SCI_GETCOLUMN, current_pos, 0) - 1;
 
-  if (doc->changed)
+  // There's no TU here, the worker process owning it completes and
+  // hands the results to cdk_completer_show_completions()
+  if (cdk_plugin_is_out_of_process (plugin))
     {
-      usf.Filename = doc->real_path;
-      usf.Contents = cdk_document_get_contents (doc);
-      usf.Length = cdk_document_get_length (doc);
-      usf_ptr = &usf;
-      n_usf = 1;
+      if (cdk_plugin_request_completion (plugin, doc, line, col))
+        {
+          self->priv->request_start = word_start;
+          self->priv->request_pos = current_pos;
+          g_free (self->priv->request_word);
+          self->priv->request_word = g_strdup (current_word);
+          self->priv->request_time = start_time;
+        }
+      return;
     }
 
-  gint len = (gint) current_pos - (gint) word_start;
-  // libclang uses 1-based line, Scintilla uses 0-based line
-  guint line = cdk_sci_send (sci, SCI_LINEFROMPOSITION, current_pos, 0) + 1;
-  guint col = cdk_sci_send (sci, SCI_GETCOLUMN, current_pos, 0) - 1;
+  // Not parsed yet, try again once it is
+  CXTranslationUnit tu = cdk_plugin_get_translation_unit (plugin, doc);
+  if (tu == NULL)
+    {
+      self->priv->waiting = TRUE;
+      return;
+    }
+
+  guint n_usf = 0;
+  struct CXUnsavedFile *usf = cdk_plugin_get_unsaved_files (plugin, doc, &n_usf);
 
   CXCodeCompleteResults *comp_res =
-    clang_codeCompleteAt (tu, doc->real_path, line, col, usf_ptr, n_usf,
+    clang_codeCompleteAt (tu, doc->real_path, line, col, n_usf ? usf : NULL, n_usf,
                           clang_defaultCodeCompleteOptions ());
+  g_free (usf);
+
+  // NULL for a TU loaded from the cache, which is being replaced by a
+  // parsed one, try again once that's in
+  if (comp_res == NULL &&
+      (cdk_plugin_is_document_updating (plugin, doc) ||
+       cdk_plugin_update_document (plugin, doc)))
+    {
+      self->priv->waiting = TRUE;
+      return;
+    }
 
   GString *autoc_str = g_string_new ("");
-  for (guint i = 0; i < comp_res->NumResults; i++)
+  for (guint i = 0; comp_res != NULL && i < comp_res->NumResults; i++)
     {
       CXCompletionResult *res = &comp_res->Results[i];
       CXCompletionString str = res->CompletionString;
@@ -156,25 +218,22 @@ cdk_completer_complete (CdkCompleter *self,
           if (kind == CXCompletionChunk_TypedText)
             {
               CXString name = clang_getCompletionChunkText (str, j);
-              const gchar *name_str = clang_getCString (name);
-              if (len == 0 || g_str_has_prefix (name_str, current_word))
-                {
-                  g_string_append (autoc_str, name_str);
-                  g_string_append_c (autoc_str, '\n');
-                }
+              cdk_completer_add_completion (autoc_str, clang_getCString (name),
+                                            current_word);
               clang_disposeString (name);
               break;
             }
         }
     }
 
-  clang_disposeCodeCompleteResults (comp_res);
+  if (comp_res != NULL)
+    clang_disposeCodeCompleteResults (comp_res);
 
-  gchar *compl_list = g_string_free (autoc_str, FALSE);
-  g_strstrip (compl_list);
-  if (strlen (compl_list) > 0)
-    cdk_sci_send (sci, SCI_AUTOCSHOW, current_pos - word_start, compl_list);
-  g_free (compl_list);
+  cdk_completer_show_list (sci, autoc_str, current_pos - word_start);
+
+  cdk_plugin_record_latency (plugin, doc, CDK_LATENCY_COMPLETE,
+                             g_get_monotonic_time () - start_time);
+  cdk_plugin_record_job_outcome (plugin, CDK_LATENCY_COMPLETE, CDK_JOB_COMPLETED);
 }
 
 static void
@@ -205,6 +264,29 @@ cdk_completer_handle_key (CdkCompleter *self,
     }
 }
 
+// Runs once the pending key presses were handled, so a burst of typing
+// causes a single completion rather than one per key
+static gboolean
+on_complete_later (CdkCompleter *self)
+{
+  CdkDocumentHelper *helper = CDK_DOCUMENT_HELPER (self);
+  GeanyDocument *doc = cdk_document_helper_get_document (helper);
+  CdkPlugin *plugin = cdk_document_helper_get_plugin (helper);
+
+  self->priv->complete_hnd = 0;
+
+  // The buffer changed some other way since, the position is meaningless
+  if (cdk_document_get_revision (doc) != self->priv->complete_revision)
+    {
+      cdk_plugin_record_job_outcome (plugin, CDK_LATENCY_COMPLETE, CDK_JOB_DISCARDED);
+      return FALSE;
+    }
+
+  cdk_completer_handle_key (self, doc->editor->sci, self->priv->complete_pos);
+
+  return FALSE;
+}
+
 static void
 cdk_completer_sci_notify (CdkCompleter *self,
                           G_GNUC_UNUSED gint unused,
@@ -213,7 +295,78 @@ cdk_completer_sci_notify (CdkCompleter *self,
 {
   if (notif->nmhdr.code == SCN_CHARADDED)
     {
-      gint offset = cdk_sci_send (sci, SCI_GETCURRENTPOS, 0, 0);
-      cdk_completer_handle_key (self, sci, offset);
+      CdkDocumentHelper *helper = CDK_DOCUMENT_HELPER (self);
+      GeanyDocument *doc = cdk_document_helper_get_document (helper);
+
+      // a newer key press supersedes the queued completion
+      if (self->priv->complete_hnd != 0)
+        {
+          cdk_plugin_record_job_outcome (cdk_document_helper_get_plugin (helper),
+                                         CDK_LATENCY_COMPLETE, CDK_JOB_DISCARDED);
+        }
+      else
+        {
+          self->priv->complete_hnd =
+            g_idle_add ((GSourceFunc) on_complete_later, self);
+        }
+
+      self->priv->complete_pos = cdk_sci_send (sci, SCI_GETCURRENTPOS, 0, 0);
+      self->priv->complete_revision = cdk_document_get_revision (doc);
+      self->priv->waiting = FALSE;
+    }
+}
+
+// Runs a completion that was waiting for the TU, unless the buffer
+// changed since, which would have queued another one anyway
+static void
+cdk_completer_updated (CdkDocumentHelper *object,
+                       GeanyDocument *document)
+{
+  CdkCompleter *self = CDK_COMPLETER (object);
+
+  if (! self->priv->waiting)
+    return;
+  self->priv->waiting = FALSE;
+
+  if (self->priv->complete_hnd == 0 &&
+      cdk_document_get_revision (document) == self->priv->complete_revision)
+    {
+      cdk_completer_handle_key (self, document->editor->sci, self->priv->complete_pos);
     }
 }
+
+/*
+ * Shows the results of a completion requested from a worker process,
+ * given the revision of the buffer it was requested at, unless the
+ * buffer changed since.
+ */
+void
+cdk_completer_show_completions (CdkCompleter *self,
+                                guint revision,
+                                gchar **completions)
+{
+  g_return_if_fail (CDK_IS_COMPLETER (self));
+
+  CdkDocumentHelper *helper = CDK_DOCUMENT_HELPER (self);
+  GeanyDocument *doc = cdk_document_helper_get_document (helper);
+  CdkPlugin *plugin = cdk_document_helper_get_plugin (helper);
+
+  // the position the results are for is meaningless now
+  if (self->priv->request_word == NULL ||
+      cdk_document_get_revision (doc) != revision)
+    {
+      cdk_plugin_record_job_outcome (plugin, CDK_LATENCY_COMPLETE, CDK_JOB_CANCELLED);
+      return;
+    }
+
+  GString *autoc_str = g_string_new ("");
+  for (gchar **it = completions; it != NULL && *it != NULL; it++)
+    cdk_completer_add_completion (autoc_str, *it, self->priv->request_word);
+
+  cdk_completer_show_list (doc->editor->sci, autoc_str,
+                           self->priv->request_pos - self->priv->request_start);
+
+  cdk_plugin_record_latency (plugin, doc, CDK_LATENCY_COMPLETE,
+                             g_get_monotonic_time () - self->priv->request_time);
+  cdk_plugin_record_job_outcome (plugin, CDK_LATENCY_COMPLETE, CDK_JOB_COMPLETED);
+}
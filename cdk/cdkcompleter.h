@@ -35,6 +35,7 @@ struct CdkCompleterClass_
 GType cdk_completer_get_type (void);
 CdkCompleter *cdk_completer_new (struct CdkPlugin_ *plugin, struct GeanyDocument *doc);
 CdkCompleter *cdk_document_get_completer (struct GeanyDocument *doc);
+void cdk_completer_show_completions (CdkCompleter *self, guint revision, gchar **completions);
 
 G_END_DECLS
 
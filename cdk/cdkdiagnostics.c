@@ -18,6 +18,7 @@
 
 #include <cdk/cdkdiagnostics.h>
 #include <cdk/cdkplugin.h>
+#include <cdk/cdkresults.h>
 #include <cdk/cdkutils.h>
 #include <geanyplugin.h>
 #include <clang-c/Index.h>
@@ -412,13 +413,12 @@ cdk_diagnostics_set_compiler_messages_enabled (CdkDiagnostics *self,
 
 static void
 cdk_diagnostics_annotate_line (G_GNUC_UNUSED CdkDiagnostics *self,
-                               CXDiagnostic diag,
+                               const CdkDiagnostic *diag,
                                guint line,
                                ScintillaObject *sci)
 {
   gint style = CDK_STYLE_DEFAULT;
-  enum CXDiagnosticSeverity severity = clang_getDiagnosticSeverity (diag);
-  switch (severity)
+  switch (diag->severity)
     {
     case CXDiagnostic_Warning:
       style = CDK_STYLE_ANNOTATION_WARNING;
@@ -431,16 +431,12 @@ cdk_diagnostics_annotate_line (G_GNUC_UNUSED CdkDiagnostics *self,
       return;
     }
 
-  CXString text = clang_getDiagnosticSpelling (diag);
-  CXString option = clang_getDiagnosticOption (diag, NULL);
   gchar *message;
 
-  if (strlen (clang_getCString (option)) == 0)
-    message = g_strdup (clang_getCString (text));
+  if (diag->option[0] == '\0')
+    message = g_strdup (diag->text);
   else
-    message = g_strdup_printf ("%s [%s]", clang_getCString (text), clang_getCString (option));
-  clang_disposeString (text);
-  clang_disposeString (option);
+    message = g_strdup_printf ("%s [%s]", diag->text, diag->option);
 
   cdk_sci_send (sci, SCI_ANNOTATIONSETTEXT, line - 1, message);
   g_free (message);
@@ -461,18 +457,15 @@ cdk_diagnostics_clear_annotations (CdkDiagnostics *self,
 
 static gboolean
 cdk_diagnostics_find_clicked_line (CdkDiagnostics *self,
-                                   CXDiagnostic diag,
+                                   gpointer diagnostic,
                                    guint position,
                                    gpointer user_data)
 {
+  const CdkDiagnostic *diag = diagnostic;
   ScintillaObject *sci = user_data;
   guint clicked_line = cdk_sci_send (sci, SCI_LINEFROMPOSITION, position, 0) + 1;
 
-  CXSourceLocation locn = clang_getDiagnosticLocation (diag);
-  guint diag_line = 0;
-  clang_getSpellingLocation (locn, NULL, &diag_line, NULL, NULL);
-
-  if (diag_line == clicked_line)
+  if (diag->line == clicked_line)
     {
       cdk_diagnostics_annotate_line (self, diag, clicked_line, sci);
       return FALSE; // found it, stop iterating
@@ -581,15 +574,10 @@ cdk_diagnostics_clear_compiler_messages (G_GNUC_UNUSED CdkDiagnostics *self)
 
 static void
 cdk_diagnostics_set_compiler_message (CdkDiagnostics *self,
-                                      CXDiagnostic diag)
+                                      const CdkDiagnostic *diag)
 {
   CdkDocumentHelper *helper = CDK_DOCUMENT_HELPER (self);
   GeanyDocument *document = cdk_document_helper_get_document (helper);
-  CXString text = clang_getDiagnosticSpelling (diag);
-  CXString option = clang_getDiagnosticOption (diag, NULL);
-  CXSourceLocation locn = clang_getDiagnosticLocation (diag);
-  guint line = 0, column = 0;
-  clang_getSpellingLocation (locn, NULL, &line, &column, NULL);
 
   // FIXME: In order to get Geany compiler tab working with mouse-click
   // we have to fake it out by putting Make-like entering/leaving directory
@@ -600,37 +588,33 @@ cdk_diagnostics_set_compiler_message (CdkDiagnostics *self,
 
   gchar *docname = g_path_get_basename (document->real_path);
 
-  if (strlen (clang_getCString (option)) == 0)
+  if (diag->option[0] == '\0')
     {
       msgwin_compiler_add (COLOR_RED,
                            "%s:%u:%u: %s",
                            docname,
-                           line, column,
-                           clang_getCString (text));
+                           diag->line, diag->column,
+                           diag->text);
     }
   else
     {
       msgwin_compiler_add (COLOR_RED,
                            "%s:%u:%u: %s [%s]",
                            docname,
-                           line, column,
-                           clang_getCString (text),
-                           clang_getCString (option));
+                           diag->line, diag->column,
+                           diag->text,
+                           diag->option);
     }
 
   msgwin_compiler_add (COLOR_BLACK, "make[1]: Leaving directory `%s'", dir);
 
   g_free (dir);
   g_free (docname);
-
-  clang_disposeString (text);
-  clang_disposeString (option);
-
 }
 
 static gboolean
 cdk_diagnostics_apply_each_compiler_message (CdkDiagnostics *self,
-                                             CXDiagnostic diag,
+                                             gpointer diag,
                                              G_GNUC_UNUSED guint position,
                                              G_GNUC_UNUSED gpointer user_data)
 {
@@ -704,25 +688,17 @@ cdk_diagnostics_foreach (CdkDiagnostics *self,
   CdkDocumentHelper *helper = CDK_DOCUMENT_HELPER (self);
   CdkPlugin *plugin = cdk_document_helper_get_plugin (helper);
   GeanyDocument *document = cdk_document_helper_get_document (helper);
-  CXTranslationUnit tu = cdk_plugin_get_translation_unit (plugin, document);
-  if (tu == NULL)
+  GArray *diags = cdk_plugin_get_diagnostics (plugin, document);
+  if (diags == NULL)
     return -1;
 
   gint cnt = 0;
-  guint n_diags = clang_getNumDiagnostics (tu);
-  if (n_diags == 0)
-    return 0;
-
-  for (guint i = 0; i < n_diags; i++)
+  for (guint i = 0; i < diags->len; i++)
     {
       cnt++;
 
-      CXDiagnostic diag = clang_getDiagnostic (tu, i);
-      CXSourceLocation locn = clang_getDiagnosticLocation (diag);
-      guint position = 0;
-      clang_getSpellingLocation (locn, NULL, NULL, NULL, &position);
-
-      if (! func (self, diag, position, user_data))
+      CdkDiagnostic *diag = &g_array_index (diags, CdkDiagnostic, i);
+      if (! func (self, diag, diag->offset, user_data))
         break;
     }
 
@@ -731,25 +707,19 @@ cdk_diagnostics_foreach (CdkDiagnostics *self,
 
 static gboolean
 cdk_diagnostics_range_iter (CdkDiagnostics *self,
-                            gpointer diag,
+                            gpointer diagnostic,
                             G_GNUC_UNUSED guint position,
                             gpointer user_data)
 {
   struct CdkDiagnosticsRangeData *data = user_data;
+  CdkDiagnostic *diag = diagnostic;
 
-  guint n_ranges = clang_getDiagnosticNumRanges (diag);
-  for (guint i = 0; i < n_ranges; i++)
+  for (guint i = 0; i < diag->ranges->len; i++)
     {
       data->counter++;
 
-      CXSourceRange range = clang_getDiagnosticRange (diag, i);
-      CXSourceLocation start_locn = clang_getRangeStart (range);
-      CXSourceLocation end_locn = clang_getRangeEnd (range);
-      guint start_pos = 0, end_pos = 0;
-      clang_getSpellingLocation (start_locn, NULL, NULL, NULL, &start_pos);
-      clang_getSpellingLocation (end_locn, NULL, NULL, NULL, &end_pos);
-
-      if (! data->func (self, diag, i, start_pos, end_pos, data->user_data))
+      CdkDiagnosticRange *range = &g_array_index (diag->ranges, CdkDiagnosticRange, i);
+      if (! data->func (self, diag, i, range->start, range->end, data->user_data))
         break;
     }
 
@@ -776,16 +746,16 @@ cdk_diagnostics_foreach_range (CdkDiagnostics *self,
 
 static gboolean
 cdk_diagnostics_apply_each_indicator (CdkDiagnostics *self,
-                                      CXDiagnostic diag,
+                                      gpointer diagnostic,
                                       G_GNUC_UNUSED guint index,
                                       guint start,
                                       guint end,
                                       gpointer document)
 {
-  enum CXDiagnosticSeverity severity = clang_getDiagnosticSeverity (diag);
+  const CdkDiagnostic *diag = diagnostic;
   gint indic = 0;
 
-  switch (severity)
+  switch (diag->severity)
     {
     case CXDiagnostic_Warning:
       indic = CDK_DIAGNOSTICS_INDIC_WARNING;
@@ -805,14 +775,14 @@ cdk_diagnostics_apply_each_indicator (CdkDiagnostics *self,
 
 static gboolean
 cdk_diagnostics_apply_each_marker (CdkDiagnostics *self,
-                                   CXDiagnostic diag,
+                                   gpointer diagnostic,
                                    guint position,
                                    gpointer document)
 {
-  enum CXDiagnosticSeverity severity = clang_getDiagnosticSeverity (diag);
+  const CdkDiagnostic *diag = diagnostic;
   gint marker = 0;
 
-  switch (severity)
+  switch (diag->severity)
     {
     case CXDiagnostic_Warning:
       marker = CDK_DIAGNOSTICS_MARKER_WARNING;
@@ -837,6 +807,7 @@ cdk_diagnostics_updated (CdkDocumentHelper *object,
                          GeanyDocument *document)
 {
   CdkDiagnostics *self = CDK_DIAGNOSTICS (object);
+  gint64 start_time = g_get_monotonic_time ();
 
   if (self->priv->indicators_enabled)
     {
@@ -860,4 +831,8 @@ cdk_diagnostics_updated (CdkDocumentHelper *object,
       // them after the document is updated again
       editor_indicator_clear (document->editor, GEANY_INDICATOR_ERROR);
     }
+
+  cdk_plugin_record_latency (cdk_document_helper_get_plugin (object), document,
+                             CDK_LATENCY_DIAGNOSTICS,
+                             g_get_monotonic_time () - start_time);
 }
@@ -45,12 +45,12 @@ gboolean cdk_diagnostics_get_compiler_messages_enabled (CdkDiagnostics *self);
 void cdk_diagnostics_set_compiler_messages_enabled (CdkDiagnostics *self, gboolean enabled);
 
 typedef gboolean (*CdkDiagnosticFunc) (CdkDiagnostics *diag,
-                                       gpointer cx_diag,
+                                       gpointer diagnostic,
                                        guint position,
                                        gpointer user_data);
 
 typedef gboolean (*CdkDiagnosticRangeFunc) (CdkDiagnostics *diag,
-                                            gpointer cx_diag,
+                                            gpointer diagnostic,
                                             guint index,
                                             guint start,
                                             guint end,
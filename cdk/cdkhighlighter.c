@@ -8,26 +8,49 @@
 #endif
 
 #include <cdk/cdkhighlighter.h>
+#include <cdk/cdkparser.h>
 #include <cdk/cdkstyle.h>
 #include <cdk/cdk.h>
 #include <geanyplugin.h>
 #include <SciLexer.h>
 #include <clang-c/Index.h>
-#include <ctype.h>
+#include <string.h>
 
-#define CDK_HIGHLIGHTER_TIMEOUT 500
 #define CDK_HL_OCCUR_INDIC INDIC_CONTAINER+10
 
+// Lines above and below the visible ones styled along with them, so
+// scrolling a little doesn't show unstyled text
+#define CDK_HIGHLIGHTER_MARGIN 50
+
+/*
+ * When all of the document needs styling again, eg. when the style
+ * scheme changes or a new TU arrives, only the visible lines and a
+ * margin around them are done right away. The rest is recorded as stale
+ * and highlighted once it's scrolled into view. The stale ranges are
+ * shifted along with edits so they keep covering the same text.
+ */
+typedef struct
+{
+  gint start_pos;
+  gint end_pos;
+}
+CdkHighlightRange;
+
 struct CdkHighlighterPrivate_
 {
   gulong editor_notif_hnd;  // editor-notify (sci-notify) handler
-  gulong update_hnd;        // update handler
-  gint timeout;             // timeout for update handler
-  gint start_pos, end_pos;  // start/end of update range
   CdkStyleScheme *scheme;   // the style scheme being applied
   glong prev_lexer;         // the lexer the document had previously
   gboolean hl_occur;        // whether to highlight occurrences of symbol
   gulong tooltip_hnd;       // signal connect to query-tooltip on the scintilla
+  GArray *stale;            // CdkHighlightRange still to highlight once in view, sorted
+  GArray *runs;             // CdkStyleRun of the buffer, sorted
+  gboolean runs_valid;      // whether runs has the styles of a TU yet
+  gboolean per_token;       // whether to style each token with its own messages
+  GByteArray *styles;       // style bytes of the range being styled
+  GArray *occurrences;      // CdkOccurrence of the TU's identifiers, or NULL
+  guint occur_usr;          // USR whose occurrences are highlighted, or 0
+  gboolean occur_shown;     // whether the indicator is filled anywhere
 };
 
 enum
@@ -41,6 +64,7 @@ enum
   PROP_0,
   PROP_SCHEME,
   PROP_HL_OCCUR,
+  PROP_PER_TOKEN,
   NUM_PROPERTIES,
 };
 
@@ -57,6 +81,12 @@ static gboolean cdk_highlighter_editor_notify (GtkWidget *widget,
                                                SCNotification *nt,
                                                CdkHighlighter *self);
 static void cdk_highlighter_highlight_occurrences (CdkHighlighter *self);
+static void cdk_highlighter_clear_occurrences (CdkHighlighter *self,
+                                               ScintillaObject *sci);
+static void cdk_highlighter_add_stale (CdkHighlighter *self,
+                                       gint start_pos,
+                                       gint end_pos);
+static gboolean cdk_highlighter_highlight_visible (CdkHighlighter *self);
 
 G_DEFINE_TYPE (CdkHighlighter, cdk_highlighter, CDK_TYPE_DOCUMENT_HELPER)
 
@@ -78,6 +108,8 @@ cdk_highlighter_load_tooltip (CdkDocumentHelper *self,
   CdkPlugin *plugin = cdk_document_helper_get_plugin (self);
   GeanyDocument *doc = cdk_document_helper_get_document (self);
   CXTranslationUnit tu = cdk_plugin_get_translation_unit (plugin, doc);
+  if (tu == NULL)
+    return FALSE;
 
   CXFile file = clang_getFile (tu, doc->real_path);
   CXSourceLocation loc = clang_getLocationForOffset (tu, file, position);
@@ -144,6 +176,50 @@ cdk_highlighter_load_tooltip (CdkDocumentHelper *self,
       g_free (rel_fn);
     }
 
+  // What the other files know about it, from the symbol index
+  CXCursor ref_cursor = clang_getCursorReferenced (cursor);
+  if (clang_Cursor_isNull (ref_cursor))
+    ref_cursor = cursor;
+  CXString usr = clang_getCursorUSR (ref_cursor);
+  const gchar *cusr = clang_getCString (usr);
+  if (cusr != NULL && *cusr != '\0')
+    {
+      GArray *locs = cdk_plugin_lookup_symbol (plugin, cusr,
+                                               CDK_INDEX_DEFINITION | CDK_INDEX_REFERENCE);
+      gboolean have_def = ! clang_Cursor_isNull (def_cursor);
+      guint n_refs = 0, n_files = 0;
+      const gchar *last_file = NULL;
+      for (guint i = 0; locs != NULL && i < locs->len; i++)
+        {
+          CdkIndexLocation *loc = &g_array_index (locs, CdkIndexLocation, i);
+          if (loc->kind == CDK_INDEX_DEFINITION)
+            {
+              // Only the first, and only if the TU didn't have one
+              if (have_def)
+                continue;
+              gchar *rel_fn = cdk_relpath (loc->filename,
+                                           geany_data->app->project->base_path);
+              g_string_append_printf (tt, "\n<b>Defined in :</b> %s:%u:%u",
+                                      rel_fn ? rel_fn : loc->filename,
+                                      loc->line, loc->column);
+              g_free (rel_fn);
+              have_def = TRUE;
+              continue;
+            }
+          n_refs++;
+          // sorted by file
+          if (loc->filename != last_file)
+            n_files++;
+          last_file = loc->filename;
+        }
+      if (n_refs > 0)
+        g_string_append_printf (tt, "\n<b>References :</b> %u in %u file%s",
+                                n_refs, n_files, n_files != 1 ? "s" : "");
+      if (locs != NULL)
+        g_array_unref (locs);
+    }
+  clang_disposeString (usr);
+
   if (tt->len == 0)
     {
       g_string_free (tt, TRUE);
@@ -226,6 +302,37 @@ cdk_highlighter_deinitialize_document (CdkHighlighter *self,
   cdk_sci_send (sci, SCI_SETLEXER, self->priv->prev_lexer, 0);
 }
 
+static void
+cdk_highlighter_updated (CdkDocumentHelper *object,
+                         GeanyDocument *document)
+{
+  CdkHighlighter *self = CDK_HIGHLIGHTER (object);
+  CdkPlugin *plugin = cdk_document_helper_get_plugin (object);
+  GArray *runs = cdk_plugin_get_style_runs (plugin, document);
+
+  // The styles worked out along with the TU replace the ones shifted
+  // along with the edits since the previous one
+  g_array_set_size (self->priv->runs, 0);
+  if (runs != NULL)
+    g_array_append_vals (self->priv->runs, runs->data, runs->len);
+  self->priv->runs_valid = (runs != NULL);
+
+  // the identifiers under the caret may refer to something else now,
+  // found along with the TU too
+  cdk_highlighter_clear_occurrences (self, document->editor->sci);
+  self->priv->occur_usr = 0;
+  if (self->priv->occurrences != NULL)
+    g_array_unref (self->priv->occurrences);
+  self->priv->occurrences = cdk_plugin_get_occurrences (plugin, document);
+  if (self->priv->occurrences != NULL)
+    g_array_ref (self->priv->occurrences);
+  cdk_highlighter_highlight_occurrences (self);
+
+  // the styles may differ anywhere, even at the same revision, eg. after
+  // a header changed
+  cdk_highlighter_highlight_all (self);
+}
+
 static void
 cdk_highlighter_class_init (CdkHighlighterClass *klass)
 {
@@ -236,6 +343,7 @@ cdk_highlighter_class_init (CdkHighlighterClass *klass)
   dh_object_class = CDK_DOCUMENT_HELPER_CLASS (klass);
 
   dh_object_class->initialize = cdk_highlighter_initialize_document;
+  dh_object_class->updated = cdk_highlighter_updated;
 
   g_object_class->constructed = cdk_highlighter_constructed;
   g_object_class->finalize = cdk_highlighter_finalize;
@@ -265,6 +373,14 @@ cdk_highlighter_class_init (CdkHighlighterClass *klass)
                           TRUE,
                           G_PARAM_CONSTRUCT | G_PARAM_READWRITE);
 
+  cdk_highlighter_properties[PROP_PER_TOKEN] =
+    g_param_spec_boolean ("per-token-styling",
+                          "PerTokenStyling",
+                          "Whether to style each token with its own messages, "
+                          "only for comparing the two in cdk-bench",
+                          FALSE,
+                          G_PARAM_READWRITE);
+
   g_object_class_install_properties (g_object_class, NUM_PROPERTIES,
                                      cdk_highlighter_properties);
 
@@ -283,8 +399,11 @@ cdk_highlighter_finalize (GObject *object)
   cdk_highlighter_deinitialize_document (self,
     cdk_document_helper_get_document (CDK_DOCUMENT_HELPER (self)));
 
-  if (self->priv->update_hnd > 0)
-    g_source_remove (self->priv->update_hnd);
+  g_array_unref (self->priv->stale);
+  g_array_unref (self->priv->runs);
+  g_byte_array_unref (self->priv->styles);
+  if (self->priv->occurrences != NULL)
+    g_array_unref (self->priv->occurrences);
 
   if (G_IS_OBJECT (self->priv->scheme))
     g_object_unref (self->priv->scheme);
@@ -296,8 +415,10 @@ static void
 cdk_highlighter_init (CdkHighlighter *self)
 {
   self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, CDK_TYPE_HIGHLIGHTER, CdkHighlighterPrivate);
-  self->priv->timeout = CDK_HIGHLIGHTER_TIMEOUT;
   self->priv->hl_occur = TRUE;
+  self->priv->stale = g_array_new (FALSE, FALSE, sizeof (CdkHighlightRange));
+  self->priv->runs = g_array_new (FALSE, FALSE, sizeof (CdkStyleRun));
+  self->priv->styles = g_byte_array_new ();
 }
 
 static void
@@ -315,6 +436,9 @@ cdk_highlighter_get_property (GObject *object,
     case PROP_HL_OCCUR:
       g_value_set_boolean (value, cdk_highlighter_get_highlight_occurrences (self));
       break;
+    case PROP_PER_TOKEN:
+      g_value_set_boolean (value, cdk_highlighter_get_per_token_styling (self));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -336,6 +460,9 @@ cdk_highlighter_set_property (GObject *object,
     case PROP_HL_OCCUR:
       cdk_highlighter_set_highlight_occurrences (self, g_value_get_boolean (value));
       break;
+    case PROP_PER_TOKEN:
+      cdk_highlighter_set_per_token_styling (self, g_value_get_boolean (value));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -365,6 +492,275 @@ cdk_highlighter_apply_style (G_GNUC_UNUSED CdkHighlighter *self,
   //g_debug ("styled token '%u' from '%u' to '%u'", (guint) style_id, start_pos, end_pos);
 }
 
+// The visible lines and the margin around them
+static void
+cdk_highlighter_get_visible_range (ScintillaObject *sci,
+                                   gint *start_pos,
+                                   gint *end_pos)
+{
+  gint first_visible = cdk_sci_send (sci, SCI_GETFIRSTVISIBLELINE, 0, 0);
+  gint first_line = cdk_sci_send (sci, SCI_DOCLINEFROMVISIBLE, first_visible, 0);
+  gint n_lines = cdk_sci_send (sci, SCI_LINESONSCREEN, 0, 0);
+  gint line_count = cdk_sci_send (sci, SCI_GETLINECOUNT, 0, 0);
+
+  // folded lines make it cover more than is visible, which is harmless
+  gint last_line = MIN (first_line + n_lines + CDK_HIGHLIGHTER_MARGIN, line_count - 1);
+  first_line = MAX (first_line - CDK_HIGHLIGHTER_MARGIN, 0);
+
+  *start_pos = cdk_sci_send (sci, SCI_POSITIONFROMLINE, first_line, 0);
+  *end_pos = cdk_sci_send (sci, SCI_GETLINEENDPOSITION, MAX (last_line, 0), 0);
+}
+
+static gint
+cdk_highlight_range_compare (const CdkHighlightRange *a,
+                             const CdkHighlightRange *b)
+{
+  return (a->start_pos > b->start_pos) - (a->start_pos < b->start_pos);
+}
+
+// Adds a range to a sorted array of them, merging it with those it
+// overlaps or touches
+static void
+cdk_highlight_ranges_add (GArray *ranges, gint start_pos, gint end_pos)
+{
+  if (start_pos >= end_pos)
+    return;
+
+  CdkHighlightRange range = { start_pos, end_pos };
+  g_array_append_val (ranges, range);
+  g_array_sort (ranges, (GCompareFunc) cdk_highlight_range_compare);
+
+  guint n = 0;
+  for (guint i = 0; i < ranges->len; i++)
+    {
+      CdkHighlightRange *r = &g_array_index (ranges, CdkHighlightRange, i);
+      CdkHighlightRange *last = &g_array_index (ranges, CdkHighlightRange, MAX (n, 1) - 1);
+      if (n > 0 && r->start_pos <= last->end_pos)
+        last->end_pos = MAX (last->end_pos, r->end_pos);
+      else
+        g_array_index (ranges, CdkHighlightRange, n++) = *r;
+    }
+  g_array_set_size (ranges, n);
+}
+
+// Records a range to highlight once it's in view
+static void
+cdk_highlighter_add_stale (CdkHighlighter *self, gint start_pos, gint end_pos)
+{
+  cdk_highlight_ranges_add (self->priv->stale, start_pos, end_pos);
+}
+
+// The index of the first run ending after pos
+static guint
+cdk_style_runs_find (GArray *runs, gint pos)
+{
+  guint lo = 0, hi = runs->len;
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+      CdkStyleRun *run = &g_array_index (runs, CdkStyleRun, mid);
+      if ((gint) (run->offset + run->length) <= pos)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo;
+}
+
+/*
+ * Applies the runs overlapping start_pos to end_pos. Their styles are
+ * filled into one buffer spanning them all and the range, with the text
+ * between the tokens in the default style, which is sent to Scintilla
+ * with a single SCI_SETSTYLINGEX. That's two messages for the range
+ * rather than two for each of its tokens.
+ */
+static void
+cdk_highlighter_apply_runs (CdkHighlighter *self,
+                            GeanyDocument *doc,
+                            GArray *runs,
+                            gint start_pos,
+                            gint end_pos)
+{
+  guint lo = cdk_style_runs_find (runs, start_pos);
+
+  // the old way, one token per message
+  if (self->priv->per_token)
+    {
+      for (guint i = lo; i < runs->len; i++)
+        {
+          CdkStyleRun *run = &g_array_index (runs, CdkStyleRun, i);
+          if ((gint) run->offset >= end_pos)
+            break;
+          cdk_highlighter_apply_style (self, doc, run->style_id,
+                                       run->offset, run->offset + run->length);
+        }
+      return;
+    }
+
+  // The buffer spans the tokens sticking out of the range too
+  guint hi_run = lo;
+  while (hi_run < runs->len && (gint) g_array_index (runs, CdkStyleRun, hi_run).offset < end_pos)
+    hi_run++;
+  if (start_pos >= end_pos && hi_run == lo)
+    return;
+
+  guint buf_start = (guint) start_pos;
+  if (hi_run > lo)
+    buf_start = MIN (buf_start, g_array_index (runs, CdkStyleRun, lo).offset);
+  guint buf_end = (guint) end_pos;
+  for (guint i = lo; i < hi_run; i++)
+    {
+      CdkStyleRun *run = &g_array_index (runs, CdkStyleRun, i);
+      buf_end = MAX (buf_end, run->offset + run->length);
+    }
+
+  GByteArray *styles = self->priv->styles;
+  g_byte_array_set_size (styles, buf_end - buf_start);
+  memset (styles->data, CDK_STYLE_DEFAULT, styles->len);
+  for (guint i = lo; i < hi_run; i++)
+    {
+      CdkStyleRun *run = &g_array_index (runs, CdkStyleRun, i);
+      memset (styles->data + (run->offset - buf_start), run->style_id, run->length);
+    }
+
+  ScintillaObject *sci = doc->editor->sci;
+  g_assert (cdk_sci_send (sci, SCI_GETLEXER, 0, 0) == SCLEX_CONTAINER);
+  cdk_sci_send (sci, SCI_STARTSTYLING, buf_start, 0);
+  cdk_sci_send (sci, SCI_SETSTYLINGEX, styles->len, (sptr_t) styles->data);
+}
+
+// Takes the stale parts between start_pos and end_pos out of the stale
+// ranges, storing the range spanning them. Returns FALSE if there are
+// none.
+static gboolean
+cdk_highlighter_take_stale (CdkHighlighter *self,
+                            gint start_pos,
+                            gint end_pos,
+                            gint *taken_start,
+                            gint *taken_end)
+{
+  GArray *stale = self->priv->stale;
+  gboolean taken = FALSE;
+
+  for (guint i = 0; i < stale->len; i++)
+    {
+      CdkHighlightRange *r = &g_array_index (stale, CdkHighlightRange, i);
+      gint start = MAX (r->start_pos, start_pos);
+      gint end = MIN (r->end_pos, end_pos);
+      if (start >= end)
+        continue;
+
+      *taken_start = taken ? MIN (*taken_start, start) : start;
+      *taken_end = taken ? MAX (*taken_end, end) : end;
+      taken = TRUE;
+
+      // what's left on either side of the part taken
+      CdkHighlightRange after = { end, r->end_pos };
+      r->end_pos = start;
+      if (after.start_pos < after.end_pos)
+        g_array_insert_val (stale, ++i, after);
+    }
+
+  // drop the emptied ones
+  guint n = 0;
+  for (guint i = 0; i < stale->len; i++)
+    {
+      CdkHighlightRange *r = &g_array_index (stale, CdkHighlightRange, i);
+      if (r->start_pos < r->end_pos)
+        g_array_index (stale, CdkHighlightRange, n++) = *r;
+    }
+  g_array_set_size (stale, n);
+
+  return taken;
+}
+
+static gint
+cdk_highlighter_shift_position (gint pos, gint mod_pos, gint length, gboolean insert)
+{
+  if (insert)
+    return (pos > mod_pos) ? pos + length : pos;
+  else if (pos <= mod_pos)
+    return pos;
+  else
+    return MAX (pos - length, mod_pos);
+}
+
+// Moves sorted ranges along with the text they cover
+static void
+cdk_highlight_ranges_shift (GArray *ranges,
+                            gint mod_pos,
+                            gint length,
+                            gboolean insert)
+{
+  guint n = 0;
+
+  for (guint i = 0; i < ranges->len; i++)
+    {
+      CdkHighlightRange r = g_array_index (ranges, CdkHighlightRange, i);
+      // text inserted right where a range starts goes before it
+      if (insert && r.start_pos == mod_pos)
+        r.start_pos += length;
+      else
+        r.start_pos = cdk_highlighter_shift_position (r.start_pos, mod_pos, length, insert);
+      r.end_pos = cdk_highlighter_shift_position (r.end_pos, mod_pos, length, insert);
+      if (r.start_pos < r.end_pos)
+        g_array_index (ranges, CdkHighlightRange, n++) = r;
+    }
+  g_array_set_size (ranges, n);
+}
+
+/*
+ * Moves the runs along with the text they style, like the stale ranges,
+ * so until the reparse arrives they still style the text they were
+ * worked out for. Text typed inside a token takes its style, text typed
+ * between tokens gets the default one and deleted text takes its part
+ * of the runs with it. The runs before the edit don't change.
+ */
+static void
+cdk_highlighter_shift_runs (CdkHighlighter *self,
+                            gint mod_pos,
+                            gint length,
+                            gboolean insert)
+{
+  GArray *runs = self->priv->runs;
+
+  guint first = cdk_style_runs_find (runs, mod_pos);
+  guint n = first;
+  for (guint i = first; i < runs->len; i++)
+    {
+      CdkStyleRun run = g_array_index (runs, CdkStyleRun, i);
+      gint start = run.offset, end = run.offset + run.length;
+      if (insert && start == mod_pos)
+        start += length;
+      else
+        start = cdk_highlighter_shift_position (start, mod_pos, length, insert);
+      end = cdk_highlighter_shift_position (end, mod_pos, length, insert);
+      if (start >= end)
+        continue;
+      run.offset = start;
+      run.length = end - start;
+      g_array_index (runs, CdkStyleRun, n++) = run;
+    }
+  g_array_set_size (runs, n);
+}
+
+// Highlights what's stale in view, eg. after scrolling
+static gboolean
+cdk_highlighter_highlight_visible (CdkHighlighter *self)
+{
+  GeanyDocument *doc = cdk_document_helper_get_document (CDK_DOCUMENT_HELPER (self));
+  gint view_start = 0, view_end = 0, start = 0, end = 0;
+
+  if (self->priv->stale->len == 0)
+    return FALSE;
+
+  cdk_highlighter_get_visible_range (doc->editor->sci, &view_start, &view_end);
+  if (! cdk_highlighter_take_stale (self, view_start, view_end, &start, &end))
+    return FALSE;
+
+  return cdk_highlighter_highlight (self, start, end);
+}
+
 static gboolean
 cdk_highlighter_editor_notify (GtkWidget *widget,
                                G_GNUC_UNUSED gint unused,
@@ -374,14 +770,31 @@ cdk_highlighter_editor_notify (GtkWidget *widget,
   ScintillaObject *sci = SCINTILLA (widget);
 
   if (nt->nmhdr.code == SCN_UPDATEUI)
-    cdk_highlighter_highlight_occurrences (self);
+    {
+      cdk_highlighter_highlight_occurrences (self);
+      if (nt->updated & SC_UPDATE_V_SCROLL)
+        cdk_highlighter_highlight_visible (self);
+    }
+  else if (nt->nmhdr.code == SCN_MODIFIED &&
+           (nt->modificationType & (SC_MOD_INSERTTEXT | SC_MOD_DELETETEXT)))
+    {
+      gboolean insert = (nt->modificationType & SC_MOD_INSERTTEXT) != 0;
+      cdk_highlight_ranges_shift (self->priv->stale, nt->position, nt->length, insert);
+      cdk_highlighter_shift_runs (self, nt->position, nt->length, insert);
+    }
   else if (nt->nmhdr.code == SCN_STYLENEEDED)
     {
-      guint start_pos = cdk_sci_send (sci, SCI_GETENDSTYLED, 0, 0);
-      guint line_num = cdk_sci_send (sci, SCI_LINEFROMPOSITION, start_pos, 0);
+      gint start_pos = cdk_sci_send (sci, SCI_GETENDSTYLED, 0, 0);
+      gint line_num = cdk_sci_send (sci, SCI_LINEFROMPOSITION, start_pos, 0);
+      gint taken_start = 0, taken_end = 0;
       start_pos = cdk_sci_send (sci, SCI_POSITIONFROMLINE, line_num, 0);
 
-      cdk_highlighter_queue_highlight (self, start_pos, nt->position);
+      // All of the range is styled now, even far out of view, or
+      // Scintilla keeps asking and a jump there or another view of the
+      // document shows the text unstyled. It only takes applying the
+      // runs, and there's no need to do it again when it's scrolled to.
+      cdk_highlighter_take_stale (self, start_pos, nt->position, &taken_start, &taken_end);
+      cdk_highlighter_highlight (self, start_pos, nt->position);
 
       return TRUE;
     }
@@ -389,25 +802,50 @@ cdk_highlighter_editor_notify (GtkWidget *widget,
 }
 
 static void
-cdk_highlighter_clear_occurrences (G_GNUC_UNUSED CdkHighlighter *self,
+cdk_highlighter_clear_occurrences (CdkHighlighter *self,
                                    ScintillaObject *sci)
 {
+  if (! self->priv->occur_shown)
+    return;
   cdk_sci_send (sci, SCI_SETINDICATORCURRENT, CDK_HL_OCCUR_INDIC, 0);
   cdk_sci_send (sci, SCI_INDICATORCLEARRANGE, 0,
                 cdk_sci_send (sci, SCI_GETLENGTH, 0, 0));
+  self->priv->occur_shown = FALSE;
 }
 
-static CXCursor
-cdk_highlighter_get_cursor_at_pos (G_GNUC_UNUSED CdkHighlighter *self,
-                                   CXTranslationUnit tu,
-                                   GeanyDocument *doc,
-                                   gint offset)
+// The USR of the identifier at or right before pos, or 0
+static guint
+cdk_highlighter_find_occurrence (CdkHighlighter *self, gint pos)
 {
-  CXFile file = clang_getFile (tu, doc->real_path);
-  CXSourceLocation locn = clang_getLocationForOffset (tu, file, offset);
-  return clang_getCursor (tu, locn);
+  GArray *occurrences = self->priv->occurrences;
+  guint lo = 0, hi = occurrences->len;
+
+  // the first occurrence past pos
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+      if (g_array_index (occurrences, CdkOccurrence, mid).offset <= (guint) pos)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  if (lo == 0)
+    return 0;
+
+  CdkOccurrence *occur = &g_array_index (occurrences, CdkOccurrence, lo - 1);
+  if ((guint) pos > occur->offset + occur->length)
+    return 0;
+
+  return occur->usr;
 }
 
+/*
+ * Fills the indicator at the other places the USR of the identifier
+ * under the caret occurs. The occurrences come from the parse job, so
+ * that's only a lookup and, when the caret moves to another symbol, a
+ * pass over them to find those of its USR.
+ */
 static void
 cdk_highlighter_highlight_occurrences (CdkHighlighter *self)
 {
@@ -415,58 +853,56 @@ cdk_highlighter_highlight_occurrences (CdkHighlighter *self)
   GeanyDocument *doc = cdk_document_helper_get_document (helper);
   ScintillaObject *sci = doc->editor->sci;
   CdkPlugin *plugin = cdk_document_helper_get_plugin (helper);
-  CXTranslationUnit tu = cdk_plugin_get_translation_unit (plugin, doc);
-
-  cdk_highlighter_clear_occurrences (self, sci);
+  GArray *occurrences = self->priv->occurrences;
+  guint usr = 0;
 
-  gchar *cur_word = cdk_sci_get_current_word (sci);
-  if (! cur_word || ! *cur_word || (! isalpha (*cur_word) && *cur_word != '_'))
-    { // no current identifier, do nothing
-      g_free (cur_word);
-      return;
+  // The offsets of a TU behind the buffer don't match the text anymore,
+  // the occurrences come back when the reparse arrives
+  if (self->priv->hl_occur && occurrences != NULL &&
+      cdk_plugin_get_translation_unit_revision (plugin, doc) == cdk_document_get_revision (doc))
+    {
+      gint pos = cdk_sci_send (sci, SCI_GETCURRENTPOS, 0, 0);
+      gint word_start = cdk_sci_send (sci, SCI_WORDSTARTPOSITION, pos, TRUE);
+      gint word_end = cdk_sci_send (sci, SCI_WORDENDPOSITION, pos, TRUE);
+      if (word_start < word_end)
+        usr = cdk_highlighter_find_occurrence (self, pos);
     }
 
-  gint word_len = strlen (cur_word);
-  gint first_line = cdk_sci_send (sci, SCI_GETFIRSTVISIBLELINE, 0, 0);
-  gint num_lines = cdk_sci_send (sci, SCI_LINESONSCREEN, 0, 0);
-  gint last_line = first_line + num_lines;
-  gint start_pos = cdk_sci_send (sci, SCI_POSITIONFROMLINE, first_line, 0);
-  gint end_pos = cdk_sci_send (sci, SCI_GETLINEENDPOSITION, last_line, 0);
+  // still on the same symbol, the indicator is already in place
+  if (usr == self->priv->occur_usr)
+    return;
 
-  gint current_pos = cdk_sci_send (sci, SCI_GETCURRENTPOS, 0, 0);
-  CXCursor cur_cursor = cdk_highlighter_get_cursor_at_pos (self, tu, doc, current_pos);
-  cur_cursor = clang_getCursorReferenced (cur_cursor);
-
-  cdk_sci_send (sci, SCI_SETSEARCHFLAGS, SCFIND_MATCHCASE | SCFIND_WHOLEWORD, 0);
+  cdk_highlighter_clear_occurrences (self, sci);
+  self->priv->occur_usr = usr;
+  if (usr == 0)
+    return;
 
-  gint start = start_pos;
-  gint n_matches = 0;
-  while (TRUE)
+  // nothing to point out if it only occurs under the caret
+  guint n_occurs = 0;
+  for (guint i = 0; i < occurrences->len && n_occurs < 2; i++)
     {
-      cdk_sci_send (sci, SCI_SETTARGETRANGE, start, end_pos);
-      gint result = cdk_sci_send (sci, SCI_SEARCHINTARGET, word_len, cur_word);
-      if (result < 0)
-        break;
-
-      gint found_start = cdk_sci_send (sci, SCI_GETTARGETSTART, 0, 0);
-      gint found_end = cdk_sci_send (sci, SCI_GETTARGETEND, 0, 0);
-
-      CXCursor test_cursor = cdk_highlighter_get_cursor_at_pos (self, tu, doc, found_start);
-      test_cursor = clang_getCursorReferenced (test_cursor);
-      if (clang_equalCursors (cur_cursor, test_cursor))
-        {
-          cdk_sci_send (sci, SCI_INDICATORFILLRANGE, found_start, found_end - found_start);
-          n_matches++;
-        }
-      start = found_end;
+      if (g_array_index (occurrences, CdkOccurrence, i).usr == usr)
+        n_occurs++;
     }
+  if (n_occurs < 2)
+    return;
 
-  if (n_matches <= 1)
-    cdk_highlighter_clear_occurrences (self, sci);
-
-  g_free (cur_word);
+  cdk_sci_send (sci, SCI_SETINDICATORCURRENT, CDK_HL_OCCUR_INDIC, 0);
+  for (guint i = 0; i < occurrences->len; i++)
+    {
+      CdkOccurrence *occur = &g_array_index (occurrences, CdkOccurrence, i);
+      if (occur->usr == usr)
+        cdk_sci_send (sci, SCI_INDICATORFILLRANGE, occur->offset, occur->length);
+    }
+  self->priv->occur_shown = TRUE;
 }
 
+/*
+ * Styles the range with the runs worked out along with the latest TU,
+ * shifted along with the edits since if it's behind the buffer. Without
+ * a TU yet the range is styled as default text and FALSE is returned,
+ * it's highlighted once the TU arrives.
+ */
 gboolean
 cdk_highlighter_highlight (CdkHighlighter *self,
                            gint start_pos,
@@ -477,100 +913,38 @@ cdk_highlighter_highlight (CdkHighlighter *self,
   CdkDocumentHelper *helper = CDK_DOCUMENT_HELPER (self);
   GeanyDocument *doc = cdk_document_helper_get_document (helper);
   CdkPlugin *plugin = cdk_document_helper_get_plugin (helper);
-  CXTranslationUnit tu = cdk_plugin_get_translation_unit (plugin, doc);
-  if (tu == NULL)
-    return FALSE;
+  gint64 start_time = g_get_monotonic_time ();
 
-  CXToken *tokens = NULL;
-  guint n_tokens = 0;
-  CXFile file = clang_getFile (tu, doc->real_path);
-  CXSourceLocation start_loc = clang_getLocationForOffset (tu, file, start_pos);
-  CXSourceLocation end_loc = clang_getLocationForOffset (tu, file, end_pos);
-  CXSourceRange range = clang_getRange (start_loc, end_loc);
-
-  clang_tokenize (tu, range, &tokens, &n_tokens);
-
-  CXCursor *cursors = g_malloc0 (n_tokens * sizeof (CXCursor));
-  clang_annotateTokens (tu, tokens, n_tokens, cursors);
-
-  for (guint i = 0; i < n_tokens; i++)
-    {
-      CXCursor cur = cursors[i];
-      enum CXCursorKind kind = clang_getCursorKind (cur);
-      CdkStyleID style_id = cdk_style_id_for_cursor_kind (kind);
-      if (style_id == 0)
-        {
-          CXTokenKind tkind = clang_getTokenKind (tokens[i]);
-          style_id = cdk_style_id_for_token_kind (tkind);
-        }
-
-      CXSourceRange range = clang_getTokenExtent (tu, tokens[i]);
-      CXSourceLocation start_loc = clang_getRangeStart (range);
-      CXSourceLocation end_loc = clang_getRangeEnd (range);
-      guint start_p = 0, end_p = 0;
-      clang_getSpellingLocation (start_loc, NULL, NULL, NULL, &start_p);
-      clang_getSpellingLocation (end_loc, NULL, NULL, NULL, &end_p);
-
-      cdk_highlighter_apply_style (self, doc, style_id, start_p, end_p);
-    }
+  cdk_highlighter_apply_runs (self, doc, self->priv->runs, start_pos, end_pos);
+  if (! self->priv->runs_valid)
+    return FALSE;
 
-  g_free (cursors);
-  clang_disposeTokens (tu, tokens, n_tokens);
+  cdk_plugin_record_latency (plugin, doc, CDK_LATENCY_HIGHLIGHT,
+                             g_get_monotonic_time () - start_time);
+  cdk_plugin_record_job_outcome (plugin, CDK_LATENCY_HIGHLIGHT, CDK_JOB_COMPLETED);
 
   g_signal_emit_by_name (self, "highlighted", doc);
 
-  //g_debug ("highlighted %u tokens", n_tokens);
-
   return TRUE;
 }
 
+/*
+ * Highlights the whole document again, the part in view right away and
+ * the rest as it's scrolled into view.
+ */
 gboolean
 cdk_highlighter_highlight_all (CdkHighlighter *self)
 {
+  g_return_val_if_fail (CDK_IS_HIGHLIGHTER (self), FALSE);
+
   GeanyDocument *doc = cdk_document_helper_get_document (CDK_DOCUMENT_HELPER (self));
   ScintillaObject *sci = doc->editor->sci;
   gint length = cdk_sci_send (sci, SCI_GETLENGTH, 0, 0);
-  return cdk_highlighter_highlight (self, 0, length);
-}
-
-static gboolean
-on_highlight_later (CdkHighlighter *self)
-{
-  cdk_highlighter_highlight (self,
-                             self->priv->start_pos,
-                             self->priv->end_pos);
-  self->priv->update_hnd = 0;
-  return FALSE;
-}
-
-void
-cdk_highlighter_queue_highlight (CdkHighlighter *self,
-                                 gint start_pos,
-                                 gint end_pos)
-{
-  g_return_if_fail (CDK_IS_HIGHLIGHTER (self));
 
-  // reset the range to highlight if no pending highlight
-  if (self->priv->update_hnd == 0)
-    {
-      self->priv->start_pos = start_pos;
-      self->priv->end_pos = end_pos;
-    }
-  // extend the range to highlight if needed
-  else
-    {
-      if (start_pos < self->priv->start_pos)
-        self->priv->start_pos = start_pos;
-      if (end_pos > self->priv->end_pos)
-        self->priv->end_pos = end_pos;
-    }
+  g_array_set_size (self->priv->stale, 0);
+  cdk_highlighter_add_stale (self, 0, length);
 
-  if (self->priv->update_hnd == 0)
-    {
-      self->priv->update_hnd =
-        g_timeout_add (self->priv->timeout,
-                       (GSourceFunc) on_highlight_later, self);
-    }
+  return cdk_highlighter_highlight_visible (self);
 }
 
 CdkStyleScheme *
@@ -661,3 +1035,28 @@ cdk_highlighter_set_highlight_occurrences (CdkHighlighter *self,
       g_object_notify (G_OBJECT (self), "highlight-occurrences");
     }
 }
+
+gboolean
+cdk_highlighter_get_per_token_styling (CdkHighlighter *self)
+{
+  g_return_val_if_fail (CDK_IS_HIGHLIGHTER (self), FALSE);
+  return self->priv->per_token;
+}
+
+/*
+ * Has each token styled with its own SCI_STARTSTYLING and SCI_SETSTYLING
+ * messages rather than each range with one SCI_SETSTYLINGEX, only meant
+ * for measuring the difference in cdk-bench.
+ */
+void
+cdk_highlighter_set_per_token_styling (CdkHighlighter *self,
+                                       gboolean per_token)
+{
+  g_return_if_fail (CDK_IS_HIGHLIGHTER (self));
+
+  if (per_token != self->priv->per_token)
+    {
+      self->priv->per_token = per_token;
+      g_object_notify (G_OBJECT (self), "per-token-styling");
+    }
+}
@@ -38,11 +38,12 @@ GType cdk_highlighter_get_type (void);
 CdkHighlighter *cdk_highlighter_new (struct CdkPlugin_ *plugin, struct GeanyDocument *doc);
 gboolean cdk_highlighter_highlight (CdkHighlighter *self, gint start_pos, gint end_pos);
 gboolean cdk_highlighter_highlight_all (CdkHighlighter *self);
-void cdk_highlighter_queue_highlight (CdkHighlighter *self, gint start_pos, gint end_pos);
 CdkStyleScheme *cdk_highlighter_get_style_scheme (CdkHighlighter *self);
 void cdk_highlighter_set_style_scheme (CdkHighlighter *self, CdkStyleScheme *scheme);
 gboolean cdk_highlighter_get_highlight_occurrences (CdkHighlighter *self);
 void cdk_highlighter_set_highlight_occurrences (CdkHighlighter *self, gboolean hl_occur);
+gboolean cdk_highlighter_get_per_token_styling (CdkHighlighter *self);
+void cdk_highlighter_set_per_token_styling (CdkHighlighter *self, gboolean per_token);
 
 G_END_DECLS
 
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <cdk/cdkhistogram.h>
+#include <string.h>
+
+/*
+ * A fixed size histogram in the spirit of HdrHistogram. Values below
+ * 32 get a bucket each, above that every power of two range is split
+ * into 16 linear sub-buckets, so any value is counted with a relative
+ * error of at most 1/16 no matter how large it is. Recording is a
+ * couple of shifts and an increment, and there's no allocation after
+ * the histogram is created.
+ */
+
+#define CDK_HISTOGRAM_SUB_BITS    4
+#define CDK_HISTOGRAM_SUB_BUCKETS (1 << CDK_HISTOGRAM_SUB_BITS)
+// enough for the index of G_MAXUINT64, see cdk_histogram_index()
+#define CDK_HISTOGRAM_N_BUCKETS \
+  ((64 - CDK_HISTOGRAM_SUB_BITS - 1) * CDK_HISTOGRAM_SUB_BUCKETS + 2 * CDK_HISTOGRAM_SUB_BUCKETS)
+
+struct CdkHistogram_
+{
+  guint64 count;                            // number of values recorded
+  guint64 max;                              // exact largest value recorded
+  guint32 buckets[CDK_HISTOGRAM_N_BUCKETS]; // counts per value range
+};
+
+// Values are shifted right until they fit in 5 bits, leaving 16..31 as
+// the sub-bucket for anything that had to be shifted
+static inline guint
+cdk_histogram_index (guint64 value)
+{
+  // gulong may only be 32 bits wide
+  guint bits = (value >> 32) ? 32 + g_bit_storage ((gulong) (value >> 32)) :
+                               g_bit_storage ((gulong) value);
+  guint shift = (bits > CDK_HISTOGRAM_SUB_BITS + 1) ?
+    bits - CDK_HISTOGRAM_SUB_BITS - 1 : 0;
+  return shift * CDK_HISTOGRAM_SUB_BUCKETS + (guint) (value >> shift);
+}
+
+// Largest value counted in the bucket at index
+static guint64
+cdk_histogram_bucket_max (guint index)
+{
+  if (index < 2 * CDK_HISTOGRAM_SUB_BUCKETS)
+    return index;
+  guint shift = index / CDK_HISTOGRAM_SUB_BUCKETS - 1;
+  guint64 sub = index - shift * CDK_HISTOGRAM_SUB_BUCKETS;
+  // wraps around to G_MAXUINT64 for the last bucket
+  return ((sub + 1) << shift) - 1;
+}
+
+CdkHistogram *
+cdk_histogram_new (void)
+{
+  return g_slice_new0 (CdkHistogram);
+}
+
+void
+cdk_histogram_free (CdkHistogram *hist)
+{
+  if (G_UNLIKELY (hist == NULL))
+    return;
+  g_slice_free (CdkHistogram, hist);
+}
+
+void
+cdk_histogram_reset (CdkHistogram *hist)
+{
+  g_return_if_fail (hist != NULL);
+  memset (hist, 0, sizeof (CdkHistogram));
+}
+
+void
+cdk_histogram_record (CdkHistogram *hist, guint64 value)
+{
+  g_return_if_fail (hist != NULL);
+
+  guint index = cdk_histogram_index (value);
+  if (G_LIKELY (hist->buckets[index] < G_MAXUINT32))
+    hist->buckets[index]++;
+  hist->count++;
+  hist->max = MAX (hist->max, value);
+}
+
+/*
+ * Adds all the values recorded in other to hist.
+ */
+void
+cdk_histogram_merge (CdkHistogram *hist, const CdkHistogram *other)
+{
+  g_return_if_fail (hist != NULL);
+  g_return_if_fail (other != NULL);
+
+  for (guint i = 0; i < CDK_HISTOGRAM_N_BUCKETS; i++)
+    {
+      guint64 sum = (guint64) hist->buckets[i] + other->buckets[i];
+      hist->buckets[i] = (guint32) MIN (sum, G_MAXUINT32);
+    }
+  hist->count += other->count;
+  hist->max = MAX (hist->max, other->max);
+}
+
+guint64
+cdk_histogram_get_count (const CdkHistogram *hist)
+{
+  g_return_val_if_fail (hist != NULL, 0);
+  return hist->count;
+}
+
+guint64
+cdk_histogram_get_max (const CdkHistogram *hist)
+{
+  g_return_val_if_fail (hist != NULL, 0);
+  return hist->max;
+}
+
+/*
+ * Returns the value below or at which percentile (0 to 100) percent of
+ * the recorded values are, rounded up to the end of its bucket but never
+ * more than the largest value recorded. 0 if nothing was recorded.
+ */
+guint64
+cdk_histogram_get_percentile (const CdkHistogram *hist, gdouble percentile)
+{
+  g_return_val_if_fail (hist != NULL, 0);
+
+  guint64 total = 0;
+  for (guint i = 0; i < CDK_HISTOGRAM_N_BUCKETS; i++)
+    total += hist->buckets[i];
+  if (total == 0)
+    return 0;
+
+  percentile = CLAMP (percentile, 0.0, 100.0);
+  guint64 rank = (guint64) (percentile / 100.0 * total + 0.5);
+  rank = CLAMP (rank, 1, total);
+
+  guint64 seen = 0;
+  for (guint i = 0; i < CDK_HISTOGRAM_N_BUCKETS; i++)
+    {
+      seen += hist->buckets[i];
+      if (seen >= rank)
+        return MIN (cdk_histogram_bucket_max (i), hist->max);
+    }
+
+  return hist->max;
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifndef CDK_HISTOGRAM_H_
+#define CDK_HISTOGRAM_H_ 1
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct CdkHistogram_ CdkHistogram;
+
+CdkHistogram *cdk_histogram_new (void);
+void cdk_histogram_free (CdkHistogram *hist);
+void cdk_histogram_reset (CdkHistogram *hist);
+void cdk_histogram_record (CdkHistogram *hist, guint64 value);
+void cdk_histogram_merge (CdkHistogram *hist, const CdkHistogram *other);
+guint64 cdk_histogram_get_count (const CdkHistogram *hist);
+guint64 cdk_histogram_get_max (const CdkHistogram *hist);
+guint64 cdk_histogram_get_percentile (const CdkHistogram *hist, gdouble percentile);
+
+G_END_DECLS
+
+#endif /* CDK_HISTOGRAM_H_ */
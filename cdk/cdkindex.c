@@ -0,0 +1,1260 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <cdk/cdkindex.h>
+#include <cdk/cdkutils.h>
+#include <clang-c/Index.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * The symbol index maps the USR of everything declared, defined or
+ * referenced in the project's files, outside of system headers, to
+ * where that happens, across all of the files.
+ *
+ * Each main file is indexed with clang_indexSourceFile() into a shard
+ * of its own, in a directory next to the index file holding only its
+ * shards, and named after the file and its arguments. The shard also lists every non-system file the main file
+ * was indexed from, as reported by clang_getInclusions(). Those lists
+ * make up a reverse inclusion graph, mapping each file to the main
+ * files that depend on it. The directories of all of those files are
+ * watched, and when one of them changes only its dependents are
+ * indexed again. All of the shards are then merged into the index
+ * file, which the main loop maps in place of the previous one.
+ *
+ * An update runs the main files to index on a pool of threads sharing
+ * a single CXIndexAction, with the ones open in the editor first. The
+ * function bodies in headers are indexed again for every file including
+ * them rather than skipped once parsed in the session, as a shard has
+ * to hold all of its file's occurrences on its own to be re-indexed
+ * alone later. The thread finishing the last file does the merge and
+ * hands the result to the main loop. When the sources are
+ * set, eg. when the project is opened, the shards left from last time
+ * are only checked against the modification times of their files, so
+ * only what changed meanwhile is indexed again. The shards of files no
+ * longer in the project are removed after the merge.
+ *
+ * Shards and the index file are made of, in native byte order:
+ *
+ *   header  - CdkIndexHeader
+ *   symbols - a CdkIndexSymbol for each USR, sorted by USR
+ *   files   - the offset of each file name in the strings
+ *   entries - a CdkIndexEntry for each occurrence, grouped by symbol
+ *   strings - the NUL-terminated USRs and file names
+ *
+ * so a lookup is a binary search on the mapped file, with nothing read
+ * in or built in memory when it's loaded. In a shard the files are all
+ * of the files it was indexed from, in the index those with entries.
+ */
+
+#define CDK_INDEX_MAGIC "CDKIDX02"
+
+// Coalesces the change notifications of eg. a checkout
+#define CDK_INDEX_UPDATE_DELAY 500
+
+typedef struct
+{
+  gchar   magic[8];     // CDK_INDEX_MAGIC, without its terminator
+  guint32 n_symbols;
+  guint32 n_files;
+  guint32 n_entries;
+  guint32 strings_size; // in bytes
+}
+CdkIndexHeader;
+
+typedef struct
+{
+  guint32 usr;       // offset of the USR in the strings
+  guint32 first;     // its first entry
+  guint32 n_entries; // number of entries it has
+}
+CdkIndexSymbol;
+
+typedef struct
+{
+  guint32 file;   // index into the files
+  guint32 line;
+  guint32 column; // shifted left by 2, the low bits being the kind's bit number
+}
+CdkIndexEntry;
+
+// A mapped index file or shard
+typedef struct
+{
+  GMappedFile          *map;     // NULL if not loaded
+  const CdkIndexHeader *header;  // start of the map
+  const CdkIndexSymbol *symbols; // sections of the map, see above
+  const guint32        *files;
+  const CdkIndexEntry  *entries;
+  const gchar          *strings;
+}
+CdkIndexData;
+
+// An entry while building, with ids instead of offsets
+typedef struct
+{
+  guint32 usr;
+  CdkIndexEntry entry;
+}
+CdkIndexBuildEntry;
+
+// What goes into an index file or shard while it's being built
+typedef struct
+{
+  GHashTable *usr_ids;   // maps a USR to its id + 1
+  GPtrArray  *usrs;      // USRs by id
+  GHashTable *file_ids;  // maps a file name to its id + 1
+  GPtrArray  *filenames; // file names by id
+  GArray     *entries;   // CdkIndexBuildEntry
+}
+CdkIndexTables;
+
+// A main file of the project, main thread only
+typedef struct
+{
+  gchar    *filename; // the main file
+  gchar   **argv;     // compiler arguments to index it with
+  gchar    *shard;    // path of its shard
+  gchar   **inputs;   // files it was indexed from, NULL until known
+  gboolean  dirty;    // whether it's to be looked at in the next update
+  gboolean  verify;   // whether the shard may still be good, to be checked first
+}
+CdkIndexFile;
+
+typedef struct CdkIndexUpdate_ CdkIndexUpdate;
+
+// Indexing of one main file in an update
+typedef struct
+{
+  CdkIndexUpdate *update;   // the update it's part of
+  gchar          *filename; // the main file, NULL to only merge
+  gchar         **argv;     // compiler arguments
+  gchar          *shard;    // where to write the shard
+  gboolean        verify;   // whether to keep the shard if it's still good
+  gboolean        open;     // whether it's open in the editor, runs first
+  gchar         **inputs;   // result: files it was indexed from, NULL if cancelled
+}
+CdkIndexJob;
+
+struct CdkIndexUpdate_
+{
+  CdkIndex      *index;     // the index being updated, main thread only
+  GThreadPool   *pool;      // threads running the jobs
+  CXIndex        cx_index;  // libclang index shared by the threads
+  CXIndexAction  action;    // indexing session shared by the threads
+  GPtrArray     *jobs;      // CdkIndexJob to run
+  gchar        **shards;    // shards of all main files, merged when done
+  gchar         *path;      // where to write the index
+  gchar         *shard_dir; // directory of the shards, others there are removed
+  gint           n_pending; // jobs not done yet, accessed atomically
+  gint           cancelled; // set to have the threads stop, accessed atomically
+  gboolean       written;   // whether the index file was written
+};
+
+struct CdkIndex_
+{
+  gchar          *path;          // the index file
+  gchar          *shard_dir;     // directory of the shards of this index only
+  gchar          *clang_version; // part of the shard names
+  CdkIndexData    data;          // the loaded index file
+  GHashTable     *files;         // maps a main file to its CdkIndexFile
+  GHashTable     *dependents;    // maps a file to the set of CdkIndexFile indexed from it
+  GHashTable     *monitors;      // maps a directory to the GFileMonitor watching it
+  GHashTable     *open_files;    // set of main files open in the editor
+  gboolean        stale;         // whether to write the index even with nothing to index
+  guint           n_threads;     // max threads of an update
+  CdkIndexUpdate *update;        // update in progress or NULL
+  guint           update_hnd;    // timeout starting the next update
+  CdkIndexFunc    func;          // called on the main loop after each update
+  gpointer        user_data;     // passed to func
+};
+
+// What a thread collects from one main file
+typedef struct
+{
+  CdkIndexUpdate *update;
+  CdkIndexTables  tables;
+  GHashTable     *cx_files; // maps a CXFile to its file id + 1, or G_MAXUINT to skip it
+}
+CdkIndexUnit;
+
+static gboolean cdk_index_start_update (CdkIndex *index);
+static void cdk_index_stop (CdkIndex *index);
+
+static void
+cdk_index_data_clear (CdkIndexData *data)
+{
+  if (data->map != NULL)
+    g_mapped_file_unref (data->map);
+  memset (data, 0, sizeof (CdkIndexData));
+}
+
+static gboolean
+cdk_index_data_load (CdkIndexData *data, const gchar *path)
+{
+  cdk_index_data_clear (data);
+
+  GMappedFile *map = g_mapped_file_new (path, FALSE, NULL);
+  if (map == NULL)
+    return FALSE;
+
+  gsize length = g_mapped_file_get_length (map);
+  const gchar *contents = g_mapped_file_get_contents (map);
+  const CdkIndexHeader *header = (const CdkIndexHeader *) contents;
+
+  // Anything that doesn't add up is from another version or cut short
+  if (length < sizeof (CdkIndexHeader) ||
+      memcmp (header->magic, CDK_INDEX_MAGIC, sizeof (header->magic)) != 0 ||
+      length != sizeof (CdkIndexHeader) +
+                (gsize) header->n_symbols * sizeof (CdkIndexSymbol) +
+                (gsize) header->n_files * sizeof (guint32) +
+                (gsize) header->n_entries * sizeof (CdkIndexEntry) +
+                header->strings_size ||
+      (header->strings_size > 0 && contents[length - 1] != '\0'))
+    {
+      g_debug ("ignoring invalid symbol index '%s'", path);
+      g_mapped_file_unref (map);
+      return FALSE;
+    }
+
+  data->map = map;
+  data->header = header;
+  data->symbols = (const CdkIndexSymbol *) (header + 1);
+  data->files = (const guint32 *) (data->symbols + header->n_symbols);
+  data->entries = (const CdkIndexEntry *) (data->files + header->n_files);
+  data->strings = (const gchar *) (data->entries + header->n_entries);
+
+  return TRUE;
+}
+
+// Out of range offsets give "" rather than reading past the map
+static const gchar *
+cdk_index_data_get_string (const CdkIndexData *data, guint32 offset)
+{
+  if (offset >= data->header->strings_size)
+    return "";
+  return data->strings + offset;
+}
+
+static void
+cdk_index_file_free (CdkIndexFile *file)
+{
+  g_free (file->filename);
+  g_strfreev (file->argv);
+  g_free (file->shard);
+  g_strfreev (file->inputs);
+  g_slice_free (CdkIndexFile, file);
+}
+
+static void
+cdk_index_monitor_free (GFileMonitor *monitor)
+{
+  g_file_monitor_cancel (monitor);
+  g_object_unref (monitor);
+}
+
+/*
+ * Loads the index from path if it's there, otherwise it stays empty
+ * until the sources are set. Shards are stored in the same directory.
+ */
+CdkIndex *
+cdk_index_new (const gchar *path)
+{
+  g_return_val_if_fail (path != NULL, NULL);
+
+  CdkIndex *index = g_slice_new0 (CdkIndex);
+  index->path = g_strdup (path);
+  gsize len = strlen (path);
+  if (g_str_has_suffix (path, ".index"))
+    len -= strlen (".index");
+  index->shard_dir = g_strdup_printf ("%.*s.shards", (gint) len, path);
+  g_mkdir_with_parents (index->shard_dir, 0700);
+  index->n_threads = 1;
+  index->files = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                        (GDestroyNotify) cdk_index_file_free);
+  index->dependents = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify) g_hash_table_destroy);
+  index->monitors = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                           (GDestroyNotify) cdk_index_monitor_free);
+  index->open_files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  CXString version = clang_getClangVersion ();
+  index->clang_version = g_strdup (clang_getCString (version));
+  clang_disposeString (version);
+
+  cdk_index_data_load (&index->data, index->path);
+
+  return index;
+}
+
+void
+cdk_index_free (CdkIndex *index)
+{
+  if (G_UNLIKELY (index == NULL))
+    return;
+
+  cdk_index_stop (index);
+  cdk_index_data_clear (&index->data);
+  g_hash_table_destroy (index->monitors);
+  g_hash_table_destroy (index->dependents);
+  g_hash_table_destroy (index->files);
+  g_hash_table_destroy (index->open_files);
+  g_free (index->clang_version);
+  g_free (index->shard_dir);
+  g_free (index->path);
+
+  g_slice_free (CdkIndex, index);
+}
+
+const gchar *
+cdk_index_get_path (CdkIndex *index)
+{
+  g_return_val_if_fail (index != NULL, NULL);
+  return index->path;
+}
+
+/*
+ * Whether there's an index file loaded, an update replaces it once it's
+ * done.
+ */
+gboolean
+cdk_index_is_loaded (CdkIndex *index)
+{
+  g_return_val_if_fail (index != NULL, FALSE);
+  return (index->data.header != NULL);
+}
+
+guint
+cdk_index_get_n_symbols (CdkIndex *index)
+{
+  g_return_val_if_fail (index != NULL, 0);
+  return (index->data.header != NULL) ? index->data.header->n_symbols : 0;
+}
+
+/*
+ * The USR of the nth symbol, in sorted order. It points into the loaded
+ * index, like the file names returned by cdk_index_lookup().
+ */
+const gchar *
+cdk_index_get_symbol (CdkIndex *index, guint n)
+{
+  g_return_val_if_fail (index != NULL, NULL);
+  g_return_val_if_fail (n < cdk_index_get_n_symbols (index), NULL);
+  return cdk_index_data_get_string (&index->data, index->data.symbols[n].usr);
+}
+
+static void
+cdk_index_add_locations (const CdkIndexData *data,
+                         const CdkIndexSymbol *symbol,
+                         guint kinds,
+                         GArray *locations)
+{
+  guint32 first = MIN (symbol->first, data->header->n_entries);
+  guint32 last = first + MIN (symbol->n_entries, data->header->n_entries - first);
+
+  for (guint32 i = first; i < last; i++)
+    {
+      const CdkIndexEntry *entry = &data->entries[i];
+      CdkIndexKind kind = 1 << (entry->column & 0x3);
+      if (! (kinds & kind) || entry->file >= data->header->n_files)
+        continue;
+
+      CdkIndexLocation loc;
+      loc.filename = cdk_index_data_get_string (data, data->files[entry->file]);
+      loc.line = entry->line;
+      loc.column = entry->column >> 2;
+      loc.kind = kind;
+      g_array_append_val (locations, loc);
+    }
+}
+
+/*
+ * Finds where the symbol with the given USR occurs as any of the
+ * CdkIndexKind in kinds. Returns a new array of CdkIndexLocation, grouped
+ * by file and sorted by position, which is empty if there are none or
+ * the index isn't loaded. The file names point into the index, so
+ * they're only good until the main loop runs again and a finished
+ * update may replace it.
+ */
+GArray *
+cdk_index_lookup (CdkIndex *index, const gchar *usr, guint kinds)
+{
+  g_return_val_if_fail (index != NULL, NULL);
+  g_return_val_if_fail (usr != NULL, NULL);
+
+  GArray *locations = g_array_new (FALSE, FALSE, sizeof (CdkIndexLocation));
+  const CdkIndexData *data = &index->data;
+  if (data->header == NULL)
+    return locations;
+
+  guint lo = 0, hi = data->header->n_symbols;
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+      gint cmp = strcmp (cdk_index_data_get_string (data, data->symbols[mid].usr), usr);
+      if (cmp == 0)
+        {
+          cdk_index_add_locations (data, &data->symbols[mid], kinds, locations);
+          break;
+        }
+      else if (cmp < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return locations;
+}
+
+void
+cdk_index_source_clear (CdkIndexSource *source)
+{
+  g_free (source->filename);
+  g_strfreev (source->argv);
+}
+
+static void
+cdk_index_tables_init (CdkIndexTables *tables)
+{
+  tables->usr_ids = g_hash_table_new (g_str_hash, g_str_equal);
+  tables->usrs = g_ptr_array_new_with_free_func (g_free);
+  tables->file_ids = g_hash_table_new (g_str_hash, g_str_equal);
+  tables->filenames = g_ptr_array_new_with_free_func (g_free);
+  tables->entries = g_array_new (FALSE, FALSE, sizeof (CdkIndexBuildEntry));
+}
+
+static void
+cdk_index_tables_clear (CdkIndexTables *tables)
+{
+  g_hash_table_destroy (tables->usr_ids);
+  g_ptr_array_free (tables->usrs, TRUE);
+  g_hash_table_destroy (tables->file_ids);
+  g_ptr_array_free (tables->filenames, TRUE);
+  g_array_unref (tables->entries);
+}
+
+static guint32
+cdk_index_intern (GHashTable *ids, GPtrArray *strings, const gchar *str)
+{
+  guint id = GPOINTER_TO_UINT (g_hash_table_lookup (ids, str));
+  if (id == 0)
+    {
+      gchar *copy = g_strdup (str);
+      g_ptr_array_add (strings, copy);
+      id = strings->len;
+      g_hash_table_insert (ids, copy, GUINT_TO_POINTER (id));
+    }
+  return id - 1;
+}
+
+static gint
+cdk_index_compare_usr_ids (gconstpointer a, gconstpointer b, gpointer usrs)
+{
+  GPtrArray *strings = usrs;
+  return strcmp (strings->pdata[*(const guint32 *) a],
+                 strings->pdata[*(const guint32 *) b]);
+}
+
+static gint
+cdk_index_compare_entries (gconstpointer a, gconstpointer b)
+{
+  const CdkIndexBuildEntry *ea = a, *eb = b;
+  if (ea->usr != eb->usr)
+    return (ea->usr < eb->usr) ? -1 : 1;
+  if (ea->entry.file != eb->entry.file)
+    return (ea->entry.file < eb->entry.file) ? -1 : 1;
+  if (ea->entry.line != eb->entry.line)
+    return (ea->entry.line < eb->entry.line) ? -1 : 1;
+  if (ea->entry.column != eb->entry.column)
+    return (ea->entry.column < eb->entry.column) ? -1 : 1;
+  return 0;
+}
+
+// Sorts the tables and writes them out to path
+static gboolean
+cdk_index_tables_write (CdkIndexTables *tables, const gchar *path)
+{
+  guint n_usrs = tables->usrs->len;
+  guint n_files = tables->filenames->len;
+  guint32 *order = g_new (guint32, n_usrs);
+  guint32 *ranks = g_new (guint32, n_usrs);
+
+  // With the USR ids replaced by their rank the entries sort into
+  // groups by symbol in the order of the USRs
+  for (guint i = 0; i < n_usrs; i++)
+    order[i] = i;
+  g_qsort_with_data (order, n_usrs, sizeof (guint32), cdk_index_compare_usr_ids, tables->usrs);
+  for (guint i = 0; i < n_usrs; i++)
+    ranks[order[i]] = i;
+  for (guint i = 0; i < tables->entries->len; i++)
+    {
+      CdkIndexBuildEntry *entry = &g_array_index (tables->entries, CdkIndexBuildEntry, i);
+      entry->usr = ranks[entry->usr];
+    }
+  g_array_sort (tables->entries, cdk_index_compare_entries);
+
+  // Declarations in headers are reported by every file including them
+  guint n_entries = 0;
+  for (guint i = 0; i < tables->entries->len; i++)
+    {
+      CdkIndexBuildEntry *entry = &g_array_index (tables->entries, CdkIndexBuildEntry, i);
+      if (n_entries > 0 &&
+          cdk_index_compare_entries (entry, &g_array_index (tables->entries,
+                                                            CdkIndexBuildEntry,
+                                                            n_entries - 1)) == 0)
+        continue;
+      g_array_index (tables->entries, CdkIndexBuildEntry, n_entries++) = *entry;
+    }
+  g_array_set_size (tables->entries, n_entries);
+
+  CdkIndexHeader header;
+  memcpy (header.magic, CDK_INDEX_MAGIC, sizeof (header.magic));
+  header.n_symbols = n_usrs;
+  header.n_files = n_files;
+  header.n_entries = n_entries;
+
+  CdkIndexSymbol *symbols = g_new0 (CdkIndexSymbol, n_usrs);
+  guint32 *files = g_new (guint32, n_files);
+  guint64 offset = 0;
+  for (guint i = 0; i < n_usrs; i++)
+    {
+      symbols[i].usr = offset;
+      offset += strlen (tables->usrs->pdata[order[i]]) + 1;
+    }
+  for (guint i = 0; i < n_files; i++)
+    {
+      files[i] = offset;
+      offset += strlen (tables->filenames->pdata[i]) + 1;
+    }
+  for (guint i = 0; i < n_entries; i++)
+    {
+      CdkIndexBuildEntry *entry = &g_array_index (tables->entries, CdkIndexBuildEntry, i);
+      if (symbols[entry->usr].n_entries++ == 0)
+        symbols[entry->usr].first = i;
+    }
+  header.strings_size = offset;
+
+  gboolean written = FALSE;
+  gchar *tmp_path = g_strconcat (path, ".tmp", NULL);
+  FILE *fp = (offset <= G_MAXUINT32) ? g_fopen (tmp_path, "wb") : NULL;
+  if (fp != NULL)
+    {
+      written = (fwrite (&header, sizeof (header), 1, fp) == 1 &&
+                 fwrite (symbols, sizeof (CdkIndexSymbol), n_usrs, fp) == n_usrs &&
+                 fwrite (files, sizeof (guint32), n_files, fp) == n_files);
+      for (guint i = 0; written && i < n_entries; i++)
+        {
+          CdkIndexBuildEntry *entry = &g_array_index (tables->entries, CdkIndexBuildEntry, i);
+          written = (fwrite (&entry->entry, sizeof (CdkIndexEntry), 1, fp) == 1);
+        }
+      for (guint i = 0; written && i < n_usrs; i++)
+        {
+          const gchar *usr = tables->usrs->pdata[order[i]];
+          written = (fwrite (usr, strlen (usr) + 1, 1, fp) == 1);
+        }
+      for (guint i = 0; written && i < n_files; i++)
+        {
+          const gchar *filename = tables->filenames->pdata[i];
+          written = (fwrite (filename, strlen (filename) + 1, 1, fp) == 1);
+        }
+      written = (fclose (fp) == 0 && written);
+    }
+
+  // Written under a temporary name first so a half-written file is
+  // never picked up
+  if (! written || g_rename (tmp_path, path) != 0)
+    {
+      g_warning ("failed to write symbol index '%s'", path);
+      g_unlink (tmp_path);
+      written = FALSE;
+    }
+
+  g_free (tmp_path);
+  g_free (symbols);
+  g_free (files);
+  g_free (ranks);
+  g_free (order);
+
+  return written;
+}
+
+// Canonical so it can be matched with the documents' paths and the
+// file monitors' events
+static gchar *
+cdk_index_get_filename (CXFile file)
+{
+  CXString name = clang_getFileName (file);
+  gchar *filename = cdk_abspath (clang_getCString (name));
+  if (filename == NULL)
+    filename = g_strdup (clang_getCString (name));
+  clang_disposeString (name);
+  return filename;
+}
+
+static void
+cdk_index_unit_add (CdkIndexUnit *unit,
+                    const gchar *usr,
+                    CXIdxLoc loc,
+                    guint kind_bit)
+{
+  if (usr == NULL || *usr == '\0')
+    return;
+
+  CXFile file = NULL;
+  guint line = 0, column = 0;
+  clang_indexLoc_getFileLocation (loc, NULL, &file, &line, &column, NULL);
+  if (file == NULL)
+    return;
+
+  // System headers aren't part of the project, and are the bulk of
+  // most TUs
+  guint file_id = GPOINTER_TO_UINT (g_hash_table_lookup (unit->cx_files, file));
+  if (file_id == 0)
+    {
+      if (clang_Location_isInSystemHeader (clang_indexLoc_getCXSourceLocation (loc)))
+        file_id = G_MAXUINT;
+      else
+        {
+          gchar *filename = cdk_index_get_filename (file);
+          file_id = cdk_index_intern (unit->tables.file_ids, unit->tables.filenames,
+                                      filename) + 1;
+          g_free (filename);
+        }
+      g_hash_table_insert (unit->cx_files, file, GUINT_TO_POINTER (file_id));
+    }
+  if (file_id == G_MAXUINT)
+    return;
+
+  CdkIndexBuildEntry entry;
+  entry.usr = cdk_index_intern (unit->tables.usr_ids, unit->tables.usrs, usr);
+  entry.entry.file = file_id - 1;
+  entry.entry.line = line;
+  entry.entry.column = (column << 2) | kind_bit;
+  g_array_append_val (unit->tables.entries, entry);
+}
+
+static gint
+cdk_index_abort_query (CdkIndexUnit *unit, G_GNUC_UNUSED gpointer reserved)
+{
+  return g_atomic_int_get (&unit->update->cancelled);
+}
+
+static void
+cdk_index_declaration (CdkIndexUnit *unit, const CXIdxDeclInfo *info)
+{
+  if (info->entityInfo != NULL)
+    cdk_index_unit_add (unit, info->entityInfo->USR, info->loc,
+                        info->isDefinition ? 1 : 0);
+}
+
+static void
+cdk_index_reference (CdkIndexUnit *unit, const CXIdxEntityRefInfo *info)
+{
+  if (info->referencedEntity != NULL)
+    cdk_index_unit_add (unit, info->referencedEntity->USR, info->loc, 2);
+}
+
+static void
+cdk_index_collect_input (CXFile included_file,
+                         CXSourceLocation *stack,
+                         unsigned stack_len,
+                         CdkIndexUnit *unit)
+{
+  // The main file comes without a stack
+  if (stack_len > 0 && clang_Location_isInSystemHeader (stack[0]))
+    return;
+
+  gchar *filename = cdk_index_get_filename (included_file);
+  cdk_index_intern (unit->tables.file_ids, unit->tables.filenames, filename);
+  g_free (filename);
+}
+
+// Modification time in nanoseconds where the system has them
+static gint64
+cdk_index_get_mtime (const GStatBuf *st)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  return (gint64) st->st_mtim.tv_sec * G_GINT64_CONSTANT (1000000000) + st->st_mtim.tv_nsec;
+#else
+  return (gint64) st->st_mtime * G_GINT64_CONSTANT (1000000000);
+#endif
+}
+
+// Whether the shard is still good, ie. none of its files changed
+// since it was written. Returns the files or NULL. A file modified at
+// the same time as the shard was written counts as changed, as file
+// times only have the resolution of the filesystem or the kernel's
+// clock tick.
+static gchar **
+cdk_index_check_shard (const gchar *shard)
+{
+  GStatBuf st;
+  CdkIndexData data = { NULL };
+
+  if (g_stat (shard, &st) != 0 || ! cdk_index_data_load (&data, shard))
+    return NULL;
+
+  gchar **inputs = g_new0 (gchar *, data.header->n_files + 1);
+  for (guint i = 0; i < data.header->n_files; i++)
+    {
+      GStatBuf input_st;
+      inputs[i] = g_strdup (cdk_index_data_get_string (&data, data.files[i]));
+      if (g_stat (inputs[i], &input_st) != 0 ||
+          cdk_index_get_mtime (&input_st) >= cdk_index_get_mtime (&st))
+        {
+          g_strfreev (inputs);
+          inputs = NULL;
+          break;
+        }
+    }
+
+  cdk_index_data_clear (&data);
+
+  return inputs;
+}
+
+static void
+cdk_index_job_index (CdkIndexJob *job)
+{
+  CdkIndexUpdate *update = job->update;
+  CdkIndexUnit unit;
+
+  unit.update = update;
+  unit.cx_files = g_hash_table_new (g_direct_hash, g_direct_equal);
+  cdk_index_tables_init (&unit.tables);
+  // the main file at least, so it's indexed again once it changes
+  cdk_index_intern (unit.tables.file_ids, unit.tables.filenames, job->filename);
+
+  IndexerCallbacks callbacks;
+  memset (&callbacks, 0, sizeof (callbacks));
+  callbacks.abortQuery = (gpointer) cdk_index_abort_query;
+  callbacks.indexDeclaration = (gpointer) cdk_index_declaration;
+  callbacks.indexEntityReference = (gpointer) cdk_index_reference;
+
+  CXTranslationUnit tu = NULL;
+  gint argc = (job->argv != NULL) ? g_strv_length (job->argv) : 0;
+  gint error =
+    clang_indexSourceFile (update->action, &unit, &callbacks, sizeof (callbacks),
+                           CXIndexOpt_SuppressRedundantRefs |
+                           CXIndexOpt_SuppressWarnings,
+                           job->filename,
+                           (const gchar *const *) job->argv, argc,
+                           NULL, 0, &tu, CXTranslationUnit_Incomplete);
+  // whatever was indexed before an error is still good
+  if (error != CXError_Success)
+    g_debug ("failed to index '%s', error '%d'", job->filename, error);
+
+  if (tu != NULL)
+    {
+      clang_getInclusions (tu, (CXInclusionVisitor) cdk_index_collect_input, &unit);
+      clang_disposeTranslationUnit (tu);
+    }
+
+  // An aborted file is left for the next update
+  if (! g_atomic_int_get (&update->cancelled))
+    {
+      g_ptr_array_add (unit.tables.filenames, NULL);
+      job->inputs = g_strdupv ((gchar **) unit.tables.filenames->pdata);
+      g_ptr_array_set_size (unit.tables.filenames, unit.tables.filenames->len - 1);
+      if (! cdk_index_tables_write (&unit.tables, job->shard))
+        g_unlink (job->shard);
+    }
+
+  g_hash_table_destroy (unit.cx_files);
+  cdk_index_tables_clear (&unit.tables);
+}
+
+// Merges all of the shards into the index file, on the thread that ran
+// the last job
+static gboolean
+cdk_index_merge (CdkIndexUpdate *update)
+{
+  CdkIndexTables tables;
+  cdk_index_tables_init (&tables);
+
+  for (gchar **it = update->shards; *it != NULL; it++)
+    {
+      CdkIndexData shard = { NULL };
+      if (g_atomic_int_get (&update->cancelled))
+        break;
+      if (! cdk_index_data_load (&shard, *it))
+        continue;
+
+      // Only the files with entries make it into the index
+      guint32 *file_ids = g_new (guint32, shard.header->n_files);
+      for (guint i = 0; i < shard.header->n_files; i++)
+        file_ids[i] = G_MAXUINT32;
+
+      for (guint i = 0; i < shard.header->n_symbols; i++)
+        {
+          const CdkIndexSymbol *symbol = &shard.symbols[i];
+          guint32 usr_id =
+            cdk_index_intern (tables.usr_ids, tables.usrs,
+                              cdk_index_data_get_string (&shard, symbol->usr));
+          guint32 first = MIN (symbol->first, shard.header->n_entries);
+          guint32 last = first + MIN (symbol->n_entries, shard.header->n_entries - first);
+          for (guint32 j = first; j < last; j++)
+            {
+              CdkIndexBuildEntry entry;
+              entry.usr = usr_id;
+              entry.entry = shard.entries[j];
+              if (entry.entry.file >= shard.header->n_files)
+                continue;
+              if (file_ids[entry.entry.file] == G_MAXUINT32)
+                {
+                  const gchar *filename =
+                    cdk_index_data_get_string (&shard, shard.files[entry.entry.file]);
+                  file_ids[entry.entry.file] =
+                    cdk_index_intern (tables.file_ids, tables.filenames, filename);
+                }
+              entry.entry.file = file_ids[entry.entry.file];
+              g_array_append_val (tables.entries, entry);
+            }
+        }
+
+      g_free (file_ids);
+      cdk_index_data_clear (&shard);
+    }
+
+  gboolean written = FALSE;
+  if (! g_atomic_int_get (&update->cancelled))
+    written = cdk_index_tables_write (&tables, update->path);
+
+  cdk_index_tables_clear (&tables);
+
+  return written;
+}
+
+// Removes the shards of the main files the update leaves out, ie. files
+// removed from the project since they were indexed
+static void
+cdk_index_remove_stale_shards (CdkIndexUpdate *update)
+{
+  GDir *dir = g_dir_open (update->shard_dir, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  GHashTable *keep = g_hash_table_new (g_str_hash, g_str_equal);
+  for (gchar **it = update->shards; *it != NULL; it++)
+    g_hash_table_add (keep, *it);
+
+  const gchar *name;
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      if (! g_str_has_suffix (name, ".shard"))
+        continue;
+      gchar *path = g_build_filename (update->shard_dir, name, NULL);
+      if (! g_hash_table_contains (keep, path))
+        g_unlink (path);
+      g_free (path);
+    }
+
+  g_hash_table_destroy (keep);
+  g_dir_close (dir);
+}
+
+static gboolean cdk_index_update_done (CdkIndexUpdate *update);
+
+static void
+cdk_index_update_finish (CdkIndexUpdate *update)
+{
+  update->written = cdk_index_merge (update);
+  if (update->written)
+    cdk_index_remove_stale_shards (update);
+  // not to be touched past this, the main loop may have freed it already
+  g_idle_add ((GSourceFunc) cdk_index_update_done, update);
+}
+
+static void
+cdk_index_run_job (CdkIndexJob *job, CdkIndexUpdate *update)
+{
+  if (job->filename != NULL && ! g_atomic_int_get (&update->cancelled))
+    {
+      if (job->verify)
+        job->inputs = cdk_index_check_shard (job->shard);
+      if (job->inputs == NULL)
+        cdk_index_job_index (job);
+    }
+
+  if (g_atomic_int_dec_and_test (&update->n_pending))
+    cdk_index_update_finish (update);
+}
+
+// Open files first, in the order they were pushed otherwise
+static gint
+cdk_index_compare_jobs (const CdkIndexJob *a,
+                        const CdkIndexJob *b,
+                        G_GNUC_UNUSED gpointer unused)
+{
+  return (b->open - a->open);
+}
+
+static void
+cdk_index_job_free (CdkIndexJob *job)
+{
+  g_free (job->filename);
+  g_strfreev (job->argv);
+  g_free (job->shard);
+  g_strfreev (job->inputs);
+  g_slice_free (CdkIndexJob, job);
+}
+
+static void
+cdk_index_update_free (CdkIndexUpdate *update)
+{
+  // Queued jobs are dropped and the running ones abort
+  g_atomic_int_set (&update->cancelled, TRUE);
+  if (update->pool != NULL)
+    g_thread_pool_free (update->pool, TRUE, TRUE);
+
+  // The last thread may have queued the result before it stopped
+  g_idle_remove_by_data (update);
+
+  clang_IndexAction_dispose (update->action);
+  clang_disposeIndex (update->cx_index);
+
+  g_ptr_array_free (update->jobs, TRUE);
+  g_strfreev (update->shards);
+  g_free (update->path);
+  g_free (update->shard_dir);
+
+  g_slice_free (CdkIndexUpdate, update);
+}
+
+// Unlinks file from the reverse inclusion graph
+static void
+cdk_index_remove_inputs (CdkIndex *index, CdkIndexFile *file)
+{
+  for (gchar **it = file->inputs; it != NULL && *it != NULL; it++)
+    {
+      GHashTable *dependents = g_hash_table_lookup (index->dependents, *it);
+      if (dependents == NULL)
+        continue;
+      g_hash_table_remove (dependents, file);
+      if (g_hash_table_size (dependents) == 0)
+        g_hash_table_remove (index->dependents, *it);
+    }
+  g_strfreev (file->inputs);
+  file->inputs = NULL;
+}
+
+static void
+cdk_index_input_changed (G_GNUC_UNUSED GFileMonitor *monitor,
+                         GFile *changed,
+                         G_GNUC_UNUSED GFile *other_file,
+                         GFileMonitorEvent event,
+                         CdkIndex *index)
+{
+  if (event != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+      event != G_FILE_MONITOR_EVENT_CREATED &&
+      event != G_FILE_MONITOR_EVENT_DELETED)
+    {
+      return;
+    }
+
+  gchar *path = g_file_get_path (changed);
+  GHashTable *dependents = NULL;
+  if (path != NULL)
+    dependents = g_hash_table_lookup (index->dependents, path);
+  g_free (path);
+  if (dependents == NULL)
+    return;
+
+  GHashTableIter iter;
+  CdkIndexFile *file = NULL;
+  g_hash_table_iter_init (&iter, dependents);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &file, NULL))
+    {
+      file->dirty = TRUE;
+      file->verify = FALSE;
+    }
+
+  if (index->update_hnd != 0)
+    g_source_remove (index->update_hnd);
+  index->update_hnd = g_timeout_add (CDK_INDEX_UPDATE_DELAY,
+                                     (GSourceFunc) cdk_index_start_update, index);
+}
+
+// Links file into the reverse inclusion graph, taking inputs, and
+// watches the directories of its inputs
+static void
+cdk_index_set_inputs (CdkIndex *index, CdkIndexFile *file, gchar **inputs)
+{
+  cdk_index_remove_inputs (index, file);
+  file->inputs = inputs;
+
+  for (gchar **it = file->inputs; it != NULL && *it != NULL; it++)
+    {
+      GHashTable *dependents = g_hash_table_lookup (index->dependents, *it);
+      if (dependents == NULL)
+        {
+          dependents = g_hash_table_new (g_direct_hash, g_direct_equal);
+          g_hash_table_insert (index->dependents, g_strdup (*it), dependents);
+        }
+      g_hash_table_add (dependents, file);
+
+      // One monitor per directory rather than per file
+      gchar *dir = g_path_get_dirname (*it);
+      if (! g_hash_table_contains (index->monitors, dir))
+        {
+          GFile *gfile = g_file_new_for_path (dir);
+          GFileMonitor *monitor =
+            g_file_monitor_directory (gfile, G_FILE_MONITOR_NONE, NULL, NULL);
+          if (monitor != NULL)
+            {
+              g_signal_connect (monitor, "changed",
+                                G_CALLBACK (cdk_index_input_changed), index);
+              g_hash_table_insert (index->monitors, g_strdup (dir), monitor);
+            }
+          g_object_unref (gfile);
+        }
+      g_free (dir);
+    }
+}
+
+static gboolean
+cdk_index_update_done (CdkIndexUpdate *update)
+{
+  CdkIndex *index = update->index;
+
+  index->update = NULL;
+
+  // The jobs are only safe to look at once the threads are gone
+  g_thread_pool_free (update->pool, FALSE, TRUE);
+  update->pool = NULL;
+
+  for (guint i = 0; i < update->jobs->len; i++)
+    {
+      CdkIndexJob *job = update->jobs->pdata[i];
+      CdkIndexFile *file = NULL;
+      if (job->filename != NULL)
+        file = g_hash_table_lookup (index->files, job->filename);
+      if (file == NULL)
+        continue;
+      if (job->inputs != NULL)
+        {
+          cdk_index_set_inputs (index, file, job->inputs);
+          job->inputs = NULL;
+        }
+      else
+        file->dirty = TRUE;
+    }
+
+  if (update->written)
+    {
+      index->stale = FALSE;
+      cdk_index_data_load (&index->data, index->path);
+    }
+
+  cdk_index_update_free (update);
+
+  if (index->func != NULL)
+    index->func (index, index->user_data);
+
+  // Changes that came in meanwhile
+  if (index->update_hnd == 0)
+    cdk_index_start_update (index);
+
+  return FALSE;
+}
+
+static gboolean
+cdk_index_start_update (CdkIndex *index)
+{
+  index->update_hnd = 0;
+
+  // The dirty files are picked up once it's done
+  if (index->update != NULL)
+    return FALSE;
+
+  GPtrArray *jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) cdk_index_job_free);
+  GPtrArray *shards = g_ptr_array_new ();
+  GHashTableIter iter;
+  CdkIndexFile *file = NULL;
+
+  g_hash_table_iter_init (&iter, index->files);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &file))
+    {
+      g_ptr_array_add (shards, g_strdup (file->shard));
+      if (! file->dirty)
+        continue;
+
+      CdkIndexJob *job = g_slice_new0 (CdkIndexJob);
+      job->filename = g_strdup (file->filename);
+      job->argv = g_strdupv (file->argv);
+      job->shard = g_strdup (file->shard);
+      job->verify = file->verify;
+      job->open = g_hash_table_contains (index->open_files, file->filename);
+      g_ptr_array_add (jobs, job);
+
+      file->dirty = FALSE;
+      file->verify = FALSE;
+    }
+  g_ptr_array_add (shards, NULL);
+
+  if (jobs->len == 0 && ! index->stale)
+    {
+      g_ptr_array_free (jobs, TRUE);
+      g_strfreev ((gchar **) g_ptr_array_free (shards, FALSE));
+      return FALSE;
+    }
+
+  // Nothing to index, only files to leave out, so just the merge
+  if (jobs->len == 0)
+    g_ptr_array_add (jobs, g_slice_new0 (CdkIndexJob));
+
+  CdkIndexUpdate *update = g_slice_new0 (CdkIndexUpdate);
+  update->index = index;
+  update->jobs = jobs;
+  update->shards = (gchar **) g_ptr_array_free (shards, FALSE);
+  update->path = g_strdup (index->path);
+  update->shard_dir = g_strdup (index->shard_dir);
+  update->n_pending = jobs->len;
+  update->cx_index = clang_createIndex (TRUE, FALSE);
+  update->action = clang_IndexAction_create (update->cx_index);
+  index->update = update;
+
+  GError *error = NULL;
+  update->pool = g_thread_pool_new ((GFunc) cdk_index_run_job, update,
+                                    index->n_threads, FALSE, &error);
+  if (update->pool == NULL)
+    {
+      g_critical ("failed to create indexing threads: %s", error->message);
+      g_error_free (error);
+      index->update = NULL;
+      cdk_index_update_free (update);
+      return FALSE;
+    }
+
+  g_thread_pool_set_sort_function (update->pool,
+                                   (GCompareDataFunc) cdk_index_compare_jobs, NULL);
+  for (guint i = 0; i < jobs->len; i++)
+    {
+      CdkIndexJob *job = jobs->pdata[i];
+      job->update = update;
+      g_thread_pool_push (update->pool, job, NULL);
+    }
+
+  return FALSE;
+}
+
+static gchar *
+cdk_index_get_shard_path (CdkIndex *index,
+                          const gchar *filename,
+                          gchar **argv)
+{
+  GChecksum *sum = g_checksum_new (G_CHECKSUM_SHA1);
+
+  // the terminators keep the fields from running into each other
+  g_checksum_update (sum, (const guchar *) filename, strlen (filename) + 1);
+  for (gchar **it = argv; it != NULL && *it != NULL; it++)
+    g_checksum_update (sum, (const guchar *) *it, strlen (*it) + 1);
+  g_checksum_update (sum, (const guchar *) "", 1);
+  g_checksum_update (sum, (const guchar *) index->clang_version,
+                     strlen (index->clang_version) + 1);
+
+  gchar *name = g_strconcat (g_checksum_get_string (sum), ".shard", NULL);
+  gchar *path = g_build_filename (index->shard_dir, name, NULL);
+  g_free (name);
+  g_checksum_free (sum);
+
+  return path;
+}
+
+// Cancels the update in progress and forgets the main files
+static void
+cdk_index_stop (CdkIndex *index)
+{
+  if (index->update_hnd != 0)
+    g_source_remove (index->update_hnd);
+  index->update_hnd = 0;
+
+  if (index->update != NULL)
+    cdk_index_update_free (index->update);
+  index->update = NULL;
+
+  g_hash_table_remove_all (index->monitors);
+  g_hash_table_remove_all (index->dependents);
+  g_hash_table_remove_all (index->files);
+}
+
+/*
+ * Sets the main files to index, an array of CdkIndexSource which is
+ * taken. Those whose shard is out of date are indexed in the background
+ * on up to n_threads threads. From then on the files they're made of
+ * are watched and the main files depending on a file that changed are
+ * indexed again. An update in progress is cancelled. After each update
+ * the new index is loaded and func is called on the main loop.
+ */
+void
+cdk_index_set_sources (CdkIndex *index,
+                       GArray *sources,
+                       guint n_threads,
+                       CdkIndexFunc func,
+                       gpointer user_data)
+{
+  g_return_if_fail (index != NULL);
+  g_return_if_fail (sources != NULL);
+
+  cdk_index_stop (index);
+
+  index->n_threads = MAX (n_threads, 1);
+  index->func = func;
+  index->user_data = user_data;
+  // the set of files may have shrunk
+  index->stale = TRUE;
+
+  for (guint i = 0; i < sources->len; i++)
+    {
+      CdkIndexSource *source = &g_array_index (sources, CdkIndexSource, i);
+      if (g_hash_table_contains (index->files, source->filename))
+        continue;
+
+      CdkIndexFile *file = g_slice_new0 (CdkIndexFile);
+      file->filename = g_strdup (source->filename);
+      file->argv = g_strdupv (source->argv);
+      file->shard = cdk_index_get_shard_path (index, file->filename, file->argv);
+      file->dirty = TRUE;
+      file->verify = TRUE;
+      g_hash_table_insert (index->files, file->filename, file);
+    }
+
+  g_array_set_clear_func (sources, (GDestroyNotify) cdk_index_source_clear);
+  g_array_unref (sources);
+
+  cdk_index_start_update (index);
+}
+
+/*
+ * Tells the index whether a main file is open in the editor, the open
+ * ones are indexed before the others.
+ */
+void
+cdk_index_set_file_open (CdkIndex *index, const gchar *filename, gboolean open)
+{
+  g_return_if_fail (index != NULL);
+  g_return_if_fail (filename != NULL);
+
+  if (open)
+    g_hash_table_add (index->open_files, g_strdup (filename));
+  else
+    g_hash_table_remove (index->open_files, filename);
+}
+
+/*
+ * Whether an update is in progress or waiting to start.
+ */
+gboolean
+cdk_index_is_building (CdkIndex *index)
+{
+  g_return_val_if_fail (index != NULL, FALSE);
+  return (index->update != NULL || index->update_hnd != 0);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifndef CDK_INDEX_H_
+#define CDK_INDEX_H_ 1
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct CdkIndex_ CdkIndex;
+
+typedef void (*CdkIndexFunc) (CdkIndex *index, gpointer user_data);
+
+typedef enum
+{
+  CDK_INDEX_DECLARATION = 1 << 0,
+  CDK_INDEX_DEFINITION  = 1 << 1,
+  CDK_INDEX_REFERENCE   = 1 << 2,
+  CDK_INDEX_ALL         = 0x7,
+}
+CdkIndexKind;
+
+// A main file to index and the compiler arguments to index it with
+typedef struct
+{
+  gchar  *filename;
+  gchar **argv;
+}
+CdkIndexSource;
+
+// Where a symbol occurs, filename points into the loaded index
+typedef struct
+{
+  const gchar  *filename;
+  guint         line;   // 1-based
+  guint         column; // 1-based
+  CdkIndexKind  kind;
+}
+CdkIndexLocation;
+
+CdkIndex *cdk_index_new (const gchar *path);
+void cdk_index_free (CdkIndex *index);
+const gchar *cdk_index_get_path (CdkIndex *index);
+gboolean cdk_index_is_loaded (CdkIndex *index);
+guint cdk_index_get_n_symbols (CdkIndex *index);
+const gchar *cdk_index_get_symbol (CdkIndex *index, guint n);
+
+void cdk_index_set_sources (CdkIndex *index,
+                            GArray *sources,
+                            guint n_threads,
+                            CdkIndexFunc func,
+                            gpointer user_data);
+void cdk_index_set_file_open (CdkIndex *index,
+                              const gchar *filename,
+                              gboolean open);
+gboolean cdk_index_is_building (CdkIndex *index);
+
+GArray *cdk_index_lookup (CdkIndex *index, const gchar *usr, guint kinds);
+
+void cdk_index_source_clear (CdkIndexSource *source);
+
+G_END_DECLS
+
+#endif /* CDK_INDEX_H_ */
@@ -0,0 +1,959 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <cdk/cdkparser.h>
+#include <cdk/cdkutils.h>
+#include <cdk/cdkworker.h>
+#include <clang-c/Index.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Jobs run on the threads of the parser's slots, each slot running its
+ * jobs one at a time in the order they were pushed, and the jobs of a
+ * main file always going to the same slot. Each slot has an index of
+ * its own. Normally there's a single slot doing all of the libclang
+ * work in-process.
+ *
+ * Out of process each slot has a worker process (see cdkworker.c)
+ * doing the libclang work for the files assigned to it. The process
+ * owns the TU, reparses it and loads it from and saves it to the cache.
+ * The job only gets the results of it (see cdkresults.c), which are
+ * all the main thread needs but for tooltips and completion, the
+ * latter being done by the process too.
+ *
+ * In-process a reparse is done on a spare TU the document keeps next to
+ * the one in use, so the latter stays usable until the result arrives.
+ * Without a spare, eg. for the first reparse, the TU is parsed anew.
+ */
+
+typedef struct
+{
+  CdkParser   *parser;  // the parser the slot belongs to
+  GThreadPool *pool;    // the thread running the slot's jobs
+  CXIndex      index;   // libclang index for the slot's TUs, only used by its thread
+  CdkWorker   *worker;  // process doing the libclang work, NULL to do it in-process
+  guint        n_files; // number of main files assigned to the slot
+}
+CdkParserSlot;
+
+struct CdkParser_
+{
+  CdkCache      *cache;        // on-disk TU cache or NULL, only used by the slots
+  CdkParserSlot *slots;        // where the jobs are run
+  guint          n_slots;      // number of slots, at least 1
+  GHashTable    *assigned;     // maps a main file to its slot's index + 1, main thread only
+  GAsyncQueue   *results;      // finished jobs waiting for the main loop
+  GMutex         lock;         // protects dispatch_hnd and shutdown
+  guint          dispatch_hnd; // idle handler delivering the results
+  gboolean       shutdown;     // whether the parser is being freed
+};
+
+static void cdk_parser_run_job (CdkParseJob *job, CdkParserSlot *slot);
+
+/*
+ * The cache is borrowed and must outlive the parser. Jobs for different
+ * main files are run on up to n_slots threads in parallel, each with a
+ * worker process of its own if out_of_process.
+ */
+CdkParser *
+cdk_parser_new (CdkCache *cache, guint n_slots, gboolean out_of_process)
+{
+  CdkParser *parser = g_slice_new0 (CdkParser);
+  GError *error = NULL;
+
+  if (out_of_process && ! cdk_worker_is_available ())
+    {
+      g_warning ("worker process not found, parsing in-process");
+      out_of_process = FALSE;
+    }
+
+  g_mutex_init (&parser->lock);
+  parser->cache = cache;
+  parser->results = g_async_queue_new ();
+  parser->assigned = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  parser->n_slots = MAX (n_slots, 1);
+  parser->slots = g_new0 (CdkParserSlot, parser->n_slots);
+
+  for (guint i = 0; i < parser->n_slots; i++)
+    {
+      CdkParserSlot *slot = &parser->slots[i];
+
+      slot->parser = parser;
+      slot->index = clang_createIndex (TRUE, TRUE);
+
+      if (out_of_process)
+        slot->worker = cdk_worker_new ();
+
+      // A single thread owns the slot's index so its jobs never run concurrently
+      slot->pool = g_thread_pool_new ((GFunc) cdk_parser_run_job, slot,
+                                      1, FALSE, &error);
+      if (slot->pool == NULL)
+        {
+          g_critical ("failed to create parser thread, parsing on main thread: %s",
+                      error->message);
+          g_clear_error (&error);
+        }
+    }
+
+  return parser;
+}
+
+void
+cdk_parser_free (CdkParser *parser)
+{
+  if (G_UNLIKELY (parser == NULL))
+    return;
+
+  // Queued jobs are skipped by the worker, a running one is waited for
+  g_mutex_lock (&parser->lock);
+  parser->shutdown = TRUE;
+  g_mutex_unlock (&parser->lock);
+
+  for (guint i = 0; i < parser->n_slots; i++)
+    {
+      if (parser->slots[i].pool != NULL)
+        g_thread_pool_free (parser->slots[i].pool, FALSE, TRUE);
+    }
+
+  if (parser->dispatch_hnd != 0)
+    g_source_remove (parser->dispatch_hnd);
+  parser->dispatch_hnd = 0;
+
+  // Undelivered results still own their TUs which must be disposed
+  // before the indexes
+  CdkParseJob *job;
+  while ((job = g_async_queue_try_pop (parser->results)) != NULL)
+    cdk_parse_job_free (job);
+  g_async_queue_unref (parser->results);
+
+  for (guint i = 0; i < parser->n_slots; i++)
+    {
+      cdk_worker_free (parser->slots[i].worker);
+      clang_disposeIndex (parser->slots[i].index);
+    }
+  g_free (parser->slots);
+  g_hash_table_destroy (parser->assigned);
+  g_mutex_clear (&parser->lock);
+
+  g_slice_free (CdkParser, parser);
+}
+
+/*
+ * Whether the jobs are run by worker processes.
+ */
+gboolean
+cdk_parser_is_out_of_process (CdkParser *parser)
+{
+  g_return_val_if_fail (parser != NULL, FALSE);
+  return (parser->slots[0].worker != NULL);
+}
+
+static gboolean
+cdk_parser_dispatch (CdkParser *parser)
+{
+  g_mutex_lock (&parser->lock);
+  parser->dispatch_hnd = 0;
+  g_mutex_unlock (&parser->lock);
+
+  CdkParseJob *job;
+  while ((job = g_async_queue_try_pop (parser->results)) != NULL)
+    {
+      if (job->func != NULL)
+        job->func (parser, job, job->user_data);
+      cdk_parse_job_free (job);
+    }
+
+  return FALSE;
+}
+
+// The main file's snapshot followed by the overlay, free with g_free()
+static struct CXUnsavedFile *
+cdk_parse_job_get_unsaved (CdkParseJob *job, guint *n_usf)
+{
+  guint n_overlay = (job->overlay != NULL) ? job->overlay->len : 0;
+  struct CXUnsavedFile *usf = g_new0 (struct CXUnsavedFile, n_overlay + 1);
+  gsize length = 0;
+
+  *n_usf = 0;
+
+  if (job->contents != NULL)
+    {
+      usf[*n_usf].Filename = job->filename;
+      usf[*n_usf].Contents = g_bytes_get_data (job->contents, &length);
+      usf[*n_usf].Length = length;
+      (*n_usf)++;
+    }
+
+  for (guint i = 0; i < n_overlay; i++)
+    {
+      const CdkUnsavedFile *file = &g_array_index (job->overlay, CdkUnsavedFile, i);
+      if (g_strcmp0 (file->filename, job->filename) == 0)
+        continue;
+      usf[*n_usf].Filename = file->filename;
+      usf[*n_usf].Contents = g_bytes_get_data (file->contents, &length);
+      usf[*n_usf].Length = length;
+      (*n_usf)++;
+    }
+
+  return usf;
+}
+
+static gboolean
+cdk_parse_job_is_overlaid (CdkParseJob *job, const gchar *filename)
+{
+  if (job->overlay == NULL)
+    return FALSE;
+
+  for (guint i = 0; i < job->overlay->len; i++)
+    {
+      if (g_strcmp0 (g_array_index (job->overlay, CdkUnsavedFile, i).filename, filename) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+cdk_file_stamp_clear (CdkFileStamp *stamp)
+{
+  g_free (stamp->filename);
+}
+
+/*
+ * The nanoseconds part of the modification time in st, which
+ * clang_getFileTime() leaves out.
+ */
+gint64
+cdk_file_stamp_get_mtime_nsec (const GStatBuf *st)
+{
+#if defined (__APPLE__)
+  return st->st_mtimespec.tv_nsec;
+#else
+  return st->st_mtim.tv_nsec;
+#endif
+}
+
+// Adds filename to the files the job's TU depends on, mtime being its
+// modification time in seconds as libclang saw it
+static void
+cdk_parse_job_add_depend (const gchar *filename,
+                          gboolean is_main,
+                          gint64 mtime,
+                          CdkParseJob *job)
+{
+  // The buffer revision covers a main file parsed from a snapshot
+  if (is_main && job->contents != NULL)
+    return;
+
+  // Canonical so it can be matched with the documents' paths
+  CdkFileStamp stamp;
+  stamp.filename = cdk_abspath (filename);
+  if (stamp.filename == NULL)
+    stamp.filename = g_strdup (filename);
+  stamp.mtime_nsec = -1;
+  if (cdk_parse_job_is_overlaid (job, stamp.filename))
+    stamp.mtime = -1;
+  else
+    {
+      // libclang only has whole seconds. The rest comes from the file,
+      // unless it was modified in or after the second the job started,
+      // as then it may have changed again since it was read without
+      // the seconds telling, which leaves the TU looking out of date.
+      GStatBuf st;
+      stamp.mtime = mtime;
+      if (g_stat (stamp.filename, &st) == 0 && (gint64) st.st_mtime == stamp.mtime &&
+          stamp.mtime < job->started_at / G_USEC_PER_SEC)
+        {
+          stamp.mtime_nsec = cdk_file_stamp_get_mtime_nsec (&st);
+        }
+    }
+  g_array_append_val (job->depends, stamp);
+}
+
+static void
+cdk_parser_collect_depend (CXFile included_file,
+                           G_GNUC_UNUSED CXSourceLocation *stack,
+                           unsigned stack_len,
+                           CdkParseJob *job)
+{
+  // System headers are only expected to change along with the PCH
+  if (stack_len > 0 &&
+      clang_Location_isInSystemHeader (clang_getLocationForOffset (job->tu, included_file, 0)))
+    return;
+
+  CXString name = clang_getFileName (included_file);
+  cdk_parse_job_add_depend (clang_getCString (name), (stack_len == 0),
+                            (gint64) clang_getFileTime (included_file), job);
+  clang_disposeString (name);
+}
+
+static GArray *
+cdk_file_stamp_list_new (void)
+{
+  GArray *depends = g_array_new (FALSE, FALSE, sizeof (CdkFileStamp));
+  g_array_set_clear_func (depends, (GDestroyNotify) cdk_file_stamp_clear);
+  return depends;
+}
+
+// Records the files job->tu was built from, so the plugin can tell
+// whether a reparse would change anything without doing one
+static void
+cdk_parser_collect_depends (CdkParseJob *job)
+{
+  job->depends = cdk_file_stamp_list_new ();
+  clang_getInclusions (job->tu, (CXInclusionVisitor) cdk_parser_collect_depend, job);
+}
+
+// Whether the job was cancelled since it started, in which case the
+// stages left are skipped and it's delivered with discarded set
+static gboolean
+cdk_parser_is_job_cancelled (CdkParseJob *job)
+{
+  if (! g_atomic_int_get (&job->cancelled))
+    return FALSE;
+  job->discarded = TRUE;
+  return TRUE;
+}
+
+static void
+cdk_parser_parse (CdkParserSlot *slot, CdkParseJob *job)
+{
+  CdkCache *cache = slot->parser->cache;
+  CXTranslationUnit tu = NULL;
+  gint argc = (job->argv != NULL) ? g_strv_length (job->argv) : 0;
+  // The cache only knows about the main file's unsaved contents
+  gboolean use_cache = (cache != NULL && job->cache_key != NULL &&
+                        job->overlay == NULL);
+
+  job->from_cache = FALSE;
+
+  // The document's previous TU, no longer of use
+  if (job->tu != NULL)
+    {
+      clang_disposeTranslationUnit (job->tu);
+      job->tu = NULL;
+    }
+
+  // A fresh TU replaces one that can't be reparsed or complete, such as
+  // one from the cache, so skip the cache and start from scratch
+  if (use_cache && ! job->fresh)
+    {
+      job->tu = cdk_cache_load (cache, slot->index, job->cache_key,
+                                job->filename, job->contents);
+      if (job->tu != NULL)
+        {
+          job->from_cache = TRUE;
+          job->error = CXError_Success;
+          cdk_parser_collect_depends (job);
+          return;
+        }
+    }
+
+  guint n_usf = 0;
+  struct CXUnsavedFile *usf = cdk_parse_job_get_unsaved (job, &n_usf);
+
+  job->error =
+    clang_parseTranslationUnit2 (slot->index,
+                                 job->filename,
+                                 (const gchar *const *) job->argv, argc,
+                                 n_usf ? usf : NULL, n_usf,
+                                 CDK_RESULTS_PARSE_OPTIONS,
+                                 &tu);
+  g_free (usf);
+
+  if (job->error != CXError_Success && tu != NULL)
+    {
+      clang_disposeTranslationUnit (tu);
+      tu = NULL;
+    }
+  else if (job->error == CXError_Success && tu == NULL)
+    job->error = CXError_Failure;
+
+  job->tu = tu;
+
+  if (tu == NULL || cdk_parser_is_job_cancelled (job))
+    return;
+
+  if (use_cache)
+    cdk_cache_save (cache, tu, job->cache_key, job->filename, job->contents);
+
+  if (! cdk_parser_is_job_cancelled (job))
+    cdk_parser_collect_depends (job);
+}
+
+static void
+cdk_parser_reparse (CdkParserSlot *slot, CdkParseJob *job)
+{
+  CdkCache *cache = slot->parser->cache;
+
+  // No spare TU to reparse yet, the document keeps using its current
+  // one meanwhile
+  if (job->tu == NULL)
+    {
+      job->fresh = TRUE;
+      cdk_parser_parse (slot, job);
+      return;
+    }
+
+  guint n_usf = 0;
+  struct CXUnsavedFile *usf = cdk_parse_job_get_unsaved (job, &n_usf);
+
+  job->error =
+    clang_reparseTranslationUnit (job->tu,
+                                  n_usf, n_usf ? usf : NULL,
+                                  clang_defaultReparseOptions (job->tu));
+  g_free (usf);
+
+  // After a failed reparse the TU is only good for disposing
+  if (job->error != CXError_Success)
+    {
+      clang_disposeTranslationUnit (job->tu);
+      job->tu = NULL;
+      return;
+    }
+
+  // A cancelled one still makes a good spare
+  if (cdk_parser_is_job_cancelled (job))
+    return;
+
+  // Only a TU matching the file on disk is worth keeping, ie. after a save
+  if (job->contents == NULL && job->overlay == NULL &&
+      cache != NULL && job->cache_key != NULL)
+    cdk_cache_save (cache, job->tu, job->cache_key, job->filename, NULL);
+
+  if (! cdk_parser_is_job_cancelled (job))
+    cdk_parser_collect_depends (job);
+}
+
+// The process keeps its own TU, reparses it and deals with the cache,
+// the job only gets its results and the files it was built from
+static void
+cdk_parser_parse_out_of_process (CdkParserSlot *slot, CdkParseJob *job)
+{
+  CdkCache *cache = slot->parser->cache;
+  gboolean use_cache = (cache != NULL && job->cache_key != NULL &&
+                        job->overlay == NULL);
+  // A warm-up only fills the cache
+  gboolean collect = (job->kind != CDK_PARSE_JOB_WARM_UP);
+  guint cache_flags = 0;
+
+  // Same as in-process, a reparsed TU is only saved if it matches the
+  // file on disk
+  if (use_cache && job->kind != CDK_PARSE_JOB_REPARSE && ! job->fresh)
+    cache_flags |= CDK_WORKER_CACHE_LOAD;
+  if (use_cache && (job->kind != CDK_PARSE_JOB_REPARSE || job->contents == NULL))
+    cache_flags |= CDK_WORKER_CACHE_SAVE;
+
+  guint n_usf = 0;
+  struct CXUnsavedFile *usf = cdk_parse_job_get_unsaved (job, &n_usf);
+
+  if (collect)
+    job->depends = cdk_file_stamp_list_new ();
+  job->error =
+    cdk_worker_parse (slot->worker, job->filename, job->argv,
+                      (job->kind == CDK_PARSE_JOB_PARSE),
+                      usf, n_usf,
+                      use_cache ? cdk_cache_get_dir (cache) : NULL,
+                      job->cache_key, cache_flags, &job->from_cache,
+                      collect ? &job->results : NULL,
+                      (CdkWorkerInclusionFunc) cdk_parse_job_add_depend, job);
+  g_free (usf);
+
+  // Killed if it was cancelled, its TUs are gone with it
+  if (job->error != CXError_Success)
+    {
+      cdk_parser_is_job_cancelled (job);
+      cdk_results_clear (&job->results);
+      if (job->depends != NULL)
+        g_array_unref (job->depends);
+      job->depends = NULL;
+      return;
+    }
+
+  // Cancelled while it ran, the results are out of date
+  cdk_parser_is_job_cancelled (job);
+}
+
+/*
+ * Writes a prefix header to filename including the system headers
+ * (#include <...>) used by at least half of the sources, in the order
+ * they were first seen.
+ */
+static gboolean
+cdk_parser_write_prefix_header (const gchar *filename,
+                                gchar **sources)
+{
+  GRegex *regex =
+    g_regex_new ("^[ \\t]*#[ \\t]*include[ \\t]*<([^>]+)>",
+                 G_REGEX_MULTILINE | G_REGEX_OPTIMIZE, 0, NULL);
+  GPtrArray *headers = g_ptr_array_new_with_free_func (g_free); // owns the names
+  GHashTable *counts = g_hash_table_new (g_str_hash, g_str_equal);
+  guint n_sources = 0;
+
+  for (gchar **it = sources; *it != NULL; it++)
+    {
+      gchar *contents = NULL;
+      if (! g_file_get_contents (*it, &contents, NULL, NULL))
+        continue;
+      n_sources++;
+
+      GHashTable *seen = g_hash_table_new (g_str_hash, g_str_equal);
+      GMatchInfo *info = NULL;
+      g_regex_match (regex, contents, 0, &info);
+      while (g_match_info_matches (info))
+        {
+          gchar *header = g_match_info_fetch (info, 1);
+          if (! g_hash_table_contains (seen, header))
+            {
+              gpointer key = NULL, count = NULL;
+              if (! g_hash_table_lookup_extended (counts, header, &key, &count))
+                {
+                  key = g_strdup (header);
+                  g_ptr_array_add (headers, key);
+                }
+              g_hash_table_insert (counts, key,
+                                   GUINT_TO_POINTER (GPOINTER_TO_UINT (count) + 1));
+              g_hash_table_add (seen, key);
+            }
+          g_free (header);
+          g_match_info_next (info, NULL);
+        }
+      g_match_info_free (info);
+      g_hash_table_destroy (seen);
+      g_free (contents);
+    }
+
+  GString *prefix = g_string_new ("// Generated by CDK, do not edit\n");
+  guint n_headers = 0;
+  for (guint i = 0; i < headers->len; i++)
+    {
+      const gchar *header = headers->pdata[i];
+      guint count = GPOINTER_TO_UINT (g_hash_table_lookup (counts, header));
+      if (count * 2 >= n_sources && (count > 1 || n_sources == 1))
+        {
+          g_string_append_printf (prefix, "#include <%s>\n", header);
+          n_headers++;
+        }
+    }
+
+  gboolean written = (n_headers > 0 &&
+                      g_file_set_contents (filename, prefix->str, prefix->len, NULL));
+
+  g_string_free (prefix, TRUE);
+  g_hash_table_destroy (counts);
+  g_ptr_array_free (headers, TRUE);
+  g_regex_unref (regex);
+
+  return written;
+}
+
+static void
+cdk_parser_collect_pch_include (CXFile included_file,
+                                CXSourceLocation *stack,
+                                unsigned stack_len,
+                                GPtrArray *includes)
+{
+  // Headers included by the prefix plus any non-system ones below them,
+  // watching every STL header isn't worth it
+  if (stack_len == 0 ||
+      (stack_len > 1 && clang_Location_isInSystemHeader (stack[0])))
+    return;
+
+  CXString name = clang_getFileName (included_file);
+  g_ptr_array_add (includes, g_strdup (clang_getCString (name)));
+  clang_disposeString (name);
+}
+
+// Moves the PCH built at tmp_output to a name made from job->output and
+// a hash of its contents, and points job->output there. A rebuild never
+// overwrites a PCH TUs are still using that way, the plugin removes the
+// old one once none is left.
+static void
+cdk_parser_version_pch (CdkParseJob *job, const gchar *tmp_output)
+{
+  GMappedFile *map = g_mapped_file_new (tmp_output, FALSE, NULL);
+  if (map == NULL)
+    {
+      g_unlink (tmp_output);
+      job->error = CXError_Failure;
+      return;
+    }
+
+  gchar *hash =
+    g_compute_checksum_for_data (G_CHECKSUM_SHA1,
+                                 (const guchar *) g_mapped_file_get_contents (map),
+                                 g_mapped_file_get_length (map));
+  g_mapped_file_unref (map);
+
+  gsize base_len = strlen (job->output);
+  if (g_str_has_suffix (job->output, ".pch"))
+    base_len -= strlen (".pch");
+  gchar *output = g_strdup_printf ("%.*s-%.16s.pch", (gint) base_len, job->output, hash);
+  g_free (hash);
+
+  // The same PCH as before, keep the file TUs already use
+  if (g_file_test (output, G_FILE_TEST_IS_REGULAR))
+    g_unlink (tmp_output);
+  else if (g_rename (tmp_output, output) != 0)
+    {
+      g_unlink (tmp_output);
+      g_free (output);
+      job->error = CXError_Failure;
+      return;
+    }
+
+  g_free (job->output);
+  job->output = output;
+}
+
+static void
+cdk_parser_build_pch (CdkParserSlot *slot, CdkParseJob *job)
+{
+  CXTranslationUnit tu = NULL;
+  gint argc = (job->argv != NULL) ? g_strv_length (job->argv) : 0;
+
+  job->error = CXError_Failure;
+
+  if (job->sources != NULL &&
+      ! cdk_parser_write_prefix_header (job->filename, job->sources))
+    return;
+
+  // Built under a temporary name, then named after its contents
+  gchar *tmp_output = g_strconcat (job->output, ".tmp", NULL);
+
+  if (slot->worker != NULL)
+    {
+      job->error = cdk_worker_build_pch (slot->worker, job->filename, job->argv,
+                                         tmp_output, &job->includes);
+      if (job->error == CXError_Success)
+        cdk_parser_version_pch (job, tmp_output);
+      g_free (tmp_output);
+      return;
+    }
+
+  job->error =
+    clang_parseTranslationUnit2 (slot->index,
+                                 job->filename,
+                                 (const gchar *const *) job->argv, argc,
+                                 NULL, 0,
+                                 CXTranslationUnit_ForSerialization |
+                                 CXTranslationUnit_Incomplete,
+                                 &tu);
+  if (job->error != CXError_Success)
+    {
+      if (tu != NULL)
+        clang_disposeTranslationUnit (tu);
+      g_free (tmp_output);
+      return;
+    }
+
+  GPtrArray *includes = g_ptr_array_new ();
+  g_ptr_array_add (includes, g_strdup (job->filename));
+  clang_getInclusions (tu, (CXInclusionVisitor) cdk_parser_collect_pch_include, includes);
+  g_ptr_array_add (includes, NULL);
+  job->includes = (gchar **) g_ptr_array_free (includes, FALSE);
+
+  if (clang_saveTranslationUnit (tu, tmp_output, clang_defaultSaveOptions (tu)) != CXSaveError_None)
+    {
+      g_unlink (tmp_output);
+      job->error = CXError_Failure;
+    }
+  else
+    cdk_parser_version_pch (job, tmp_output);
+  g_free (tmp_output);
+
+  clang_disposeTranslationUnit (tu);
+}
+
+// Saves the TU to the cache if there's a key for it, then gets rid of
+// it along with the worker process' TU of the file
+static void
+cdk_parser_dispose (CdkParserSlot *slot, CdkParseJob *job)
+{
+  CdkCache *cache = slot->parser->cache;
+
+  // Out of process only a TU matching the file on disk can be saved, as
+  // the contents don't go along
+  if (slot->worker != NULL)
+    {
+      gboolean save = (cache != NULL && job->cache_key != NULL && job->contents == NULL);
+      cdk_worker_dispose (slot->worker, job->filename,
+                          save ? cdk_cache_get_dir (cache) : NULL,
+                          save ? job->cache_key : NULL);
+    }
+
+  if (job->tu == NULL)
+    return;
+
+  if (cache != NULL && job->cache_key != NULL)
+    cdk_cache_save (cache, job->tu, job->cache_key, job->filename, job->contents);
+
+  clang_disposeTranslationUnit (job->tu);
+  job->tu = NULL;
+}
+
+// Makes sure the cache has an entry for the file as it is on disk,
+// without keeping the TU around
+static void
+cdk_parser_warm_up (CdkParserSlot *slot, CdkParseJob *job)
+{
+  CdkCache *cache = slot->parser->cache;
+
+  if (cache == NULL || job->cache_key == NULL)
+    {
+      job->error = CXError_InvalidArguments;
+      return;
+    }
+
+  if (cdk_cache_is_fresh (cache, job->cache_key, job->filename))
+    return;
+
+  if (slot->worker != NULL)
+    {
+      cdk_parser_parse_out_of_process (slot, job);
+      cdk_worker_dispose (slot->worker, job->filename, NULL, NULL);
+    }
+  else
+    cdk_parser_parse (slot, job);
+
+  if (job->tu != NULL)
+    {
+      clang_disposeTranslationUnit (job->tu);
+      job->tu = NULL;
+    }
+}
+
+static void
+cdk_parser_complete (CdkParserSlot *slot, CdkParseJob *job)
+{
+  // In-process the TU is the main thread's, which completes by itself
+  if (slot->worker == NULL)
+    {
+      job->error = CXError_InvalidArguments;
+      return;
+    }
+
+  guint n_usf = 0;
+  struct CXUnsavedFile *usf = cdk_parse_job_get_unsaved (job, &n_usf);
+
+  job->error =
+    cdk_worker_complete (slot->worker, job->filename, job->argv,
+                         job->line, job->column, usf, n_usf,
+                         &job->completions);
+  g_free (usf);
+}
+
+static void
+cdk_parser_run_job (CdkParseJob *job, CdkParserSlot *slot)
+{
+  CdkParser *parser = slot->parser;
+  gboolean shutdown;
+
+  g_mutex_lock (&parser->lock);
+  shutdown = parser->shutdown;
+  g_mutex_unlock (&parser->lock);
+
+  if (! shutdown && g_atomic_int_get (&job->cancelled))
+    job->discarded = TRUE;
+  else if (! shutdown)
+    {
+      gint64 started_at = g_get_monotonic_time ();
+      job->started_at = g_get_real_time ();
+
+      switch (job->kind)
+        {
+        case CDK_PARSE_JOB_PARSE:
+        case CDK_PARSE_JOB_REPARSE:
+          if (slot->worker != NULL)
+            {
+              cdk_worker_set_cancelled (slot->worker, &job->cancelled);
+              cdk_parser_parse_out_of_process (slot, job);
+              cdk_worker_set_cancelled (slot->worker, NULL);
+            }
+          else
+            {
+              if (job->kind == CDK_PARSE_JOB_PARSE)
+                cdk_parser_parse (slot, job);
+              else
+                cdk_parser_reparse (slot, job);
+              if (job->tu != NULL && ! cdk_parser_is_job_cancelled (job))
+                cdk_results_collect (&job->results, job->tu);
+            }
+          break;
+        case CDK_PARSE_JOB_BUILD_PCH:
+          cdk_parser_build_pch (slot, job);
+          break;
+        case CDK_PARSE_JOB_DISPOSE:
+          cdk_parser_dispose (slot, job);
+          break;
+        case CDK_PARSE_JOB_COMPLETE:
+          cdk_parser_complete (slot, job);
+          break;
+        case CDK_PARSE_JOB_WARM_UP:
+          cdk_parser_warm_up (slot, job);
+          break;
+        }
+
+      job->run_time = g_get_monotonic_time () - started_at;
+    }
+
+  g_async_queue_push (parser->results, job);
+
+  g_mutex_lock (&parser->lock);
+  if (parser->dispatch_hnd == 0 && ! parser->shutdown)
+    parser->dispatch_hnd = g_idle_add ((GSourceFunc) cdk_parser_dispatch, parser);
+  g_mutex_unlock (&parser->lock);
+}
+
+// The slot of filename, a new file is assigned to the least busy one
+static CdkParserSlot *
+cdk_parser_get_slot (CdkParser *parser, const gchar *filename)
+{
+  if (parser->n_slots == 1)
+    return &parser->slots[0];
+
+  guint index = GPOINTER_TO_UINT (g_hash_table_lookup (parser->assigned, filename));
+  if (index == 0)
+    {
+      for (guint i = 0; i < parser->n_slots; i++)
+        {
+          if (index == 0 || parser->slots[i].n_files < parser->slots[index - 1].n_files)
+            index = i + 1;
+        }
+      parser->slots[index - 1].n_files++;
+      g_hash_table_insert (parser->assigned, g_strdup (filename),
+                           GUINT_TO_POINTER (index));
+    }
+
+  return &parser->slots[index - 1];
+}
+
+static void
+cdk_parser_push_to_slot (CdkParserSlot *slot, CdkParseJob *job)
+{
+  job->queued_at = g_get_monotonic_time ();
+
+  GError *error = NULL;
+  if (slot->pool == NULL ||
+      ! g_thread_pool_push (slot->pool, job, &error))
+    {
+      if (error != NULL)
+        {
+          g_critical ("failed to queue parse job for '%s': %s",
+                      job->filename, error->message);
+          g_error_free (error);
+        }
+      // fallback to parsing synchronously, result is still delivered
+      // asynchronously on the main loop
+      cdk_parser_run_job (job, slot);
+    }
+}
+
+void
+cdk_parser_push (CdkParser *parser, CdkParseJob *job)
+{
+  g_return_if_fail (parser != NULL);
+  g_return_if_fail (job != NULL);
+
+  cdk_parser_push_to_slot (cdk_parser_get_slot (parser, job->filename), job);
+}
+
+/*
+ * Lets the parser forget about filename once it's no longer used, so a
+ * worker process doesn't keep its TU around. Jobs for it already pushed
+ * are still run.
+ */
+void
+cdk_parser_release (CdkParser *parser, const gchar *filename)
+{
+  g_return_if_fail (parser != NULL);
+  g_return_if_fail (filename != NULL);
+
+  guint index = GPOINTER_TO_UINT (g_hash_table_lookup (parser->assigned, filename));
+  if (index == 0)
+    return;
+
+  CdkParserSlot *slot = &parser->slots[index - 1];
+  cdk_parser_push_to_slot (slot,
+                           cdk_parse_job_new (CDK_PARSE_JOB_DISPOSE, NULL, filename,
+                                              NULL, NULL, NULL));
+  slot->n_files--;
+  g_hash_table_remove (parser->assigned, filename);
+}
+
+/*
+ * Takes ownership of argv. The job is owned by the parser once pushed
+ * and freed after its callback has run. The callback can steal the
+ * resulting TU by setting job->tu to NULL, otherwise it's disposed.
+ */
+CdkParseJob *
+cdk_parse_job_new (CdkParseJobKind kind,
+                   struct GeanyDocument *doc,
+                   const gchar *filename,
+                   gchar **argv,
+                   CdkParseFunc func,
+                   gpointer user_data)
+{
+  CdkParseJob *job = g_slice_new0 (CdkParseJob);
+  job->kind = kind;
+  job->doc = doc;
+  job->filename = g_strdup (filename);
+  job->argv = argv;
+  job->error = CXError_Success;
+  job->func = func;
+  job->user_data = user_data;
+  return job;
+}
+
+/*
+ * Asks the worker to skip the job if it hasn't got to it yet, in which
+ * case it's delivered untouched with discarded set. A (re)parse already
+ * running stops after the stage it's in, between parsing, saving to the
+ * cache, collecting the files it depends on and working out its results,
+ * and is delivered with discarded set too; its TU, if
+ * any, is only good as a spare. A worker process still busy with it
+ * after a grace period is killed. Can be called from any thread.
+ */
+void
+cdk_parse_job_cancel (CdkParseJob *job)
+{
+  g_return_if_fail (job != NULL);
+  g_atomic_int_set (&job->cancelled, TRUE);
+}
+
+void
+cdk_parse_job_free (CdkParseJob *job)
+{
+  if (G_UNLIKELY (job == NULL))
+    return;
+
+  if (job->tu != NULL)
+    clang_disposeTranslationUnit (job->tu);
+
+  if (job->contents != NULL)
+    g_bytes_unref (job->contents);
+
+  g_free (job->filename);
+  g_strfreev (job->argv);
+  g_free (job->cache_key);
+  g_free (job->output);
+  g_strfreev (job->sources);
+  g_strfreev (job->includes);
+  g_strfreev (job->completions);
+
+  if (job->depends != NULL)
+    g_array_unref (job->depends);
+  cdk_results_clear (&job->results);
+  if (job->overlay != NULL)
+    g_array_unref (job->overlay);
+
+  g_slice_free (CdkParseJob, job);
+}
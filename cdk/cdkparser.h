@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifndef CDK_PARSER_H_
+#define CDK_PARSER_H_ 1
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <cdk/cdkcache.h>
+#include <cdk/cdkresults.h>
+
+G_BEGIN_DECLS
+
+struct GeanyDocument;
+struct CXTranslationUnitImpl;
+
+typedef struct CdkParser_   CdkParser;
+typedef struct CdkParseJob_ CdkParseJob;
+
+typedef void (*CdkParseFunc) (CdkParser *parser, CdkParseJob *job, gpointer user_data);
+
+// A file a TU was built from and its modification time at the time
+typedef struct
+{
+  gchar  *filename;
+  gint64  mtime;      // seconds since the epoch, -1 if read from the overlay
+  gint64  mtime_nsec; // nanoseconds part of it, -1 if not known to match what was read
+}
+CdkFileStamp;
+
+// Unsaved contents of a file other than the main one
+typedef struct
+{
+  gchar  *filename;
+  GBytes *contents;
+}
+CdkUnsavedFile;
+
+typedef enum
+{
+  CDK_PARSE_JOB_PARSE,
+  CDK_PARSE_JOB_REPARSE,
+  CDK_PARSE_JOB_BUILD_PCH,
+  CDK_PARSE_JOB_DISPOSE,
+  CDK_PARSE_JOB_COMPLETE,
+  CDK_PARSE_JOB_WARM_UP,
+}
+CdkParseJobKind;
+
+struct CdkParseJob_
+{
+  CdkParseJobKind               kind;      // what the worker should do
+  struct GeanyDocument         *doc;       // document the job is for (never touched off-thread)
+  gchar                        *filename;  // main file of the translation unit
+  gchar                       **argv;      // compiler flags
+  GBytes                       *contents;  // snapshot of the unsaved buffer or NULL
+  guint                         revision;  // buffer revision the snapshot was taken at
+  GArray                       *overlay;   // CdkUnsavedFile of other dirty buffers or NULL
+  guint                         overlay_serial; // serial of the overlay when the job was made
+  gchar                        *cache_key; // on-disk cache entry or NULL to bypass it
+  struct CXTranslationUnitImpl *tu;        // TU to reparse (or to dispose for a PARSE) and the resulting TU, always NULL out of process
+  gboolean                      fresh;     // parse from scratch, not loading from the cache
+  gboolean                      from_cache; // whether the TU was loaded from the cache
+  GArray                       *depends;   // PARSE/REPARSE: CdkFileStamp of the non-system files read
+  CdkResults                    results;   // PARSE/REPARSE: what the main thread needs of the TU, empty if it failed
+  gchar                        *output;    // BUILD_PCH: name to make the PCH's from, then the file it was written to
+  gchar                       **sources;   // BUILD_PCH: generate filename from these, or NULL
+  gchar                       **includes;  // BUILD_PCH: headers the PCH depends on
+  guint                         line;      // COMPLETE: 1-based line to complete at
+  guint                         column;    // COMPLETE: 1-based column to complete at
+  gchar                       **completions; // COMPLETE: typed text of the results
+  gint                          error;     // CXErrorCode from libclang
+  gint64                        queued_at; // monotonic time the job was pushed
+  gint64                        started_at; // real time the worker started on the job
+  gint64                        run_time;  // microseconds the worker spent on the job
+  gint                          cancelled; // set by cdk_parse_job_cancel(), accessed atomically
+  gboolean                      discarded; // whether the worker skipped it or stopped early as cancelled
+  CdkParseFunc                  func;      // called on the main loop when done
+  gpointer                      user_data; // passed to func
+};
+
+CdkParser *cdk_parser_new (CdkCache *cache, guint n_slots, gboolean out_of_process);
+void cdk_parser_free (CdkParser *parser);
+gboolean cdk_parser_is_out_of_process (CdkParser *parser);
+void cdk_parser_push (CdkParser *parser, CdkParseJob *job);
+void cdk_parser_release (CdkParser *parser, const gchar *filename);
+gint64 cdk_file_stamp_get_mtime_nsec (const GStatBuf *st);
+
+CdkParseJob *cdk_parse_job_new (CdkParseJobKind kind,
+                                struct GeanyDocument *doc,
+                                const gchar *filename,
+                                gchar **argv,
+                                CdkParseFunc func,
+                                gpointer user_data);
+void cdk_parse_job_free (CdkParseJob *job);
+void cdk_parse_job_cancel (CdkParseJob *job);
+
+G_END_DECLS
+
+#endif /* CDK_PARSER_H_ */
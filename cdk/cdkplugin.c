@@ -11,10 +11,16 @@
 #include <cdk/cdkhighlighter.h>
 #include <cdk/cdkcompleter.h>
 #include <cdk/cdkdiagnostics.h>
+#include <cdk/cdkcache.h>
+#include <cdk/cdkcompdb.h>
+#include <cdk/cdkhistogram.h>
+#include <cdk/cdkparser.h>
 #include <cdk/cdkutils.h>
 #include <geanyplugin.h>
 #include <clang-c/Index.h>
+#include <glib/gstdio.h>
 #include <unistd.h>
+#include <string.h>
 
 typedef struct
 {
@@ -22,21 +28,83 @@ typedef struct
   CdkCompleter     *completer;    // auto-completion helper
   CdkHighlighter   *highlighter;  // syntax highlighting helper
   CdkDiagnostics   *diagnostics;  // diagnostic highlighter/message helper
-  CXTranslationUnit tu;           // libclang translation unit
+  CXTranslationUnit tu;           // libclang translation unit, NULL if pending or out of process
+  CXTranslationUnit spare_tu;     // the TU before tu, reparsed into the next one, or NULL
   GeanyDocument    *doc;          // the associated GeanyDocument
+  CdkParseJob      *pending_job;  // background parse/reparse in progress, if any
+  CdkParseJob      *complete_job; // completion in a worker process in progress, if any
+  gboolean          needs_update; // whether an update was requested while pending
+  gboolean          parsed;       // whether a TU has arrived, and not been evicted since
+  guint             tu_revision;  // buffer revision the current TU was parsed at
+  gboolean          tu_unsaved;   // whether the TU was parsed from an unsaved buffer
+  GArray           *depends;      // CdkFileStamp of the files the TU was parsed from
+  GArray           *runs;         // CdkStyleRun of the TU's main file or NULL
+  GArray           *occurrences;  // CdkOccurrence of the TU's main file or NULL
+  GArray           *diags;        // CdkDiagnostic of the TU or NULL
+  gboolean          tu_overlaid;  // whether the TU was parsed with other unsaved buffers
+  guint             tu_overlay_serial; // overlay serial the TU was parsed at
+  gboolean          from_cache;   // whether the TU was loaded from the cache
+  gchar            *cache_key;    // cache entry of the TU or NULL
+  gchar           **argv;         // compiler arguments the TU was parsed with
+  CdkResourceUsage  usage;        // memory used by the TU when it last arrived
+  CdkResourceUsage  spare_usage;  // memory used by spare_tu when it was the TU
+  gint64            last_active;  // monotonic time the document was last activated
+  gboolean          evicted;      // whether the TU was dropped to stay in budget
+  gint64            update_due;   // monotonic time a scheduled update runs at, 0 if none
+  gint64            update_limit; // latest the scheduled update can be pushed back to
+  gint64            reparse_cost; // moving average of the worker time of reparses, 0 if unknown
+  CdkHistogram     *latency[CDK_NUM_LATENCIES]; // timings, created on first use
 }
 CdkDocumentData;
 
+typedef struct
+{
+  GeanyDocument *doc;    // the document with unsaved changes
+  guint          serial; // overlay serial of its last change
+}
+CdkOverlayEntry;
+
 struct CdkPluginPrivate_
 {
-  CXIndex         index;         // libclang index for all TUs
+  CdkParser      *parser;        // background parse service owning the index
+  gboolean        out_of_process; // whether the parser runs libclang in worker processes
+  gboolean        warm_up;       // whether to fill the cache with all project files on open
+  gboolean        warm_up_queued; // whether a warm-up waits for the PCH
+  CdkParser      *warm_up_parser; // parser of the warm-up in progress or NULL
+  guint           warm_up_pending; // warm-up jobs not done yet
+  guint           warm_up_hnd;   // idle handler freeing warm_up_parser once done
+  gboolean        symbol_index;  // whether to keep an index of the project's symbols
+  CdkIndex       *index;         // the project's symbol index or NULL
+  CdkCache       *cache;         // on-disk TU cache or NULL
   GHashTable     *file_set;      // set of project files
   gboolean        project_open;  // whether a CDK project is open
   gchar          *cflags;        // compiler flags
+  const gchar *const *cflags_argv; // cflags split into arguments, interned in compdb
+  CdkCompDb      *compdb;        // per-file arguments from compile_commands.json
+  gchar          *compdb_dir;    // configured directory of compile_commands.json
   GPtrArray      *files;         // ordered list of project files
   GeanyDocument  *current_doc;   // active document if supported or NULL
   GHashTable     *doc_data;      // maps a document to extra data/helpers
+  GHashTable     *includers;     // maps a file to the set of CdkDocumentData whose TU read it
+  GHashTable     *overlay_files; // maps the path of a dirty buffer to its CdkOverlayEntry
+  GArray         *overlay;       // CdkUnsavedFile of all dirty buffers, NULL if stale
+  guint           overlay_serial; // bumped on every change to a dirty buffer
   CdkStyleScheme *scheme;        // scheme to use for highlighters
+  gchar          *pch_prefix;    // prefix header for the PCH, "auto" or NULL
+  gchar          *pch_path;      // the project's PCH file or NULL
+  gchar         **pch_argv;      // arguments pch_path was built with
+  gboolean        pch_cxx;       // whether pch_path is for C++ rather than C
+  gboolean        pch_ready;     // whether pch_path is up to date and usable
+  CdkParseJob    *pch_job;       // PCH build in progress, if any
+  GPtrArray      *pch_monitors;  // monitors of the headers in the PCH
+  GPtrArray      *pch_stale;     // superseded PCH files, removed once unused
+  guint           pch_rebuild_hnd; // timeout rebuilding the PCH after a change
+  guint64         memory_budget; // max memory for resident TUs in bytes, 0 for no limit
+  guint           schedule_hnd;  // timeout running the next scheduled update
+  guint           background_limit; // max (re)parses pending while other documents update
+  gint64          schedule_due;  // monotonic time schedule_hnd fires at
+  CdkHistogram   *latency[CDK_NUM_LATENCIES]; // timings of all documents since the project opened
+  guint64         outcomes[CDK_NUM_LATENCIES][CDK_NUM_JOB_OUTCOMES]; // job outcomes since then
 };
 
 enum
@@ -47,6 +115,7 @@ enum
   SIG_DOCUMENT_ADDED,
   SIG_DOCUMENT_REMOVED,
   SIG_DOCUMENT_UPDATED,
+  SIG_RESOURCE_USAGE_CHANGED,
   NUM_SIGNALS,
 };
 
@@ -58,6 +127,9 @@ enum
   PROP_PROJECT_OPEN,
   PROP_CURRENT_DOCUMENT,
   PROP_SCHEME,
+  PROP_PCH_PREFIX,
+  PROP_COMPDB_DIR,
+  PROP_MEMORY_BUDGET,
   NUM_PROPERTIES,
 };
 
@@ -65,6 +137,14 @@ static gulong cdk_plugin_signals[NUM_SIGNALS] = {0};
 static GParamSpec *cdk_plugin_properties[NUM_PROPERTIES] = { NULL };
 
 static void cdk_plugin_finalize (GObject *object);
+static void cdk_plugin_clear_pch (CdkPlugin *self);
+static void cdk_plugin_collect_pch (CdkPlugin *self);
+static void cdk_plugin_remove_stale_pch (CdkPlugin *self, guint index);
+static void cdk_plugin_clear_scheduler (CdkPlugin *self);
+static void cdk_plugin_clear_overlay (CdkPlugin *self);
+static void cdk_plugin_stop_warm_up (CdkPlugin *self);
+static void cdk_plugin_stop_index (CdkPlugin *self);
+static void cdk_plugin_unlink_depends (CdkPlugin *self, CdkDocumentData *data);
 static void cdk_plugin_get_property (GObject *object, guint prop_id,
                                       GValue *value, GParamSpec *pspec);
 static void cdk_plugin_set_property (GObject *object, guint prop_id,
@@ -78,6 +158,21 @@ cdk_document_data_new (void)
   return g_slice_new0 (CdkDocumentData);
 }
 
+// Drops what was worked out along with the TU
+static void
+cdk_document_data_clear_results (CdkDocumentData *data)
+{
+  if (data->runs != NULL)
+    g_array_unref (data->runs);
+  data->runs = NULL;
+  if (data->occurrences != NULL)
+    g_array_unref (data->occurrences);
+  data->occurrences = NULL;
+  if (data->diags != NULL)
+    g_array_unref (data->diags);
+  data->diags = NULL;
+}
+
 static void
 cdk_document_data_free (CdkDocumentData *data)
 {
@@ -98,12 +193,44 @@ cdk_document_data_free (CdkDocumentData *data)
 
   if (data->tu != NULL)
     clang_disposeTranslationUnit (data->tu);
+  if (data->spare_tu != NULL)
+    clang_disposeTranslationUnit (data->spare_tu);
+
+  if (data->pending_job != NULL)
+    cdk_parse_job_cancel (data->pending_job);
+  if (data->complete_job != NULL)
+    cdk_parse_job_cancel (data->complete_job);
+
+  // the worker process can drop its TU of the file too
+  cdk_parser_release (self->priv->parser, doc->real_path);
+
+  if (self->priv->index != NULL && doc->real_path != NULL)
+    cdk_index_set_file_open (self->priv->index, doc->real_path, FALSE);
+
+  g_free (data->cache_key);
+  g_strfreev (data->argv);
+
+  if (data->depends != NULL)
+    {
+      cdk_plugin_unlink_depends (self, data);
+      g_array_unref (data->depends);
+    }
+  cdk_document_data_clear_results (data);
+
+  for (guint i = 0; i < CDK_NUM_LATENCIES; i++)
+    cdk_histogram_free (data->latency[i]);
 
   g_slice_free (CdkDocumentData, data);
 
   g_signal_emit_by_name (self, "document-removed", doc);
 }
 
+static void
+cdk_overlay_entry_free (CdkOverlayEntry *entry)
+{
+  g_slice_free (CdkOverlayEntry, entry);
+}
+
 static void
 cdk_plugin_class_init (CdkPluginClass *klass)
 {
@@ -166,6 +293,15 @@ cdk_plugin_class_init (CdkPluginClass *klass)
                   G_TYPE_NONE,
                   1, G_TYPE_POINTER);
 
+  cdk_plugin_signals[SIG_RESOURCE_USAGE_CHANGED] =
+    g_signal_new ("resource-usage-changed",
+                  G_TYPE_FROM_CLASS (g_object_class),
+                  G_SIGNAL_RUN_FIRST,
+                  0, NULL, NULL,
+                  g_cclosure_marshal_VOID__POINTER,
+                  G_TYPE_NONE,
+                  1, G_TYPE_POINTER);
+
   cdk_plugin_properties[PROP_CFLAGS] =
     g_param_spec_string ("cflags",
                          "CompilerFlags",
@@ -200,12 +336,44 @@ cdk_plugin_class_init (CdkPluginClass *klass)
                          CDK_TYPE_STYLE_SCHEME,
                          G_PARAM_READWRITE);
 
+  cdk_plugin_properties[PROP_PCH_PREFIX] =
+    g_param_spec_string ("pch-prefix",
+                         "PchPrefix",
+                         "Prefix header for the project's PCH, \"auto\" or NULL",
+                         NULL,
+                         G_PARAM_READWRITE);
+
+  cdk_plugin_properties[PROP_COMPDB_DIR] =
+    g_param_spec_string ("compdb-dir",
+                         "CompilationDatabaseDir",
+                         "Directory containing compile_commands.json or NULL",
+                         NULL,
+                         G_PARAM_READWRITE);
+
+  cdk_plugin_properties[PROP_MEMORY_BUDGET] =
+    g_param_spec_uint64 ("memory-budget",
+                         "MemoryBudget",
+                         "Memory the translation units may use in bytes, 0 for no limit, "
+                         "otherwise at least 1 MiB",
+                         0, G_MAXUINT64, 0,
+                         G_PARAM_READWRITE);
+
   g_object_class_install_properties (g_object_class, NUM_PROPERTIES,
                                      cdk_plugin_properties);
 
   g_type_class_add_private ((gpointer)klass, sizeof (CdkPluginPrivate));
 }
 
+// Out of process the worker pool is sized to use all cores, and all
+// but one of them can be busy with documents other than the current
+static CdkParser *
+cdk_plugin_new_parser (CdkPlugin *self)
+{
+  guint n_slots = self->priv->out_of_process ? g_get_num_processors () : 1;
+  self->priv->background_limit = MAX (n_slots, 2) - 1;
+  return cdk_parser_new (self->priv->cache, n_slots, self->priv->out_of_process);
+}
+
 static void
 cdk_plugin_finalize (GObject *object)
 {
@@ -217,12 +385,34 @@ cdk_plugin_finalize (GObject *object)
 
   g_hash_table_destroy (self->priv->file_set);
   g_hash_table_destroy (self->priv->doc_data);
+  g_hash_table_destroy (self->priv->includers);
+  cdk_plugin_clear_overlay (self);
+  g_hash_table_destroy (self->priv->overlay_files);
 
   g_free (self->priv->cflags);
+  g_free (self->priv->compdb_dir);
+  cdk_compdb_free (self->priv->compdb);
   g_ptr_array_free (self->priv->files, TRUE);
 
-  if (self->priv->index)
-    clang_disposeIndex (self->priv->index);
+  cdk_plugin_clear_pch (self);
+  g_free (self->priv->pch_prefix);
+  g_strfreev (self->priv->pch_argv);
+  g_ptr_array_free (self->priv->pch_monitors, TRUE);
+
+  cdk_plugin_clear_scheduler (self);
+
+  cdk_plugin_stop_warm_up (self);
+  cdk_plugin_stop_index (self);
+  cdk_parser_free (self->priv->parser);
+  cdk_cache_free (self->priv->cache);
+
+  // nothing uses them anymore
+  while (self->priv->pch_stale->len > 0)
+    cdk_plugin_remove_stale_pch (self, self->priv->pch_stale->len - 1);
+  g_ptr_array_free (self->priv->pch_stale, TRUE);
+
+  for (guint i = 0; i < CDK_NUM_LATENCIES; i++)
+    cdk_histogram_free (self->priv->latency[i]);
 
   g_object_set_data (G_OBJECT (geany_data->main_widgets->window), "cdk-plugin", NULL);
 
@@ -235,15 +425,35 @@ cdk_plugin_init (CdkPlugin *self)
   self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, CDK_TYPE_PLUGIN, CdkPluginPrivate);
 
   self->priv->project_open = FALSE;
-  self->priv->index = clang_createIndex (TRUE, TRUE);
+
+  gchar *cache_dir = g_build_filename (g_get_user_cache_dir (), "cdk", NULL);
+  self->priv->cache = cdk_cache_new (cache_dir);
+  g_free (cache_dir);
+  // before any parser thread uses it
+  if (self->priv->cache != NULL)
+    cdk_cache_prune (self->priv->cache, CDK_CACHE_MAX_SIZE, CDK_CACHE_MAX_AGE);
+
+  self->priv->parser = cdk_plugin_new_parser (self);
   self->priv->cflags = g_strdup ("");
+  self->priv->compdb = cdk_compdb_new ();
+  self->priv->cflags_argv = cdk_compdb_intern (self->priv->compdb, NULL);
   self->priv->files = g_ptr_array_new_with_free_func (g_free);
+  self->priv->pch_monitors = g_ptr_array_new_with_free_func (g_object_unref);
+  self->priv->pch_stale = g_ptr_array_new_with_free_func (g_free);
+  for (guint i = 0; i < CDK_NUM_LATENCIES; i++)
+    self->priv->latency[i] = cdk_histogram_new ();
   self->priv->file_set = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
   self->priv->doc_data =
     g_hash_table_new_full (g_direct_hash,
                            g_direct_equal,
                            NULL,
                            (GDestroyNotify) cdk_document_data_free);
+  self->priv->includers =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                           (GDestroyNotify) g_hash_table_destroy);
+  self->priv->overlay_files =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                           (GDestroyNotify) cdk_overlay_entry_free);
 
   g_object_set_data (G_OBJECT (geany_data->main_widgets->window), "cdk-plugin", self);
 
@@ -281,6 +491,15 @@ cdk_plugin_get_property (GObject *object,
     case PROP_SCHEME:
       g_value_set_object (value, self->priv->scheme);
       break;
+    case PROP_PCH_PREFIX:
+      g_value_set_string (value, cdk_plugin_get_pch_prefix (self));
+      break;
+    case PROP_COMPDB_DIR:
+      g_value_set_string (value, cdk_plugin_get_compdb_dir (self));
+      break;
+    case PROP_MEMORY_BUDGET:
+      g_value_set_uint64 (value, cdk_plugin_get_memory_budget (self));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -309,6 +528,15 @@ cdk_plugin_set_property (GObject *object,
     case PROP_SCHEME:
       cdk_plugin_set_style_scheme (self, g_value_get_object (value));
       break;
+    case PROP_PCH_PREFIX:
+      cdk_plugin_set_pch_prefix (self, g_value_get_string (value));
+      break;
+    case PROP_COMPDB_DIR:
+      cdk_plugin_set_compdb_dir (self, g_value_get_string (value));
+      break;
+    case PROP_MEMORY_BUDGET:
+      cdk_plugin_set_memory_budget (self, g_value_get_uint64 (value));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -331,259 +559,2572 @@ cdk_plugin_is_supported_document (CdkPlugin *self,
           (doc->file_type->id == GEANY_FILETYPES_C ||
            doc->file_type->id == GEANY_FILETYPES_CPP ||
            doc->file_type->id == GEANY_FILETYPES_OBJECTIVEC) &&
-           g_hash_table_lookup (self->priv->file_set, doc->real_path) != NULL);
+          (g_hash_table_lookup (self->priv->file_set, doc->real_path) != NULL ||
+           cdk_compdb_lookup (self->priv->compdb, doc->real_path) != NULL));
 }
 
-static CXTranslationUnit
-cdk_plugin_create_translation_unit (CdkPlugin *self,
-                                    GeanyDocument *doc)
+static void
+cdk_plugin_document_updated (CdkPlugin *self, CdkDocumentData *data)
+{
+  cdk_document_helper_updated (CDK_DOCUMENT_HELPER (data->completer));
+  cdk_document_helper_updated (CDK_DOCUMENT_HELPER (data->highlighter));
+  cdk_document_helper_updated (CDK_DOCUMENT_HELPER (data->diagnostics));
+  g_signal_emit_by_name (self, "document-updated", data->doc);
+}
+
+// Snapshot of the buffer for the parser, NULL if it matches the file on
+// disk. Shared with anything else needing the same revision.
+static GBytes *
+cdk_plugin_snapshot_document (G_GNUC_UNUSED CdkPlugin *self,
+                              GeanyDocument *doc)
+{
+  if (! doc->changed)
+    return NULL;
+
+  CdkBufferSnapshot *snapshot = cdk_buffer_snapshot_get (doc);
+  GBytes *bytes = g_bytes_ref (cdk_buffer_snapshot_get_bytes (snapshot));
+  cdk_buffer_snapshot_unref (snapshot);
+
+  return bytes;
+}
+
+static gchar *
+cdk_plugin_make_cache_key (CdkPlugin *self,
+                           const gchar *filename,
+                           gchar **argv)
+{
+  if (self->priv->cache == NULL)
+    return NULL;
+  return cdk_cache_make_key (self->priv->cache, filename,
+                             (const gchar *const *) argv);
+}
+
+// Splits the cflags into arguments once when they change instead of
+// on every parse
+static void
+cdk_plugin_parse_cflags (CdkPlugin *self)
 {
-  CXTranslationUnit tu = NULL;
   gchar **argv = NULL;
-  gint argc = 0;
   GError *err = NULL;
 
-  if (! g_shell_parse_argv (self->priv->cflags, &argc, &argv, &err))
+  self->priv->cflags_argv = NULL;
+
+  if (! g_shell_parse_argv (self->priv->cflags, NULL, &argv, &err))
     {
-      g_warning ("failed to parse compiler flags: %s", err->message);
+      if (! g_error_matches (err, G_SHELL_ERROR, G_SHELL_ERROR_EMPTY_STRING))
+        {
+          g_warning ("failed to parse compiler flags: %s", err->message);
+          g_error_free (err);
+          return;
+        }
       g_error_free (err);
-      return NULL;
     }
 
-  enum CXErrorCode error =
-    clang_parseTranslationUnit2 (self->priv->index,
-                                 doc->real_path,
-                                 (const gchar *const *) argv, argc,
-                                 NULL, 0,
-                                 clang_defaultEditingTranslationUnitOptions (),
-                                 &tu);
-
+  self->priv->cflags_argv =
+    cdk_compdb_intern (self->priv->compdb, (const gchar *const *) argv);
   g_strfreev (argv);
-
-  if (error == CXError_Success)
-    return tu;
-
-  g_critical ("failed to parse translation unit '%s', error '%u'",
-              doc->real_path, (guint) error);
-
-  if (tu != NULL)
-    clang_disposeTranslationUnit (tu);
-  return NULL;
 }
 
-gboolean
-cdk_plugin_add_document (CdkPlugin *self, struct GeanyDocument *doc)
+// Drops the compilation database and loads it again from the
+// configured directory, if any
+static void
+cdk_plugin_reload_compdb (CdkPlugin *self)
 {
-  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
-
-  if (! cdk_plugin_is_supported_document (self, doc))
-    return FALSE;
+  cdk_compdb_free (self->priv->compdb);
+  self->priv->compdb = cdk_compdb_new ();
 
-  // If the TU isn't valid, don't add the document
-  CXTranslationUnit tu = cdk_plugin_create_translation_unit (self, doc);
-  if (tu == NULL)
-    return FALSE;
+  // the cflags are interned in the old database
+  cdk_plugin_parse_cflags (self);
 
-  // In case the document was already added, remove previous one first
-  cdk_plugin_remove_document (self, doc);
+  if (self->priv->project_open && self->priv->compdb_dir != NULL)
+    {
+      const gchar *dir = self->priv->compdb_dir;
+      gchar *abs_dir = NULL;
+      if (! g_path_is_absolute (dir))
+        dir = abs_dir = g_build_filename (geany_data->app->project->base_path, dir, NULL);
 
-  CdkDocumentData *data = cdk_document_data_new ();
-  data->plugin = self;
-  data->tu = tu;
-  data->highlighter = cdk_highlighter_new (self, doc);
-  data->completer = cdk_completer_new (self, doc);
-  data->diagnostics = cdk_diagnostics_new (self, doc);
-  data->doc = doc;
+      GError *error = NULL;
+      if (! cdk_compdb_load (self->priv->compdb, dir, &error))
+        {
+          g_warning ("%s", error->message);
+          g_error_free (error);
+        }
+      g_free (abs_dir);
+    }
+}
 
-  cdk_highlighter_set_style_scheme (data->highlighter, self->priv->scheme);
+static gboolean cdk_strv_equal (const gchar *const *a, const gchar *const *b);
 
-  g_hash_table_insert (self->priv->doc_data, doc, data);
-  g_signal_emit_by_name (self, "document-added", doc);
+// Whether clang parses filename as C++ with argv, going by an -x option
+// or else by the extension like clang does
+static gboolean
+cdk_plugin_is_cxx_file (const gchar *filename, const gchar *const *argv)
+{
+  for (const gchar *const *it = argv; it != NULL && *it != NULL; it++)
+    {
+      if (strcmp (*it, "-x") == 0 && it[1] != NULL)
+        return g_str_has_prefix (it[1], "c++");
+      if (g_str_has_prefix (*it, "-x") && (*it)[2] != '\0')
+        return g_str_has_prefix (*it + 2, "c++");
+    }
 
-  return cdk_plugin_update_document (self, doc);
+  const gchar *ext = strrchr (filename, '.');
+  return (ext != NULL && g_strcmp0 (ext, ".c") != 0 && g_strcmp0 (ext, ".h") != 0);
 }
 
-gboolean
-cdk_plugin_remove_document (CdkPlugin *self, struct GeanyDocument *doc)
+// Compiler arguments for a parse of filename, from the compilation
+// database if it's in there or else the project's cflags, plus the PCH
+// if it's ready and was built with the same ones. Returns NULL if the
+// flags can't be used.
+static gchar **
+cdk_plugin_get_argv (CdkPlugin *self,
+                     const gchar *filename,
+                     gboolean use_pch)
 {
-  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
-  return g_hash_table_remove (self->priv->doc_data, doc);
-}
+  const gchar *const *args = NULL;
 
-static enum CXErrorCode
-cdk_plugin_reparse_unsaved (G_GNUC_UNUSED CdkPlugin *self,
-                            CXTranslationUnit tu,
-                            GeanyDocument *doc)
-{
-  struct CXUnsavedFile usf;
-  usf.Filename = doc->real_path;
-  usf.Contents = cdk_document_get_contents (doc);
-  usf.Length = cdk_document_get_length (doc);
-  return clang_reparseTranslationUnit (tu, 1, &usf, clang_defaultReparseOptions (tu));
-}
+  if (filename != NULL)
+    args = cdk_compdb_lookup (self->priv->compdb, filename);
+  if (args == NULL)
+    args = self->priv->cflags_argv;
 
-gboolean
-cdk_plugin_update_document (CdkPlugin *self, struct GeanyDocument *doc)
-{
-  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
+  if (args == NULL)
+    return NULL;
 
-  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
-  if (data == NULL)
-    return FALSE;
+  // a PCH can't be mixed with other flags than its own, nor languages
+  if (! cdk_strv_equal (args, (const gchar *const *) self->priv->pch_argv) ||
+      (filename != NULL && cdk_plugin_is_cxx_file (filename, args) != self->priv->pch_cxx))
+    use_pch = FALSE;
 
-  enum CXErrorCode status = CXError_Success;
-  if (doc->changed)
-    status = cdk_plugin_reparse_unsaved (self, data->tu, doc);
-  else
-    status = clang_reparseTranslationUnit (data->tu, 0, NULL, clang_defaultReparseOptions (data->tu));
+  gint argc = g_strv_length ((gchar **) args);
+  gchar **argv = g_new (gchar *, argc + 3);
+  for (gint i = 0; i < argc; i++)
+    argv[i] = g_strdup (args[i]);
+  argv[argc] = NULL;
 
-  if (status == CXError_Success)
+  if (use_pch && self->priv->pch_ready)
     {
-      cdk_document_helper_updated (CDK_DOCUMENT_HELPER (data->completer));
-      cdk_document_helper_updated (CDK_DOCUMENT_HELPER (data->highlighter));
-      cdk_document_helper_updated (CDK_DOCUMENT_HELPER (data->diagnostics));
-      g_signal_emit_by_name (self, "document-updated", doc);
-      return TRUE;
+      argv[argc++] = g_strdup ("-include-pch");
+      argv[argc++] = g_strdup (self->priv->pch_path);
+      argv[argc] = NULL;
     }
-  return FALSE;
+
+  return argv;
 }
 
-struct CXTranslationUnitImpl *
-cdk_plugin_get_translation_unit (CdkPlugin *self,
-                                 struct GeanyDocument *doc)
+/*
+ * The overlay is the set of open buffers with unsaved changes, passed
+ * to libclang along with a TU's own buffer so it sees edited headers as
+ * they are in the editor rather than on disk. Edits only mark the overlay
+ * stale; it's rebuilt from the buffer snapshots when next needed and
+ * then shared by all jobs and completions until another edit. TUs none
+ * of whose dependencies are dirty get no overlay at all, which keeps
+ * them eligible for the cache.
+ */
+
+static void
+cdk_unsaved_file_clear (CdkUnsavedFile *file)
 {
-  g_return_val_if_fail (CDK_IS_PLUGIN (self), NULL);
-  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
-  if (data != NULL)
-    return data->tu;
-  return NULL;
+  g_free (file->filename);
+  g_bytes_unref (file->contents);
 }
 
 static void
-cdk_ptr_array_clear (GPtrArray *arr)
+cdk_plugin_invalidate_overlay (CdkPlugin *self)
 {
-  while (arr->len > 0)
-    g_ptr_array_remove_index (arr, arr->len - 1);
-  if (arr->len != 0)
-    g_critical ("failed arr->len == 0? = %lu", (gulong) arr->len);
+  if (self->priv->overlay != NULL)
+    g_array_unref (self->priv->overlay);
+  self->priv->overlay = NULL;
 }
 
-void
-cdk_plugin_open_project (CdkPlugin *self, GKeyFile *config)
+static void
+cdk_plugin_clear_overlay (CdkPlugin *self)
 {
-  g_return_if_fail (CDK_IS_PLUGIN (self));
-  g_return_if_fail (config != NULL);
+  g_hash_table_remove_all (self->priv->overlay_files);
+  cdk_plugin_invalidate_overlay (self);
+}
 
-  self->priv->project_open = TRUE;
-  if (self->priv->index != NULL)
-    clang_disposeIndex (self->priv->index);
-  self->priv->index = clang_createIndex (TRUE, TRUE);
+// The shared overlay, snapshotting the buffers changed since last time
+static GArray *
+cdk_plugin_get_overlay (CdkPlugin *self)
+{
+  GHashTableIter iter;
+  const gchar *filename = NULL;
+  CdkOverlayEntry *entry = NULL;
 
-  if (g_key_file_has_group (config, "cdk"))
+  if (self->priv->overlay != NULL)
+    return self->priv->overlay;
+
+  self->priv->overlay = g_array_new (FALSE, FALSE, sizeof (CdkUnsavedFile));
+  g_array_set_clear_func (self->priv->overlay, (GDestroyNotify) cdk_unsaved_file_clear);
+
+  g_hash_table_iter_init (&iter, self->priv->overlay_files);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &filename, (gpointer *) &entry))
     {
+      CdkBufferSnapshot *snapshot = cdk_buffer_snapshot_get (entry->doc);
+      CdkUnsavedFile file;
+      file.filename = g_strdup (filename);
+      file.contents = g_bytes_ref (cdk_buffer_snapshot_get_bytes (snapshot));
+      g_array_append_val (self->priv->overlay, file);
+      cdk_buffer_snapshot_unref (snapshot);
+    }
 
-      if (g_key_file_has_key (config, "cdk", "cflags", NULL))
-        {
-          gchar *command = g_key_file_get_string (config, "cdk", "cflags", NULL);
-          if (command != NULL)
-            cdk_plugin_set_cflags (self, command);
-          g_free (command);
-        }
+  return self->priv->overlay;
+}
 
-      if (g_key_file_has_key (config, "cdk", "files", NULL))
-        {
-          g_hash_table_remove_all (self->priv->file_set);
-          cdk_ptr_array_clear (self->priv->files);
+// Whether the TU of doc could read any dirty buffer but its own
+static gboolean
+cdk_plugin_needs_overlay (CdkPlugin *self, GeanyDocument *doc)
+{
+  guint n_dirty = g_hash_table_size (self->priv->overlay_files);
+  if (doc->real_path != NULL &&
+      g_hash_table_contains (self->priv->overlay_files, doc->real_path))
+    {
+      n_dirty--;
+    }
+  if (n_dirty == 0)
+    return FALSE;
 
-          gsize n_files = 0;
-          gchar **files =
-            g_key_file_get_string_list (config, "cdk", "files", &n_files, NULL);
-          if (files != NULL)
-            {
-              // files in config file are relative but we need absolute
-              // so change temorarily into to the project base dir and
-              // expand the paths, then change back into whatever dir
-              // we were in.
-              gchar *cwd = g_get_current_dir ();
-              chdir (geany_data->app->project->base_path);
-              for (gsize i = 0; i < n_files; i++)
-                {
-                  gchar *file = cdk_abspath (files[i]);
-                  g_hash_table_insert (self->priv->file_set, file, file);
-                  g_ptr_array_add (self->priv->files, g_strdup (file));
-                }
-              chdir (cwd);
-              g_free (cwd);
-              g_strfreev (files);
-            }
+  // Not parsed yet, anything could be included
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+  if (data == NULL || data->depends == NULL)
+    return TRUE;
 
-          g_ptr_array_add (self->priv->files, NULL);
+  for (guint i = 0; i < data->depends->len; i++)
+    {
+      const CdkFileStamp *stamp = &g_array_index (data->depends, CdkFileStamp, i);
+      if (g_strcmp0 (stamp->filename, doc->real_path) != 0 &&
+          g_hash_table_contains (self->priv->overlay_files, stamp->filename))
+        {
+          return TRUE;
         }
     }
 
-  g_object_notify (G_OBJECT (self), "project-open");
-  g_signal_emit_by_name (self, "project-opened");
+  return FALSE;
 }
 
+// New reference to the overlay for a job on doc, or NULL if it needs none
+static GArray *
+cdk_plugin_get_job_overlay (CdkPlugin *self, GeanyDocument *doc)
+{
+  if (! cdk_plugin_needs_overlay (self, doc))
+    return NULL;
+  return g_array_ref (cdk_plugin_get_overlay (self));
+}
+
+/*
+ * Called when the buffer of doc is edited, whether or not it's in the
+ * project, so other TUs including it see the unsaved contents.
+ */
 void
-cdk_plugin_save_project (CdkPlugin *self, GKeyFile *config)
+cdk_plugin_mark_buffer_dirty (CdkPlugin *self, struct GeanyDocument *doc)
 {
   g_return_if_fail (CDK_IS_PLUGIN (self));
-  g_return_if_fail (config != NULL);
+  g_return_if_fail (doc != NULL);
 
-  if (! self->priv->project_open)
-    return;
+  if (doc->real_path == NULL || doc->file_type == NULL ||
+      (doc->file_type->id != GEANY_FILETYPES_C &&
+       doc->file_type->id != GEANY_FILETYPES_CPP &&
+       doc->file_type->id != GEANY_FILETYPES_OBJECTIVEC))
+    {
+      return;
+    }
 
-  g_key_file_set_string (config, "cdk", "cflags", self->priv->cflags);
+  CdkOverlayEntry *entry = g_hash_table_lookup (self->priv->overlay_files, doc->real_path);
+  if (entry == NULL)
+    {
+      entry = g_slice_new0 (CdkOverlayEntry);
+      entry->doc = doc;
+      g_hash_table_insert (self->priv->overlay_files, g_strdup (doc->real_path), entry);
+    }
 
-  // store paths in config file as relative to project dir
-  gchar **files = cdk_relpaths ((const gchar *const *) self->priv->files->pdata,
-                                geany_data->app->project->base_path);
-  g_key_file_set_string_list (config, "cdk", "files",
-                              (const gchar *const *) files,
-                              self->priv->files->len - 1);
-  g_strfreev (files);
+  entry->serial = ++self->priv->overlay_serial;
+  cdk_plugin_invalidate_overlay (self);
+}
 
-  g_signal_emit_by_name (self, "project-saved");
+static gboolean
+cdk_overlay_entry_is_for (G_GNUC_UNUSED gpointer filename,
+                          CdkOverlayEntry *entry,
+                          GeanyDocument *doc)
+{
+  return (entry->doc == doc);
 }
 
+/*
+ * Called when doc is saved or closed, the file on disk is what other
+ * TUs should see from then on.
+ */
 void
-cdk_plugin_close_project (CdkPlugin *self)
+cdk_plugin_mark_buffer_clean (CdkPlugin *self, struct GeanyDocument *doc)
 {
   g_return_if_fail (CDK_IS_PLUGIN (self));
 
-  if (! self->priv->project_open)
-    return;
+  // looked up by document in case it was saved under another name
+  if (g_hash_table_foreach_remove (self->priv->overlay_files,
+                                   (GHRFunc) cdk_overlay_entry_is_for, doc) > 0)
+    {
+      cdk_plugin_invalidate_overlay (self);
+    }
+}
 
-  g_hash_table_remove_all (self->priv->doc_data);
-  g_hash_table_remove_all (self->priv->file_set);
+/*
+ * The unsaved files for a code completion in doc: its own buffer if
+ * it's modified followed by the other dirty buffers its TU could read.
+ * They're only valid until the buffers change. Free the array with
+ * g_free().
+ */
+struct CXUnsavedFile *
+cdk_plugin_get_unsaved_files (CdkPlugin *self,
+                              struct GeanyDocument *doc,
+                              guint *n_files)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), NULL);
+  g_return_val_if_fail (doc != NULL, NULL);
+  g_return_val_if_fail (n_files != NULL, NULL);
 
-  if (self->priv->cflags != NULL)
-    self->priv->cflags[0] = '\0';
-  else
-    self->priv->cflags = g_strdup ("");
-  cdk_ptr_array_clear (self->priv->files);
+  GArray *overlay = NULL;
+  if (cdk_plugin_needs_overlay (self, doc))
+    overlay = cdk_plugin_get_overlay (self);
 
-  clang_disposeIndex (self->priv->index);
-  self->priv->index = clang_createIndex (TRUE, TRUE);
+  guint n_overlay = (overlay != NULL) ? overlay->len : 0;
+  struct CXUnsavedFile *files = g_new0 (struct CXUnsavedFile, n_overlay + 1);
 
-  cdk_plugin_set_current_document (self, NULL);
+  *n_files = 0;
 
-  self->priv->project_open = FALSE;
+  if (doc->changed)
+    {
+      // kept alive by the document until its next edit
+      CdkBufferSnapshot *snapshot = cdk_buffer_snapshot_get (doc);
+      gsize length = 0;
+      files[*n_files].Filename = doc->real_path;
+      files[*n_files].Contents = cdk_buffer_snapshot_get_data (snapshot, &length);
+      files[*n_files].Length = length;
+      (*n_files)++;
+      cdk_buffer_snapshot_unref (snapshot);
+    }
 
-  g_signal_emit_by_name (self, "project-closed");
-  g_object_notify (G_OBJECT (self), "project-open");
+  for (guint i = 0; i < n_overlay; i++)
+    {
+      const CdkUnsavedFile *file = &g_array_index (overlay, CdkUnsavedFile, i);
+      gsize length = 0;
+      if (g_strcmp0 (file->filename, doc->real_path) == 0)
+        continue;
+      files[*n_files].Filename = file->filename;
+      files[*n_files].Contents = g_bytes_get_data (file->contents, &length);
+      files[*n_files].Length = length;
+      (*n_files)++;
+    }
+
+  return files;
 }
 
-gboolean
-cdk_plugin_is_project_open (CdkPlugin *self)
+/*
+ * The files each TU was parsed from, its depends, are also kept the
+ * other way around, so the documents whose TUs read a header can be
+ * found when it's saved without going through all of them.
+ */
+
+static void
+cdk_plugin_link_depends (CdkPlugin *self, CdkDocumentData *data)
 {
-  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
-  return self->priv->project_open;
+  for (guint i = 0; data->depends != NULL && i < data->depends->len; i++)
+    {
+      const CdkFileStamp *stamp = &g_array_index (data->depends, CdkFileStamp, i);
+      GHashTable *includers = g_hash_table_lookup (self->priv->includers, stamp->filename);
+      if (includers == NULL)
+        {
+          includers = g_hash_table_new (g_direct_hash, g_direct_equal);
+          g_hash_table_insert (self->priv->includers, g_strdup (stamp->filename), includers);
+        }
+      g_hash_table_add (includers, data);
+    }
 }
 
-struct GeanyDocument *
-cdk_plugin_get_current_document (CdkPlugin *self)
+static void
+cdk_plugin_unlink_depends (CdkPlugin *self, CdkDocumentData *data)
+{
+  for (guint i = 0; data->depends != NULL && i < data->depends->len; i++)
+    {
+      const CdkFileStamp *stamp = &g_array_index (data->depends, CdkFileStamp, i);
+      GHashTable *includers = g_hash_table_lookup (self->priv->includers, stamp->filename);
+      if (includers == NULL)
+        continue;
+      g_hash_table_remove (includers, data);
+      if (g_hash_table_size (includers) == 0)
+        g_hash_table_remove (self->priv->includers, stamp->filename);
+    }
+}
+
+static CdkParseJob *cdk_plugin_create_translation_unit (CdkPlugin *self,
+                                                        GeanyDocument *doc);
+static void cdk_plugin_enforce_memory_budget (CdkPlugin *self);
+static void cdk_plugin_rearm_scheduler (CdkPlugin *self);
+
+// Sums up the CXTUResourceUsageEntry a TU's results came with
+static void
+cdk_plugin_measure_translation_unit (GArray *entries,
+                                     CdkResourceUsage *usage)
+{
+  memset (usage, 0, sizeof (CdkResourceUsage));
+
+  for (guint i = 0; entries != NULL && i < entries->len; i++)
+    {
+      const CXTUResourceUsageEntry *entry =
+        &g_array_index (entries, CXTUResourceUsageEntry, i);
+      guint64 amount = entry->amount;
+      switch (entry->kind)
+        {
+        case CXTUResourceUsage_AST:
+        case CXTUResourceUsage_AST_SideTables:
+          usage->ast += amount;
+          break;
+        case CXTUResourceUsage_Identifiers:
+        case CXTUResourceUsage_Selectors:
+          usage->identifiers += amount;
+          break;
+        case CXTUResourceUsage_ExternalASTSource_Membuffer_Malloc:
+        case CXTUResourceUsage_ExternalASTSource_Membuffer_MMap:
+          usage->preamble += amount;
+          break;
+        case CXTUResourceUsage_SourceManagerContentCache:
+        case CXTUResourceUsage_SourceManager_Membuffer_Malloc:
+        case CXTUResourceUsage_SourceManager_Membuffer_MMap:
+        case CXTUResourceUsage_SourceManager_DataStructures:
+          usage->source_manager += amount;
+          break;
+        case CXTUResourceUsage_Preprocessor:
+        case CXTUResourceUsage_PreprocessingRecord:
+        case CXTUResourceUsage_Preprocessor_HeaderSearch:
+          usage->preprocessor += amount;
+          break;
+        case CXTUResourceUsage_GlobalCompletionResults:
+          usage->completion += amount;
+          break;
+        default:
+          break;
+        }
+      usage->total += amount;
+    }
+}
+
+static void
+cdk_resource_usage_add (CdkResourceUsage *usage,
+                        const CdkResourceUsage *other)
+{
+  usage->ast += other->ast;
+  usage->identifiers += other->identifiers;
+  usage->preamble += other->preamble;
+  usage->source_manager += other->source_manager;
+  usage->preprocessor += other->preprocessor;
+  usage->completion += other->completion;
+  usage->total += other->total;
+}
+
+static void
+cdk_plugin_translation_unit_created (G_GNUC_UNUSED CdkParser *parser,
+                                     CdkParseJob *job,
+                                     CdkPlugin *self)
+{
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, job->doc);
+  CdkLatencyKind kind = (job->kind == CDK_PARSE_JOB_REPARSE) ?
+                          CDK_LATENCY_REPARSE : CDK_LATENCY_PARSE;
+
+  // The document was removed or re-added while it was being parsed
+  if (data == NULL || data->pending_job != job)
+    {
+      cdk_plugin_record_job_outcome (self, kind, job->discarded ?
+                                       CDK_JOB_DISCARDED : CDK_JOB_CANCELLED);
+      return;
+    }
+
+  data->pending_job = NULL;
+
+  // Superseded by a newer revision before the worker got to it or while
+  // it ran. The spare TU comes back untouched or reparsed, either way
+  // it's still a spare, go again from the newest revision.
+  if (job->discarded)
+    {
+      cdk_plugin_record_job_outcome (self, kind, CDK_JOB_DISCARDED);
+      if (job->kind == CDK_PARSE_JOB_REPARSE)
+        {
+          data->spare_tu = job->tu;
+          job->tu = NULL;
+        }
+      data->needs_update = FALSE;
+      if (! data->parsed || job->kind == CDK_PARSE_JOB_PARSE)
+        {
+          data->pending_job = cdk_plugin_create_translation_unit (self, data->doc);
+          if (data->pending_job == NULL)
+            cdk_plugin_remove_document (self, job->doc);
+        }
+      else
+        cdk_plugin_update_document (self, data->doc);
+      return;
+    }
+
+  if (job->error != CXError_Success)
+    {
+      if (job->kind == CDK_PARSE_JOB_REPARSE)
+        {
+          // The spare is gone with the failed reparse, start from scratch
+          g_warning ("failed to reparse translation unit '%s', error '%u'",
+                     job->filename, (guint) job->error);
+          data->pending_job = cdk_plugin_create_translation_unit (self, data->doc);
+          if (data->pending_job != NULL)
+            return;
+        }
+      else
+        g_critical ("failed to parse translation unit '%s', error '%u'",
+                    job->filename, (guint) job->error);
+      // keep using the TU there is, if any
+      if (! data->parsed)
+        cdk_plugin_remove_document (self, job->doc);
+      return;
+    }
+
+  cdk_plugin_record_latency (self, data->doc, kind,
+                             g_get_monotonic_time () - job->queued_at);
+
+  // Full parses cost a lot more than the reparses edits cause, only
+  // the latter say how long to wait for more edits
+  if (job->kind == CDK_PARSE_JOB_REPARSE && ! job->fresh)
+    {
+      if (data->reparse_cost == 0)
+        data->reparse_cost = job->run_time;
+      else
+        data->reparse_cost = (job->run_time + 3 * data->reparse_cost) / 4;
+    }
+
+  // The TU replaced is reparsed into the next one. One parsed with other
+  // arguments or loaded from the cache can't be. Out of process the
+  // worker reparses its own TU and there's none here.
+  if (data->spare_tu != NULL)
+    clang_disposeTranslationUnit (data->spare_tu);
+  data->spare_tu = NULL;
+  memset (&data->spare_usage, 0, sizeof (CdkResourceUsage));
+  if (data->tu != NULL)
+    {
+      if (job->kind == CDK_PARSE_JOB_REPARSE && ! data->from_cache)
+        {
+          data->spare_tu = data->tu;
+          data->spare_usage = data->usage;
+        }
+      else
+        clang_disposeTranslationUnit (data->tu);
+    }
+
+  data->tu = job->tu;
+  data->parsed = TRUE;
+  data->tu_revision = job->revision;
+  data->tu_unsaved = (job->contents != NULL);
+  data->tu_overlaid = (job->overlay != NULL);
+  data->tu_overlay_serial = job->overlay_serial;
+  data->from_cache = job->from_cache;
+  cdk_plugin_measure_translation_unit (job->results.usage, &data->usage);
+  job->tu = NULL;
+
+  if (data->depends != NULL)
+    {
+      cdk_plugin_unlink_depends (self, data);
+      g_array_unref (data->depends);
+    }
+  data->depends = job->depends;
+  job->depends = NULL;
+  cdk_plugin_link_depends (self, data);
+
+  cdk_document_data_clear_results (data);
+  data->runs = job->results.runs;
+  job->results.runs = NULL;
+  data->occurrences = job->results.occurrences;
+  job->results.occurrences = NULL;
+  data->diags = job->results.diagnostics;
+  job->results.diagnostics = NULL;
+
+  g_signal_emit_by_name (self, "resource-usage-changed", data->doc);
+
+  if (job->kind == CDK_PARSE_JOB_PARSE)
+    {
+      g_free (data->cache_key);
+      data->cache_key = job->cache_key;
+      job->cache_key = NULL;
+      g_strfreev (data->argv);
+      data->argv = job->argv;
+      job->argv = NULL;
+    }
+
+  // The buffer changed while the job was running, so the result is
+  // already out of date. Don't bother the helpers with it and go again.
+  if (job->revision != cdk_document_get_revision (data->doc))
+    {
+      cdk_plugin_record_job_outcome (self, kind, CDK_JOB_CANCELLED);
+      data->needs_update = FALSE;
+      cdk_plugin_update_document (self, data->doc);
+    }
+  else
+    {
+      cdk_plugin_record_job_outcome (self, kind, CDK_JOB_COMPLETED);
+      cdk_plugin_document_updated (self, data);
+
+      if (data->needs_update)
+        {
+          data->needs_update = FALSE;
+          cdk_plugin_update_document (self, data->doc);
+        }
+    }
+
+  // A TU from the cache is only good until a real one is parsed in the
+  // background, which is due right away
+  if (data->from_cache && data->pending_job == NULL)
+    {
+      data->update_due = g_get_monotonic_time ();
+      data->update_limit = data->update_due;
+    }
+
+  cdk_plugin_enforce_memory_budget (self);
+
+  // the TU replaced may have been the last on an old PCH
+  if (job->kind == CDK_PARSE_JOB_PARSE)
+    cdk_plugin_collect_pch (self);
+
+  // background updates were waiting for the parser to be free
+  cdk_plugin_rearm_scheduler (self);
+}
+
+static CdkParseJob *
+cdk_plugin_create_translation_unit (CdkPlugin *self,
+                                    GeanyDocument *doc)
+{
+  gchar **argv = cdk_plugin_get_argv (self, doc->real_path, TRUE);
+  if (argv == NULL)
+    return NULL;
+
+  CdkParseJob *job =
+    cdk_parse_job_new (CDK_PARSE_JOB_PARSE, doc, doc->real_path, argv,
+                       (CdkParseFunc) cdk_plugin_translation_unit_created,
+                       self);
+  job->contents = cdk_plugin_snapshot_document (self, doc);
+  job->cache_key = cdk_plugin_make_cache_key (self, doc->real_path, argv);
+  job->overlay = cdk_plugin_get_job_overlay (self, doc);
+  job->overlay_serial = self->priv->overlay_serial;
+  job->revision = cdk_document_get_revision (doc);
+
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+  if (data != NULL)
+    {
+      // The current TU stays in use until this one replaces it, the
+      // spare is of no use with it gone
+      job->fresh = data->parsed;
+      job->tu = data->spare_tu;
+      data->spare_tu = NULL;
+      memset (&data->spare_usage, 0, sizeof (CdkResourceUsage));
+    }
+
+  cdk_parser_push (self->priv->parser, job);
+
+  return job;
+}
+
+static gboolean
+cdk_strv_equal (const gchar *const *a, const gchar *const *b)
+{
+  if (a == NULL || b == NULL)
+    return (a == b);
+  while (*a != NULL && *b != NULL && strcmp (*a, *b) == 0)
+    {
+      a++;
+      b++;
+    }
+  return (*a == NULL && *b == NULL);
+}
+
+// The arguments the document's TU was or is being parsed with
+static const gchar *const *
+cdk_document_data_get_argv (CdkDocumentData *data)
+{
+  if (data->pending_job != NULL && data->pending_job->kind == CDK_PARSE_JOB_PARSE)
+    return (const gchar *const *) data->pending_job->argv;
+  return (const gchar *const *) data->argv;
+}
+
+/*
+ * The project PCH is built in the background from the prefix header
+ * configured with the "pch" key, or with "auto" from the system headers
+ * most of the project files include. It's built with the arguments most
+ * files of the project and its compilation database are parsed with,
+ * for the language most of those are in, and only the files parsed with
+ * those arguments as that language use it. Until the first one is
+ * ready the TUs are parsed without it. Once it's ready all open documents are
+ * parsed again using it, and the headers it's made of are watched so
+ * it can be rebuilt when they change.
+ *
+ * Each build goes to a file named after its contents, so a rebuild
+ * never replaces the PCH under the TUs still using it. The documents
+ * are moved over to the new one explicitly, and the old file is kept
+ * until no document's arguments refer to it anymore. The prefix header
+ * generated for "auto" goes along with the last file built from it.
+ */
+
+static void cdk_plugin_queue_pch_build (CdkPlugin *self, guint delay);
+static void cdk_plugin_resume_warm_up (CdkPlugin *self);
+
+static void
+cdk_plugin_clear_pch_monitors (CdkPlugin *self)
+{
+  for (guint i = 0; i < self->priv->pch_monitors->len; i++)
+    {
+      GFileMonitor *monitor = self->priv->pch_monitors->pdata[i];
+      g_signal_handlers_disconnect_by_data (monitor, self);
+      g_file_monitor_cancel (monitor);
+    }
+  g_ptr_array_set_size (self->priv->pch_monitors, 0);
+}
+
+static gboolean
+cdk_plugin_argv_uses_pch (const gchar *const *argv, const gchar *pch_path)
+{
+  for (const gchar *const *it = argv; it != NULL && *it != NULL; it++)
+    {
+      if (g_strcmp0 (*it, "-include-pch") == 0 && g_strcmp0 (it[1], pch_path) == 0)
+        return TRUE;
+    }
+  return FALSE;
+}
+
+// Removes the superseded PCH files no TU uses, nor is being parsed with
+static void
+cdk_plugin_collect_pch (CdkPlugin *self)
+{
+  for (guint i = self->priv->pch_stale->len; i > 0; i--)
+    {
+      const gchar *pch_path = self->priv->pch_stale->pdata[i - 1];
+      gboolean in_use = FALSE;
+      GHashTableIter iter;
+      CdkDocumentData *data = NULL;
+
+      g_hash_table_iter_init (&iter, self->priv->doc_data);
+      while (! in_use && g_hash_table_iter_next (&iter, NULL, (gpointer *) &data))
+        {
+          in_use =
+            cdk_plugin_argv_uses_pch ((const gchar *const *) data->argv, pch_path) ||
+            (data->pending_job != NULL &&
+             cdk_plugin_argv_uses_pch ((const gchar *const *) data->pending_job->argv,
+                                       pch_path));
+        }
+
+      if (! in_use)
+        cdk_plugin_remove_stale_pch (self, i - 1);
+    }
+}
+
+// The part of a PCH file name the build's key makes up, the parser
+// names them <key>-<hash>.pch
+static gchar *
+cdk_plugin_get_pch_base (const gchar *pch_path)
+{
+  const gchar *end = strrchr (pch_path, '-');
+  return g_strndup (pch_path, end != NULL ? (gsize) (end - pch_path) : strlen (pch_path));
+}
+
+static gboolean
+cdk_plugin_is_pch_base (const gchar *pch_path, const gchar *base)
+{
+  gsize len = strlen (base);
+  return (pch_path != NULL && strncmp (pch_path, base, len) == 0 && pch_path[len] == '-' &&
+          strchr (pch_path + len + 1, '-') == NULL);
+}
+
+// Removes the index-th superseded PCH file, along with the prefix header
+// "auto" generated for it unless it's the one of another PCH too
+static void
+cdk_plugin_remove_stale_pch (CdkPlugin *self, guint index)
+{
+  gchar *base = cdk_plugin_get_pch_base (self->priv->pch_stale->pdata[index]);
+
+  g_unlink (self->priv->pch_stale->pdata[index]);
+  g_ptr_array_remove_index_fast (self->priv->pch_stale, index);
+
+  gboolean shared = cdk_plugin_is_pch_base (self->priv->pch_path, base);
+  for (guint i = 0; ! shared && i < self->priv->pch_stale->len; i++)
+    shared = cdk_plugin_is_pch_base (self->priv->pch_stale->pdata[i], base);
+
+  if (! shared)
+    {
+      gchar *header = g_strconcat (base, "-prefix.h", NULL);
+      g_unlink (header);
+      g_free (header);
+      header = g_strconcat (base, "-prefix.hh", NULL);
+      g_unlink (header);
+      g_free (header);
+    }
+
+  g_free (base);
+}
+
+// Stops using the PCH, the file stays until cdk_plugin_collect_pch()
+// finds it unused
+static void
+cdk_plugin_clear_pch (CdkPlugin *self)
+{
+  if (self->priv->pch_rebuild_hnd != 0)
+    g_source_remove (self->priv->pch_rebuild_hnd);
+  self->priv->pch_rebuild_hnd = 0;
+
+  cdk_plugin_clear_pch_monitors (self);
+
+  if (self->priv->pch_path != NULL)
+    g_ptr_array_add (self->priv->pch_stale, self->priv->pch_path);
+  self->priv->pch_path = NULL;
+  self->priv->pch_ready = FALSE;
+  self->priv->pch_job = NULL; // the result will be ignored
+}
+
+static void
+cdk_plugin_pch_header_changed (G_GNUC_UNUSED GFileMonitor *monitor,
+                               G_GNUC_UNUSED GFile *file,
+                               G_GNUC_UNUSED GFile *other_file,
+                               GFileMonitorEvent event,
+                               CdkPlugin *self)
+{
+  if (event != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+      event != G_FILE_MONITOR_EVENT_CREATED &&
+      event != G_FILE_MONITOR_EVENT_DELETED)
+    {
+      return;
+    }
+
+  // The PCH no longer matches its headers, stop using it right away
+  self->priv->pch_ready = FALSE;
+  cdk_plugin_queue_pch_build (self, 500);
+}
+
+static void
+cdk_plugin_pch_built (G_GNUC_UNUSED CdkParser *parser,
+                      CdkParseJob *job,
+                      CdkPlugin *self)
+{
+  // Superseded by another build or the project was closed, the file it
+  // built is unused unless it's the same as one in use
+  if (self->priv->pch_job != job)
+    {
+      gboolean known = (g_strcmp0 (self->priv->pch_path, job->output) == 0);
+      for (guint i = 0; ! known && i < self->priv->pch_stale->len; i++)
+        known = (g_strcmp0 (self->priv->pch_stale->pdata[i], job->output) == 0);
+      if (job->error == CXError_Success && ! known)
+        {
+          g_ptr_array_add (self->priv->pch_stale, g_strdup (job->output));
+          cdk_plugin_collect_pch (self);
+        }
+      return;
+    }
+
+  self->priv->pch_job = NULL;
+
+  if (job->error != CXError_Success)
+    {
+      g_warning ("failed to build precompiled header from '%s', error '%u'",
+                 job->filename, (guint) job->error);
+      cdk_plugin_resume_warm_up (self);
+      return;
+    }
+
+  // The same file again if the contents didn't change
+  for (guint i = self->priv->pch_stale->len; i > 0; i--)
+    {
+      if (g_strcmp0 (self->priv->pch_stale->pdata[i - 1], job->output) == 0)
+        g_ptr_array_remove_index_fast (self->priv->pch_stale, i - 1);
+    }
+  if (self->priv->pch_path != NULL && g_strcmp0 (self->priv->pch_path, job->output) != 0)
+    g_ptr_array_add (self->priv->pch_stale, self->priv->pch_path);
+  else
+    g_free (self->priv->pch_path);
+  self->priv->pch_path = g_strdup (job->output);
+  self->priv->pch_ready = TRUE;
+  g_strfreev (self->priv->pch_argv);
+  self->priv->pch_argv = g_strdupv (job->argv);
+  self->priv->pch_cxx = cdk_plugin_is_cxx_file (job->filename,
+                                                (const gchar *const *) job->argv);
+
+  cdk_plugin_clear_pch_monitors (self);
+  for (gchar **it = job->includes; it != NULL && *it != NULL; it++)
+    {
+      GFile *file = g_file_new_for_path (*it);
+      GFileMonitor *monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, NULL);
+      if (monitor != NULL)
+        {
+          g_signal_connect (monitor, "changed",
+                            G_CALLBACK (cdk_plugin_pch_header_changed), self);
+          g_ptr_array_add (self->priv->pch_monitors, monitor);
+        }
+      g_object_unref (file);
+    }
+
+  // Move the open documents over to the new PCH, superseding any job in
+  // flight with the old arguments. Evicted ones move when restored.
+  GHashTableIter iter;
+  CdkDocumentData *data = NULL;
+  g_hash_table_iter_init (&iter, self->priv->doc_data);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &data))
+    {
+      if (data->evicted || (! data->parsed && data->pending_job == NULL))
+        continue;
+
+      gchar **argv = cdk_plugin_get_argv (self, data->doc->real_path, TRUE);
+      if (argv != NULL &&
+          ! cdk_strv_equal ((const gchar *const *) argv, cdk_document_data_get_argv (data)))
+        {
+          data->needs_update = FALSE;
+          if (data->pending_job != NULL)
+            cdk_parse_job_cancel (data->pending_job);
+          data->pending_job = cdk_plugin_create_translation_unit (self, data->doc);
+        }
+      g_strfreev (argv);
+    }
+
+  cdk_plugin_collect_pch (self);
+  cdk_plugin_resume_warm_up (self);
+}
+
+static void
+cdk_plugin_group_file (GHashTable *groups,
+                       const gchar *filename,
+                       const gchar *const *args)
+{
+  if (args == NULL)
+    return;
+
+  GPtrArray *group = g_hash_table_lookup (groups, args);
+  if (group == NULL)
+    {
+      group = g_ptr_array_new ();
+      g_hash_table_insert (groups, (gpointer) args, group);
+    }
+  g_ptr_array_add (group, (gpointer) filename);
+}
+
+// The arguments most of the project's files and the compilation
+// database's are parsed with, the cflags if there are no files. Adds
+// the files parsed with them to sources.
+static const gchar *const *
+cdk_plugin_get_pch_args (CdkPlugin *self, GPtrArray *sources)
+{
+  // the vectors are interned, the same arguments are the same pointer
+  GHashTable *groups =
+    g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) g_ptr_array_unref);
+
+  // files is NULL-terminated
+  for (guint i = 0; i + 1 < self->priv->files->len; i++)
+    {
+      const gchar *filename = self->priv->files->pdata[i];
+      const gchar *const *args = cdk_compdb_lookup (self->priv->compdb, filename);
+      cdk_plugin_group_file (groups, filename,
+                             args != NULL ? args : self->priv->cflags_argv);
+    }
+
+  gsize n_files = 0;
+  const gchar *const *files = cdk_compdb_get_files (self->priv->compdb, &n_files);
+  for (gsize i = 0; i < n_files; i++)
+    {
+      if (! g_hash_table_contains (self->priv->file_set, files[i]))
+        cdk_plugin_group_file (groups, files[i],
+                               cdk_compdb_lookup (self->priv->compdb, files[i]));
+    }
+
+  const gchar *const *best_args = self->priv->cflags_argv;
+  GPtrArray *best = NULL;
+  GHashTableIter iter;
+  gpointer args = NULL, group = NULL;
+
+  g_hash_table_iter_init (&iter, groups);
+  while (g_hash_table_iter_next (&iter, &args, &group))
+    {
+      if (best == NULL || ((GPtrArray *) group)->len > best->len)
+        {
+          best_args = args;
+          best = group;
+        }
+    }
+
+  for (guint i = 0; best != NULL && i < best->len; i++)
+    g_ptr_array_add (sources, g_strdup (best->pdata[i]));
+
+  g_hash_table_destroy (groups);
+
+  return best_args;
+}
+
+static gboolean
+cdk_plugin_build_pch (CdkPlugin *self)
+{
+  const gchar *prefix = self->priv->pch_prefix;
+  gboolean is_auto = (g_strcmp0 (prefix, "auto") == 0);
+
+  self->priv->pch_rebuild_hnd = 0;
+  self->priv->pch_job = NULL;
+
+  // The current PCH, if still up to date, is used until the new one is in
+  if (! self->priv->project_open || prefix == NULL || prefix[0] == '\0' ||
+      self->priv->cache == NULL)
+    {
+      self->priv->pch_ready = FALSE;
+      cdk_plugin_resume_warm_up (self);
+      return FALSE;
+    }
+
+  // Built with the arguments most files share, only those use it
+  GPtrArray *sources = g_ptr_array_new_with_free_func (g_free);
+  const gchar *const *args = cdk_plugin_get_pch_args (self, sources);
+  if (args == NULL || (is_auto && sources->len == 0))
+    {
+      g_ptr_array_free (sources, TRUE);
+      self->priv->pch_ready = FALSE;
+      cdk_plugin_resume_warm_up (self);
+      return FALSE;
+    }
+  gchar **argv = g_strdupv ((gchar **) args);
+
+  const gchar *base_path = geany_data->app->project->base_path;
+  gchar *header = NULL;
+  if (is_auto)
+    header = g_strdup (base_path);
+  else if (g_path_is_absolute (prefix))
+    header = g_strdup (prefix);
+  else
+    header = g_build_filename (base_path, prefix, NULL);
+
+  gchar *key = cdk_cache_make_key (self->priv->cache, header,
+                                   (const gchar *const *) argv);
+  const gchar *cache_dir = cdk_cache_get_dir (self->priv->cache);
+
+  if (is_auto)
+    {
+      // For the language most of the sources are in, the files in the
+      // other one don't use it. clang picks the header language from
+      // the extension.
+      guint n_cxx = 0;
+      for (guint i = 0; i < sources->len; i++)
+        n_cxx += cdk_plugin_is_cxx_file (sources->pdata[i], (const gchar *const *) argv);
+      gboolean is_cxx = (n_cxx * 2 > sources->len);
+      for (guint i = sources->len; i > 0; i--)
+        {
+          if (cdk_plugin_is_cxx_file (sources->pdata[i - 1], (const gchar *const *) argv) != is_cxx)
+            g_ptr_array_remove_index (sources, i - 1);
+        }
+      gchar *name = g_strconcat (key, is_cxx ? "-prefix.hh" : "-prefix.h", NULL);
+      g_free (header);
+      header = g_build_filename (cache_dir, name, NULL);
+      g_free (name);
+    }
+
+  // the parser adds a hash of the contents to the name
+  gchar *name = g_strconcat (key, ".pch", NULL);
+  gchar *output = g_build_filename (cache_dir, name, NULL);
+  g_free (name);
+  g_free (key);
+
+  CdkParseJob *job =
+    cdk_parse_job_new (CDK_PARSE_JOB_BUILD_PCH, NULL, header, argv,
+                       (CdkParseFunc) cdk_plugin_pch_built, self);
+  job->output = output;
+  if (is_auto)
+    {
+      g_ptr_array_add (sources, NULL);
+      job->sources = (gchar **) g_ptr_array_free (sources, FALSE);
+    }
+  else
+    g_ptr_array_free (sources, TRUE);
+  g_free (header);
+
+  self->priv->pch_job = job;
+  cdk_parser_push (self->priv->parser, job);
+
+  return FALSE;
+}
+
+// Coalesces requests to (re)build the PCH, ie. while the project is
+// being loaded or a header is saved several times in a row
+static void
+cdk_plugin_queue_pch_build (CdkPlugin *self, guint delay)
+{
+  if (self->priv->pch_rebuild_hnd != 0)
+    g_source_remove (self->priv->pch_rebuild_hnd);
+  self->priv->pch_rebuild_hnd =
+    g_timeout_add (delay, (GSourceFunc) cdk_plugin_build_pch, self);
+}
+
+/*
+ * With "warm-up" set, all of the project's files that aren't open are
+ * parsed in the background when it's opened, so their TUs are in the
+ * cache by the time they are. It's done by a parser of its own with a
+ * thread (and worker process if out of process) for every core but
+ * one, which is left to the documents being edited. The PCH is part of
+ * the arguments, so a warm-up waits for it to be built. Files already
+ * in the cache are skipped, and the parser is freed once done.
+ */
+
+static void
+cdk_plugin_stop_warm_up (CdkPlugin *self)
+{
+  if (self->priv->warm_up_hnd != 0)
+    g_source_remove (self->priv->warm_up_hnd);
+  self->priv->warm_up_hnd = 0;
+
+  // waits for the parses running, the queued ones are skipped
+  cdk_parser_free (self->priv->warm_up_parser);
+  self->priv->warm_up_parser = NULL;
+  self->priv->warm_up_pending = 0;
+  self->priv->warm_up_queued = FALSE;
+}
+
+static gboolean
+cdk_plugin_finish_warm_up (CdkPlugin *self)
+{
+  self->priv->warm_up_hnd = 0;
+  cdk_plugin_stop_warm_up (self);
+  return FALSE;
+}
+
+static void
+cdk_plugin_warmed_up (G_GNUC_UNUSED CdkParser *parser,
+                      CdkParseJob *job,
+                      CdkPlugin *self)
+{
+  if (job->error != CXError_Success)
+    g_debug ("failed to warm up '%s', error '%u'", job->filename, (guint) job->error);
+
+  // can't free the parser from its own callback
+  if (--self->priv->warm_up_pending == 0 && self->priv->warm_up_hnd == 0)
+    self->priv->warm_up_hnd = g_idle_add ((GSourceFunc) cdk_plugin_finish_warm_up, self);
+}
+
+static gboolean
+cdk_plugin_is_file_open (CdkPlugin *self, const gchar *filename)
+{
+  GHashTableIter iter;
+  CdkDocumentData *data = NULL;
+
+  g_hash_table_iter_init (&iter, self->priv->doc_data);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &data))
+    {
+      if (g_strcmp0 (data->doc->real_path, filename) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+cdk_plugin_start_warm_up (CdkPlugin *self)
+{
+  cdk_plugin_stop_warm_up (self);
+
+  if (! self->priv->warm_up || ! self->priv->project_open || self->priv->cache == NULL)
+    return;
+
+  guint n_slots = MAX (g_get_num_processors (), 2) - 1;
+  self->priv->warm_up_parser =
+    cdk_parser_new (self->priv->cache, n_slots, self->priv->out_of_process);
+
+  // files is NULL-terminated
+  for (guint i = 0; i + 1 < self->priv->files->len; i++)
+    {
+      const gchar *filename = self->priv->files->pdata[i];
+      if (cdk_plugin_is_file_open (self, filename))
+        continue;
+
+      gchar **argv = cdk_plugin_get_argv (self, filename, TRUE);
+      if (argv == NULL)
+        continue;
+
+      CdkParseJob *job =
+        cdk_parse_job_new (CDK_PARSE_JOB_WARM_UP, NULL, filename, argv,
+                           (CdkParseFunc) cdk_plugin_warmed_up, self);
+      job->cache_key = cdk_plugin_make_cache_key (self, filename, argv);
+      cdk_parser_push (self->priv->warm_up_parser, job);
+      self->priv->warm_up_pending++;
+    }
+
+  if (self->priv->warm_up_pending == 0)
+    cdk_plugin_stop_warm_up (self);
+}
+
+// Starts a warm-up that was waiting for the PCH
+static void
+cdk_plugin_resume_warm_up (CdkPlugin *self)
+{
+  if (self->priv->warm_up_queued)
+    cdk_plugin_start_warm_up (self);
+}
+
+static void
+cdk_plugin_queue_warm_up (CdkPlugin *self)
+{
+  cdk_plugin_stop_warm_up (self);
+
+  if (! self->priv->warm_up)
+    return;
+
+  if (self->priv->pch_rebuild_hnd != 0 || self->priv->pch_job != NULL)
+    self->priv->warm_up_queued = TRUE;
+  else
+    cdk_plugin_start_warm_up (self);
+}
+
+/*
+ * With "symbol-index" set, all of the project's files are indexed in
+ * the background when it's opened, see cdkindex.c, so things can be
+ * looked up across files. The index is kept next to the TU cache and
+ * the one from last time is used until the new one is done. After
+ * that it follows changes to the files on its own, indexing the open
+ * documents first. Like a warm-up it's done on every core but one, and
+ * without the PCH, which is made of system headers the index leaves
+ * out anyway.
+ */
+
+static void
+cdk_plugin_stop_index (CdkPlugin *self)
+{
+  cdk_index_free (self->priv->index);
+  self->priv->index = NULL;
+}
+
+static void
+cdk_plugin_indexed (CdkIndex *index, G_GNUC_UNUSED CdkPlugin *self)
+{
+  g_debug ("indexed %u symbols of the project", cdk_index_get_n_symbols (index));
+}
+
+static void
+cdk_plugin_start_index (CdkPlugin *self)
+{
+  if (! self->priv->symbol_index || ! self->priv->project_open || self->priv->cache == NULL)
+    {
+      cdk_plugin_stop_index (self);
+      return;
+    }
+
+  // One for each project directory
+  if (self->priv->index == NULL)
+    {
+      gchar *key = cdk_cache_make_key (self->priv->cache,
+                                       geany_data->app->project->base_path, NULL);
+      gchar *name = g_strconcat (key, ".index", NULL);
+      gchar *path = g_build_filename (cdk_cache_get_dir (self->priv->cache), name, NULL);
+      self->priv->index = cdk_index_new (path);
+      g_free (path);
+      g_free (name);
+      g_free (key);
+    }
+
+  GArray *sources = g_array_new (FALSE, FALSE, sizeof (CdkIndexSource));
+  // files is NULL-terminated
+  for (guint i = 0; i + 1 < self->priv->files->len; i++)
+    {
+      CdkIndexSource source;
+      source.argv = cdk_plugin_get_argv (self, self->priv->files->pdata[i], FALSE);
+      if (source.argv == NULL)
+        continue;
+      source.filename = g_strdup (self->priv->files->pdata[i]);
+      g_array_append_val (sources, source);
+    }
+
+  // The documents already open go first
+  GHashTableIter iter;
+  GeanyDocument *doc = NULL;
+  g_hash_table_iter_init (&iter, self->priv->doc_data);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &doc, NULL))
+    {
+      if (doc->real_path != NULL)
+        cdk_index_set_file_open (self->priv->index, doc->real_path, TRUE);
+    }
+
+  guint n_threads = MAX (g_get_num_processors (), 2) - 1;
+  cdk_index_set_sources (self->priv->index, sources, n_threads,
+                         (CdkIndexFunc) cdk_plugin_indexed, self);
+}
+
+/*
+ * With a memory budget set, the TUs of the least recently activated
+ * documents are dropped once the resident TUs use more than that. The
+ * spare TUs of documents other than the current one go first, which
+ * only makes their next reparse a full parse. On the way out a TU is
+ * saved to the cache if it still matches the buffer, so when its
+ * document is activated again it's usually loaded from there rather
+ * than parsed. Out of process that's only if the buffer is unmodified,
+ * and it's the worker process' TU that's dropped.
+ */
+
+static void
+cdk_plugin_evict_document (CdkPlugin *self, CdkDocumentData *data)
+{
+  CdkParseJob *job =
+    cdk_parse_job_new (CDK_PARSE_JOB_DISPOSE, data->doc, data->doc->real_path,
+                       NULL, NULL, NULL);
+
+  if (! data->from_cache && ! data->tu_overlaid &&
+      data->tu_revision == cdk_document_get_revision (data->doc))
+    {
+      job->cache_key = g_strdup (data->cache_key);
+      job->contents = cdk_plugin_snapshot_document (self, data->doc);
+    }
+
+  job->tu = data->tu;
+  data->tu = NULL;
+  data->parsed = FALSE;
+  memset (&data->usage, 0, sizeof (CdkResourceUsage));
+  data->evicted = TRUE;
+  cdk_document_data_clear_results (data);
+
+  if (data->spare_tu != NULL)
+    clang_disposeTranslationUnit (data->spare_tu);
+  data->spare_tu = NULL;
+  memset (&data->spare_usage, 0, sizeof (CdkResourceUsage));
+
+  cdk_parser_push (self->priv->parser, job);
+
+  g_signal_emit_by_name (self, "resource-usage-changed", data->doc);
+}
+
+static void
+cdk_plugin_restore_document (CdkPlugin *self, CdkDocumentData *data)
+{
+  data->evicted = FALSE;
+  data->pending_job = cdk_plugin_create_translation_unit (self, data->doc);
+}
+
+static void
+cdk_plugin_enforce_memory_budget (CdkPlugin *self)
+{
+  if (self->priv->memory_budget == 0)
+    return;
+
+  for (;;)
+    {
+      GHashTableIter iter;
+      CdkDocumentData *data = NULL, *lru = NULL, *lru_spare = NULL;
+      guint64 total = 0;
+
+      g_hash_table_iter_init (&iter, self->priv->doc_data);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &data))
+        {
+          if (data->spare_tu != NULL)
+            {
+              total += data->spare_usage.total;
+              if (data->doc != self->priv->current_doc &&
+                  (lru_spare == NULL || data->last_active < lru_spare->last_active))
+                {
+                  lru_spare = data;
+                }
+            }
+          if (! data->parsed)
+            continue;
+          total += data->usage.total;
+          if (data->doc != self->priv->current_doc &&
+              data->pending_job == NULL &&
+              (lru == NULL || data->last_active < lru->last_active))
+            {
+              lru = data;
+            }
+        }
+
+      if (total <= self->priv->memory_budget || (lru == NULL && lru_spare == NULL))
+        break;
+
+      if (lru_spare != NULL)
+        {
+          clang_disposeTranslationUnit (lru_spare->spare_tu);
+          lru_spare->spare_tu = NULL;
+          memset (&lru_spare->spare_usage, 0, sizeof (CdkResourceUsage));
+          g_signal_emit_by_name (self, "resource-usage-changed", lru_spare->doc);
+        }
+      else
+        cdk_plugin_evict_document (self, lru);
+    }
+}
+
+gboolean
+cdk_plugin_add_document (CdkPlugin *self, struct GeanyDocument *doc)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
+
+  if (! cdk_plugin_is_supported_document (self, doc))
+    return FALSE;
+
+  // In case the document was already added, remove previous one first
+  cdk_plugin_remove_document (self, doc);
+
+  // The TU is parsed in the background, the helpers stay pending
+  // until it arrives
+  CdkParseJob *job = cdk_plugin_create_translation_unit (self, doc);
+  if (job == NULL)
+    return FALSE;
+
+  CdkDocumentData *data = cdk_document_data_new ();
+  data->plugin = self;
+  data->pending_job = job;
+  data->highlighter = cdk_highlighter_new (self, doc);
+  data->completer = cdk_completer_new (self, doc);
+  data->diagnostics = cdk_diagnostics_new (self, doc);
+  data->doc = doc;
+
+  cdk_highlighter_set_style_scheme (data->highlighter, self->priv->scheme);
+
+  if (self->priv->index != NULL && doc->real_path != NULL)
+    cdk_index_set_file_open (self->priv->index, doc->real_path, TRUE);
+
+  g_hash_table_insert (self->priv->doc_data, doc, data);
+  g_signal_emit_by_name (self, "document-added", doc);
+
+  return TRUE;
+}
+
+gboolean
+cdk_plugin_remove_document (CdkPlugin *self, struct GeanyDocument *doc)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
+  if (! g_hash_table_remove (self->priv->doc_data, doc))
+    return FALSE;
+  // it may have been the last TU on an old PCH
+  cdk_plugin_collect_pch (self);
+  return TRUE;
+}
+
+// Whether a reparse would produce the same TU as the current one, ie.
+// neither the buffer nor any of the files it was parsed from changed
+static gboolean
+cdk_plugin_is_document_current (CdkPlugin *self, CdkDocumentData *data)
+{
+  if (data->tu_revision != cdk_document_get_revision (data->doc) || data->depends == NULL)
+    return FALSE;
+
+  // Saved since, reparse so the cache gets the TU matching the file
+  if (data->tu_unsaved && ! data->doc->changed && self->priv->cache != NULL)
+    return FALSE;
+
+  for (guint i = 0; i < data->depends->len; i++)
+    {
+      const CdkFileStamp *stamp = &g_array_index (data->depends, CdkFileStamp, i);
+
+      // A dirty buffer is current if the TU saw it as it is now
+      CdkOverlayEntry *entry =
+        g_hash_table_lookup (self->priv->overlay_files, stamp->filename);
+      if (entry != NULL && entry->doc != data->doc)
+        {
+          if (stamp->mtime != -1 || entry->serial > data->tu_overlay_serial)
+            return FALSE;
+          continue;
+        }
+
+      // Edits within the same second as the parse are told apart by
+      // the nanoseconds, which aren't recorded if in doubt
+      GStatBuf st;
+      if (g_stat (stamp->filename, &st) != 0 || (gint64) st.st_mtime != stamp->mtime ||
+          stamp->mtime_nsec == -1 || cdk_file_stamp_get_mtime_nsec (&st) != stamp->mtime_nsec)
+        {
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/*
+ * Reparses the document's TU in the background against a snapshot of
+ * the buffer. The current TU stays usable meanwhile: the parser reparses
+ * the document's spare TU, or parses it anew if there's none, and the
+ * current one becomes the spare once the result arrives. Results for a
+ * revision older than the buffer are dropped and the document is
+ * reparsed again, so the helpers only ever see the newest revision.
+ * Nothing is done if neither the buffer nor any of the files the TU
+ * was parsed from changed since, so it's cheap to call on activation.
+ *
+ * Returns TRUE if a reparse was queued.
+ */
+gboolean
+cdk_plugin_update_document (CdkPlugin *self, struct GeanyDocument *doc)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
+
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+  if (data == NULL)
+    return FALSE;
+
+  // whatever was scheduled is taken care of now
+  data->update_due = 0;
+
+  if (data->evicted)
+    {
+      cdk_plugin_restore_document (self, data);
+      return (data->pending_job != NULL);
+    }
+
+  // Still being (re)parsed, update once the TU arrives unless it's
+  // already being parsed from the current buffer
+  if (data->pending_job != NULL || ! data->parsed)
+    {
+      if (data->pending_job == NULL ||
+          data->pending_job->revision != cdk_document_get_revision (doc))
+        {
+          data->needs_update = TRUE;
+          // No point in running it if it's still queued. The first parse
+          // always runs though, or constant typing would keep restarting
+          // it and never get a TU; a stale one is installed and brought
+          // up to date by a cheap reparse.
+          if (data->pending_job != NULL && data->parsed)
+            cdk_parse_job_cancel (data->pending_job);
+        }
+      return FALSE;
+    }
+
+  // A TU loaded from an AST file can't be reparsed nor code-complete,
+  // replace it even if it's current
+  if (data->from_cache)
+    {
+      data->pending_job = cdk_plugin_create_translation_unit (self, doc);
+      return (data->pending_job != NULL);
+    }
+
+  if (cdk_plugin_is_document_current (self, data))
+    return FALSE;
+
+  CdkParseJob *job =
+    cdk_parse_job_new (CDK_PARSE_JOB_REPARSE, doc, doc->real_path,
+                       // a worker process may have to parse it from scratch
+                       g_strdupv (data->argv),
+                       (CdkParseFunc) cdk_plugin_translation_unit_created,
+                       self);
+  job->contents = cdk_plugin_snapshot_document (self, doc);
+  job->cache_key = g_strdup (data->cache_key);
+  job->overlay = cdk_plugin_get_job_overlay (self, doc);
+  job->overlay_serial = self->priv->overlay_serial;
+  job->revision = cdk_document_get_revision (doc);
+  job->tu = data->spare_tu;
+  data->spare_tu = NULL;
+  memset (&data->spare_usage, 0, sizeof (CdkResourceUsage));
+  data->pending_job = job;
+
+  cdk_parser_push (self->priv->parser, job);
+
+  return TRUE;
+}
+
+/*
+ * Edits schedule an update of their document instead of reparsing it
+ * right away. Each document has its own due time, pushed back by every
+ * further edit for a window sized from how long its reparses take, so
+ * a big TU waits for the typing to settle while a small one is kept up
+ * to date almost immediately. The current document is updated as soon
+ * as it's due. The others only while fewer (re)parses are pending than
+ * the parser has slots to spare, so they never hold up the document
+ * being edited in the parser's queue.
+ */
+
+#define CDK_UPDATE_DELAY_DEFAULT (250 * G_TIME_SPAN_MILLISECOND)
+#define CDK_UPDATE_DELAY_MIN     (50 * G_TIME_SPAN_MILLISECOND)
+#define CDK_UPDATE_DELAY_MAX     (2 * G_TIME_SPAN_SECOND)
+
+static gint64
+cdk_document_data_get_update_delay (CdkDocumentData *data)
+{
+  if (data->reparse_cost == 0)
+    return CDK_UPDATE_DELAY_DEFAULT;
+  return CLAMP (2 * data->reparse_cost, CDK_UPDATE_DELAY_MIN, CDK_UPDATE_DELAY_MAX);
+}
+
+// Whether the parser has as many (re)parses pending as the other
+// documents may take up
+static gboolean
+cdk_plugin_is_parser_busy (CdkPlugin *self)
+{
+  GHashTableIter iter;
+  CdkDocumentData *data = NULL;
+  guint n_pending = 0;
+
+  if (self->priv->pch_job != NULL)
+    return TRUE;
+
+  g_hash_table_iter_init (&iter, self->priv->doc_data);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &data))
+    {
+      if (data->pending_job != NULL && ++n_pending >= self->priv->background_limit)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+// The document with the update to run next, or NULL if there's none
+// that can run yet. Stores when it's due in due.
+static CdkDocumentData *
+cdk_plugin_next_scheduled (CdkPlugin *self, gint64 *due)
+{
+  GHashTableIter iter;
+  CdkDocumentData *data = NULL, *next = NULL, *current = NULL;
+
+  if (self->priv->current_doc != NULL)
+    {
+      current = g_hash_table_lookup (self->priv->doc_data, self->priv->current_doc);
+      if (current != NULL && current->update_due == 0)
+        current = NULL;
+    }
+
+  if (! cdk_plugin_is_parser_busy (self))
+    {
+      g_hash_table_iter_init (&iter, self->priv->doc_data);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &data))
+        {
+          if (data != current && data->update_due != 0 &&
+              (next == NULL || data->update_due < next->update_due))
+            {
+              next = data;
+            }
+        }
+    }
+
+  // The current document goes first among those already due
+  if (current != NULL &&
+      (next == NULL ||
+       current->update_due <= MAX (next->update_due, g_get_monotonic_time ())))
+    {
+      next = current;
+    }
+
+  if (next != NULL)
+    *due = next->update_due;
+
+  return next;
+}
+
+static gboolean
+cdk_plugin_run_scheduler (CdkPlugin *self)
+{
+  self->priv->schedule_hnd = 0;
+
+  gint64 due = 0;
+  CdkDocumentData *data = cdk_plugin_next_scheduled (self, &due);
+  if (data != NULL && due <= g_get_monotonic_time ())
+    cdk_plugin_update_document (self, data->doc);
+
+  cdk_plugin_rearm_scheduler (self);
+
+  return FALSE;
+}
+
+static void
+cdk_plugin_rearm_scheduler (CdkPlugin *self)
+{
+  gint64 due = 0;
+  if (cdk_plugin_next_scheduled (self, &due) == NULL)
+    {
+      if (self->priv->schedule_hnd != 0)
+        g_source_remove (self->priv->schedule_hnd);
+      self->priv->schedule_hnd = 0;
+      return;
+    }
+
+  if (self->priv->schedule_hnd != 0)
+    {
+      if (self->priv->schedule_due == due)
+        return;
+      g_source_remove (self->priv->schedule_hnd);
+    }
+
+  gint64 delay = MAX (0, due - g_get_monotonic_time ());
+  self->priv->schedule_due = due;
+  self->priv->schedule_hnd =
+    g_timeout_add_full (G_PRIORITY_DEFAULT_IDLE,
+                        (guint) (delay / G_TIME_SPAN_MILLISECOND),
+                        (GSourceFunc) cdk_plugin_run_scheduler, self, NULL);
+}
+
+static void
+cdk_plugin_clear_scheduler (CdkPlugin *self)
+{
+  if (self->priv->schedule_hnd != 0)
+    g_source_remove (self->priv->schedule_hnd);
+  self->priv->schedule_hnd = 0;
+}
+
+/*
+ * Schedules an update of the document for when the editing is likely
+ * to have settled. Calling it again before then postpones the update,
+ * but by no more than twice the delay after the first call so it's not
+ * starved by continuous typing.
+ */
+void
+cdk_plugin_schedule_update (CdkPlugin *self, struct GeanyDocument *doc)
+{
+  g_return_if_fail (CDK_IS_PLUGIN (self));
+
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+  if (data == NULL)
+    return;
+
+  gint64 now = g_get_monotonic_time ();
+  gint64 delay = cdk_document_data_get_update_delay (data);
+
+  if (data->update_due == 0)
+    data->update_limit = now + 2 * delay;
+  data->update_due = MIN (now + delay, data->update_limit);
+
+  cdk_plugin_rearm_scheduler (self);
+}
+
+/*
+ * Called when doc is saved or closed, so the other documents whose TUs
+ * were parsed from its file are updated in the background. They run
+ * like any other update of a document other than the current one, on
+ * as many of the parser's slots as are left for those.
+ */
+void
+cdk_plugin_update_dependents (CdkPlugin *self, struct GeanyDocument *doc)
+{
+  g_return_if_fail (CDK_IS_PLUGIN (self));
+  g_return_if_fail (doc != NULL);
+
+  if (doc->real_path == NULL)
+    return;
+
+  GHashTable *includers = g_hash_table_lookup (self->priv->includers, doc->real_path);
+  if (includers == NULL)
+    return;
+
+  GHashTableIter iter;
+  CdkDocumentData *data = NULL;
+  gint64 now = g_get_monotonic_time ();
+
+  // Due right away, those whose TU is still current are skipped then.
+  // Evicted ones are brought back up to date when they're activated.
+  g_hash_table_iter_init (&iter, includers);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &data, NULL))
+    {
+      if (data->doc == doc || data->evicted)
+        continue;
+      data->update_due = now;
+      data->update_limit = now;
+    }
+
+  cdk_plugin_rearm_scheduler (self);
+}
+
+/*
+ * The document's TU, NULL if it's pending or out of process, where the
+ * TU is only in a worker process. The results worked out along with it
+ * are there either way.
+ */
+struct CXTranslationUnitImpl *
+cdk_plugin_get_translation_unit (CdkPlugin *self,
+                                 struct GeanyDocument *doc)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), NULL);
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+  if (data != NULL)
+    return data->tu;
+  return NULL;
+}
+
+/*
+ * Revision of the buffer the document's TU was parsed at, compare with
+ * cdk_document_get_revision() to tell if it's behind the buffer.
+ */
+guint
+cdk_plugin_get_translation_unit_revision (CdkPlugin *self,
+                                          struct GeanyDocument *doc)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), 0);
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+  if (data != NULL)
+    return data->tu_revision;
+  return 0;
+}
+
+/*
+ * The styles of the tokens of the document's TU, worked out along with
+ * it, as a sorted array of CdkStyleRun. NULL if there's no TU. Their
+ * offsets are those of the TU's revision.
+ */
+GArray *
+cdk_plugin_get_style_runs (CdkPlugin *self,
+                           struct GeanyDocument *doc)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), NULL);
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+  if (data != NULL)
+    return data->runs;
+  return NULL;
+}
+
+/*
+ * The identifiers of the document's TU that refer to something, found
+ * along with it, as a sorted array of CdkOccurrence. NULL if there's no
+ * TU. Their offsets are those of the TU's revision.
+ */
+GArray *
+cdk_plugin_get_occurrences (CdkPlugin *self,
+                            struct GeanyDocument *doc)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), NULL);
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+  if (data != NULL)
+    return data->occurrences;
+  return NULL;
+}
+
+/*
+ * The diagnostics of the document's TU, worked out along with it, as an
+ * array of CdkDiagnostic. NULL if there's no TU. Their offsets are those
+ * of the TU's revision.
+ */
+GArray *
+cdk_plugin_get_diagnostics (CdkPlugin *self,
+                            struct GeanyDocument *doc)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), NULL);
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+  if (data != NULL)
+    return data->diags;
+  return NULL;
+}
+
+/*
+ * The highlighter of the document, or NULL if it wasn't added.
+ */
+struct CdkHighlighter_ *
+cdk_plugin_get_highlighter (CdkPlugin *self,
+                            struct GeanyDocument *doc)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), NULL);
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+  if (data != NULL)
+    return data->highlighter;
+  return NULL;
+}
+
+/*
+ * Whether libclang runs in worker processes rather than in-process, in
+ * which case the documents have no TU here, only the results worked out
+ * along with it, and complete through the worker process, see
+ * cdk_plugin_request_completion().
+ */
+gboolean
+cdk_plugin_is_out_of_process (CdkPlugin *self)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
+  return cdk_parser_is_out_of_process (self->priv->parser);
+}
+
+/*
+ * Whether the project asks for libclang to run in worker processes, set
+ * by the "out-of-process" key. The parser falls back to in-process when
+ * it can't start them, see cdk_plugin_is_out_of_process() for that.
+ */
+gboolean
+cdk_plugin_get_out_of_process (CdkPlugin *self)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
+  return self->priv->out_of_process;
+}
+
+static void
+cdk_plugin_completion_done (G_GNUC_UNUSED CdkParser *parser,
+                            CdkParseJob *job,
+                            CdkPlugin *self)
+{
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, job->doc);
+
+  // The document was removed or a newer request superseded it
+  if (data == NULL || data->complete_job != job)
+    {
+      cdk_plugin_record_job_outcome (self, CDK_LATENCY_COMPLETE, job->discarded ?
+                                       CDK_JOB_DISCARDED : CDK_JOB_CANCELLED);
+      return;
+    }
+
+  data->complete_job = NULL;
+
+  if (job->error != CXError_Success)
+    g_warning ("failed to complete in '%s', error '%u'",
+               job->filename, (guint) job->error);
+
+  cdk_completer_show_completions (data->completer, job->revision, job->completions);
+}
+
+/*
+ * Has the worker process owning the document's TU code complete at the
+ * 1-based line and column of the buffer as it is now. The results are
+ * handed to the document's completer once they're in, unless another
+ * request for the document came in meanwhile.
+ *
+ * Returns FALSE if the document isn't known or parsing in-process.
+ */
+gboolean
+cdk_plugin_request_completion (CdkPlugin *self,
+                               struct GeanyDocument *doc,
+                               guint line,
+                               guint column)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
+
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+  if (data == NULL || ! cdk_plugin_is_out_of_process (self))
+    return FALSE;
+
+  if (data->complete_job != NULL)
+    cdk_parse_job_cancel (data->complete_job);
+
+  CdkParseJob *job =
+    cdk_parse_job_new (CDK_PARSE_JOB_COMPLETE, doc, doc->real_path,
+                       g_strdupv (data->argv),
+                       (CdkParseFunc) cdk_plugin_completion_done,
+                       self);
+  job->contents = cdk_plugin_snapshot_document (self, doc);
+  job->overlay = cdk_plugin_get_job_overlay (self, doc);
+  job->overlay_serial = self->priv->overlay_serial;
+  job->revision = cdk_document_get_revision (doc);
+  job->line = line;
+  job->column = column;
+  data->complete_job = job;
+
+  cdk_parser_push (self->priv->parser, job);
+
+  return TRUE;
+}
+
+/*
+ * Whether the project's files are parsed into the cache in the
+ * background when it's opened, set by the "warm-up" key.
+ */
+gboolean
+cdk_plugin_get_warm_up (CdkPlugin *self)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
+  return self->priv->warm_up;
+}
+
+/*
+ * Whether a warm-up is in progress.
+ */
+gboolean
+cdk_plugin_is_warming_up (CdkPlugin *self)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
+  return (self->priv->warm_up_parser != NULL || self->priv->warm_up_queued);
+}
+
+/*
+ * Whether an index of the symbols in all of the project's files is
+ * kept, set by the "symbol-index" key.
+ */
+gboolean
+cdk_plugin_get_symbol_index (CdkPlugin *self)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
+  return self->priv->symbol_index;
+}
+
+/*
+ * Whether the symbol index is being built.
+ */
+gboolean
+cdk_plugin_is_indexing (CdkPlugin *self)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
+  return (self->priv->index != NULL && cdk_index_is_building (self->priv->index));
+}
+
+/*
+ * The project's symbol index, or NULL if it has none. It belongs to
+ * the plugin and goes away with the project.
+ */
+CdkIndex *
+cdk_plugin_get_index (CdkPlugin *self)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), NULL);
+  return self->priv->index;
+}
+
+/*
+ * Looks the symbol with the given USR up in the project's symbol index,
+ * see cdk_index_lookup(). Returns NULL if there's no index.
+ */
+GArray *
+cdk_plugin_lookup_symbol (CdkPlugin *self, const gchar *usr, guint kinds)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), NULL);
+  g_return_val_if_fail (usr != NULL, NULL);
+
+  if (self->priv->index == NULL)
+    return NULL;
+
+  gint64 start = g_get_monotonic_time ();
+  GArray *locations = cdk_index_lookup (self->priv->index, usr, kinds);
+  cdk_plugin_record_latency (self, NULL, CDK_LATENCY_LOOKUP,
+                             g_get_monotonic_time () - start);
+
+  return locations;
+}
+
+gboolean
+cdk_plugin_is_document_pending (CdkPlugin *self,
+                                struct GeanyDocument *doc)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+  return (data != NULL && ! data->parsed);
+}
+
+/*
+ * Whether the document is being (re)parsed, its current TU if any is
+ * to be replaced once that's done.
+ */
+gboolean
+cdk_plugin_is_document_updating (CdkPlugin *self,
+                                 struct GeanyDocument *doc)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+  return (data != NULL && data->pending_job != NULL);
+}
+
+/*
+ * Fills usage with the memory used by the document's TU as measured
+ * when it was last (re)parsed, plus its spare TU if it has one. Out of
+ * process that's the memory of the worker process' TU. Returns FALSE
+ * and zeros usage if the document has no TU in memory, ie. it's pending
+ * or was evicted.
+ */
+gboolean
+cdk_plugin_get_resource_usage (CdkPlugin *self,
+                               struct GeanyDocument *doc,
+                               CdkResourceUsage *usage)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
+  g_return_val_if_fail (usage != NULL, FALSE);
+
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+  if (data == NULL || ! data->parsed)
+    {
+      memset (usage, 0, sizeof (CdkResourceUsage));
+      return FALSE;
+    }
+
+  *usage = data->usage;
+  cdk_resource_usage_add (usage, &data->spare_usage);
+  return TRUE;
+}
+
+/*
+ * Fills usage with the memory used by all TUs currently in memory.
+ */
+void
+cdk_plugin_get_project_resource_usage (CdkPlugin *self,
+                                       CdkResourceUsage *usage)
+{
+  g_return_if_fail (CDK_IS_PLUGIN (self));
+  g_return_if_fail (usage != NULL);
+
+  memset (usage, 0, sizeof (CdkResourceUsage));
+
+  GHashTableIter iter;
+  CdkDocumentData *data = NULL;
+  g_hash_table_iter_init (&iter, self->priv->doc_data);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &data))
+    {
+      if (data->parsed)
+        cdk_resource_usage_add (usage, &data->usage);
+      cdk_resource_usage_add (usage, &data->spare_usage);
+    }
+}
+
+/*
+ * Records that doc spent usecs in the hot path kind, for the document
+ * and the project. Must be called from the main thread.
+ */
+void
+cdk_plugin_record_latency (CdkPlugin *self,
+                           struct GeanyDocument *doc,
+                           CdkLatencyKind kind,
+                           gint64 usecs)
+{
+  g_return_if_fail (CDK_IS_PLUGIN (self));
+  g_return_if_fail (kind < CDK_NUM_LATENCIES);
+
+  usecs = MAX (usecs, 0);
+  cdk_histogram_record (self->priv->latency[kind], usecs);
+
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+  if (data != NULL)
+    {
+      if (data->latency[kind] == NULL)
+        data->latency[kind] = cdk_histogram_new ();
+      cdk_histogram_record (data->latency[kind], usecs);
+    }
+}
+
+static void
+cdk_latency_stats_fill (CdkLatencyStats *stats, const CdkHistogram *hist)
+{
+  stats->count = cdk_histogram_get_count (hist);
+  stats->p50 = cdk_histogram_get_percentile (hist, 50.0);
+  stats->p95 = cdk_histogram_get_percentile (hist, 95.0);
+  stats->p99 = cdk_histogram_get_percentile (hist, 99.0);
+  stats->max = cdk_histogram_get_max (hist);
+}
+
+/*
+ * Fills stats with the timings of kind recorded for the document since
+ * it was added. Returns FALSE and zeros stats if none were recorded.
+ */
+gboolean
+cdk_plugin_get_latency_stats (CdkPlugin *self,
+                              struct GeanyDocument *doc,
+                              CdkLatencyKind kind,
+                              CdkLatencyStats *stats)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
+  g_return_val_if_fail (kind < CDK_NUM_LATENCIES, FALSE);
+  g_return_val_if_fail (stats != NULL, FALSE);
+
+  CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+  if (data == NULL || data->latency[kind] == NULL)
+    {
+      memset (stats, 0, sizeof (CdkLatencyStats));
+      return FALSE;
+    }
+
+  cdk_latency_stats_fill (stats, data->latency[kind]);
+  return TRUE;
+}
+
+/*
+ * Fills stats with the timings of kind recorded for all documents since
+ * the project was opened, including ones that were closed since.
+ */
+void
+cdk_plugin_get_project_latency_stats (CdkPlugin *self,
+                                      CdkLatencyKind kind,
+                                      CdkLatencyStats *stats)
+{
+  g_return_if_fail (CDK_IS_PLUGIN (self));
+  g_return_if_fail (kind < CDK_NUM_LATENCIES);
+  g_return_if_fail (stats != NULL);
+
+  cdk_latency_stats_fill (stats, self->priv->latency[kind]);
+}
+
+/*
+ * Counts what became of a job, to see how much work is wasted on
+ * results that are out of date by the time they'd be used. Must be
+ * called from the main thread.
+ */
+void
+cdk_plugin_record_job_outcome (CdkPlugin *self,
+                               CdkLatencyKind kind,
+                               CdkJobOutcome outcome)
+{
+  g_return_if_fail (CDK_IS_PLUGIN (self));
+  g_return_if_fail (kind < CDK_NUM_LATENCIES);
+  g_return_if_fail (outcome < CDK_NUM_JOB_OUTCOMES);
+
+  self->priv->outcomes[kind][outcome]++;
+}
+
+/*
+ * Number of jobs of kind with the outcome since the project was opened.
+ */
+guint64
+cdk_plugin_get_job_outcome_count (CdkPlugin *self,
+                                  CdkLatencyKind kind,
+                                  CdkJobOutcome outcome)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), 0);
+  g_return_val_if_fail (kind < CDK_NUM_LATENCIES, 0);
+  g_return_val_if_fail (outcome < CDK_NUM_JOB_OUTCOMES, 0);
+
+  return self->priv->outcomes[kind][outcome];
+}
+
+/*
+ * Forgets all timings and job outcomes recorded so far.
+ */
+void
+cdk_plugin_reset_latency_stats (CdkPlugin *self)
+{
+  g_return_if_fail (CDK_IS_PLUGIN (self));
+
+  for (guint i = 0; i < CDK_NUM_LATENCIES; i++)
+    cdk_histogram_reset (self->priv->latency[i]);
+  memset (self->priv->outcomes, 0, sizeof (self->priv->outcomes));
+
+  GHashTableIter iter;
+  CdkDocumentData *data = NULL;
+  g_hash_table_iter_init (&iter, self->priv->doc_data);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &data))
+    {
+      for (guint i = 0; i < CDK_NUM_LATENCIES; i++)
+        {
+          cdk_histogram_free (data->latency[i]);
+          data->latency[i] = NULL;
+        }
+    }
+}
+
+static void
+cdk_ptr_array_clear (GPtrArray *arr)
+{
+  while (arr->len > 0)
+    g_ptr_array_remove_index (arr, arr->len - 1);
+  if (arr->len != 0)
+    g_critical ("failed arr->len == 0? = %lu", (gulong) arr->len);
+}
+
+// Resets the project settings to what's in config
+static void
+cdk_plugin_load_config (CdkPlugin *self, GKeyFile *config)
+{
+  g_free (self->priv->pch_prefix);
+  self->priv->pch_prefix = NULL;
+  g_free (self->priv->compdb_dir);
+  self->priv->compdb_dir = NULL;
+  self->priv->memory_budget = 0;
+  self->priv->out_of_process = FALSE;
+  self->priv->warm_up = FALSE;
+  self->priv->symbol_index = FALSE;
+
+  if (g_key_file_has_group (config, "cdk"))
+    {
+      if (g_key_file_has_key (config, "cdk", "symbol-index", NULL))
+        self->priv->symbol_index =
+          g_key_file_get_boolean (config, "cdk", "symbol-index", NULL);
+
+      if (g_key_file_has_key (config, "cdk", "warm-up", NULL))
+        self->priv->warm_up = g_key_file_get_boolean (config, "cdk", "warm-up", NULL);
+
+      if (g_key_file_has_key (config, "cdk", "out-of-process", NULL))
+        self->priv->out_of_process =
+          g_key_file_get_boolean (config, "cdk", "out-of-process", NULL);
+
+      if (g_key_file_has_key (config, "cdk", "pch", NULL))
+        self->priv->pch_prefix = g_key_file_get_string (config, "cdk", "pch", NULL);
+
+      if (g_key_file_has_key (config, "cdk", "compdb", NULL))
+        self->priv->compdb_dir = g_key_file_get_string (config, "cdk", "compdb", NULL);
+
+      // in MiB in the config file
+      if (g_key_file_has_key (config, "cdk", "memory-budget", NULL))
+        {
+          guint64 budget = g_key_file_get_uint64 (config, "cdk", "memory-budget", NULL);
+          budget = MIN (budget, G_MAXUINT64 / CDK_MEMORY_BUDGET_UNIT);
+          cdk_plugin_set_memory_budget (self, budget * CDK_MEMORY_BUDGET_UNIT);
+        }
+
+      if (g_key_file_has_key (config, "cdk", "cflags", NULL))
+        {
+          gchar *command = g_key_file_get_string (config, "cdk", "cflags", NULL);
+          if (command != NULL)
+            cdk_plugin_set_cflags (self, command);
+          g_free (command);
+        }
+
+      if (g_key_file_has_key (config, "cdk", "files", NULL))
+        {
+          g_hash_table_remove_all (self->priv->file_set);
+          cdk_ptr_array_clear (self->priv->files);
+
+          gsize n_files = 0;
+          gchar **files =
+            g_key_file_get_string_list (config, "cdk", "files", &n_files, NULL);
+          if (files != NULL)
+            {
+              // files in config file are relative but we need absolute
+              // so change temorarily into to the project base dir and
+              // expand the paths, then change back into whatever dir
+              // we were in.
+              gchar *cwd = g_get_current_dir ();
+              chdir (geany_data->app->project->base_path);
+              for (gsize i = 0; i < n_files; i++)
+                {
+                  gchar *file = cdk_abspath (files[i]);
+                  g_hash_table_insert (self->priv->file_set, file, file);
+                  g_ptr_array_add (self->priv->files, g_strdup (file));
+                }
+              chdir (cwd);
+              g_free (cwd);
+              g_strfreev (files);
+            }
+
+          g_ptr_array_add (self->priv->files, NULL);
+        }
+    }
+
+  // Pick up a compilation database in the project dir unless told otherwise
+  if (self->priv->compdb_dir == NULL)
+    {
+      gchar *fn = g_build_filename (geany_data->app->project->base_path,
+                                    "compile_commands.json", NULL);
+      if (g_file_test (fn, G_FILE_TEST_EXISTS))
+        self->priv->compdb_dir = g_strdup (geany_data->app->project->base_path);
+      g_free (fn);
+    }
+  cdk_plugin_reload_compdb (self);
+}
+
+void
+cdk_plugin_open_project (CdkPlugin *self, GKeyFile *config)
+{
+  g_return_if_fail (CDK_IS_PLUGIN (self));
+  g_return_if_fail (config != NULL);
+
+  self->priv->project_open = TRUE;
+
+  // Start over with a fresh index, any TUs must be disposed before it
+  g_hash_table_remove_all (self->priv->doc_data);
+  cdk_plugin_reset_latency_stats (self);
+  cdk_plugin_clear_pch (self);
+  cdk_plugin_collect_pch (self);
+
+  // says whether to parse out of process
+  cdk_plugin_load_config (self, config);
+
+  cdk_parser_free (self->priv->parser);
+  self->priv->parser = cdk_plugin_new_parser (self);
+
+  cdk_plugin_queue_pch_build (self, 0);
+  cdk_plugin_queue_warm_up (self);
+  cdk_plugin_start_index (self);
+
+  g_object_notify (G_OBJECT (self), "project-open");
+  g_object_notify (G_OBJECT (self), "pch-prefix");
+  g_object_notify (G_OBJECT (self), "compdb-dir");
+  g_signal_emit_by_name (self, "project-opened");
+}
+
+/*
+ * Applies a changed configuration to the open project without starting
+ * over like closing and opening it again would. Documents no longer in
+ * the project are dropped, open documents that were added are parsed,
+ * and those whose compiler arguments changed are parsed again in the
+ * background. All other TUs are kept as they are.
+ */
+void
+cdk_plugin_reconfigure_project (CdkPlugin *self, GKeyFile *config)
+{
+  g_return_if_fail (CDK_IS_PLUGIN (self));
+  g_return_if_fail (config != NULL);
+
+  if (! self->priv->project_open)
+    {
+      cdk_plugin_open_project (self, config);
+      return;
+    }
+
+  gchar *old_cflags = g_strdup (self->priv->cflags);
+  gchar *old_pch_prefix = g_strdup (self->priv->pch_prefix);
+  gchar *old_compdb_dir = g_strdup (self->priv->compdb_dir);
+  gchar **old_files = g_strdupv ((gchar **) self->priv->files->pdata);
+  gboolean old_out_of_process = self->priv->out_of_process;
+  gboolean old_warm_up = self->priv->warm_up;
+  gboolean old_symbol_index = self->priv->symbol_index;
+
+  cdk_plugin_load_config (self, config);
+
+  gboolean cflags_changed = (g_strcmp0 (old_cflags, self->priv->cflags) != 0);
+  gboolean files_changed =
+    ! cdk_strv_equal ((const gchar *const *) old_files,
+                      (const gchar *const *) self->priv->files->pdata);
+
+  // The TUs and the PCH job belong to the old parser, so switching it
+  // means starting over with all documents, which are added back below
+  if (old_out_of_process != self->priv->out_of_process)
+    {
+      g_hash_table_remove_all (self->priv->doc_data);
+      cdk_plugin_clear_pch (self);
+      cdk_plugin_collect_pch (self);
+      cdk_parser_free (self->priv->parser);
+      self->priv->parser = cdk_plugin_new_parser (self);
+      if (self->priv->pch_prefix != NULL)
+        cdk_plugin_queue_pch_build (self, 0);
+    }
+  // A PCH built with other flags can't be used anymore, otherwise the
+  // current one is used until the new one is ready
+  else if (self->priv->pch_prefix == NULL)
+    {
+      cdk_plugin_clear_pch (self);
+      cdk_plugin_collect_pch (self);
+    }
+  else if (cflags_changed ||
+           g_strcmp0 (old_pch_prefix, self->priv->pch_prefix) != 0 ||
+           (files_changed && g_strcmp0 (self->priv->pch_prefix, "auto") == 0))
+    {
+      if (cflags_changed)
+        self->priv->pch_ready = FALSE;
+      cdk_plugin_queue_pch_build (self, 0);
+    }
+
+  GList *docs = g_hash_table_get_keys (self->priv->doc_data);
+  for (GList *it = docs; it != NULL; it = it->next)
+    {
+      GeanyDocument *doc = it->data;
+      CdkDocumentData *data = g_hash_table_lookup (self->priv->doc_data, doc);
+
+      if (! cdk_plugin_is_supported_document (self, doc))
+        {
+          cdk_plugin_remove_document (self, doc);
+          continue;
+        }
+
+      // Evicted TUs are parsed with the new arguments when restored
+      if (data->evicted)
+        continue;
+
+      gchar **argv = cdk_plugin_get_argv (self, doc->real_path, TRUE);
+      if (! cdk_strv_equal ((const gchar *const *) argv,
+                            cdk_document_data_get_argv (data)))
+        {
+          // supersedes a job in flight, its result will be dropped
+          data->needs_update = FALSE;
+          if (data->pending_job != NULL)
+            cdk_parse_job_cancel (data->pending_job);
+          data->pending_job = cdk_plugin_create_translation_unit (self, doc);
+          if (data->pending_job == NULL)
+            cdk_plugin_remove_document (self, doc);
+        }
+      g_strfreev (argv);
+    }
+  g_list_free (docs);
+
+  guint i;
+  foreach_document (i)
+    {
+      if (! g_hash_table_contains (self->priv->doc_data, documents[i]))
+        cdk_plugin_add_document (self, documents[i]);
+    }
+
+  // Anything changing the arguments or the files calls for another
+  // warm-up, the files still in the cache are skipped
+  if (self->priv->warm_up != old_warm_up ||
+      old_out_of_process != self->priv->out_of_process ||
+      cflags_changed || files_changed ||
+      g_strcmp0 (old_pch_prefix, self->priv->pch_prefix) != 0 ||
+      g_strcmp0 (old_compdb_dir, self->priv->compdb_dir) != 0)
+    cdk_plugin_queue_warm_up (self);
+
+  // The index doesn't depend on the PCH
+  if (self->priv->symbol_index != old_symbol_index ||
+      cflags_changed || files_changed ||
+      g_strcmp0 (old_compdb_dir, self->priv->compdb_dir) != 0)
+    cdk_plugin_start_index (self);
+
+  if (g_strcmp0 (old_pch_prefix, self->priv->pch_prefix) != 0)
+    g_object_notify (G_OBJECT (self), "pch-prefix");
+  if (g_strcmp0 (old_compdb_dir, self->priv->compdb_dir) != 0)
+    g_object_notify (G_OBJECT (self), "compdb-dir");
+  if (files_changed)
+    g_object_notify (G_OBJECT (self), "files");
+
+  g_free (old_cflags);
+  g_free (old_pch_prefix);
+  g_free (old_compdb_dir);
+  g_strfreev (old_files);
+}
+
+void
+cdk_plugin_save_project (CdkPlugin *self, GKeyFile *config)
+{
+  g_return_if_fail (CDK_IS_PLUGIN (self));
+  g_return_if_fail (config != NULL);
+
+  if (! self->priv->project_open)
+    return;
+
+  g_key_file_set_string (config, "cdk", "cflags", self->priv->cflags);
+  if (self->priv->pch_prefix != NULL)
+    g_key_file_set_string (config, "cdk", "pch", self->priv->pch_prefix);
+  else
+    g_key_file_remove_key (config, "cdk", "pch", NULL);
+  if (self->priv->compdb_dir != NULL)
+    g_key_file_set_string (config, "cdk", "compdb", self->priv->compdb_dir);
+  else
+    g_key_file_remove_key (config, "cdk", "compdb", NULL);
+  if (self->priv->memory_budget > 0)
+    g_key_file_set_uint64 (config, "cdk", "memory-budget",
+                           cdk_plugin_get_memory_budget_mib (self));
+  else
+    g_key_file_remove_key (config, "cdk", "memory-budget", NULL);
+  if (self->priv->out_of_process)
+    g_key_file_set_boolean (config, "cdk", "out-of-process", TRUE);
+  else
+    g_key_file_remove_key (config, "cdk", "out-of-process", NULL);
+  if (self->priv->warm_up)
+    g_key_file_set_boolean (config, "cdk", "warm-up", TRUE);
+  else
+    g_key_file_remove_key (config, "cdk", "warm-up", NULL);
+  if (self->priv->symbol_index)
+    g_key_file_set_boolean (config, "cdk", "symbol-index", TRUE);
+  else
+    g_key_file_remove_key (config, "cdk", "symbol-index", NULL);
+
+  // store paths in config file as relative to project dir
+  gchar **files = cdk_relpaths ((const gchar *const *) self->priv->files->pdata,
+                                geany_data->app->project->base_path);
+  g_key_file_set_string_list (config, "cdk", "files",
+                              (const gchar *const *) files,
+                              self->priv->files->len - 1);
+  g_strfreev (files);
+
+  g_signal_emit_by_name (self, "project-saved");
+}
+
+void
+cdk_plugin_close_project (CdkPlugin *self)
+{
+  g_return_if_fail (CDK_IS_PLUGIN (self));
+
+  if (! self->priv->project_open)
+    return;
+
+  g_hash_table_remove_all (self->priv->doc_data);
+  g_hash_table_remove_all (self->priv->file_set);
+  cdk_plugin_clear_scheduler (self);
+  cdk_plugin_clear_overlay (self);
+
+  if (self->priv->cflags != NULL)
+    self->priv->cflags[0] = '\0';
+  else
+    self->priv->cflags = g_strdup ("");
+  cdk_ptr_array_clear (self->priv->files);
+
+  cdk_plugin_clear_pch (self);
+  g_free (self->priv->pch_prefix);
+  self->priv->pch_prefix = NULL;
+  g_free (self->priv->compdb_dir);
+  self->priv->compdb_dir = NULL;
+  self->priv->out_of_process = FALSE;
+  self->priv->warm_up = FALSE;
+  self->priv->symbol_index = FALSE;
+
+  cdk_plugin_stop_warm_up (self);
+  cdk_plugin_stop_index (self);
+  cdk_parser_free (self->priv->parser);
+  self->priv->parser = cdk_plugin_new_parser (self);
+
+  cdk_plugin_set_current_document (self, NULL);
+
+  self->priv->project_open = FALSE;
+  cdk_plugin_reload_compdb (self);
+
+  g_signal_emit_by_name (self, "project-closed");
+  g_object_notify (G_OBJECT (self), "project-open");
+}
+
+gboolean
+cdk_plugin_is_project_open (CdkPlugin *self)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), FALSE);
+  return self->priv->project_open;
+}
+
+struct GeanyDocument *
+cdk_plugin_get_current_document (CdkPlugin *self)
 {
   g_return_val_if_fail (CDK_IS_PLUGIN (self), NULL);
   return self->priv->current_doc;
@@ -593,10 +3134,26 @@ void
 cdk_plugin_set_current_document (CdkPlugin *self, struct GeanyDocument *doc)
 {
   g_return_if_fail (CDK_IS_PLUGIN (self));
-  if (doc == NULL ||
-      g_hash_table_lookup (self->priv->doc_data, doc) != NULL)
+
+  CdkDocumentData *data = NULL;
+  if (doc != NULL)
+    data = g_hash_table_lookup (self->priv->doc_data, doc);
+
+  if (doc == NULL || data != NULL)
     {
       self->priv->current_doc = doc;
+
+      if (data != NULL)
+        {
+          data->last_active = g_get_monotonic_time ();
+          // bring back a TU dropped to save memory
+          if (data->evicted)
+            cdk_plugin_restore_document (self, data);
+          cdk_plugin_enforce_memory_budget (self);
+          // it goes ahead of the others now
+          cdk_plugin_rearm_scheduler (self);
+        }
+
       g_object_notify (G_OBJECT (self), "current-document");
     }
 }
@@ -627,7 +3184,101 @@ cdk_plugin_set_cflags (CdkPlugin *self,
     {
       g_free (self->priv->cflags);
       self->priv->cflags = g_strdup (cflags ? cflags : "");
+      cdk_plugin_parse_cflags (self);
       g_object_notify (G_OBJECT (self), "cflags");
+      // the PCH has to be built with the same flags as the TUs
+      if (self->priv->project_open && self->priv->pch_prefix != NULL)
+        cdk_plugin_queue_pch_build (self, 0);
+    }
+}
+
+guint64
+cdk_plugin_get_memory_budget (CdkPlugin *self)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), 0);
+  return self->priv->memory_budget;
+}
+
+/*
+ * The memory budget in MiB as it's stored in project files, rounded up
+ * so a budget that's set is never saved as 0, which means no limit.
+ */
+guint64
+cdk_plugin_get_memory_budget_mib (CdkPlugin *self)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), 0);
+  guint64 budget = self->priv->memory_budget;
+  return budget / CDK_MEMORY_BUDGET_UNIT + (budget % CDK_MEMORY_BUDGET_UNIT != 0);
+}
+
+/*
+ * Sets how much memory the TUs may use in bytes, 0 for no limit. Less
+ * than CDK_MEMORY_BUDGET_UNIT can't be stored and is rejected.
+ */
+void
+cdk_plugin_set_memory_budget (CdkPlugin *self,
+                              guint64 budget)
+{
+  g_return_if_fail (CDK_IS_PLUGIN (self));
+
+  if (budget > 0 && budget < CDK_MEMORY_BUDGET_UNIT)
+    {
+      g_warning ("memory budget of %" G_GUINT64_FORMAT " bytes is below the "
+                 "minimum of 1 MiB, ignoring it", budget);
+      return;
+    }
+
+  if (budget != self->priv->memory_budget)
+    {
+      self->priv->memory_budget = budget;
+      cdk_plugin_enforce_memory_budget (self);
+      g_object_notify (G_OBJECT (self), "memory-budget");
+    }
+}
+
+const gchar *
+cdk_plugin_get_compdb_dir (CdkPlugin *self)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), NULL);
+  return self->priv->compdb_dir;
+}
+
+void
+cdk_plugin_set_compdb_dir (CdkPlugin *self,
+                           const gchar *dir)
+{
+  g_return_if_fail (CDK_IS_PLUGIN (self));
+
+  if (g_strcmp0 (self->priv->compdb_dir, dir) != 0)
+    {
+      g_free (self->priv->compdb_dir);
+      self->priv->compdb_dir = g_strdup (dir);
+      cdk_plugin_reload_compdb (self);
+      g_object_notify (G_OBJECT (self), "compdb-dir");
+    }
+}
+
+const gchar *
+cdk_plugin_get_pch_prefix (CdkPlugin *self)
+{
+  g_return_val_if_fail (CDK_IS_PLUGIN (self), NULL);
+  return self->priv->pch_prefix;
+}
+
+void
+cdk_plugin_set_pch_prefix (CdkPlugin *self,
+                           const gchar *prefix)
+{
+  g_return_if_fail (CDK_IS_PLUGIN (self));
+
+  if (g_strcmp0 (self->priv->pch_prefix, prefix) != 0)
+    {
+      g_free (self->priv->pch_prefix);
+      self->priv->pch_prefix = g_strdup (prefix);
+      cdk_plugin_clear_pch (self);
+      if (self->priv->project_open)
+        cdk_plugin_queue_pch_build (self, 0);
+      g_object_notify (G_OBJECT (self), "pch-prefix");
     }
 }
 
@@ -6,6 +6,7 @@
 #ifndef CDK_PLUGIN_H_
 #define CDK_PLUGIN_H_ 1
 
+#include <cdk/cdkindex.h>
 #include <cdk/cdkstylescheme.h>
 #include <glib-object.h>
 
@@ -13,6 +14,8 @@ G_BEGIN_DECLS
 
 struct GeanyDocument;
 struct CXTranslationUnitImpl;
+struct CXUnsavedFile;
+struct CdkHighlighter_;
 
 #define CDK_TYPE_PLUGIN            (cdk_plugin_get_type ())
 #define CDK_PLUGIN(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), CDK_TYPE_PLUGIN, CdkPlugin))
@@ -21,6 +24,66 @@ struct CXTranslationUnitImpl;
 #define CDK_IS_PLUGIN_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), CDK_TYPE_PLUGIN))
 #define CDK_PLUGIN_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), CDK_TYPE_PLUGIN, CdkPluginClass))
 
+// The memory budget is set in whole MiB in project files, it's at least one
+#define CDK_MEMORY_BUDGET_UNIT (G_GUINT64_CONSTANT (1024) * 1024)
+
+/*
+ * Memory used by translation units in bytes, see
+ * clang_getCXTUResourceUsage().
+ */
+typedef struct CdkResourceUsage
+{
+  guint64 ast;            // the AST and its side tables
+  guint64 identifiers;    // identifier and selector tables
+  guint64 preamble;       // precompiled preamble and PCH buffers
+  guint64 source_manager; // file buffers and source manager structures
+  guint64 preprocessor;   // preprocessor, preprocessing record and header search
+  guint64 completion;     // cached global code completion results
+  guint64 total;          // all of the above
+}
+CdkResourceUsage;
+
+/*
+ * The hot paths timed by the plugin, see cdk_plugin_get_latency_stats().
+ */
+typedef enum
+{
+  CDK_LATENCY_PARSE,       // parsing a TU, from queueing it until it arrives
+  CDK_LATENCY_REPARSE,     // reparsing a TU, from queueing it until it arrives
+  CDK_LATENCY_HIGHLIGHT,   // tokenizing and annotating a range for highlighting
+  CDK_LATENCY_COMPLETE,    // code completion
+  CDK_LATENCY_DIAGNOSTICS, // applying the diagnostics after an update
+  CDK_LATENCY_LOOKUP,      // looking up a symbol in the project's symbol index
+  CDK_NUM_LATENCIES,
+}
+CdkLatencyKind;
+
+/*
+ * Summary of the recorded timings of one CdkLatencyKind in microseconds.
+ * The percentiles are accurate to within 1/16th of their value.
+ */
+typedef struct CdkLatencyStats
+{
+  guint64 count; // number of timings recorded
+  guint64 p50;
+  guint64 p95;
+  guint64 p99;
+  guint64 max;   // exact
+}
+CdkLatencyStats;
+
+/*
+ * What became of a job of some CdkLatencyKind.
+ */
+typedef enum
+{
+  CDK_JOB_COMPLETED, // ran and its result was used
+  CDK_JOB_CANCELLED, // ran but was superseded meanwhile, its result was dropped
+  CDK_JOB_DISCARDED, // superseded before it got to run
+  CDK_NUM_JOB_OUTCOMES,
+}
+CdkJobOutcome;
+
 typedef struct CdkPlugin_        CdkPlugin;
 typedef struct CdkPluginClass_   CdkPluginClass;
 typedef struct CdkPluginPrivate_ CdkPluginPrivate;
@@ -41,8 +104,38 @@ CdkPlugin *cdk_plugin_new (void);
 gboolean cdk_plugin_add_document (CdkPlugin *self, struct GeanyDocument *doc);
 gboolean cdk_plugin_remove_document (CdkPlugin *self, struct GeanyDocument *doc);
 gboolean cdk_plugin_update_document (CdkPlugin *self, struct GeanyDocument *doc);
+void cdk_plugin_schedule_update (CdkPlugin *self, struct GeanyDocument *doc);
+void cdk_plugin_mark_buffer_dirty (CdkPlugin *self, struct GeanyDocument *doc);
+void cdk_plugin_mark_buffer_clean (CdkPlugin *self, struct GeanyDocument *doc);
+void cdk_plugin_update_dependents (CdkPlugin *self, struct GeanyDocument *doc);
+struct CXUnsavedFile *cdk_plugin_get_unsaved_files (CdkPlugin *self, struct GeanyDocument *doc, guint *n_files);
 struct CXTranslationUnitImpl *cdk_plugin_get_translation_unit (CdkPlugin *self, struct GeanyDocument *doc);
+guint cdk_plugin_get_translation_unit_revision (CdkPlugin *self, struct GeanyDocument *doc);
+GArray *cdk_plugin_get_style_runs (CdkPlugin *self, struct GeanyDocument *doc);
+GArray *cdk_plugin_get_occurrences (CdkPlugin *self, struct GeanyDocument *doc);
+GArray *cdk_plugin_get_diagnostics (CdkPlugin *self, struct GeanyDocument *doc);
+struct CdkHighlighter_ *cdk_plugin_get_highlighter (CdkPlugin *self, struct GeanyDocument *doc);
+gboolean cdk_plugin_get_out_of_process (CdkPlugin *self);
+gboolean cdk_plugin_is_out_of_process (CdkPlugin *self);
+gboolean cdk_plugin_request_completion (CdkPlugin *self, struct GeanyDocument *doc, guint line, guint column);
+gboolean cdk_plugin_get_warm_up (CdkPlugin *self);
+gboolean cdk_plugin_is_warming_up (CdkPlugin *self);
+gboolean cdk_plugin_get_symbol_index (CdkPlugin *self);
+gboolean cdk_plugin_is_indexing (CdkPlugin *self);
+CdkIndex *cdk_plugin_get_index (CdkPlugin *self);
+GArray *cdk_plugin_lookup_symbol (CdkPlugin *self, const gchar *usr, guint kinds);
+gboolean cdk_plugin_is_document_pending (CdkPlugin *self, struct GeanyDocument *doc);
+gboolean cdk_plugin_is_document_updating (CdkPlugin *self, struct GeanyDocument *doc);
+gboolean cdk_plugin_get_resource_usage (CdkPlugin *self, struct GeanyDocument *doc, CdkResourceUsage *usage);
+void cdk_plugin_get_project_resource_usage (CdkPlugin *self, CdkResourceUsage *usage);
+void cdk_plugin_record_latency (CdkPlugin *self, struct GeanyDocument *doc, CdkLatencyKind kind, gint64 usecs);
+gboolean cdk_plugin_get_latency_stats (CdkPlugin *self, struct GeanyDocument *doc, CdkLatencyKind kind, CdkLatencyStats *stats);
+void cdk_plugin_get_project_latency_stats (CdkPlugin *self, CdkLatencyKind kind, CdkLatencyStats *stats);
+void cdk_plugin_record_job_outcome (CdkPlugin *self, CdkLatencyKind kind, CdkJobOutcome outcome);
+guint64 cdk_plugin_get_job_outcome_count (CdkPlugin *self, CdkLatencyKind kind, CdkJobOutcome outcome);
+void cdk_plugin_reset_latency_stats (CdkPlugin *self);
 void cdk_plugin_open_project (CdkPlugin *self, GKeyFile *config);
+void cdk_plugin_reconfigure_project (CdkPlugin *self, GKeyFile *config);
 void cdk_plugin_save_project (CdkPlugin *self, GKeyFile *config);
 void cdk_plugin_close_project (CdkPlugin *self);
 gboolean cdk_plugin_is_project_open (CdkPlugin *self);
@@ -51,6 +144,13 @@ void cdk_plugin_set_current_document (CdkPlugin *self, struct GeanyDocument *doc
 const gchar *cdk_plugin_get_cflags (CdkPlugin *self);
 const gchar *const *cdk_plugin_get_files (CdkPlugin *self, gsize *n_files);
 void cdk_plugin_set_cflags (CdkPlugin *self, const gchar *cflags);
+guint64 cdk_plugin_get_memory_budget (CdkPlugin *self);
+guint64 cdk_plugin_get_memory_budget_mib (CdkPlugin *self);
+void cdk_plugin_set_memory_budget (CdkPlugin *self, guint64 budget);
+const gchar *cdk_plugin_get_compdb_dir (CdkPlugin *self);
+void cdk_plugin_set_compdb_dir (CdkPlugin *self, const gchar *dir);
+const gchar *cdk_plugin_get_pch_prefix (CdkPlugin *self);
+void cdk_plugin_set_pch_prefix (CdkPlugin *self, const gchar *prefix);
 void cdk_plugin_set_files (CdkPlugin *self, const gchar *const *files, gssize n_files);
 CdkStyleScheme *cdk_plugin_get_style_scheme (CdkPlugin *self);
 void cdk_plugin_set_style_scheme (CdkPlugin *self, CdkStyleScheme *scheme);
@@ -0,0 +1,470 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <cdk/cdkresults.h>
+#include <string.h>
+
+/*
+ * What a (re)parse yields for the main thread: the styles of the main
+ * file's tokens, what its identifiers refer to, the diagnostics and the
+ * memory the TU uses. Worked out by whoever owns the TU, the parser's
+ * thread in-process or the cdk-worker process otherwise, which sends
+ * them back with cdk_results_write(). That way the main thread never
+ * has to go through the TU for them.
+ */
+
+// Rules for what to look at next to find a token's style, stored in the
+// tables below next to the CdkStyleIDs they resolve to
+enum
+{
+  CDK_RULE_NONE = 0,                    // no rule, fall through to the next table
+  CDK_RULE_REFERENCED = CDK_NUM_STYLES, // classify the declaration referenced
+  CDK_RULE_VARIABLE,                    // classify by storage class and scope
+};
+
+// Map libclang CXTokenKinds to CdkStyleIDs
+static const guint8 token_rules[] = {
+  [CXToken_Punctuation] = CDK_STYLE_PUNCTUATION,
+  [CXToken_Keyword]     = CDK_STYLE_KEYWORD,
+  [CXToken_Identifier]  = CDK_STYLE_IDENTIFIER,
+  [CXToken_Literal]     = CDK_STYLE_LITERAL,
+  [CXToken_Comment]     = CDK_STYLE_COMMENT,
+};
+
+// Map the CXCursorKinds tokens are annotated with (more specific than
+// the token kind) to CdkStyleIDs
+static const guint8 cursor_rules[] = {
+  [CXCursor_TypeRef]          = CDK_STYLE_TYPE_NAME,
+  [CXCursor_MemberRef]        = CDK_STYLE_MEMBER_REF,
+  [CXCursor_MemberRefExpr]    = CDK_STYLE_MEMBER_REF,
+  [CXCursor_CallExpr]         = CDK_STYLE_FUNCTION_CALL,
+  [CXCursor_StringLiteral]    = CDK_STYLE_STRING,
+  [CXCursor_CharacterLiteral] = CDK_STYLE_CHARACTER,
+  [CXCursor_IntegerLiteral]   = CDK_STYLE_NUMBER,
+  [CXCursor_FloatingLiteral]  = CDK_STYLE_NUMBER,
+  [CXCursor_ImaginaryLiteral] = CDK_STYLE_NUMBER,
+};
+
+// Map the CXCursorKinds identifier tokens are annotated with to
+// CdkStyleIDs or rules, checked before cursor_rules
+static const guint8 identifier_rules[] = {
+  [CXCursor_StructDecl]            = CDK_STYLE_TYPE_NAME,
+  [CXCursor_UnionDecl]             = CDK_STYLE_TYPE_NAME,
+  [CXCursor_ClassDecl]             = CDK_STYLE_TYPE_NAME,
+  [CXCursor_EnumDecl]              = CDK_STYLE_TYPE_NAME,
+  [CXCursor_FieldDecl]             = CDK_STYLE_FIELD,
+  [CXCursor_EnumConstantDecl]      = CDK_STYLE_ENUM_CONSTANT,
+  [CXCursor_VarDecl]               = CDK_RULE_VARIABLE,
+  [CXCursor_ParmDecl]              = CDK_STYLE_PARAMETER,
+  [CXCursor_TypedefDecl]           = CDK_STYLE_TYPE_NAME,
+  [CXCursor_Namespace]             = CDK_STYLE_NAMESPACE,
+  [CXCursor_TemplateTypeParameter] = CDK_STYLE_TYPE_NAME,
+  [CXCursor_ClassTemplate]         = CDK_STYLE_TYPE_NAME,
+  [CXCursor_NamespaceAlias]        = CDK_STYLE_NAMESPACE,
+  [CXCursor_TypeAliasDecl]         = CDK_STYLE_TYPE_NAME,
+  [CXCursor_TemplateRef]           = CDK_STYLE_TYPE_NAME,
+  [CXCursor_NamespaceRef]          = CDK_STYLE_NAMESPACE,
+  [CXCursor_MemberRef]             = CDK_RULE_REFERENCED,
+  [CXCursor_OverloadedDeclRef]     = CDK_RULE_REFERENCED,
+  [CXCursor_VariableRef]           = CDK_RULE_REFERENCED,
+  [CXCursor_DeclRefExpr]           = CDK_RULE_REFERENCED,
+  [CXCursor_MemberRefExpr]         = CDK_RULE_REFERENCED,
+  [CXCursor_MacroDefinition]       = CDK_STYLE_MACRO,
+  [CXCursor_MacroExpansion]        = CDK_STYLE_MACRO,
+};
+
+// Map the CXCursorKinds of referenced declarations to CdkStyleIDs or
+// rules, anything else falls through to cursor_rules
+static const guint8 declaration_rules[] = {
+  [CXCursor_FieldDecl]        = CDK_STYLE_FIELD,
+  [CXCursor_EnumConstantDecl] = CDK_STYLE_ENUM_CONSTANT,
+  [CXCursor_VarDecl]          = CDK_RULE_VARIABLE,
+  [CXCursor_ParmDecl]         = CDK_STYLE_PARAMETER,
+  [CXCursor_Namespace]        = CDK_STYLE_NAMESPACE,
+  [CXCursor_NamespaceAlias]   = CDK_STYLE_NAMESPACE,
+  [CXCursor_MacroDefinition]  = CDK_STYLE_MACRO,
+};
+
+// The CXCursorKinds variables declared inside of are local
+static const gboolean function_kinds[] = {
+  [CXCursor_FunctionDecl]           = TRUE,
+  [CXCursor_ObjCInstanceMethodDecl] = TRUE,
+  [CXCursor_ObjCClassMethodDecl]    = TRUE,
+  [CXCursor_CXXMethod]              = TRUE,
+  [CXCursor_Constructor]            = TRUE,
+  [CXCursor_Destructor]             = TRUE,
+  [CXCursor_ConversionFunction]     = TRUE,
+  [CXCursor_FunctionTemplate]       = TRUE,
+  [CXCursor_BlockExpr]              = TRUE,
+};
+
+#define CDK_RULE_LOOKUP(table, kind) \
+  (((guint) (kind) < G_N_ELEMENTS (table)) ? (table)[(kind)] : 0)
+
+// Storage class first, since static locals last as long as globals, then
+// whether the variable was declared inside of a function
+static CdkStyleID
+classify_variable (CXCursor decl)
+{
+  switch (clang_Cursor_getStorageClass (decl))
+    {
+    case CX_SC_Static:
+      return CDK_STYLE_STATIC_VARIABLE;
+    case CX_SC_Extern:
+    case CX_SC_PrivateExtern:
+      return CDK_STYLE_GLOBAL_VARIABLE;
+    default:
+      break;
+    }
+
+  enum CXCursorKind parent_kind =
+    clang_getCursorKind (clang_getCursorSemanticParent (decl));
+  if (CDK_RULE_LOOKUP (function_kinds, parent_kind))
+    return CDK_STYLE_LOCAL_VARIABLE;
+
+  return CDK_STYLE_GLOBAL_VARIABLE;
+}
+
+/*
+ * The style of a token of the kind given annotated with cursor.
+ */
+CdkStyleID
+cdk_style_id_for_token (CXCursor cursor, CXTokenKind token_kind)
+{
+  enum CXCursorKind kind = clang_getCursorKind (cursor);
+  guint rule = CDK_RULE_NONE;
+
+  // Only the names in declarations and references say something about
+  // what's declared or referenced, not the keywords and punctuation
+  if (token_kind == CXToken_Identifier)
+    {
+      rule = CDK_RULE_LOOKUP (identifier_rules, kind);
+      if (rule == CDK_RULE_REFERENCED)
+        {
+          cursor = clang_getCursorReferenced (cursor);
+          rule = clang_Cursor_isNull (cursor) ? CDK_RULE_NONE :
+            CDK_RULE_LOOKUP (declaration_rules, clang_getCursorKind (cursor));
+        }
+      if (rule == CDK_RULE_VARIABLE)
+        return classify_variable (cursor);
+    }
+
+  if (rule == CDK_RULE_NONE)
+    rule = CDK_RULE_LOOKUP (cursor_rules, kind);
+  if (rule == CDK_RULE_NONE)
+    rule = CDK_RULE_LOOKUP (token_rules, token_kind);
+
+  return rule;
+}
+
+// Adds the identifier to the occurrences if it refers to something,
+// numbering the USRs as they're first seen
+static void
+cdk_results_collect_occurrence (CdkResults *results,
+                                CXCursor cursor,
+                                guint start,
+                                guint end,
+                                GHashTable *usrs)
+{
+  CXCursor ref_cursor = clang_getCursorReferenced (cursor);
+  if (clang_Cursor_isNull (ref_cursor))
+    return;
+
+  CXString usr = clang_getCursorUSR (ref_cursor);
+  const gchar *cusr = clang_getCString (usr);
+  if (cusr != NULL && *cusr != '\0')
+    {
+      guint id = GPOINTER_TO_UINT (g_hash_table_lookup (usrs, cusr));
+      if (id == 0)
+        {
+          id = g_hash_table_size (usrs) + 1;
+          g_hash_table_insert (usrs, g_strdup (cusr), GUINT_TO_POINTER (id));
+        }
+      CdkOccurrence occur = { start, end - start, id };
+      g_array_append_val (results->occurrences, occur);
+    }
+  clang_disposeString (usr);
+}
+
+static void
+cdk_results_collect_tokens (CdkResults *results, CXTranslationUnit tu)
+{
+  CXToken *tokens = NULL;
+  guint n_tokens = 0;
+  CXSourceRange range =
+    clang_getCursorExtent (clang_getTranslationUnitCursor (tu));
+  GHashTable *usrs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  clang_tokenize (tu, range, &tokens, &n_tokens);
+
+  CXCursor *cursors = g_malloc0 (n_tokens * sizeof (CXCursor));
+  clang_annotateTokens (tu, tokens, n_tokens, cursors);
+
+  results->runs = g_array_sized_new (FALSE, FALSE, sizeof (CdkStyleRun), n_tokens);
+  results->occurrences = g_array_new (FALSE, FALSE, sizeof (CdkOccurrence));
+  for (guint i = 0; i < n_tokens; i++)
+    {
+      CXSourceRange extent = clang_getTokenExtent (tu, tokens[i]);
+      guint start = 0, end = 0;
+      clang_getSpellingLocation (clang_getRangeStart (extent), NULL, NULL, NULL, &start);
+      clang_getSpellingLocation (clang_getRangeEnd (extent), NULL, NULL, NULL, &end);
+      if (end <= start)
+        continue;
+
+      CXTokenKind kind = clang_getTokenKind (tokens[i]);
+      CdkStyleRun run = { start, end - start, cdk_style_id_for_token (cursors[i], kind) };
+      g_array_append_val (results->runs, run);
+
+      if (kind == CXToken_Identifier)
+        cdk_results_collect_occurrence (results, cursors[i], start, end, usrs);
+    }
+
+  g_hash_table_destroy (usrs);
+  g_free (cursors);
+  clang_disposeTokens (tu, tokens, n_tokens);
+}
+
+static void
+cdk_diagnostic_clear (CdkDiagnostic *diag)
+{
+  g_free (diag->text);
+  g_free (diag->option);
+  if (diag->ranges != NULL)
+    g_array_unref (diag->ranges);
+}
+
+static GArray *
+cdk_diagnostic_list_new (void)
+{
+  GArray *diagnostics = g_array_new (FALSE, TRUE, sizeof (CdkDiagnostic));
+  g_array_set_clear_func (diagnostics, (GDestroyNotify) cdk_diagnostic_clear);
+  return diagnostics;
+}
+
+static void
+cdk_results_collect_diagnostics (CdkResults *results, CXTranslationUnit tu)
+{
+  guint n_diags = clang_getNumDiagnostics (tu);
+
+  results->diagnostics = cdk_diagnostic_list_new ();
+  for (guint i = 0; i < n_diags; i++)
+    {
+      CXDiagnostic cx_diag = clang_getDiagnostic (tu, i);
+      CdkDiagnostic diag = { 0 };
+
+      diag.severity = clang_getDiagnosticSeverity (cx_diag);
+      clang_getSpellingLocation (clang_getDiagnosticLocation (cx_diag), NULL,
+                                 &diag.line, &diag.column, &diag.offset);
+
+      CXString text = clang_getDiagnosticSpelling (cx_diag);
+      CXString option = clang_getDiagnosticOption (cx_diag, NULL);
+      diag.text = g_strdup (clang_getCString (text));
+      diag.option = g_strdup (clang_getCString (option));
+      if (diag.option == NULL)
+        diag.option = g_strdup ("");
+      clang_disposeString (text);
+      clang_disposeString (option);
+
+      guint n_ranges = clang_getDiagnosticNumRanges (cx_diag);
+      diag.ranges = g_array_sized_new (FALSE, FALSE, sizeof (CdkDiagnosticRange), n_ranges);
+      for (guint j = 0; j < n_ranges; j++)
+        {
+          CXSourceRange range = clang_getDiagnosticRange (cx_diag, j);
+          CdkDiagnosticRange drange = { 0, 0 };
+          clang_getSpellingLocation (clang_getRangeStart (range), NULL, NULL, NULL, &drange.start);
+          clang_getSpellingLocation (clang_getRangeEnd (range), NULL, NULL, NULL, &drange.end);
+          g_array_append_val (diag.ranges, drange);
+        }
+
+      g_array_append_val (results->diagnostics, diag);
+      clang_disposeDiagnostic (cx_diag);
+    }
+}
+
+static void
+cdk_results_collect_usage (CdkResults *results, CXTranslationUnit tu)
+{
+  CXTUResourceUsage cx_usage = clang_getCXTUResourceUsage (tu);
+
+  results->usage = g_array_sized_new (FALSE, FALSE, sizeof (CXTUResourceUsageEntry),
+                                      cx_usage.numEntries);
+  g_array_append_vals (results->usage, cx_usage.entries, cx_usage.numEntries);
+
+  clang_disposeCXTUResourceUsage (cx_usage);
+}
+
+/*
+ * Fills results from tu. Done once per TU, rather than for each range
+ * Scintilla asks to style or each time the helpers are updated.
+ */
+void
+cdk_results_collect (CdkResults *results, CXTranslationUnit tu)
+{
+  g_return_if_fail (results != NULL);
+  g_return_if_fail (tu != NULL);
+
+  cdk_results_clear (results);
+  cdk_results_collect_tokens (results, tu);
+  cdk_results_collect_diagnostics (results, tu);
+  cdk_results_collect_usage (results, tu);
+}
+
+void
+cdk_results_clear (CdkResults *results)
+{
+  g_return_if_fail (results != NULL);
+
+  if (results->runs != NULL)
+    g_array_unref (results->runs);
+  if (results->occurrences != NULL)
+    g_array_unref (results->occurrences);
+  if (results->diagnostics != NULL)
+    g_array_unref (results->diagnostics);
+  if (results->usage != NULL)
+    g_array_unref (results->usage);
+
+  memset (results, 0, sizeof (CdkResults));
+}
+
+/*
+ * Adds results to a worker message. Each array is its length followed
+ * by its elements field by field.
+ */
+void
+cdk_results_write (const CdkResults *results, GByteArray *msg)
+{
+  g_return_if_fail (results != NULL);
+  g_return_if_fail (msg != NULL);
+
+  guint n_runs = (results->runs != NULL) ? results->runs->len : 0;
+  cdk_worker_message_add_uint (msg, n_runs);
+  for (guint i = 0; i < n_runs; i++)
+    {
+      const CdkStyleRun *run = &g_array_index (results->runs, CdkStyleRun, i);
+      cdk_worker_message_add_uint (msg, run->offset);
+      cdk_worker_message_add_uint (msg, run->length);
+      cdk_worker_message_add_uint (msg, run->style_id);
+    }
+
+  guint n_occurs = (results->occurrences != NULL) ? results->occurrences->len : 0;
+  cdk_worker_message_add_uint (msg, n_occurs);
+  for (guint i = 0; i < n_occurs; i++)
+    {
+      const CdkOccurrence *occur = &g_array_index (results->occurrences, CdkOccurrence, i);
+      cdk_worker_message_add_uint (msg, occur->offset);
+      cdk_worker_message_add_uint (msg, occur->length);
+      cdk_worker_message_add_uint (msg, occur->usr);
+    }
+
+  guint n_diags = (results->diagnostics != NULL) ? results->diagnostics->len : 0;
+  cdk_worker_message_add_uint (msg, n_diags);
+  for (guint i = 0; i < n_diags; i++)
+    {
+      const CdkDiagnostic *diag = &g_array_index (results->diagnostics, CdkDiagnostic, i);
+      cdk_worker_message_add_uint (msg, diag->severity);
+      cdk_worker_message_add_uint (msg, diag->offset);
+      cdk_worker_message_add_uint (msg, diag->line);
+      cdk_worker_message_add_uint (msg, diag->column);
+      cdk_worker_message_add_string (msg, diag->text);
+      cdk_worker_message_add_string (msg, diag->option);
+      cdk_worker_message_add_uint (msg, diag->ranges->len);
+      for (guint j = 0; j < diag->ranges->len; j++)
+        {
+          const CdkDiagnosticRange *range = &g_array_index (diag->ranges, CdkDiagnosticRange, j);
+          cdk_worker_message_add_uint (msg, range->start);
+          cdk_worker_message_add_uint (msg, range->end);
+        }
+    }
+
+  guint n_entries = (results->usage != NULL) ? results->usage->len : 0;
+  cdk_worker_message_add_uint (msg, n_entries);
+  for (guint i = 0; i < n_entries; i++)
+    {
+      const CXTUResourceUsageEntry *entry =
+        &g_array_index (results->usage, CXTUResourceUsageEntry, i);
+      cdk_worker_message_add_uint (msg, entry->kind);
+      cdk_worker_message_add_uint64 (msg, entry->amount);
+    }
+}
+
+/*
+ * Fills results from what cdk_results_write() added to a message.
+ * Returns FALSE if the message doesn't hold them, results are cleared
+ * then.
+ */
+gboolean
+cdk_results_read (CdkResults *results, CdkWorkerReader *reader)
+{
+  g_return_val_if_fail (results != NULL, FALSE);
+  g_return_val_if_fail (reader != NULL, FALSE);
+
+  cdk_results_clear (results);
+
+  guint32 n_runs = cdk_worker_reader_get_uint (reader);
+  results->runs = g_array_new (FALSE, FALSE, sizeof (CdkStyleRun));
+  for (guint32 i = 0; i < n_runs && ! reader->failed; i++)
+    {
+      CdkStyleRun run;
+      run.offset = cdk_worker_reader_get_uint (reader);
+      run.length = cdk_worker_reader_get_uint (reader);
+      run.style_id = cdk_worker_reader_get_uint (reader);
+      g_array_append_val (results->runs, run);
+    }
+
+  guint32 n_occurs = cdk_worker_reader_get_uint (reader);
+  results->occurrences = g_array_new (FALSE, FALSE, sizeof (CdkOccurrence));
+  for (guint32 i = 0; i < n_occurs && ! reader->failed; i++)
+    {
+      CdkOccurrence occur;
+      occur.offset = cdk_worker_reader_get_uint (reader);
+      occur.length = cdk_worker_reader_get_uint (reader);
+      occur.usr = cdk_worker_reader_get_uint (reader);
+      g_array_append_val (results->occurrences, occur);
+    }
+
+  guint32 n_diags = cdk_worker_reader_get_uint (reader);
+  results->diagnostics = cdk_diagnostic_list_new ();
+  for (guint32 i = 0; i < n_diags && ! reader->failed; i++)
+    {
+      CdkDiagnostic diag = { 0 };
+      diag.severity = cdk_worker_reader_get_uint (reader);
+      diag.offset = cdk_worker_reader_get_uint (reader);
+      diag.line = cdk_worker_reader_get_uint (reader);
+      diag.column = cdk_worker_reader_get_uint (reader);
+      diag.text = cdk_worker_reader_get_string (reader);
+      diag.option = cdk_worker_reader_get_string (reader);
+      diag.ranges = g_array_new (FALSE, FALSE, sizeof (CdkDiagnosticRange));
+      guint32 n_ranges = cdk_worker_reader_get_uint (reader);
+      for (guint32 j = 0; j < n_ranges && ! reader->failed; j++)
+        {
+          CdkDiagnosticRange range;
+          range.start = cdk_worker_reader_get_uint (reader);
+          range.end = cdk_worker_reader_get_uint (reader);
+          g_array_append_val (diag.ranges, range);
+        }
+      if (diag.text == NULL || diag.option == NULL)
+        reader->failed = TRUE;
+      g_array_append_val (results->diagnostics, diag);
+    }
+
+  guint32 n_entries = cdk_worker_reader_get_uint (reader);
+  results->usage = g_array_new (FALSE, FALSE, sizeof (CXTUResourceUsageEntry));
+  for (guint32 i = 0; i < n_entries && ! reader->failed; i++)
+    {
+      CXTUResourceUsageEntry entry;
+      entry.kind = cdk_worker_reader_get_uint (reader);
+      entry.amount = cdk_worker_reader_get_uint64 (reader);
+      g_array_append_val (results->usage, entry);
+    }
+
+  if (reader->failed)
+    cdk_results_clear (results);
+
+  return ! reader->failed;
+}
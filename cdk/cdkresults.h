@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifndef CDK_RESULTS_H_
+#define CDK_RESULTS_H_ 1
+
+#include <glib.h>
+#include <cdk/cdkstyle.h>
+#include <cdk/cdkworkerproto.h>
+#include <clang-c/Index.h>
+
+G_BEGIN_DECLS
+
+// A token of the main file and the style it's highlighted with
+typedef struct
+{
+  guint      offset;
+  guint      length;
+  CdkStyleID style_id;
+}
+CdkStyleRun;
+
+// An identifier of the main file and what it refers to
+typedef struct
+{
+  guint offset;
+  guint length;
+  guint usr;    // the same for all identifiers referring to the same USR, never 0
+}
+CdkOccurrence;
+
+// Source range a diagnostic is about, as offsets
+typedef struct
+{
+  guint start;
+  guint end;
+}
+CdkDiagnosticRange;
+
+// A diagnostic of the TU, located in whichever file it was reported in
+typedef struct
+{
+  guint   severity; // CXDiagnosticSeverity
+  guint   offset;   // where it was reported
+  guint   line;     // 1-based line of that
+  guint   column;   // 1-based column of that
+  gchar  *text;     // the message
+  gchar  *option;   // option enabling it, "" if none
+  GArray *ranges;   // CdkDiagnosticRange it's about
+}
+CdkDiagnostic;
+
+// What the main thread needs from a (re)parsed TU, worked out on the
+// thread or in the process owning it
+typedef struct
+{
+  GArray *runs;        // CdkStyleRun of the main file's tokens, sorted
+  GArray *occurrences; // CdkOccurrence of the main file's identifiers, sorted
+  GArray *diagnostics; // CdkDiagnostic of the TU
+  GArray *usage;       // CXTUResourceUsageEntry of the memory the TU uses
+}
+CdkResults;
+
+// Options to parse the TUs results are collected from with, the macro
+// styles need the macro definitions and expansions recorded. What the
+// record takes up is in the TU's memory usage, like the rest of it.
+#define CDK_RESULTS_PARSE_OPTIONS \
+  (clang_defaultEditingTranslationUnitOptions () | \
+   CXTranslationUnit_DetailedPreprocessingRecord)
+
+CdkStyleID cdk_style_id_for_token (CXCursor cursor, CXTokenKind token_kind);
+
+void cdk_results_collect (CdkResults *results, CXTranslationUnit tu);
+void cdk_results_clear (CdkResults *results);
+void cdk_results_write (const CdkResults *results, GByteArray *msg);
+gboolean cdk_results_read (CdkResults *results, CdkWorkerReader *reader);
+
+G_END_DECLS
+
+#endif /* CDK_RESULTS_H_ */
@@ -75,6 +75,14 @@ cdk_style_id_get_type (void)
         { CDK_STYLE_TYPE_NAME,          "CDK_STYLE_TYPE_NAME",          "TYPE_NAME" },
         { CDK_STYLE_FUNCTION_CALL,      "CDK_STYLE_FUNCTION_CALL",      "FUNCTION_CALL" },
         { CDK_STYLE_CHARACTER,          "CDK_STYLE_CHARACTER",          "CHARACTER" },
+        { CDK_STYLE_LOCAL_VARIABLE,     "CDK_STYLE_LOCAL_VARIABLE",     "LOCAL_VARIABLE" },
+        { CDK_STYLE_PARAMETER,          "CDK_STYLE_PARAMETER",          "PARAMETER" },
+        { CDK_STYLE_FIELD,              "CDK_STYLE_FIELD",              "FIELD" },
+        { CDK_STYLE_GLOBAL_VARIABLE,    "CDK_STYLE_GLOBAL_VARIABLE",    "GLOBAL_VARIABLE" },
+        { CDK_STYLE_STATIC_VARIABLE,    "CDK_STYLE_STATIC_VARIABLE",    "STATIC_VARIABLE" },
+        { CDK_STYLE_MACRO,              "CDK_STYLE_MACRO",              "MACRO" },
+        { CDK_STYLE_ENUM_CONSTANT,      "CDK_STYLE_ENUM_CONSTANT",      "ENUM_CONSTANT" },
+        { CDK_STYLE_NAMESPACE,          "CDK_STYLE_NAMESPACE",          "NAMESPACE" },
         { CDK_STYLE_DIAGNOSTIC_WARNING, "CDK_STYLE_DIAGNOSTIC_WARNING", "DIAGNOSTIC_WARNING" },
         { CDK_STYLE_DIAGNOSTIC_ERROR,   "CDK_STYLE_DIAGNOSTIC_ERROR",   "DIAGNOSTIC_ERROR" },
         { CDK_STYLE_ANNOTATION_WARNING, "CDK_STYLE_ANNOTATION_WARNING", "ANNOTATION_WARNING" },
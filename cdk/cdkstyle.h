@@ -28,6 +28,14 @@ typedef enum
   CDK_STYLE_TYPE_NAME,
   CDK_STYLE_FUNCTION_CALL,
   CDK_STYLE_CHARACTER,
+  CDK_STYLE_LOCAL_VARIABLE,
+  CDK_STYLE_PARAMETER,
+  CDK_STYLE_FIELD,
+  CDK_STYLE_GLOBAL_VARIABLE,
+  CDK_STYLE_STATIC_VARIABLE,
+  CDK_STYLE_MACRO,
+  CDK_STYLE_ENUM_CONSTANT,
+  CDK_STYLE_NAMESPACE,
   CDK_STYLE_DIAGNOSTIC_WARNING,
   CDK_STYLE_DIAGNOSTIC_ERROR,
   CDK_STYLE_ANNOTATION_WARNING,
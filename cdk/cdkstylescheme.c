@@ -51,8 +51,6 @@ static void cdk_style_scheme_get_property (GObject *object, guint prop_id, GValu
 static void cdk_style_scheme_set_property (GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec);
 
 static GHashTable *style_name_map = NULL;
-static GHashTable *token_map = NULL;
-static GHashTable *cursor_map = NULL;
 
 static inline glong
 style_id_from_name (const gchar *name)
@@ -438,18 +436,6 @@ add_map (const gchar *name, CdkStyleID id)
   g_hash_table_insert (style_name_map, g_strdup (name), GSIZE_TO_POINTER (id));
 }
 
-static inline void
-add_token (guint token_kind, CdkStyleID id)
-{
-  g_hash_table_insert (token_map, GSIZE_TO_POINTER (token_kind), GSIZE_TO_POINTER (id));
-}
-
-static inline void
-add_cursor (guint cursor_kind, CdkStyleID id)
-{
-  g_hash_table_insert (cursor_map, GSIZE_TO_POINTER (cursor_kind), GSIZE_TO_POINTER (id));
-}
-
 void
 cdk_style_schemes_init (void)
 {
@@ -457,8 +443,6 @@ cdk_style_schemes_init (void)
     return;
 
   style_name_map = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-  token_map = g_hash_table_new (g_direct_hash, g_direct_equal);
-  cursor_map = g_hash_table_new (g_direct_hash, g_direct_equal);
 
   // Map style scheme style names to CdkStyleIDs
   add_map ("default", CDK_STYLE_DEFAULT);
@@ -474,29 +458,19 @@ cdk_style_schemes_init (void)
   add_map ("type_name", CDK_STYLE_TYPE_NAME);
   add_map ("function_call", CDK_STYLE_FUNCTION_CALL);
   add_map ("character", CDK_STYLE_CHARACTER);
+  add_map ("local_variable", CDK_STYLE_LOCAL_VARIABLE);
+  add_map ("parameter", CDK_STYLE_PARAMETER);
+  add_map ("field", CDK_STYLE_FIELD);
+  add_map ("global_variable", CDK_STYLE_GLOBAL_VARIABLE);
+  add_map ("static_variable", CDK_STYLE_STATIC_VARIABLE);
+  add_map ("macro", CDK_STYLE_MACRO);
+  add_map ("enum_constant", CDK_STYLE_ENUM_CONSTANT);
+  add_map ("namespace", CDK_STYLE_NAMESPACE);
   add_map ("diagnostic_warning", CDK_STYLE_DIAGNOSTIC_WARNING);
   add_map ("diagnostic_error", CDK_STYLE_DIAGNOSTIC_ERROR);
   add_map ("annotation_warning", CDK_STYLE_ANNOTATION_WARNING);
   add_map ("annotation_error", CDK_STYLE_ANNOTATION_ERROR);
 
-  // Map libclang CXTokenKinds to CdkStyleIDs
-  add_token (CXToken_Punctuation, CDK_STYLE_PUNCTUATION);
-  add_token (CXToken_Keyword, CDK_STYLE_KEYWORD);
-  add_token (CXToken_Identifier, CDK_STYLE_IDENTIFIER);
-  add_token (CXToken_Literal, CDK_STYLE_LITERAL);
-  add_token (CXToken_Comment, CDK_STYLE_COMMENT);
-
-  // Map libclang CXCursorKinds (more specific) to CdkStyleIDs
-  add_cursor (CXCursor_TypeRef, CDK_STYLE_TYPE_NAME);
-  add_cursor (CXCursor_MemberRef, CDK_STYLE_MEMBER_REF);
-  add_cursor (CXCursor_MemberRefExpr, CDK_STYLE_MEMBER_REF);
-  add_cursor (CXCursor_CallExpr, CDK_STYLE_FUNCTION_CALL);
-  add_cursor (CXCursor_StringLiteral, CDK_STYLE_STRING);
-  add_cursor (CXCursor_CharacterLiteral, CDK_STYLE_CHARACTER);
-  add_cursor (CXCursor_IntegerLiteral, CDK_STYLE_NUMBER);
-  add_cursor (CXCursor_FloatingLiteral, CDK_STYLE_NUMBER);
-  add_cursor (CXCursor_ImaginaryLiteral, CDK_STYLE_NUMBER);
-  // ...
 }
 
 void
@@ -506,24 +480,6 @@ cdk_style_schemes_cleanup (void)
     return;
 
   g_hash_table_destroy (style_name_map);
-  g_hash_table_destroy (token_map);
-  g_hash_table_destroy (cursor_map);
-}
-
-CdkStyleID
-cdk_style_id_for_token_kind (guint token_kind)
-{
-  if (G_UNLIKELY (token_map == NULL))
-    return CDK_STYLE_DEFAULT;
-  return GPOINTER_TO_SIZE (g_hash_table_lookup (token_map, GSIZE_TO_POINTER (token_kind)));
-}
-
-CdkStyleID
-cdk_style_id_for_cursor_kind (guint cursor_kind)
-{
-  if (G_UNLIKELY (cursor_map == NULL))
-    return CDK_STYLE_DEFAULT;
-  return GPOINTER_TO_SIZE (g_hash_table_lookup (cursor_map, GSIZE_TO_POINTER (cursor_kind)));
 }
 
 gboolean
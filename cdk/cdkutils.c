@@ -27,6 +27,155 @@ cdk_document_get_length (struct GeanyDocument *doc)
   return scintilla_send_message (doc->editor->sci, SCI_GETLENGTH, 0, 0);
 }
 
+/*
+ * Each editor gets a tracker, attached on first use, counting the
+ * modifications of its buffer and holding on to the last snapshot
+ * taken so it can be handed out again until the next modification.
+ */
+
+struct CdkBufferSnapshot_
+{
+  gint    ref_count;
+  GBytes *bytes;     // copy of the buffer
+  guint   revision;  // revision of the buffer it was taken at
+};
+
+typedef struct
+{
+  guint              revision; // bumped on every insertion or deletion
+  CdkBufferSnapshot *latest;   // snapshot of the current revision or NULL
+}
+CdkBufferTracker;
+
+static void
+cdk_buffer_tracker_free (CdkBufferTracker *tracker)
+{
+  if (tracker->latest != NULL)
+    cdk_buffer_snapshot_unref (tracker->latest);
+  g_slice_free (CdkBufferTracker, tracker);
+}
+
+static void
+cdk_buffer_tracker_sci_notify (CdkBufferTracker *tracker,
+                               G_GNUC_UNUSED gint unused,
+                               SCNotification *nt,
+                               G_GNUC_UNUSED ScintillaObject *sci)
+{
+  if (nt->nmhdr.code == SCN_MODIFIED &&
+      (nt->modificationType & (SC_MOD_INSERTTEXT | SC_MOD_DELETETEXT)))
+    {
+      tracker->revision++;
+      if (tracker->latest != NULL)
+        cdk_buffer_snapshot_unref (tracker->latest);
+      tracker->latest = NULL;
+    }
+}
+
+static CdkBufferTracker *
+cdk_document_get_buffer_tracker (struct GeanyDocument *doc)
+{
+  static GQuark quark = 0;
+  if (G_UNLIKELY (quark == 0))
+    quark = g_quark_from_static_string ("cdk-buffer-tracker");
+
+  ScintillaObject *sci = doc->editor->sci;
+  CdkBufferTracker *tracker = g_object_get_qdata (G_OBJECT (sci), quark);
+  if (tracker == NULL)
+    {
+      tracker = g_slice_new0 (CdkBufferTracker);
+      g_signal_connect_swapped (sci, "sci-notify",
+                                G_CALLBACK (cdk_buffer_tracker_sci_notify), tracker);
+      g_object_set_qdata_full (G_OBJECT (sci), quark, tracker,
+                               (GDestroyNotify) cdk_buffer_tracker_free);
+    }
+
+  return tracker;
+}
+
+/*
+ * Revision of the document's buffer, which changes on every insertion
+ * or deletion made after the first call for the document.
+ */
+guint
+cdk_document_get_revision (struct GeanyDocument *doc)
+{
+  g_return_val_if_fail (DOC_VALID (doc), 0);
+  return cdk_document_get_buffer_tracker (doc)->revision;
+}
+
+/*
+ * An immutable copy of the document's buffer at its current revision.
+ * The buffer is copied at most once per revision, until it changes all
+ * callers share the same snapshot. Unlike cdk_document_get_contents(),
+ * the data stays valid after further edits and can be used from any
+ * thread, only getting the snapshot must be done on the main thread.
+ */
+CdkBufferSnapshot *
+cdk_buffer_snapshot_get (struct GeanyDocument *doc)
+{
+  g_return_val_if_fail (DOC_VALID (doc), NULL);
+
+  CdkBufferTracker *tracker = cdk_document_get_buffer_tracker (doc);
+  if (tracker->latest == NULL)
+    {
+      // SCI_GETTEXT copies around the gap instead of moving it
+      gsize length = cdk_document_get_length (doc);
+      gchar *text = g_malloc (length + 1);
+      scintilla_send_message (doc->editor->sci, SCI_GETTEXT, length + 1, (sptr_t) text);
+
+      CdkBufferSnapshot *snapshot = g_slice_new0 (CdkBufferSnapshot);
+      snapshot->ref_count = 1;
+      snapshot->bytes = g_bytes_new_take (text, length);
+      snapshot->revision = tracker->revision;
+      tracker->latest = snapshot;
+    }
+
+  return cdk_buffer_snapshot_ref (tracker->latest);
+}
+
+CdkBufferSnapshot *
+cdk_buffer_snapshot_ref (CdkBufferSnapshot *snapshot)
+{
+  g_return_val_if_fail (snapshot != NULL, NULL);
+  g_atomic_int_inc (&snapshot->ref_count);
+  return snapshot;
+}
+
+void
+cdk_buffer_snapshot_unref (CdkBufferSnapshot *snapshot)
+{
+  if (G_UNLIKELY (snapshot == NULL))
+    return;
+
+  if (g_atomic_int_dec_and_test (&snapshot->ref_count))
+    {
+      g_bytes_unref (snapshot->bytes);
+      g_slice_free (CdkBufferSnapshot, snapshot);
+    }
+}
+
+// Borrowed, take a reference to keep it beyond the snapshot
+GBytes *
+cdk_buffer_snapshot_get_bytes (CdkBufferSnapshot *snapshot)
+{
+  g_return_val_if_fail (snapshot != NULL, NULL);
+  return snapshot->bytes;
+}
+
+const gchar *
+cdk_buffer_snapshot_get_data (CdkBufferSnapshot *snapshot, gsize *length)
+{
+  g_return_val_if_fail (snapshot != NULL, NULL);
+  return g_bytes_get_data (snapshot->bytes, length);
+}
+
+guint
+cdk_buffer_snapshot_get_revision (CdkBufferSnapshot *snapshot)
+{
+  g_return_val_if_fail (snapshot != NULL, 0);
+  return snapshot->revision;
+}
+
 void
 cdk_scintilla_set_style (struct _ScintillaObject *sci, guint id, const struct CdkStyle *style)
 {
@@ -19,6 +19,16 @@ G_BEGIN_DECLS
 
 const gchar *cdk_document_get_contents (struct GeanyDocument *doc);
 gsize cdk_document_get_length (struct GeanyDocument *doc);
+guint cdk_document_get_revision (struct GeanyDocument *doc);
+
+typedef struct CdkBufferSnapshot_ CdkBufferSnapshot;
+
+CdkBufferSnapshot *cdk_buffer_snapshot_get (struct GeanyDocument *doc);
+CdkBufferSnapshot *cdk_buffer_snapshot_ref (CdkBufferSnapshot *snapshot);
+void cdk_buffer_snapshot_unref (CdkBufferSnapshot *snapshot);
+GBytes *cdk_buffer_snapshot_get_bytes (CdkBufferSnapshot *snapshot);
+const gchar *cdk_buffer_snapshot_get_data (CdkBufferSnapshot *snapshot, gsize *length);
+guint cdk_buffer_snapshot_get_revision (CdkBufferSnapshot *snapshot);
 
 void cdk_scintilla_set_style (struct _ScintillaObject *sci, guint id, const struct CdkStyle *style);
 
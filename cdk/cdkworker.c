@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <cdk/cdkworker.h>
+#include <cdk/cdkworkerproto.h>
+#include <clang-c/Index.h>
+#include <gio/gio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+/*
+ * A CdkWorker is a cdk-worker process the parser runs the libclang
+ * calls of its jobs in, so a crash in libclang only takes the process
+ * down and a runaway parse can be killed. The process is started on
+ * the first request and again after it died. Requests block until the
+ * reply arrives, so each worker is only used by one thread. A request
+ * whose job is cancelled while the process is still busy with it past
+ * a grace period gets the process killed too, as it's the only way to
+ * stop libclang.
+ */
+
+// A request taking longer than this is assumed to be stuck, eg. in a
+// runaway template instantiation, and the process is killed
+#define CDK_WORKER_TIMEOUT (60 * 1000)
+
+// How long a cancelled request may still run before the process is
+// killed, which costs the TUs of all of its files, and how often the
+// cancellation is checked for
+#define CDK_WORKER_CANCEL_GRACE    500
+#define CDK_WORKER_CANCEL_INTERVAL 50
+
+struct CdkWorker_
+{
+  GSubprocess *process;   // the running cdk-worker or NULL
+  gint         fd;        // our end of the socket to it, -1 if not running
+  const gint  *cancelled; // flag of the request's job, accessed atomically, or NULL
+};
+
+CdkWorker *
+cdk_worker_new (void)
+{
+  CdkWorker *worker = g_slice_new0 (CdkWorker);
+  worker->fd = -1;
+  return worker;
+}
+
+static void
+cdk_worker_stop (CdkWorker *worker)
+{
+  if (worker->process == NULL)
+    return;
+
+  close (worker->fd);
+  worker->fd = -1;
+
+  g_subprocess_force_exit (worker->process);
+  g_subprocess_wait (worker->process, NULL, NULL);
+  g_object_unref (worker->process);
+  worker->process = NULL;
+}
+
+void
+cdk_worker_free (CdkWorker *worker)
+{
+  if (G_UNLIKELY (worker == NULL))
+    return;
+
+  cdk_worker_stop (worker);
+
+  g_slice_free (CdkWorker, worker);
+}
+
+// overridable to run it from the build tree
+static const gchar *
+cdk_worker_get_path (void)
+{
+  const gchar *path = g_getenv ("CDK_WORKER_PATH");
+  if (path == NULL || *path == '\0')
+    path = CDK_WORKER_PATH;
+  return path;
+}
+
+/*
+ * Whether the cdk-worker program is installed, without it the parser
+ * runs libclang in-process.
+ */
+gboolean
+cdk_worker_is_available (void)
+{
+  return g_file_test (cdk_worker_get_path (), G_FILE_TEST_IS_EXECUTABLE);
+}
+
+static gboolean
+cdk_worker_start (CdkWorker *worker)
+{
+  if (worker->process != NULL)
+    return TRUE;
+
+  gint fds[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+      g_warning ("failed to create socket for worker process");
+      return FALSE;
+    }
+  fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+
+  const gchar *path = cdk_worker_get_path ();
+
+  GError *error = NULL;
+  GSubprocessLauncher *launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
+  g_subprocess_launcher_take_fd (launcher, fds[1], CDK_WORKER_FD);
+  worker->process = g_subprocess_launcher_spawn (launcher, &error, path, NULL);
+  g_object_unref (launcher);
+
+  if (worker->process == NULL)
+    {
+      g_warning ("failed to start worker process '%s': %s", path, error->message);
+      g_error_free (error);
+      close (fds[0]);
+      return FALSE;
+    }
+
+  worker->fd = fds[0];
+
+  return TRUE;
+}
+
+/*
+ * Makes the requests that follow check cancelled, the flag a job's
+ * cdk_parse_job_cancel() sets, while waiting for their reply. NULL to
+ * stop checking.
+ */
+void
+cdk_worker_set_cancelled (CdkWorker *worker, const gint *cancelled)
+{
+  g_return_if_fail (worker != NULL);
+  worker->cancelled = cancelled;
+}
+
+// Waits for the reply to arrive, FALSE if the request timed out or was
+// cancelled for long enough
+static gboolean
+cdk_worker_wait_reply (CdkWorker *worker, gboolean *cancelled)
+{
+  gint64 started = g_get_monotonic_time ();
+  gint64 deadline = started + (gint64) CDK_WORKER_TIMEOUT * 1000;
+  gint64 grace_end = 0;
+
+  for (;;)
+    {
+      gint64 now = g_get_monotonic_time ();
+      if (now >= deadline)
+        return FALSE;
+
+      if (worker->cancelled != NULL && g_atomic_int_get (worker->cancelled))
+        {
+          if (grace_end == 0)
+            grace_end = MAX (now, started + CDK_WORKER_CANCEL_GRACE * 1000);
+          if (now >= grace_end)
+            {
+              *cancelled = TRUE;
+              return FALSE;
+            }
+        }
+
+      struct pollfd pfd = { worker->fd, POLLIN, 0 };
+      gint64 wait = MIN (deadline - now, CDK_WORKER_CANCEL_INTERVAL * 1000);
+      gint ret = poll (&pfd, 1, (gint) (wait / 1000) + 1);
+      if (ret > 0)
+        return TRUE;
+      if (ret < 0 && errno != EINTR)
+        return FALSE;
+    }
+}
+
+// Sends a request and waits for its reply, NULL if the process failed
+// to answer in time or the request was cancelled, in which case it was
+// killed
+static GByteArray *
+cdk_worker_call (CdkWorker *worker,
+                 guint32 kind,
+                 GByteArray *request,
+                 const gchar *filename)
+{
+  GByteArray *reply = NULL;
+  guint32 reply_kind = 0;
+  gboolean cancelled = FALSE;
+
+  if (! cdk_worker_start (worker))
+    return NULL;
+
+  if (cdk_worker_write_message (worker->fd, kind, request) &&
+      cdk_worker_wait_reply (worker, &cancelled))
+    {
+      reply = cdk_worker_read_message (worker->fd, &reply_kind, CDK_WORKER_TIMEOUT);
+    }
+
+  if (reply != NULL && reply_kind != CDK_WORKER_REPLY)
+    {
+      g_byte_array_unref (reply);
+      reply = NULL;
+    }
+
+  if (reply == NULL)
+    {
+      if (cancelled)
+        g_debug ("request for '%s' cancelled, restarting worker process", filename);
+      else
+        g_warning ("worker process crashed or got stuck on '%s', restarting it",
+                   filename);
+      cdk_worker_stop (worker);
+    }
+
+  return reply;
+}
+
+// Copies the unsaved files to shared memory and adds their names to
+// request, the returned names unlink them again when freed
+static GPtrArray *
+cdk_worker_add_unsaved (GByteArray *request,
+                        const struct CXUnsavedFile *usf,
+                        guint n_usf)
+{
+  GPtrArray *names = g_ptr_array_new_with_free_func ((GDestroyNotify) cdk_worker_unshare);
+
+  cdk_worker_message_add_uint (request, n_usf);
+  for (guint i = 0; i < n_usf; i++)
+    {
+      gchar *name = cdk_worker_share (usf[i].Contents, usf[i].Length);
+      if (name == NULL)
+        g_warning ("failed to share unsaved contents of '%s'", usf[i].Filename);
+      g_ptr_array_add (names, name);
+      cdk_worker_message_add_string (request, usf[i].Filename);
+      cdk_worker_message_add_string (request, name);
+      cdk_worker_message_add_uint (request, usf[i].Length);
+    }
+
+  return names;
+}
+
+/*
+ * Has the process reparse its TU of filename if it was parsed with the
+ * same arguments and fresh is FALSE, or parse it otherwise. With
+ * cache_flags it may load the TU from the cache in cache_dir and saves
+ * it there under cache_key, from_cache telling if it was loaded. Unless
+ * results is NULL, it's filled with the results of the TU and func is
+ * called for the files it was built from. Returns a CXErrorCode.
+ */
+gint
+cdk_worker_parse (CdkWorker *worker,
+                  const gchar *filename,
+                  gchar **argv,
+                  gboolean fresh,
+                  const struct CXUnsavedFile *usf,
+                  guint n_usf,
+                  const gchar *cache_dir,
+                  const gchar *cache_key,
+                  guint cache_flags,
+                  gboolean *from_cache,
+                  CdkResults *results,
+                  CdkWorkerInclusionFunc func,
+                  gpointer user_data)
+{
+  g_return_val_if_fail (worker != NULL, CXError_InvalidArguments);
+  g_return_val_if_fail (filename != NULL, CXError_InvalidArguments);
+  g_return_val_if_fail (from_cache != NULL, CXError_InvalidArguments);
+
+  GByteArray *request = g_byte_array_new ();
+  cdk_worker_message_add_string (request, filename);
+  cdk_worker_message_add_strv (request, argv);
+  cdk_worker_message_add_uint (request, fresh);
+  GPtrArray *shared = cdk_worker_add_unsaved (request, usf, n_usf);
+  cdk_worker_message_add_string (request, cache_dir);
+  cdk_worker_message_add_string (request, cache_key);
+  cdk_worker_message_add_uint (request, (cache_dir != NULL && cache_key != NULL) ? cache_flags : 0);
+  cdk_worker_message_add_uint (request, (results != NULL));
+
+  GByteArray *reply = cdk_worker_call (worker, CDK_WORKER_PARSE, request, filename);
+  gint error = CXError_Crashed;
+  *from_cache = FALSE;
+  if (reply != NULL)
+    {
+      CdkWorkerReader reader;
+      cdk_worker_reader_init (&reader, reply);
+      error = cdk_worker_reader_get_uint (&reader);
+      *from_cache = cdk_worker_reader_get_uint (&reader);
+
+      if (error == CXError_Success && results != NULL)
+        {
+          guint32 n_inclusions = cdk_worker_reader_get_uint (&reader);
+          for (guint32 i = 0; i < n_inclusions && ! reader.failed; i++)
+            {
+              gchar *name = cdk_worker_reader_get_string (&reader);
+              gboolean is_main = cdk_worker_reader_get_uint (&reader);
+              gint64 mtime = cdk_worker_reader_get_uint64 (&reader);
+              if (name != NULL && func != NULL)
+                func (name, is_main, mtime, user_data);
+              g_free (name);
+            }
+          cdk_results_read (results, &reader);
+        }
+
+      if (reader.failed)
+        error = CXError_Failure;
+      g_byte_array_unref (reply);
+    }
+
+  g_ptr_array_free (shared, TRUE);
+  g_byte_array_unref (request);
+
+  return error;
+}
+
+/*
+ * Has the process build a PCH of filename at output. On success the
+ * headers it depends on are stored in includes. Returns a CXErrorCode.
+ */
+gint
+cdk_worker_build_pch (CdkWorker *worker,
+                      const gchar *filename,
+                      gchar **argv,
+                      const gchar *output,
+                      gchar ***includes)
+{
+  g_return_val_if_fail (worker != NULL, CXError_InvalidArguments);
+  g_return_val_if_fail (filename != NULL, CXError_InvalidArguments);
+  g_return_val_if_fail (output != NULL, CXError_InvalidArguments);
+  g_return_val_if_fail (includes != NULL, CXError_InvalidArguments);
+
+  GByteArray *request = g_byte_array_new ();
+  cdk_worker_message_add_string (request, filename);
+  cdk_worker_message_add_strv (request, argv);
+  cdk_worker_message_add_string (request, output);
+
+  GByteArray *reply = cdk_worker_call (worker, CDK_WORKER_BUILD_PCH, request, filename);
+  gint error = CXError_Crashed;
+  *includes = NULL;
+  if (reply != NULL)
+    {
+      CdkWorkerReader reader;
+      cdk_worker_reader_init (&reader, reply);
+      error = cdk_worker_reader_get_uint (&reader);
+      *includes = cdk_worker_reader_get_strv (&reader);
+      if (reader.failed)
+        error = CXError_Failure;
+      if (error != CXError_Success)
+        {
+          g_strfreev (*includes);
+          *includes = NULL;
+        }
+      g_byte_array_unref (reply);
+    }
+
+  g_byte_array_unref (request);
+
+  return error;
+}
+
+/*
+ * Has the process complete at line and column of filename, parsing it
+ * first if it has no TU of it. The typed text of the results is stored
+ * in completions. Returns a CXErrorCode.
+ */
+gint
+cdk_worker_complete (CdkWorker *worker,
+                     const gchar *filename,
+                     gchar **argv,
+                     guint line,
+                     guint column,
+                     const struct CXUnsavedFile *usf,
+                     guint n_usf,
+                     gchar ***completions)
+{
+  g_return_val_if_fail (worker != NULL, CXError_InvalidArguments);
+  g_return_val_if_fail (filename != NULL, CXError_InvalidArguments);
+  g_return_val_if_fail (completions != NULL, CXError_InvalidArguments);
+
+  GByteArray *request = g_byte_array_new ();
+  cdk_worker_message_add_string (request, filename);
+  cdk_worker_message_add_strv (request, argv);
+  cdk_worker_message_add_uint (request, line);
+  cdk_worker_message_add_uint (request, column);
+  GPtrArray *shared = cdk_worker_add_unsaved (request, usf, n_usf);
+
+  GByteArray *reply = cdk_worker_call (worker, CDK_WORKER_COMPLETE, request, filename);
+  gint error = CXError_Crashed;
+  *completions = NULL;
+  if (reply != NULL)
+    {
+      CdkWorkerReader reader;
+      cdk_worker_reader_init (&reader, reply);
+      error = cdk_worker_reader_get_uint (&reader);
+      *completions = cdk_worker_reader_get_strv (&reader);
+      if (reader.failed)
+        error = CXError_Failure;
+      g_byte_array_unref (reply);
+    }
+
+  g_ptr_array_free (shared, TRUE);
+  g_byte_array_unref (request);
+
+  return error;
+}
+
+/*
+ * Has the process dispose of its TU of filename, if it's running,
+ * saving it to the cache in cache_dir under cache_key first unless
+ * they're NULL.
+ */
+void
+cdk_worker_dispose (CdkWorker *worker,
+                    const gchar *filename,
+                    const gchar *cache_dir,
+                    const gchar *cache_key)
+{
+  g_return_if_fail (worker != NULL);
+  g_return_if_fail (filename != NULL);
+
+  if (worker->process == NULL)
+    return;
+
+  GByteArray *request = g_byte_array_new ();
+  cdk_worker_message_add_string (request, filename);
+  cdk_worker_message_add_string (request, cache_dir);
+  cdk_worker_message_add_string (request, cache_key);
+  // a dead process is noticed by the next request
+  cdk_worker_write_message (worker->fd, CDK_WORKER_DISPOSE, request);
+  g_byte_array_unref (request);
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifndef CDK_WORKER_H_
+#define CDK_WORKER_H_ 1
+
+#include <glib.h>
+#include <cdk/cdkresults.h>
+
+G_BEGIN_DECLS
+
+struct CXUnsavedFile;
+
+typedef struct CdkWorker_ CdkWorker;
+
+// Called for each file other than a system header a TU was built from,
+// with its modification time in seconds as libclang saw it
+typedef void (*CdkWorkerInclusionFunc) (const gchar *filename,
+                                        gboolean is_main,
+                                        gint64 mtime,
+                                        gpointer user_data);
+
+gboolean cdk_worker_is_available (void);
+CdkWorker *cdk_worker_new (void);
+void cdk_worker_free (CdkWorker *worker);
+void cdk_worker_set_cancelled (CdkWorker *worker, const gint *cancelled);
+
+gint cdk_worker_parse (CdkWorker *worker,
+                       const gchar *filename,
+                       gchar **argv,
+                       gboolean fresh,
+                       const struct CXUnsavedFile *usf,
+                       guint n_usf,
+                       const gchar *cache_dir,
+                       const gchar *cache_key,
+                       guint cache_flags,
+                       gboolean *from_cache,
+                       CdkResults *results,
+                       CdkWorkerInclusionFunc func,
+                       gpointer user_data);
+gint cdk_worker_build_pch (CdkWorker *worker,
+                           const gchar *filename,
+                           gchar **argv,
+                           const gchar *output,
+                           gchar ***includes);
+gint cdk_worker_complete (CdkWorker *worker,
+                          const gchar *filename,
+                          gchar **argv,
+                          guint line,
+                          guint column,
+                          const struct CXUnsavedFile *usf,
+                          guint n_usf,
+                          gchar ***completions);
+void cdk_worker_dispose (CdkWorker *worker,
+                         const gchar *filename,
+                         const gchar *cache_dir,
+                         const gchar *cache_key);
+
+G_END_DECLS
+
+#endif /* CDK_WORKER_H_ */
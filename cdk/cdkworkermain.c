@@ -0,0 +1,522 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <cdk/cdkcache.h>
+#include <cdk/cdkresults.h>
+#include <cdk/cdkworkerproto.h>
+#include <clang-c/Index.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+/*
+ * cdk-worker is the helper process libcdk runs the libclang calls in
+ * when it parses out of process, see cdkworker.c. It owns the TUs of
+ * the files libcdk sends it, keyed by their main file, and reparses
+ * them in place. It also loads them from and saves them to libcdk's
+ * cache. After every (re)parse it sends back the results libcdk needs
+ * of the TU (see cdkresults.c) and the files it was built from, so the
+ * TU itself never has to leave the process. Requests are handled one
+ * at a time until the socket is closed.
+ */
+
+typedef struct
+{
+  CXTranslationUnit tu;     // TU of the file
+  gchar           **argv;   // compiler arguments it was parsed with
+  gboolean          loaded; // whether tu was loaded from the cache, so can't be reparsed
+}
+CdkWorkerUnit;
+
+typedef struct
+{
+  CXTranslationUnit tu;    // TU the inclusions are of
+  GByteArray       *data;  // the inclusions as sent
+  guint32           count; // number of inclusions in data
+}
+CdkWorkerInclusions;
+
+static CdkCache *worker_cache = NULL; // the cache of the last request using one
+
+static void
+cdk_worker_unit_free (CdkWorkerUnit *unit)
+{
+  clang_disposeTranslationUnit (unit->tu);
+  g_strfreev (unit->argv);
+  g_slice_free (CdkWorkerUnit, unit);
+}
+
+static gboolean
+cdk_worker_strv_equal (gchar **a, gchar **b)
+{
+  if (a == NULL || b == NULL)
+    return (a == b);
+  for (; *a != NULL && *b != NULL; a++, b++)
+    {
+      if (strcmp (*a, *b) != 0)
+        return FALSE;
+    }
+  return (*a == NULL && *b == NULL);
+}
+
+// Maps the unsaved files of a request, free with cdk_worker_free_unsaved()
+static struct CXUnsavedFile *
+cdk_worker_read_unsaved (CdkWorkerReader *reader, guint *n_usf)
+{
+  guint32 n_files = cdk_worker_reader_get_uint (reader);
+  struct CXUnsavedFile *usf = NULL;
+
+  *n_usf = 0;
+  if (reader->failed)
+    return NULL;
+
+  usf = g_new0 (struct CXUnsavedFile, n_files + 1);
+  for (guint32 i = 0; i < n_files && ! reader->failed; i++)
+    {
+      gchar *filename = cdk_worker_reader_get_string (reader);
+      gchar *name = cdk_worker_reader_get_string (reader);
+      guint32 length = cdk_worker_reader_get_uint (reader);
+      gpointer contents = NULL;
+
+      // libcdk failed to share it, the file on disk has to do
+      if (filename != NULL && name != NULL)
+        contents = cdk_worker_map (name, length);
+      g_free (name);
+
+      if (contents == NULL)
+        {
+          g_free (filename);
+          continue;
+        }
+
+      usf[*n_usf].Filename = filename;
+      usf[*n_usf].Contents = contents;
+      usf[*n_usf].Length = length;
+      (*n_usf)++;
+    }
+
+  return usf;
+}
+
+static void
+cdk_worker_free_unsaved (struct CXUnsavedFile *usf, guint n_usf)
+{
+  for (guint i = 0; i < n_usf; i++)
+    {
+      cdk_worker_unmap ((gpointer) usf[i].Contents, usf[i].Length);
+      g_free ((gchar *) usf[i].Filename);
+    }
+  g_free (usf);
+}
+
+// Reparses the file's TU if it was parsed with argv, otherwise parses
+// it from scratch
+static CdkWorkerUnit *
+cdk_worker_update_unit (CXIndex index,
+                        GHashTable *units,
+                        const gchar *filename,
+                        gchar **argv,
+                        gboolean fresh,
+                        struct CXUnsavedFile *usf,
+                        guint n_usf,
+                        gint *error)
+{
+  CdkWorkerUnit *unit = g_hash_table_lookup (units, filename);
+
+  if (unit != NULL && ! fresh && ! unit->loaded &&
+      cdk_worker_strv_equal (unit->argv, argv))
+    {
+      *error = clang_reparseTranslationUnit (unit->tu, n_usf, n_usf ? usf : NULL,
+                                             clang_defaultReparseOptions (unit->tu));
+      if (*error == CXError_Success)
+        return unit;
+    }
+
+  // A failed reparse leaves the TU only good for disposing
+  g_hash_table_remove (units, filename);
+
+  CXTranslationUnit tu = NULL;
+  gint argc = (argv != NULL) ? g_strv_length (argv) : 0;
+  *error =
+    clang_parseTranslationUnit2 (index, filename,
+                                 (const gchar *const *) argv, argc,
+                                 n_usf ? usf : NULL, n_usf,
+                                 CDK_RESULTS_PARSE_OPTIONS,
+                                 &tu);
+  if (*error != CXError_Success)
+    {
+      if (tu != NULL)
+        clang_disposeTranslationUnit (tu);
+      return NULL;
+    }
+
+  unit = g_slice_new0 (CdkWorkerUnit);
+  unit->tu = tu;
+  unit->argv = g_strdupv (argv);
+  g_hash_table_insert (units, g_strdup (filename), unit);
+
+  return unit;
+}
+
+// The cache in dir, kept from the last request if it's the same
+static CdkCache *
+cdk_worker_get_cache (const gchar *dir)
+{
+  if (dir == NULL)
+    return NULL;
+  if (worker_cache != NULL && g_strcmp0 (cdk_cache_get_dir (worker_cache), dir) == 0)
+    return worker_cache;
+
+  cdk_cache_free (worker_cache);
+  worker_cache = cdk_cache_new (dir);
+  return worker_cache;
+}
+
+// The unsaved contents of filename among usf or NULL, as the cache
+// takes them
+static GBytes *
+cdk_worker_get_contents (const gchar *filename,
+                         struct CXUnsavedFile *usf,
+                         guint n_usf)
+{
+  for (guint i = 0; i < n_usf; i++)
+    {
+      if (g_strcmp0 (usf[i].Filename, filename) == 0)
+        return g_bytes_new_static (usf[i].Contents, usf[i].Length);
+    }
+  return NULL;
+}
+
+// Loads the file's TU from the cache, replacing the one there was
+static CdkWorkerUnit *
+cdk_worker_load_unit (CXIndex index,
+                      GHashTable *units,
+                      CdkCache *cache,
+                      const gchar *cache_key,
+                      const gchar *filename,
+                      gchar **argv,
+                      GBytes *contents)
+{
+  CXTranslationUnit tu = cdk_cache_load (cache, index, cache_key, filename, contents);
+  if (tu == NULL)
+    return NULL;
+
+  CdkWorkerUnit *unit = g_slice_new0 (CdkWorkerUnit);
+  unit->tu = tu;
+  unit->argv = g_strdupv (argv);
+  unit->loaded = TRUE;
+  g_hash_table_insert (units, g_strdup (filename), unit);
+
+  return unit;
+}
+
+// Same as cdk_parser_collect_depend(), libcdk makes the stamps
+static void
+cdk_worker_collect_inclusion (CXFile included_file,
+                              G_GNUC_UNUSED CXSourceLocation *stack,
+                              unsigned stack_len,
+                              CdkWorkerInclusions *incs)
+{
+  if (stack_len > 0 &&
+      clang_Location_isInSystemHeader (clang_getLocationForOffset (incs->tu, included_file, 0)))
+    return;
+
+  CXString name = clang_getFileName (included_file);
+  cdk_worker_message_add_string (incs->data, clang_getCString (name));
+  cdk_worker_message_add_uint (incs->data, (stack_len == 0));
+  cdk_worker_message_add_uint64 (incs->data, (guint64) clang_getFileTime (included_file));
+  incs->count++;
+  clang_disposeString (name);
+}
+
+static void
+cdk_worker_add_inclusions (GByteArray *reply, CXTranslationUnit tu)
+{
+  CdkWorkerInclusions incs;
+
+  incs.tu = tu;
+  incs.data = g_byte_array_new ();
+  incs.count = 0;
+  clang_getInclusions (tu, (CXInclusionVisitor) cdk_worker_collect_inclusion, &incs);
+
+  cdk_worker_message_add_uint (reply, incs.count);
+  g_byte_array_append (reply, incs.data->data, incs.data->len);
+  g_byte_array_unref (incs.data);
+}
+
+static void
+cdk_worker_handle_parse (CXIndex index,
+                         GHashTable *units,
+                         CdkWorkerReader *reader,
+                         GByteArray *reply)
+{
+  gchar *filename = cdk_worker_reader_get_string (reader);
+  gchar **argv = cdk_worker_reader_get_strv (reader);
+  gboolean fresh = cdk_worker_reader_get_uint (reader);
+  guint n_usf = 0;
+  struct CXUnsavedFile *usf = cdk_worker_read_unsaved (reader, &n_usf);
+  gchar *cache_dir = cdk_worker_reader_get_string (reader);
+  gchar *cache_key = cdk_worker_reader_get_string (reader);
+  guint32 cache_flags = cdk_worker_reader_get_uint (reader);
+  gboolean collect = cdk_worker_reader_get_uint (reader);
+  CdkCache *cache = NULL;
+  GBytes *contents = NULL;
+  CdkWorkerUnit *unit = NULL;
+  gint error = CXError_InvalidArguments;
+
+  if (! reader->failed && filename != NULL)
+    {
+      if (cache_key != NULL)
+        cache = cdk_worker_get_cache (cache_dir);
+      if (cache != NULL)
+        contents = cdk_worker_get_contents (filename, usf, n_usf);
+
+      if (cache != NULL && (cache_flags & CDK_WORKER_CACHE_LOAD))
+        unit = cdk_worker_load_unit (index, units, cache, cache_key,
+                                     filename, argv, contents);
+
+      if (unit != NULL)
+        error = CXError_Success;
+      else
+        {
+          unit = cdk_worker_update_unit (index, units, filename, argv, fresh,
+                                         usf, n_usf, &error);
+          if (unit != NULL && cache != NULL && (cache_flags & CDK_WORKER_CACHE_SAVE))
+            cdk_cache_save (cache, unit->tu, cache_key, filename, contents);
+        }
+    }
+
+  cdk_worker_message_add_uint (reply, error);
+  cdk_worker_message_add_uint (reply, (unit != NULL && unit->loaded));
+
+  if (unit != NULL && collect)
+    {
+      CdkResults results = { NULL, NULL, NULL, NULL };
+      cdk_worker_add_inclusions (reply, unit->tu);
+      cdk_results_collect (&results, unit->tu);
+      cdk_results_write (&results, reply);
+      cdk_results_clear (&results);
+    }
+
+  if (contents != NULL)
+    g_bytes_unref (contents);
+  cdk_worker_free_unsaved (usf, n_usf);
+  g_free (filename);
+  g_strfreev (argv);
+  g_free (cache_dir);
+  g_free (cache_key);
+}
+
+// Saves the file's TU to the cache if asked to, then disposes of it
+static void
+cdk_worker_handle_dispose (GHashTable *units, CdkWorkerReader *reader)
+{
+  gchar *filename = cdk_worker_reader_get_string (reader);
+  gchar *cache_dir = cdk_worker_reader_get_string (reader);
+  gchar *cache_key = cdk_worker_reader_get_string (reader);
+
+  CdkWorkerUnit *unit = (filename != NULL) ? g_hash_table_lookup (units, filename) : NULL;
+  if (unit != NULL && ! unit->loaded && ! reader->failed && cache_key != NULL)
+    {
+      CdkCache *cache = cdk_worker_get_cache (cache_dir);
+      if (cache != NULL)
+        cdk_cache_save (cache, unit->tu, cache_key, filename, NULL);
+    }
+
+  if (filename != NULL)
+    g_hash_table_remove (units, filename);
+
+  g_free (filename);
+  g_free (cache_dir);
+  g_free (cache_key);
+}
+
+// Same as cdk_parser_collect_pch_include()
+static void
+cdk_worker_collect_pch_include (CXFile included_file,
+                                CXSourceLocation *stack,
+                                unsigned stack_len,
+                                GPtrArray *includes)
+{
+  if (stack_len == 0 ||
+      (stack_len > 1 && clang_Location_isInSystemHeader (stack[0])))
+    return;
+
+  CXString name = clang_getFileName (included_file);
+  g_ptr_array_add (includes, g_strdup (clang_getCString (name)));
+  clang_disposeString (name);
+}
+
+static void
+cdk_worker_handle_build_pch (CXIndex index,
+                             CdkWorkerReader *reader,
+                             GByteArray *reply)
+{
+  gchar *filename = cdk_worker_reader_get_string (reader);
+  gchar **argv = cdk_worker_reader_get_strv (reader);
+  gchar *output = cdk_worker_reader_get_string (reader);
+  GPtrArray *includes = g_ptr_array_new_with_free_func (g_free);
+  CXTranslationUnit tu = NULL;
+  gint error = CXError_InvalidArguments;
+
+  if (! reader->failed && filename != NULL && output != NULL)
+    {
+      gint argc = (argv != NULL) ? g_strv_length (argv) : 0;
+      error =
+        clang_parseTranslationUnit2 (index, filename,
+                                     (const gchar *const *) argv, argc,
+                                     NULL, 0,
+                                     CXTranslationUnit_ForSerialization |
+                                     CXTranslationUnit_Incomplete,
+                                     &tu);
+    }
+
+  if (error == CXError_Success)
+    {
+      g_ptr_array_add (includes, g_strdup (filename));
+      clang_getInclusions (tu, (CXInclusionVisitor) cdk_worker_collect_pch_include, includes);
+
+      gchar *tmp_output = g_strconcat (output, ".tmp", NULL);
+      if (clang_saveTranslationUnit (tu, tmp_output, clang_defaultSaveOptions (tu)) != CXSaveError_None ||
+          g_rename (tmp_output, output) != 0)
+        {
+          g_unlink (tmp_output);
+          error = CXError_Failure;
+        }
+      g_free (tmp_output);
+    }
+
+  if (tu != NULL)
+    clang_disposeTranslationUnit (tu);
+
+  g_ptr_array_add (includes, NULL);
+  cdk_worker_message_add_uint (reply, error);
+  cdk_worker_message_add_strv (reply, (error == CXError_Success) ?
+                                        (gchar **) includes->pdata : NULL);
+
+  g_ptr_array_free (includes, TRUE);
+  g_free (filename);
+  g_strfreev (argv);
+  g_free (output);
+}
+
+static void
+cdk_worker_handle_complete (CXIndex index,
+                            GHashTable *units,
+                            CdkWorkerReader *reader,
+                            GByteArray *reply)
+{
+  gchar *filename = cdk_worker_reader_get_string (reader);
+  gchar **argv = cdk_worker_reader_get_strv (reader);
+  guint32 line = cdk_worker_reader_get_uint (reader);
+  guint32 column = cdk_worker_reader_get_uint (reader);
+  guint n_usf = 0;
+  struct CXUnsavedFile *usf = cdk_worker_read_unsaved (reader, &n_usf);
+  GPtrArray *completions = g_ptr_array_new_with_free_func (g_free);
+  gint error = CXError_InvalidArguments;
+
+  if (! reader->failed && filename != NULL)
+    {
+      // Not parsed here yet, or loaded from the cache which can't complete
+      CdkWorkerUnit *unit = g_hash_table_lookup (units, filename);
+      if (unit == NULL || unit->loaded)
+        unit = cdk_worker_update_unit (index, units, filename, argv, TRUE,
+                                       usf, n_usf, &error);
+
+      CXCodeCompleteResults *results = NULL;
+      if (unit != NULL)
+        results = clang_codeCompleteAt (unit->tu, filename, line, column,
+                                        n_usf ? usf : NULL, n_usf,
+                                        clang_defaultCodeCompleteOptions ());
+      error = (results != NULL) ? CXError_Success : CXError_Failure;
+
+      // Only the typed text is of any use to the completer
+      for (guint i = 0; results != NULL && i < results->NumResults; i++)
+        {
+          CXCompletionString str = results->Results[i].CompletionString;
+          guint n_chunks = clang_getNumCompletionChunks (str);
+          for (guint j = 0; j < n_chunks; j++)
+            {
+              if (clang_getCompletionChunkKind (str, j) == CXCompletionChunk_TypedText)
+                {
+                  CXString name = clang_getCompletionChunkText (str, j);
+                  g_ptr_array_add (completions, g_strdup (clang_getCString (name)));
+                  clang_disposeString (name);
+                  break;
+                }
+            }
+        }
+
+      if (results != NULL)
+        clang_disposeCodeCompleteResults (results);
+    }
+
+  g_ptr_array_add (completions, NULL);
+  cdk_worker_message_add_uint (reply, error);
+  cdk_worker_message_add_strv (reply, (gchar **) completions->pdata);
+
+  g_ptr_array_free (completions, TRUE);
+  cdk_worker_free_unsaved (usf, n_usf);
+  g_free (filename);
+  g_strfreev (argv);
+}
+
+int
+main (G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv)
+{
+  CXIndex index = clang_createIndex (TRUE, FALSE);
+  GHashTable *units = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify) cdk_worker_unit_free);
+  GByteArray *msg;
+  guint32 kind = 0;
+
+  while ((msg = cdk_worker_read_message (CDK_WORKER_FD, &kind, -1)) != NULL)
+    {
+      CdkWorkerReader reader;
+      GByteArray *reply = g_byte_array_new ();
+
+      cdk_worker_reader_init (&reader, msg);
+
+      switch (kind)
+        {
+        case CDK_WORKER_PARSE:
+          cdk_worker_handle_parse (index, units, &reader, reply);
+          break;
+        case CDK_WORKER_BUILD_PCH:
+          cdk_worker_handle_build_pch (index, &reader, reply);
+          break;
+        case CDK_WORKER_COMPLETE:
+          cdk_worker_handle_complete (index, units, &reader, reply);
+          break;
+        case CDK_WORKER_DISPOSE:
+          cdk_worker_handle_dispose (units, &reader);
+          g_byte_array_unref (reply);
+          reply = NULL;
+          break;
+        default:
+          g_warning ("unknown request %u", (guint) kind);
+          break;
+        }
+
+      g_byte_array_unref (msg);
+
+      if (reply != NULL)
+        {
+          gboolean sent = cdk_worker_write_message (CDK_WORKER_FD, CDK_WORKER_REPLY, reply);
+          g_byte_array_unref (reply);
+          if (! sent)
+            break;
+        }
+    }
+
+  g_hash_table_destroy (units);
+  cdk_cache_free (worker_cache);
+  clang_disposeIndex (index);
+
+  return 0;
+}
@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <cdk/cdkworkerproto.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * libcdk and its worker processes talk over a local socket. Every
+ * message is a header of two native endian 32-bit words, the kind of
+ * message and the size of the payload, followed by the payload. The
+ * payload is a sequence of 32-bit words, 64-bit ones for sizes, and
+ * strings, a string being its length followed by its bytes, with a
+ * length of G_MAXUINT32 for NULL. String vectors are their length
+ * followed by the strings.
+ *
+ * Unsaved buffers aren't part of the messages, they're copied to POSIX
+ * shared memory objects and only the names of those are sent.
+ */
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+// Anything bigger means the stream is out of sync
+#define CDK_WORKER_MAX_MESSAGE (64 * 1024 * 1024)
+
+void
+cdk_worker_message_add_uint (GByteArray *msg, guint32 value)
+{
+  g_byte_array_append (msg, (const guint8 *) &value, sizeof (value));
+}
+
+void
+cdk_worker_message_add_uint64 (GByteArray *msg, guint64 value)
+{
+  g_byte_array_append (msg, (const guint8 *) &value, sizeof (value));
+}
+
+void
+cdk_worker_message_add_string (GByteArray *msg, const gchar *str)
+{
+  if (str == NULL)
+    {
+      cdk_worker_message_add_uint (msg, G_MAXUINT32);
+      return;
+    }
+
+  guint32 length = strlen (str);
+  cdk_worker_message_add_uint (msg, length);
+  g_byte_array_append (msg, (const guint8 *) str, length);
+}
+
+void
+cdk_worker_message_add_strv (GByteArray *msg, gchar **strv)
+{
+  guint32 length = (strv != NULL) ? g_strv_length (strv) : 0;
+
+  cdk_worker_message_add_uint (msg, length);
+  for (guint32 i = 0; i < length; i++)
+    cdk_worker_message_add_string (msg, strv[i]);
+}
+
+void
+cdk_worker_reader_init (CdkWorkerReader *reader, GByteArray *msg)
+{
+  reader->data = msg->data;
+  reader->length = msg->len;
+  reader->offset = 0;
+  reader->failed = FALSE;
+}
+
+static gboolean
+cdk_worker_reader_ensure (CdkWorkerReader *reader, gsize size)
+{
+  if (reader->failed || reader->length - reader->offset < size)
+    {
+      reader->failed = TRUE;
+      return FALSE;
+    }
+  return TRUE;
+}
+
+guint32
+cdk_worker_reader_get_uint (CdkWorkerReader *reader)
+{
+  guint32 value = 0;
+
+  if (cdk_worker_reader_ensure (reader, sizeof (value)))
+    {
+      memcpy (&value, reader->data + reader->offset, sizeof (value));
+      reader->offset += sizeof (value);
+    }
+
+  return value;
+}
+
+guint64
+cdk_worker_reader_get_uint64 (CdkWorkerReader *reader)
+{
+  guint64 value = 0;
+
+  if (cdk_worker_reader_ensure (reader, sizeof (value)))
+    {
+      memcpy (&value, reader->data + reader->offset, sizeof (value));
+      reader->offset += sizeof (value);
+    }
+
+  return value;
+}
+
+gchar *
+cdk_worker_reader_get_string (CdkWorkerReader *reader)
+{
+  guint32 length = cdk_worker_reader_get_uint (reader);
+
+  if (length == G_MAXUINT32 || ! cdk_worker_reader_ensure (reader, length))
+    return NULL;
+
+  gchar *str = g_strndup ((const gchar *) reader->data + reader->offset, length);
+  reader->offset += length;
+
+  return str;
+}
+
+gchar **
+cdk_worker_reader_get_strv (CdkWorkerReader *reader)
+{
+  guint32 length = cdk_worker_reader_get_uint (reader);
+
+  // every string takes at least its length
+  if (! cdk_worker_reader_ensure (reader, (gsize) length * sizeof (guint32)))
+    return NULL;
+
+  gchar **strv = g_new0 (gchar *, length + 1);
+  for (guint32 i = 0; i < length; i++)
+    {
+      strv[i] = cdk_worker_reader_get_string (reader);
+      if (strv[i] == NULL)
+        {
+          reader->failed = TRUE;
+          g_strfreev (strv);
+          return NULL;
+        }
+    }
+
+  return strv;
+}
+
+static gboolean
+cdk_worker_write_all (gint fd, const guint8 *data, gsize length)
+{
+  while (length > 0)
+    {
+      gssize n = send (fd, data, length, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return FALSE;
+      data += n;
+      length -= n;
+    }
+  return TRUE;
+}
+
+// Gives up once the monotonic time passes deadline, unless it's 0
+static gboolean
+cdk_worker_read_all (gint fd, guint8 *data, gsize length, gint64 deadline)
+{
+  while (length > 0)
+    {
+      if (deadline > 0)
+        {
+          gint64 remaining = (deadline - g_get_monotonic_time ()) / 1000;
+          struct pollfd pfd = { fd, POLLIN, 0 };
+          gint ret = poll (&pfd, 1, (gint) MAX (remaining, 0));
+          if (ret < 0 && errno == EINTR)
+            continue;
+          if (ret <= 0)
+            return FALSE;
+        }
+
+      gssize n = read (fd, data, length);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return FALSE;
+      data += n;
+      length -= n;
+    }
+  return TRUE;
+}
+
+gboolean
+cdk_worker_write_message (gint fd, guint32 kind, GByteArray *msg)
+{
+  guint32 header[2] = { kind, (msg != NULL) ? msg->len : 0 };
+
+  if (! cdk_worker_write_all (fd, (const guint8 *) header, sizeof (header)))
+    return FALSE;
+
+  return (msg == NULL || cdk_worker_write_all (fd, msg->data, msg->len));
+}
+
+/*
+ * Waits at most timeout milliseconds for the whole message, forever if
+ * it's negative. Returns NULL if it didn't arrive or the other end is
+ * gone.
+ */
+GByteArray *
+cdk_worker_read_message (gint fd, guint32 *kind, gint timeout)
+{
+  guint32 header[2] = { 0, 0 };
+  gint64 deadline = 0;
+
+  if (timeout >= 0)
+    deadline = g_get_monotonic_time () + (gint64) timeout * 1000 + 1;
+
+  if (! cdk_worker_read_all (fd, (guint8 *) header, sizeof (header), deadline) ||
+      header[1] > CDK_WORKER_MAX_MESSAGE)
+    return NULL;
+
+  GByteArray *msg = g_byte_array_sized_new (header[1]);
+  g_byte_array_set_size (msg, header[1]);
+  if (! cdk_worker_read_all (fd, msg->data, msg->len, deadline))
+    {
+      g_byte_array_unref (msg);
+      return NULL;
+    }
+
+  *kind = header[0];
+
+  return msg;
+}
+
+/*
+ * Copies data into a new shared memory object and returns its name,
+ * which is freed and unlinked with cdk_worker_unshare(). Returns NULL
+ * on failure.
+ */
+gchar *
+cdk_worker_share (gconstpointer data, gsize length)
+{
+  static gint serial = 0;
+  gchar *name = g_strdup_printf ("/cdk-%d-%d", (gint) getpid (),
+                                 g_atomic_int_add (&serial, 1));
+
+  gint fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    {
+      g_free (name);
+      return NULL;
+    }
+
+  gboolean shared = (ftruncate (fd, length) == 0);
+  if (shared && length > 0)
+    {
+      gpointer map = mmap (NULL, length, PROT_WRITE, MAP_SHARED, fd, 0);
+      if (map != MAP_FAILED)
+        {
+          memcpy (map, data, length);
+          munmap (map, length);
+        }
+      else
+        shared = FALSE;
+    }
+  close (fd);
+
+  if (! shared)
+    {
+      cdk_worker_unshare (name);
+      return NULL;
+    }
+
+  return name;
+}
+
+void
+cdk_worker_unshare (gchar *name)
+{
+  if (name == NULL)
+    return;
+  shm_unlink (name);
+  g_free (name);
+}
+
+/*
+ * Maps a shared memory object read-only, unmap with cdk_worker_unmap().
+ * An empty one maps to "".
+ */
+gpointer
+cdk_worker_map (const gchar *name, gsize length)
+{
+  if (length == 0)
+    return "";
+
+  gint fd = shm_open (name, O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  gpointer map = NULL;
+  if (fstat (fd, &st) == 0 && (gsize) st.st_size >= length)
+    {
+      map = mmap (NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+      if (map == MAP_FAILED)
+        map = NULL;
+    }
+  close (fd);
+
+  return map;
+}
+
+void
+cdk_worker_unmap (gpointer data, gsize length)
+{
+  if (data != NULL && length > 0)
+    munmap (data, length);
+}
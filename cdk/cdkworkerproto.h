@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2015, Matthew Brush <mbrush@codebrainz.ca>
+ * All rights reserved. See the COPYING file for full license.
+ */
+
+#ifndef CDK_WORKER_PROTO_H_
+#define CDK_WORKER_PROTO_H_ 1
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+// The descriptor of the socket to libcdk in the worker process
+#define CDK_WORKER_FD 3
+
+typedef enum
+{
+  CDK_WORKER_PARSE = 1, // filename, argv, fresh, unsaved, cache_dir, cache_key, cache_flags, collect
+                        //   -> error, from_cache, inclusions, results
+  CDK_WORKER_BUILD_PCH, // filename, argv, output -> error, includes
+  CDK_WORKER_COMPLETE,  // filename, argv, line, column, unsaved -> error, completions
+  CDK_WORKER_DISPOSE,   // filename, cache_dir, cache_key -> no reply
+  CDK_WORKER_REPLY,
+}
+CdkWorkerMessageKind;
+
+// What a PARSE may do with the cache given with it
+typedef enum
+{
+  CDK_WORKER_CACHE_LOAD = 1 << 0, // load the TU from it if the entry is fresh
+  CDK_WORKER_CACHE_SAVE = 1 << 1, // save the TU to it once (re)parsed
+}
+CdkWorkerCacheFlags;
+
+// Walks the payload of a message, any read past its end fails it
+typedef struct
+{
+  const guint8 *data;
+  gsize         length;
+  gsize         offset;
+  gboolean      failed;
+}
+CdkWorkerReader;
+
+void cdk_worker_message_add_uint (GByteArray *msg, guint32 value);
+void cdk_worker_message_add_uint64 (GByteArray *msg, guint64 value);
+void cdk_worker_message_add_string (GByteArray *msg, const gchar *str);
+void cdk_worker_message_add_strv (GByteArray *msg, gchar **strv);
+
+void cdk_worker_reader_init (CdkWorkerReader *reader, GByteArray *msg);
+guint32 cdk_worker_reader_get_uint (CdkWorkerReader *reader);
+guint64 cdk_worker_reader_get_uint64 (CdkWorkerReader *reader);
+gchar *cdk_worker_reader_get_string (CdkWorkerReader *reader);
+gchar **cdk_worker_reader_get_strv (CdkWorkerReader *reader);
+
+gboolean cdk_worker_write_message (gint fd, guint32 kind, GByteArray *msg);
+GByteArray *cdk_worker_read_message (gint fd, guint32 *kind, gint timeout);
+
+gchar *cdk_worker_share (gconstpointer data, gsize length);
+void cdk_worker_unshare (gchar *name);
+gpointer cdk_worker_map (const gchar *name, gsize length);
+void cdk_worker_unmap (gpointer data, gsize length);
+
+G_END_DECLS
+
+#endif /* CDK_WORKER_PROTO_H_ */
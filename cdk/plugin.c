@@ -13,11 +13,12 @@
 #include <cdk/cdkutils.h>
 #include <geanyplugin.h>
 
-static gint update_timeout = 250;
-static gulong update_handler = 0;
 static GtkWidget *project_page = NULL;
 static GtkTextView *cflags_textview = NULL;
 static GtkTextView *files_textview = NULL;
+static GtkWidget *usage_page = NULL;
+static GtkListStore *usage_store = NULL;
+static guint usage_refresh_handler = 0;
 static CdkPlugin *cdk_plugin = NULL;
 GeanyData *geany_data;
 GeanyPlugin *geany_plugin;
@@ -56,14 +57,22 @@ static void on_document_close (G_GNUC_UNUSED GObject *object,
   GeanyDocument *doc, G_GNUC_UNUSED gpointer user_data)
 {
   if (cdk_project_is_open ())
-    cdk_plugin_remove_document (cdk_plugin, doc);
+    {
+      cdk_plugin_mark_buffer_clean (cdk_plugin, doc);
+      cdk_plugin_update_dependents (cdk_plugin, doc);
+      cdk_plugin_remove_document (cdk_plugin, doc);
+    }
 }
 
 static void on_document_save (G_GNUC_UNUSED GObject *object,
   GeanyDocument *doc, G_GNUC_UNUSED gpointer user_data)
 {
   if (cdk_project_is_open ())
-    cdk_plugin_update_document (cdk_plugin, doc);
+    {
+      cdk_plugin_mark_buffer_clean (cdk_plugin, doc);
+      cdk_plugin_update_document (cdk_plugin, doc);
+      cdk_plugin_update_dependents (cdk_plugin, doc);
+    }
 }
 
 static void on_document_activate (G_GNUC_UNUSED GObject *object,
@@ -169,40 +178,207 @@ static void on_project_dialog_confirmed (G_GNUC_UNUSED GObject *object,
   g_free (cflags_text);
   g_key_file_set_string_list (config, "cdk", "files", (const gchar *const *) files_list, files_len);
   g_strfreev (files_list);
-
-  // FIXME: don't reload the whole thing here
-  cdk_plugin_close_project (cdk_plugin);
-  cdk_plugin_open_project (cdk_plugin, config);
+  const gchar *pch_prefix = cdk_plugin_get_pch_prefix (cdk_plugin);
+  if (pch_prefix != NULL)
+    g_key_file_set_string (config, "cdk", "pch", pch_prefix);
+  const gchar *compdb_dir = cdk_plugin_get_compdb_dir (cdk_plugin);
+  if (compdb_dir != NULL)
+    g_key_file_set_string (config, "cdk", "compdb", compdb_dir);
+  guint64 budget = cdk_plugin_get_memory_budget_mib (cdk_plugin);
+  if (budget > 0)
+    g_key_file_set_uint64 (config, "cdk", "memory-budget", budget);
+  if (cdk_plugin_get_out_of_process (cdk_plugin))
+    g_key_file_set_boolean (config, "cdk", "out-of-process", TRUE);
+  if (cdk_plugin_get_warm_up (cdk_plugin))
+    g_key_file_set_boolean (config, "cdk", "warm-up", TRUE);
+  if (cdk_plugin_get_symbol_index (cdk_plugin))
+    g_key_file_set_boolean (config, "cdk", "symbol-index", TRUE);
+
+  // only reparses what the changes affect
+  cdk_plugin_reconfigure_project (cdk_plugin, config);
   g_key_file_free (config);
+}
 
+static gboolean on_editor_notify (G_GNUC_UNUSED GObject *object,
+  GeanyEditor *editor, SCNotification *nt, G_GNUC_UNUSED gpointer user_data)
+{
+  if (cdk_project_is_open () &&
+      nt->nmhdr.code == SCN_MODIFIED &&
+      (nt->modificationType & SC_MOD_INSERTTEXT ||
+       nt->modificationType & SC_MOD_DELETETEXT))
+    {
+      cdk_plugin_mark_buffer_dirty (cdk_plugin, editor->document);
+      cdk_plugin_schedule_update (cdk_plugin, editor->document);
+    }
+  return FALSE;
+}
+
+//
+// Sidebar view of the memory used by the translation units
+//
+
+enum
+{
+  USAGE_COL_NAME,
+  USAGE_COL_TOTAL,
+  USAGE_COL_AST,
+  USAGE_COL_IDENTIFIERS,
+  USAGE_COL_PREAMBLE,
+  USAGE_COL_SOURCE_MANAGER,
+  USAGE_COL_PREPROCESSOR,
+  USAGE_NUM_COLS,
+};
+
+static void usage_store_append (const gchar *name, const CdkResourceUsage *usage)
+{
+  gchar *sizes[USAGE_NUM_COLS] = { NULL };
+  sizes[USAGE_COL_TOTAL] = g_format_size (usage->total);
+  sizes[USAGE_COL_AST] = g_format_size (usage->ast);
+  sizes[USAGE_COL_IDENTIFIERS] = g_format_size (usage->identifiers);
+  sizes[USAGE_COL_PREAMBLE] = g_format_size (usage->preamble);
+  sizes[USAGE_COL_SOURCE_MANAGER] = g_format_size (usage->source_manager);
+  sizes[USAGE_COL_PREPROCESSOR] = g_format_size (usage->preprocessor);
+
+  GtkTreeIter iter;
+  gtk_list_store_append (usage_store, &iter);
+  gtk_list_store_set (usage_store, &iter,
+                      USAGE_COL_NAME, name,
+                      USAGE_COL_TOTAL, sizes[USAGE_COL_TOTAL],
+                      USAGE_COL_AST, sizes[USAGE_COL_AST],
+                      USAGE_COL_IDENTIFIERS, sizes[USAGE_COL_IDENTIFIERS],
+                      USAGE_COL_PREAMBLE, sizes[USAGE_COL_PREAMBLE],
+                      USAGE_COL_SOURCE_MANAGER, sizes[USAGE_COL_SOURCE_MANAGER],
+                      USAGE_COL_PREPROCESSOR, sizes[USAGE_COL_PREPROCESSOR],
+                      -1);
+
+  for (guint i = 0; i < USAGE_NUM_COLS; i++)
+    g_free (sizes[i]);
+}
+
+static gboolean on_usage_refresh (G_GNUC_UNUSED gpointer user_data)
+{
+  usage_refresh_handler = 0;
+
+  if (! GTK_IS_LIST_STORE (usage_store))
+    return FALSE;
+
+  gtk_list_store_clear (usage_store);
+
+  if (! cdk_project_is_open ())
+    return FALSE;
+
+  // biggest first, those are the ones worth looking at
+  GArray *usages = g_array_new (FALSE, FALSE, sizeof (CdkResourceUsage));
+  GPtrArray *docs = g_ptr_array_new ();
   guint i;
   foreach_document (i)
     {
-      on_document_open(NULL, documents[i], NULL);
+      CdkResourceUsage usage;
+      if (! cdk_plugin_get_resource_usage (cdk_plugin, documents[i], &usage))
+        continue;
+      guint pos = 0;
+      while (pos < usages->len &&
+             g_array_index (usages, CdkResourceUsage, pos).total >= usage.total)
+        pos++;
+      g_array_insert_val (usages, pos, usage);
+      g_ptr_array_insert (docs, pos, documents[i]);
+    }
+
+  for (i = 0; i < docs->len; i++)
+    {
+      GeanyDocument *doc = docs->pdata[i];
+      gchar *name = g_path_get_basename (DOC_FILENAME (doc));
+      usage_store_append (name, &g_array_index (usages, CdkResourceUsage, i));
+      g_free (name);
     }
+
+  CdkResourceUsage project_usage;
+  cdk_plugin_get_project_resource_usage (cdk_plugin, &project_usage);
+  usage_store_append (_("Project"), &project_usage);
+
+  g_ptr_array_free (docs, TRUE);
+  g_array_free (usages, TRUE);
+
+  return FALSE;
 }
 
-static gboolean on_update_timeout (GeanyDocument *doc)
+// coalesce the refreshes, a lot of TUs arrive at once on project open
+static void on_usage_changed (G_GNUC_UNUSED CdkPlugin *plugin,
+  G_GNUC_UNUSED gpointer doc, G_GNUC_UNUSED gpointer user_data)
 {
-  if (cdk_project_is_open ())
-    cdk_plugin_update_document (cdk_plugin, doc);
-  update_handler = 0;
-  return FALSE;
+  if (usage_refresh_handler == 0)
+    usage_refresh_handler = g_timeout_add (500, on_usage_refresh, NULL);
 }
 
-static gboolean on_editor_notify (G_GNUC_UNUSED GObject *object,
-  GeanyEditor *editor, SCNotification *nt, G_GNUC_UNUSED gpointer user_data)
+static void on_usage_project_closed (CdkPlugin *plugin,
+  G_GNUC_UNUSED gpointer user_data)
 {
-  if (cdk_project_is_open () &&
-      nt->nmhdr.code == SCN_MODIFIED &&
-      (nt->modificationType & SC_MOD_INSERTTEXT ||
-       nt->modificationType & SC_MOD_DELETETEXT) &&
-      update_handler == 0)
+  on_usage_changed (plugin, NULL, NULL);
+}
+
+static void usage_view_add_column (GtkTreeView *view, const gchar *title, gint col)
+{
+  GtkCellRenderer *renderer = gtk_cell_renderer_text_new ();
+  if (col != USAGE_COL_NAME)
+    g_object_set (renderer, "xalign", 1.0, NULL);
+  GtkTreeViewColumn *column =
+    gtk_tree_view_column_new_with_attributes (title, renderer, "text", col, NULL);
+  gtk_tree_view_column_set_resizable (column, TRUE);
+  gtk_tree_view_append_column (view, column);
+}
+
+static void usage_view_create (void)
+{
+  usage_store = gtk_list_store_new (USAGE_NUM_COLS,
+                                    G_TYPE_STRING, G_TYPE_STRING,
+                                    G_TYPE_STRING, G_TYPE_STRING,
+                                    G_TYPE_STRING, G_TYPE_STRING,
+                                    G_TYPE_STRING);
+
+  GtkWidget *view = gtk_tree_view_new_with_model (GTK_TREE_MODEL (usage_store));
+  usage_view_add_column (GTK_TREE_VIEW (view), _("Document"), USAGE_COL_NAME);
+  usage_view_add_column (GTK_TREE_VIEW (view), _("Total"), USAGE_COL_TOTAL);
+  usage_view_add_column (GTK_TREE_VIEW (view), _("AST"), USAGE_COL_AST);
+  usage_view_add_column (GTK_TREE_VIEW (view), _("Identifiers"), USAGE_COL_IDENTIFIERS);
+  usage_view_add_column (GTK_TREE_VIEW (view), _("Preamble/PCH"), USAGE_COL_PREAMBLE);
+  usage_view_add_column (GTK_TREE_VIEW (view), _("Source Manager"), USAGE_COL_SOURCE_MANAGER);
+  usage_view_add_column (GTK_TREE_VIEW (view), _("Preprocessor"), USAGE_COL_PREPROCESSOR);
+
+  usage_page = gtk_scrolled_window_new (NULL, NULL);
+  gtk_scrolled_window_set_policy (GTK_SCROLLED_WINDOW (usage_page),
+                                  GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+  gtk_container_add (GTK_CONTAINER (usage_page), view);
+  gtk_widget_show_all (usage_page);
+
+  gtk_notebook_append_page (GTK_NOTEBOOK (geany_data->main_widgets->sidebar_notebook),
+                            usage_page, gtk_label_new (_("CDK Memory")));
+
+  g_signal_connect (cdk_plugin, "resource-usage-changed", G_CALLBACK (on_usage_changed), NULL);
+  g_signal_connect (cdk_plugin, "document-removed", G_CALLBACK (on_usage_changed), NULL);
+  g_signal_connect (cdk_plugin, "project-closed", G_CALLBACK (on_usage_project_closed), NULL);
+}
+
+static void usage_view_destroy (void)
+{
+  if (CDK_IS_PLUGIN (cdk_plugin))
     {
-      update_handler = g_timeout_add (update_timeout,
-        (GSourceFunc) on_update_timeout, editor->document);
+      g_signal_handlers_disconnect_by_func (cdk_plugin, on_usage_changed, NULL);
+      g_signal_handlers_disconnect_by_func (cdk_plugin, on_usage_project_closed, NULL);
     }
-  return FALSE;
+
+  if (usage_refresh_handler != 0)
+    {
+      g_source_remove (usage_refresh_handler);
+      usage_refresh_handler = 0;
+    }
+
+  if (GTK_IS_WIDGET (usage_page))
+    gtk_widget_destroy (usage_page);
+  usage_page = NULL;
+
+  if (GTK_IS_LIST_STORE (usage_store))
+    g_object_unref (usage_store);
+  usage_store = NULL;
 }
 
 //
@@ -243,6 +419,8 @@ void plugin_init (G_GNUC_UNUSED GeanyData *unused)
   PC("document-filetype-set", on_document_filetype_set, NULL);
   PC("editor-notify", on_editor_notify, NULL);
 
+  usage_view_create ();
+
   // if a project was already open, open the CDK project
   if (geany_data->app->project != NULL)
     {
@@ -277,18 +455,14 @@ void plugin_cleanup (void)
   g_object_set_data (G_OBJECT (geany_data->main_widgets->window),
                      "cdk-plugin", NULL);
 
-  if (update_handler != 0)
-    {
-      g_source_remove (update_handler);
-      update_handler = 0;
-    }
-
   if (GTK_IS_WIDGET (project_page))
     {
       gtk_widget_destroy (GTK_WIDGET (project_page));
       project_page = NULL;
     }
 
+  usage_view_destroy ();
+
   cflags_textview = NULL;
   files_textview = NULL;
 